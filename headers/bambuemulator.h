@@ -3,21 +3,31 @@
 
 #include <QObject>
 #include <QString>
-#include <QProcess>
+#include <QJsonObject>
 #include "headers/bambulab.h"
+#include "headers/mqttbroker.h"
+#include "headers/ftpsserver.h"
 
 class BambuEmulator : public QObject {
     Q_OBJECT
 public:
-    BambuEmulator(QObject* parent = nullptr);
+    BambuEmulator(QJsonObject config = QJsonObject(), QObject* parent = nullptr);
     ~BambuEmulator();
-    void addPrinter(quint32 id, BambuLab* printer);
+    void addPrinter(quint32 id, BambuLab* printer, const QString &emulatorAccessCode = QString()); //Access code slicers use to reach this printer through the kiosk
     void removePrinter(quint32 id);
 signals:
     void jobLoaded(quint32 id, const QString &filepath, QMap<QString, QString> properties);
+    void jobInfoLoaded(const QVariantMap &properties);
 private:
+    void handleRequest(const QString &topic, const QByteArray &payload);
+    void handleUpload(const QString &filepath, const QString &password, QMap<QString, QString> properties);
+    bool checkAccessCode(const QString &username, const QString &password) const;
+    QJsonObject idleReport();
     QMap<quint32, BambuLab*> printers;
-    QProcess* mosquito;
+    QMap<quint32, QString> printerCodes;
+    MqttBroker broker;
+    FtpsServer ftps;
+    QString accessCode;
 };
 
 #endif // BAMBUEMULATOR_H
@@ -14,9 +14,13 @@
 #include <QtMqtt/QMqttClient>
 #include <QJsonObject>
 #include <QJsonArray>
+#include <QElapsedTimer>
 #include "headers/ftpsclient.h"
 #include "printer.h"
 #include <QColor>
+#include <QThread>
+#include <QQueue>
+#include <QSet>
 
 #define minVal(x,y) ((x < y) ? x : y)
 
@@ -28,6 +32,7 @@ public:
     bool timelapse = false;
     quint16 plateNum = 1;
     QString storageType = "sdcard";
+    QString md5; //Upper case hex of the project file
     bool bedLeveling = true;
     bool flowCali = true;
     bool vibroCali = true;
@@ -101,11 +106,21 @@ class BambuLab : public Printer {
 public:
     BambuLab(QObject* parent = 0);
     BambuLab(QString name, QString model, QString hostname, QString accessCode, QString username = "bblp", quint16 port = 8883, QObject* parent = 0);
+    ~BambuLab();
     void startPrint(const QString &filePath) override;
-    void startConnection();
-    void setHostname(QString hostname);
+    void stageFile(const QString &filePath) override;
+    void startStaged(const QString &filePath) override;
+    void discardStaged(const QString &filePath) override;
+    bool isIdle() override;
+    bool setTargetTemperatures(int nozzle, int bed) override;
+    void startConnection() override;
+    void probeConnection() override; //Fresh reports, or a pushall the printer has to answer
+    void setHostname(QString hostname) override;
+    QString getHostname() override;
     void setAccessCode(QString accessCode);
     void setStorageType(const QString &storage);
+    void setEmulatorAccessCode(const QString &code);
+    QString getEmulatorAccessCode();
 
 protected:
     QString hostname;
@@ -114,22 +129,52 @@ protected:
     QString username;
     bool hasAms = false;
     QList<BambuAms> amsList;
-    void requestPrintProject(const BambuPrintOptions &options);
+    void requestPrintProject(const BambuPrintOptions &options, const QString &jobId = QString());
     void startPrintGCode(const QString &gcodeFilepath);
     void startPrintProject(const QString &projFilepath);
 private:
+    void initMqtt();
     void updateState();
+    bool reconnectPending = false;
+    bool failureReported = false; //One report per failed attempt, disconnected and errorChanged both fire for it
+    QElapsedTimer reportAge; //Since the last push_status
+    bool probePending = false; //A pushall went out and no report has come back yet
     QString virtualSN = "undefined";
     quint32 sequenceId = 0;
+    struct AwaitingAck {
+        QElapsedTimer sent;
+        QString jobId;
+        qint64 traceStart = 0;
+    };
+    QMap<QString, AwaitingAck> awaitingAck; //Request sequence id -> publish time, the printer echoes the id in a report
+    void publishRequest(const QJsonObject &request, const QString &jobId = QString());
     QMqttTopicName requestTopic;
     QByteArray latestReportBytes;
     QJsonObject latestReport;
     QMqttClient* mqtt;
-    FtpsClient* ftps;
+    FtpsClient* ftps = nullptr;
+    QThread* ftpsThread = nullptr;
+    struct PendingUpload {
+        QString filepath;
+        bool startAfter = false;
+        bool discarded = false;
+        quint64 ticket = 0; //Transfer scheduler slot
+        qint64 traceStart = 0;
+        std::shared_ptr<std::atomic_bool> cancelled = std::make_shared<std::atomic_bool>(false); //Shared with the FTPS thread
+    };
+    QMap<quint64, PendingUpload> scheduledUploads; //Waiting for the transfer scheduler
+    QQueue<PendingUpload> pendingUploads; //In the order the FTPS thread runs them
+    QSet<QString> stagedFiles; //Uploaded and waiting for a start command
     QString storageType = "sdcard"; //"sdcard", "internal"
+    QString emulatorAccessCode; //Code slicers use for this printer on the kiosk emulator
     QMqttTopicFilter reportFilter {"device/+/report"};
     QMqttTopicFilter requestFiler {"device/+/request"};
-    void sendGCode(QString filepath);
+    void sendGCode(QString filepath, bool startAfterUpload);
+    void beginUpload(quint64 ticket);
+    void uploadFinished(bool success, const QString &error);
+    void sendStartCommand(const QString &filePath);
+    void deleteRemote(const QString &filePath);
+    void releaseJob(const QString &filePath); //Drops the intake digest once no queue still holds the file
     friend class PrinterManager;
     //bool testConnection();
 };
@@ -0,0 +1,88 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef COMMANDENGINE_H
+#define COMMANDENGINE_H
+
+#include <QObject>
+#include <QJsonObject>
+#include <QVariantMap>
+#include <QStringList>
+#include <QQueue>
+#include <QTimer>
+#include <functional>
+#include "headers/errors.hpp"
+
+//Staff terminal commands, registered once and looked up through a prefix trie for execution and tab completion
+class CommandEngine : public QObject {
+    Q_OBJECT
+public:
+    enum class ArgType {
+        Word, //One token
+        Choice, //One token that must be one of values()
+        Int,
+        Number,
+        Text //The rest of the line
+    };
+    struct Arg {
+        QString name;
+        ArgType type = ArgType::Word;
+        bool optional = false;
+        std::function<QStringList()> values; //Completion candidates, and the accepted words of a Choice
+    };
+    struct Invocation {
+        QString name;
+        QStringList tokens; //Arguments after the command name, quotes removed
+        QVariantMap args; //By Arg name, typed
+        quint8 authLevel = 0;
+        QString text(const QString &arg) const { return args.value(arg).toString(); }
+        bool has(const QString &arg) const { return args.contains(arg); }
+    };
+    struct Command {
+        QString name;
+        QStringList aliases;
+        QList<Arg> args;
+        QString summary;
+        quint8 authLevel = 1; //0 is normal, 1 is staff, 2 is system admin, 3 is supervisor
+        std::function<void(const Invocation &)> run;
+    };
+    struct Completion {
+        QString line; //Input with the last token extended as far as every candidate agrees
+        QStringList candidates;
+    };
+    explicit CommandEngine(QObject* parent = nullptr);
+    void loadConfig(QJsonObject cfg);
+    void add(const Command &command);
+    void execute(const QString &line, quint8 authLevel);
+    Completion complete(const QString &line, quint8 authLevel) const;
+    QStringList help(quint8 authLevel, const QString &name = QString()) const;
+    QStringList names(quint8 authLevel) const;
+    void print(const QString &text);
+    void print(const QStringList &lines); //Sent a page at a time so long listings don't stall the interface
+    void printError(const QString &text);
+    void gather(std::function<QStringList()> work); //Runs on the thread pool, the lines are printed when it finishes
+    static Eo<QStringList> tokenize(const QString &line, bool allowOpenQuote = false);
+signals:
+    void output(const QString &text);
+private:
+    struct Node {
+        QMap<QChar, int> next;
+        int command = -1;
+    };
+    int find(const QString &name) const; //Command index, -1 if unknown
+    QList<int> withPrefix(const QString &prefix) const;
+    void insert(const QString &key, int command);
+    Eo<QVariantMap> parse(const Command &command, const QStringList &tokens) const;
+    static QString usage(const Command &command);
+    void flush();
+    QList<Command> commands;
+    QList<Node> trie;
+    QQueue<QString> pending;
+    QTimer pager;
+    int pageSize = 40;
+};
+
+#endif // COMMANDENGINE_H
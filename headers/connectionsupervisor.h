@@ -0,0 +1,72 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef CONNECTIONSUPERVISOR_H
+#define CONNECTIONSUPERVISOR_H
+
+#include <QObject>
+#include <QTimer>
+#include <QQueue>
+#include <QMap>
+#include <QJsonObject>
+#include "printer.h"
+
+enum class HealthState {
+    Connecting,
+    Online,
+    Degraded, //Connected, but recent operations failed
+    Offline
+};
+
+class ConnectionSupervisor : public QObject { //Tracks printer health, reconnects with backoff and trips a circuit breaker on repeated failures
+    Q_OBJECT
+public:
+    explicit ConnectionSupervisor(QObject* parent = nullptr);
+    void loadConfig(QJsonObject cfg);
+    void addPrinter(quint32 id, Printer* printer);
+    void removePrinter(quint32 id);
+    void connectPrinter(quint32 id); //Queue a connection attempt, respecting the concurrency limit
+    HealthState state(quint32 id) const;
+    bool isDispatchable(quint32 id) const;
+    bool isBreakerOpen(quint32 id) const;
+    static QString stateName(HealthState s);
+public slots:
+    void reportSuccess(quint32 id);
+    void reportFailure(quint32 id, const QString &reason);
+signals:
+    void stateChanged(quint32 id, HealthState state);
+private:
+    struct Entry {
+        Printer* printer = nullptr;
+        HealthState state = HealthState::Connecting;
+        int consecutiveFailures = 0;
+        int attempt = 0; //Reconnect attempts since last success, drives the backoff
+        bool breakerOpen = false;
+        qint64 breakerOpenedAt = 0;
+        bool queued = false; //Waiting for a reconnect slot
+        bool inFlight = false; //Connection attempt running
+        QTimer* retryTimer = nullptr;
+        QTimer* attemptTimeout = nullptr;
+    };
+    void setState(quint32 id, HealthState s);
+    void scheduleReconnect(quint32 id);
+    void pumpQueue();
+    void finishAttempt(quint32 id);
+    void healthCheck();
+    qint64 backoffDelay(int attempt) const;
+    QMap<quint32, Entry> entries;
+    QQueue<quint32> reconnectQueue;
+    int activeAttempts = 0;
+    int maxConcurrentAttempts = 2; //Keeps a Wi-Fi blip from turning into a reconnect storm
+    qint64 baseBackoff = 1000;
+    qint64 maxBackoff = 120000;
+    qint64 attemptTimeoutMs = 15000;
+    int breakerThreshold = 3;
+    qint64 breakerCooldown = 60000;
+    QTimer healthTimer;
+};
+
+#endif // CONNECTIONSUPERVISOR_H
@@ -0,0 +1,92 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef DATABASESERVICE_H
+#define DATABASESERVICE_H
+
+#include <QObject>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QElapsedTimer>
+#include <QFuture>
+#include <QPromise>
+#include <QVariant>
+#include <QMap>
+#include <QList>
+#include <memory>
+#include "headers/errors.hpp"
+#include "headers/statementcache.h"
+
+using DbRow = QVariantList; //Columns in SELECT order
+using DbRows = QList<DbRow>;
+
+struct DbStatement {
+    QString sql;
+    QMap<QString, QVariant> values;
+};
+
+class DatabaseService : public QObject { //Owns a second SQLite connection on a worker thread so slow disks or locks never stall the GUI
+    Q_OBJECT
+public:
+    explicit DatabaseService(QObject* parent = nullptr);
+    ~DatabaseService();
+    bool start(const QString &databaseName); //Opens the worker's connection, false if it could not be opened
+    void stop(); //Finishes queued writes, then closes the connection
+    QFuture<Eo<DbRows>> read(const QString &sql, const QMap<QString, QVariant> &values = {}, quint64 after = 0); //Served ahead of queued writes, unless after names a write it has to see
+    QFuture<Eo<int>> write(const QString &sql, const QMap<QString, QVariant> &values = {}); //Rows affected, committed with other pending writes
+    QFuture<Eo<QList<DbRows>>> transaction(const QList<DbStatement> &statements); //All or nothing, rows per statement for RETURNING clauses
+    void setMaxBatch(int statements);
+    quint64 lastWrite() const; //Sequence of the newest write or transaction, pass it to read() to see everything submitted so far
+    QString summary() const;
+signals:
+    void writeFailed(const QString &sql, const QString &error);
+private:
+    enum Kind {
+        Read,
+        Write,
+        Transaction
+    };
+    struct Request {
+        Kind kind;
+        QList<DbStatement> statements;
+        std::shared_ptr<QPromise<Eo<DbRows>>> rows;
+        std::shared_ptr<QPromise<Eo<int>>> affected;
+        std::shared_ptr<QPromise<Eo<QList<DbRows>>>> results;
+        QElapsedTimer queued;
+        quint64 sequence = 0; //Submission order
+        quint64 after = 0; //Reads only, held until the writes up to this sequence are done
+    };
+    void enqueue(Request request);
+    void run();
+    void serveRead(Request &request);
+    void serveWrites(QList<Request> &batch);
+    void serveTransaction(Request &request);
+    void fail(Request &request, const Error &error);
+    QSqlQuery* exec(const DbStatement &statement, QString &error); //Cached statement with its result set, nullptr on failure
+    QString connectionName;
+    QString databaseName;
+    QThread* worker = nullptr;
+    mutable QMutex mutex;
+    QWaitCondition wake;
+    QWaitCondition opened;
+    QQueue<Request> reads;
+    QQueue<Request> writes; //Plain writes and transactions, in submission order
+    quint64 nextSequence = 1;
+    quint64 lastWriteSequence = 0;
+    bool running = false;
+    bool stopping = false;
+    bool openFailed = false;
+    int maxBatch = 64;
+    StatementCache statements; //Lives on the worker, the connection can't be shared across threads
+    quint64 readCount = 0;
+    quint64 writeCount = 0;
+    quint64 batchCount = 0;
+    qint64 longestWaitMs = 0;
+};
+
+#endif // DATABASESERVICE_H
@@ -11,20 +11,19 @@ public:
     template<typename T>
     static void handle(const ErrorOption<T> &eo) {
         if (!eo.isError()) return;
-        Error* err = eo.error();
+        const Error* err = eo.error();
         if (err == nullptr) return;
         handle(*err);
     };
     template<typename T>
     static void softHandle(const ErrorOption<T> &eo) {
         if (!eo.isError()) return;
-        Error* err = eo.error();
+        const Error* err = eo.error();
         if (err == nullptr) return;
         softHandle(*err);
     };
     static inline QTBackend* bk = nullptr;
 private:
-    static QString genLogLine(const QString &lvl, const QString &content);
     static void printLn(ErrorLevel lvl, const QString &content);
     static void printLn(const Error &err);
 };
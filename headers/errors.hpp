@@ -5,6 +5,7 @@
 #include <QDebug>
 #include <QObject>
 #include <QVariant>
+#include <optional>
 
 enum ErrorLevel {
     None,
@@ -24,7 +25,7 @@ public:
     static Error None() { return Error("None", "", ErrorLevel::None); }
     static Error handle(QString t = "None", QString m= "", ErrorLevel l = ErrorLevel::Trivial);
     bool isError() const {
-        return level == ErrorLevel::None || type == "None";
+        return level != ErrorLevel::None && type != "None";
     }
     friend QDebug operator<<(QDebug debug, const Error &err) {
         QDebugStateSaver saver(debug);
@@ -34,31 +35,28 @@ public:
 };
 
 template<typename T>
-class ErrorOption {
+class ErrorOption { //The Error is held inline, failing queries on hot paths don't touch the heap
 public:
-    ErrorOption(Error* er) {
-        errorObj = er;
-        isErr = true;
+    ErrorOption(const Error &er) {
+        errorObj.emplace(er);
     };
-    ErrorOption(T value) {
-        this->value = value;
-        errorObj = nullptr;
-        isErr = false;
-    }
-    ErrorOption(T value, Error* error) {
-        this->value = value;
-        errorObj = error;
-        isErr = true;
+    ErrorOption(T value) : value(std::move(value)) {};
+    ErrorOption(T value, const Error &error) : value(std::move(value)) {
+        errorObj.emplace(error);
     };
-    ErrorOption(T value, QString errorType, QString errorMsg, ErrorLevel errorLvl = ErrorLevel :: Debug) {
-        this->value = value;
-        errorObj = new Error(errorType, errorMsg, errorLvl);
-        isErr = true;
+    ErrorOption(T value, QString errorType, QString errorMsg, ErrorLevel errorLvl = ErrorLevel :: Debug) : value(std::move(value)) {
+        errorObj.emplace(errorType, errorMsg, errorLvl);
     };
     ErrorOption(QString errorType, QString errorMsg, ErrorLevel errorLvl = ErrorLevel :: Trivial) {
-        errorObj = new Error(errorType, errorMsg, errorLvl);
-        isErr = true;
+        errorObj.emplace(errorType, errorMsg, errorLvl);
     }
+    ErrorOption(const ErrorOption &other) = default;
+    ErrorOption &operator=(const ErrorOption &other) { //Error's fields are const, so rebuild it rather than assign
+        value = other.value;
+        errorObj.reset();
+        if (other.errorObj.has_value()) errorObj.emplace(*other.errorObj);
+        return *this;
+    };
     T get() const {
         return value;
     };
@@ -69,32 +67,31 @@ public:
         return getOrDefault(def);
     };
     QString errorType() const {
-        if (errorObj == nullptr) return "None";
+        if (!errorObj.has_value()) return "None";
         return errorObj->type;
     }
     QString errorString() const {
-        if (errorObj == nullptr) return "";
+        if (!errorObj.has_value()) return "";
         return errorObj->errorString;
     };
     ErrorLevel errorLevel() const {
-        if (errorObj == nullptr) return ErrorLevel::None;
+        if (!errorObj.has_value()) return ErrorLevel::None;
         return errorObj->level;
     }
-    Error* error() const {
-        return errorObj;
+    const Error* error() const {
+        return errorObj.has_value() ? &*errorObj : nullptr;
     };
     bool isError() const {
-        return isErr;
+        return errorObj.has_value();
     };
     friend QDebug operator<<(QDebug debug, const ErrorOption &err) {
         QDebugStateSaver saver(debug);
-        debug.nospace() << "ErrorOption(" << ((err.errorObj->isError()) ? Error::None() : *err.errorObj) << ", " << err.value <<")";
+        debug.nospace() << "ErrorOption(" << (err.errorObj.has_value() ? *err.errorObj : Error::None()) << ", " << err.value <<")";
         return debug;
     };
 private:
-    T value;
-    Error* errorObj;
-    bool isErr;
+    T value {};
+    std::optional<Error> errorObj;
 };
 
 
@@ -0,0 +1,166 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef FLEETSIMULATOR_H
+#define FLEETSIMULATOR_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QSslConfiguration>
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QRandomGenerator>
+#include <QTimer>
+#include <QMap>
+#include "headers/mqttbroker.h"
+#include "headers/ftpsserver.h"
+#include "headers/journalserver.h"
+
+struct SimSettings { //Behaviour shared by every virtual printer in the fleet
+    qint64 bandwidth = 0; //Upload bytes per second per printer, 0 is unlimited
+    double errorRate = 0; //Chance an upload or print request is refused
+    double outageRate = 0; //Chance per minute a printer drops off the network
+    int outageSeconds = 30;
+    int latencyMs = 0; //Added to every response
+    int printSeconds = 120; //Simulated print duration
+    int reportIntervalMs = 1000;
+};
+
+class VirtualPrinter : public QObject { //Job and temperature model shared by the PrusaLink and Bambu simulations
+    Q_OBJECT
+public:
+    VirtualPrinter(const QString &name, const SimSettings &settings, QObject* parent = nullptr);
+    QString getName() const;
+    bool isPrinting() const;
+    virtual bool start() = 0;
+    virtual void stop() = 0;
+    virtual QJsonObject kioskConfig() const = 0; //Printer entry the kiosk configuration needs to reach this printer
+signals:
+    void uploadReceived(const QString &printer, qint64 bytes, qint64 elapsedMs);
+    void uploadRefused(const QString &printer, const QString &reason);
+    void jobStarted(const QString &printer, const QString &file);
+    void jobFinished(const QString &printer, const QString &file);
+protected:
+    bool startJob(const QString &file);
+    void stopJob();
+    bool injectError();
+    void tick(); //Advances temperatures and print progress
+    virtual void stateChanged() {}
+    QString name;
+    SimSettings settings;
+    QString jobFile;
+    quint32 jobId = 0;
+    QElapsedTimer jobTimer;
+    double progress = 0; //0 to 100
+    bool finished = false;
+    double nozzle = 25;
+    double bed = 25;
+    double nozzleTarget = 0;
+    double bedTarget = 0;
+    QTimer tickTimer;
+    QTimer outageTimer;
+    bool offline = false;
+};
+
+class VirtualPrusa : public VirtualPrinter { //PrusaLink v1 HTTP API on a loopback port
+    Q_OBJECT
+public:
+    VirtualPrusa(const QString &name, const QString &apiKey, const QHostAddress &address, quint16 port, const SimSettings &settings, QObject* parent = nullptr);
+    bool start() override;
+    void stop() override;
+    QJsonObject kioskConfig() const override;
+private:
+    struct Connection {
+        QTcpSocket* socket = nullptr;
+        QByteArray buffer;
+        bool headerDone = false;
+        QString method;
+        QString path;
+        QMap<QString, QString> headers; //Lower case names
+        qint64 contentLength = 0;
+        qint64 bodyReceived = 0;
+        QElapsedTimer uploadTimer;
+    };
+    void acceptConnections();
+    void readConnection(Connection* c, const QByteArray &data);
+    void drain(); //Reads throttled connections at the bandwidth limit
+    void handleRequest(Connection* c);
+    void respond(Connection* c, int status, const QByteArray &body = QByteArray());
+    void dropConnection(Connection* c);
+    QJsonObject statusObject() const;
+    QJsonObject jobObject() const;
+    QString apiKey;
+    QHostAddress address;
+    quint16 port;
+    QTcpServer server;
+    QList<Connection*> connections;
+    QMap<QString, qint64> files; //Stored files and their sizes
+    QTimer drainTimer;
+};
+
+class VirtualBambu : public VirtualPrinter { //Bambu LAN mode: MQTT reports/requests over TLS and implicit FTPS uploads
+    Q_OBJECT
+public:
+    VirtualBambu(const QString &name, const QString &serial, const QString &accessCode, const QHostAddress &address, const SimSettings &settings, const QSslConfiguration &ssl, QObject* parent = nullptr);
+    bool start() override;
+    void stop() override;
+    void setPorts(quint16 mqttPort, quint16 ftpsPort);
+    QJsonObject kioskConfig() const override;
+private:
+    void handleRequest(const QByteArray &payload);
+    void publishReport(bool full);
+    void stateChanged() override;
+    QString serial;
+    QString accessCode;
+    QHostAddress address;
+    QSslConfiguration ssl;
+    quint16 mqttPort = 8883;
+    quint16 ftpsPort = 990;
+    QString spoolDir;
+    MqttBroker broker;
+    FtpsServer ftps;
+    QTimer reportTimer;
+    QMap<QString, QElapsedTimer> uploadTimers;
+    quint32 reportSequence = 0;
+    QString gcodeState = "IDLE";
+    int printError = 0;
+};
+
+class FleetSimulator : public QObject { //Builds the virtual fleet and reports load statistics
+    Q_OBJECT
+public:
+    explicit FleetSimulator(QObject* parent = nullptr);
+    void loadConfig(QJsonObject cfg);
+    bool start();
+    bool writeKioskConfig(const QString &filepath) const;
+private:
+    void printStats();
+    int prusaCount = 1;
+    int bambuCount = 1;
+    quint16 prusaBasePort = 18000;
+    QString bambuSubnet = "127.0.1."; //Each Bambu printer gets its own loopback address since drivers use fixed ports
+    quint16 bambuMqttPort = 8883;
+    quint16 bambuFtpsPort = 990;
+    QString certificate = "bambu_emulator_cert.pem";
+    QString privateKey = "bambu_emulator_key.pem";
+    int statsIntervalMs = 10000;
+    SimSettings settings;
+    quint16 journalPort = 18090; //0 disables the journal server
+    QString journalDir = "journal";
+    double journalFailureRate = 0;
+    JournalServer* journal = nullptr;
+    QList<VirtualPrinter*> fleet;
+    QTimer statsTimer;
+    QElapsedTimer uptime;
+    qint64 uploads = 0;
+    qint64 refused = 0;
+    qint64 bytesReceived = 0;
+    qint64 jobsStarted = 0;
+    QList<qint64> uploadTimes; //Since the last stats report
+};
+
+#endif // FLEETSIMULATOR_H
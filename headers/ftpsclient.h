@@ -4,13 +4,18 @@
 #include <QObject>
 #include <curl/curl.h>
 #include <QFile>
+#include <atomic>
+#include <memory>
 
 class FtpsClient : public QObject {
     Q_OBJECT
 public:
     explicit FtpsClient(QObject* parent = 0);
     ~FtpsClient();
-    void uploadFile(const QString &localFile, const QString &host, const QString &username, const QString &password, const QString &remotePath);
+    void uploadFile(const QString &localFile, const QString &host, const QString &username, const QString &password, const QString &remotePath, QIODevice* source = nullptr, std::shared_ptr<std::atomic_bool> cancelled = nullptr); //Reads source instead of localFile when set, cancelled belongs to this one upload
+    void deleteFile(const QString &host, const QString &username, const QString &password, const QString &remotePath);
+    void abort(); //Thread safe, cancels the running upload and every one after it, for shutdown
+    void setSendSpeedLimit(qint64 bytesPerSecond); //Applies to the next upload, 0 is unlimited
 signals:
     void progress(qint64 bytesSent, qint64 totalBytes);
     void finished(bool success, const QString &errorString);
@@ -19,9 +24,14 @@ private:
     static size_t readCallback(void *ptr, size_t size, size_t nmemb, void *stream);
     static int progressCallback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
 
-    QFile* m_file;
+    QFile* m_file = nullptr;
+    QIODevice* m_source = nullptr;
+    qint64 m_bytesSent = 0; //Counted in the read callback, FTPS thread only
     CURL* m_curl = nullptr;
     QString m_errorString;
+    std::atomic_bool m_abort = false;
+    std::shared_ptr<std::atomic_bool> m_cancelled; //Set while an upload runs
+    qint64 m_sendSpeedLimit = 0;
 };
 
 #endif // FTPSCLIENT_H
@@ -0,0 +1,80 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef FTPSSERVER_H
+#define FTPSSERVER_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QSslConfiguration>
+#include <QFile>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <functional>
+#include "headers/gcodeparser.h"
+
+class FtpsServer : public QObject { //Implicit TLS FTP server that accepts slicer uploads into the spool
+    Q_OBJECT
+public:
+    explicit FtpsServer(QObject* parent = nullptr);
+    ~FtpsServer();
+    bool listen(const QHostAddress &address, quint16 port, const QSslConfiguration &sslConfig = QSslConfiguration()); //Null config listens without TLS
+    void close();
+    void setAuthenticator(std::function<bool(const QString &username, const QString &password)> auth);
+    void setSpoolDirectory(const QString &dir);
+    void setPassivePortRange(quint16 first, quint16 last);
+    void setRateLimit(qint64 bytesPerSecond); //Per upload, 0 is unlimited
+signals:
+    void uploadStarted(const QString &fileName, const QString &password);
+    void uploadFinished(const QString &filepath, const QString &password, const QMap<QString, QString> &properties);
+    void uploadFailed(const QString &fileName, const QString &error);
+private:
+    struct Session {
+        QTcpSocket* control = nullptr;
+        QByteArray lineBuffer;
+        QString username;
+        QString password;
+        bool authenticated = false;
+        bool protectData = false;
+        QTcpServer* passive = nullptr;
+        QTcpSocket* data = nullptr;
+        QTimer* throttle = nullptr; //Drains the data socket at the rate limit
+        QByteArray earlyData; //Data that arrived before STOR
+        QFile* file = nullptr;
+        QString fileName;
+        GCodeStreamParser* parser = nullptr;
+        qint64 received = 0;
+        QElapsedTimer storeTimer; //From STOR to the parsed file
+        QString jobId;
+        qint64 traceStart = 0;
+        bool storing = false;
+        bool listing = false;
+    };
+    void acceptControl();
+    void readControl(Session* s);
+    void handleCommand(Session* s, const QString &command, const QString &argument);
+    void reply(Session* s, const QString &line);
+    bool openPassive(Session* s);
+    void acceptData(Session* s);
+    void consumeData(Session* s, const QByteArray &chunk);
+    void readData(Session* s);
+    void finishTransfer(Session* s);
+    void discardTransfer(Session* s, const QString &reason); //Removes the partial file of an unfinished STOR
+    void closeData(Session* s);
+    void dropSession(Session* s);
+    QTcpServer* server = nullptr;
+    QSslConfiguration ssl;
+    bool encrypted = false;
+    QList<Session*> sessions;
+    QString spoolDir = "uploaded/bambu";
+    quint16 passiveFirst = 0;
+    quint16 passiveLast = 0;
+    qint64 rateLimit = 0;
+    std::function<bool(const QString &, const QString &)> authenticator;
+};
+
+#endif // FTPSSERVER_H
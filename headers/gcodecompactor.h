@@ -0,0 +1,83 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef GCODECOMPACTOR_H
+#define GCODECOMPACTOR_H
+
+#include <QIODevice>
+#include <QFile>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QThread>
+#include <QElapsedTimer>
+#include <QList>
+#include <QPair>
+
+class GCodeCompactor : public QIODevice { //Streams a spooled G-code file through a size reducing transform on a worker thread
+    Q_OBJECT
+public:
+    enum Mode {
+        Passthrough,
+        StripComments, //ASCII without comments or thumbnails, keeps the metadata printers display
+        Binary //Prusa binary G-code, MeatPack + Heatshrink 12/4
+    };
+    GCodeCompactor(const QString &sourcePath, Mode mode, QObject* parent = nullptr);
+    ~GCodeCompactor();
+    bool open(OpenMode mode) override; //Starts the worker
+    void close() override;
+    bool isSequential() const override;
+    bool atEnd() const override;
+    qint64 bytesAvailable() const override;
+    bool waitForReadyRead(int msecs) override; //For readers on other threads, like the FTPS client
+    qint64 bytesIn() const;
+    qint64 bytesOut() const;
+    static Mode modeFor(const QString &setting, const QString &fileName); //Only plain .gcode is transformed
+    static QString outputName(const QString &fileName, Mode mode);
+    static QByteArray meatpackEncode(const QByteArray &gcode);
+    static QByteArray heatshrinkCompress(const QByteArray &data);
+    static quint32 crc32(const QByteArray &data, quint32 crc = 0);
+signals:
+    void compactionFinished(qint64 bytesIn, qint64 bytesOut, qint64 elapsedMs);
+protected:
+    qint64 readData(char* data, qint64 maxSize) override;
+    qint64 writeData(const char* data, qint64 maxSize) override;
+private:
+    struct Thumbnail {
+        quint16 format = 0; //0 PNG, 1 JPG, 2 QOI
+        quint16 width = 0;
+        quint16 height = 0;
+        QByteArray base64;
+    };
+    void run();
+    void runPassthrough(QFile &source);
+    void runStrip(QFile &source);
+    void runBinary(QFile &source);
+    void scanMetadata(QFile &source, QList<QPair<QString, QString>> &metadata, QList<Thumbnail> &thumbnails);
+    bool push(const QByteArray &chunk); //Blocks while the reader is behind, false once cancelled
+    QByteArray block(quint16 type, const QByteArray &params, const QByteArray &data, bool compress);
+    static QByteArray stripLine(const QByteArray &line);
+    static bool isThumbnailStart(const QByteArray &line);
+    static bool isThumbnailEnd(const QByteArray &line);
+    QString sourcePath;
+    Mode mode;
+    QThread* worker = nullptr;
+    mutable QMutex mutex;
+    QWaitCondition notEmpty;
+    QWaitCondition notFull;
+    QQueue<QByteArray> chunks;
+    qint64 queuedBytes = 0;
+    qint64 chunkOffset = 0; //Already read from chunks.head()
+    bool done = false;
+    bool cancelled = false;
+    qint64 inCount = 0;
+    qint64 outCount = 0;
+    QElapsedTimer timer;
+    static const qint64 MAX_QUEUED = 4 * 1024 * 1024;
+    static const int GCODE_BLOCK_SIZE = 65536;
+};
+
+#endif // GCODECOMPACTOR_H
@@ -12,6 +12,10 @@
 #include <QVector>
 #include <QMap>
 #include <QFileInfo>
+#include <QCache>
+#include <QMutex>
+#include <atomic>
+#include "headers/streamhasher.h"
 
 /*struct PrintData {
     QString printer_settings;
@@ -27,6 +31,7 @@ class GCodeParser
 public:
     static QMap<QString, QString> parseFile(QString filepath);
 private:
+    friend class GCodeStreamParser;
     static const int LINE_COUNT = 600;
     static const int BLINE_COUNT = 100;
     static inline const std::vector<QString> GCODE_TARGETS = std::vector<QString>({"total filament used [g]", "filament_type", "printer_settings_id", "estimated printing time (normal mode)", "filament_settings_id", "print_settings_id", "filament used [g]"});
@@ -39,4 +44,26 @@ private:
     static QMap<QString, QByteArray> extractGCode3mf(const QString &filepath);
 };
 
+class GCodeStreamParser //Collects the parts of an upload the parser needs and hashes it while it is being received
+{
+public:
+    explicit GCodeStreamParser(const QString &fileName);
+    void feed(const QByteArray &chunk);
+    QMap<QString, QString> finish(const QString &filepath); //Properties include the upload's md5, xxh64 and size
+    static QMap<QString, QString> parseLocalFile(const QString &filepath); //Single read of a file that did not arrive over the network
+    static QString cacheSummary();
+private:
+    static QCache<QString, QMap<QString, QString>> parseCache; //By xxh64, slicers resend identical files on retries
+    static inline QMutex cacheMutex; //Uploads and parseLocalFile finish on different threads, lookups reorder the cache too
+    static inline std::atomic<quint64> cacheHits = 0;
+    static inline std::atomic<quint64> cacheMisses = 0;
+    StreamHasher hasher;
+    static const int HEAD_SIZE = 600*60 + 20000; //Covers every region readGCode reads from the start of a file
+    static const int TAIL_SIZE = 600*60;
+    QString fileName;
+    QByteArray head;
+    QByteArray tail;
+    qint64 total = 0;
+};
+
 #endif // GCODEPARSER_H
@@ -0,0 +1,38 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef JOURNALSERVER_H
+#define JOURNALSERVER_H
+
+#include <QObject>
+#include <QHttpServer>
+#include <QHttpServerRequest>
+#include <QHttpServerResponse>
+#include <QTcpServer>
+#include <QDir>
+#include <QMap>
+
+class JournalServer : public QObject { //Stand-in for the central print log service, keeps each kiosk's journal as JSON lines
+    Q_OBJECT
+public:
+    JournalServer(const QString &directory, QObject* parent = nullptr);
+    bool listen(const QHostAddress &address, quint16 port);
+    quint16 port() const;
+    void setFailureRate(double rate); //Chance a batch is refused with 503, to exercise kiosk backoff
+signals:
+    void batchStored(const QString &kiosk, int entries, qint64 acked);
+private:
+    QHttpServerResponse receive(const QHttpServerRequest &request);
+    qint64 recover(const QString &kiosk); //Highest stored sequence, read back from the kiosk's file
+    QString fileFor(const QString &kiosk) const;
+    QHttpServer server;
+    QTcpServer* tcp = nullptr;
+    QDir directory;
+    QMap<QString, qint64> acked; //Per kiosk
+    double failureRate = 0;
+};
+
+#endif // JOURNALSERVER_H
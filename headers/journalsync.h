@@ -0,0 +1,55 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef JOURNALSYNC_H
+#define JOURNALSYNC_H
+
+#include <QObject>
+#include <QJsonObject>
+#include <QNetworkAccessManager>
+#include <QTimer>
+#include <QUrl>
+#include <QDateTime>
+#include "headers/databaseservice.h"
+
+//Ships the local journal table to a central server in compressed batches
+//Batches carry the sequence number the kiosk believes the server holds, so lost replies and replays are harmless
+class JournalSync : public QObject {
+    Q_OBJECT
+public:
+    explicit JournalSync(DatabaseService* dbs, QObject* parent = nullptr);
+    void loadConfig(QJsonObject cfg);
+    void nudge(); //New entries were committed, sync soon instead of waiting for the interval
+    QString summary() const;
+private:
+    void sync();
+    void send(const DbRows &entries);
+    void finished(QNetworkReply* reply, qint64 lastSent, int count);
+    void resync(qint64 serverAcked); //409 reply, the server holds a different position
+    void reachable();
+    void setAcked(qint64 seq);
+    void retryLater();
+    DatabaseService* dbs;
+    QNetworkAccessManager network;
+    QTimer timer;
+    QUrl endpoint;
+    QString kioskId;
+    QByteArray token; //Optional bearer token for the central server
+    bool enabled = false;
+    bool inFlight = false;
+    qint64 acked = -1; //Highest sequence the server confirmed, -1 until read from journalState
+    int batchSize = 500;
+    int intervalMs = 30000;
+    int failures = 0;
+    quint64 entriesSent = 0;
+    quint64 batchesSent = 0;
+    quint64 rawBytes = 0;
+    quint64 compressedBytes = 0;
+    QDateTime lastSuccess;
+    QString lastError;
+};
+
+#endif // JOURNALSYNC_H
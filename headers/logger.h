@@ -0,0 +1,98 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <QString>
+#include <QStringList>
+#include <QJsonObject>
+#include <QLoggingCategory>
+#include <QMutex>
+#include <QHash>
+#include <QFile>
+#include <QThread>
+#include <atomic>
+
+Q_DECLARE_LOGGING_CATEGORY(lcErrors) //ErrorHandler
+Q_DECLARE_LOGGING_CATEGORY(lcBambu)
+Q_DECLARE_LOGGING_CATEGORY(lcPrusa)
+Q_DECLARE_LOGGING_CATEGORY(lcOctoprint)
+
+//Qt message handler that never blocks: messages go into a lock free ring and a writer thread formats them as JSON lines,
+//rotating the file by size. Levels are applied per category through Qt's category filter, so a disabled qCDebug costs one flag check
+class Logger {
+public:
+    enum Level {
+        Debug,
+        Info,
+        Warning,
+        Critical,
+        Fatal,
+        Off
+    };
+    static void install(); //Starts the writer with the default file, call before anything logs
+    static void loadConfig(QJsonObject cfg);
+    static void shutdown(); //Drains the ring and restores Qt's handler
+    static bool setLevel(const QString &category, const QString &level); //false for an unknown level name
+    static QStringList summary();
+    static QString levelName(Level level);
+    static constexpr int CAPACITY = 8192; //Power of two
+private:
+    struct Record {
+        qint64 timeMs = 0;
+        Level level = Debug;
+        char category[32] = {};
+        QString message;
+        const char* file = nullptr; //Only filled in debug builds, __FILE__ lives for the whole run
+        int line = 0;
+        quintptr thread = 0;
+    };
+    struct Slot {
+        std::atomic<quint64> sequence = 0; //Index it may next be written at, plus one once it holds a record
+        Record record;
+    };
+    static void handleMessage(QtMsgType type, const QMessageLogContext &context, const QString &message);
+    static bool push(Level level, const char* category, const QString &message, const QMessageLogContext &context);
+    static void filter(QLoggingCategory* category);
+    static void applyLevels();
+    static Level parseLevel(const QString &name, bool* ok = nullptr);
+    static void run();
+    static int drain();
+    static void write(const Record &record);
+    static void openFile();
+    static void rotate();
+    static QString timestamp(qint64 ms);
+
+    static inline Slot ring[CAPACITY];
+    static inline std::atomic<quint64> enqueuePos = 0;
+    static inline quint64 dequeuePos = 0; //Writer thread only
+    static inline std::atomic<quint64> written = 0; //Records taken off the ring, lets a fatal message wait for its own
+    static inline std::atomic<quint64> dropped = 0;
+    static inline std::atomic<qint64> coarseMs = 0; //Refreshed by the writer every pass, producers never read the clock
+    static inline std::atomic<bool> running = false;
+    static inline std::atomic<bool> reopen = false;
+    static inline QThread* writer = nullptr;
+    static inline QtMessageHandler previousHandler = nullptr;
+    static inline QLoggingCategory::CategoryFilter previousFilter = nullptr;
+
+    static inline QMutex configLock; //Configuration only, never taken by a producer
+    //Printer drivers log whole MQTT reports and HTTP responses at debug, so they start at info. "categories" overrides these
+    static inline const QHash<QByteArray, Level> defaultLevels = {{"kiosk.bambu", Info}, {"kiosk.prusa", Info}};
+    static inline QHash<QByteArray, Level> levels = defaultLevels; //Categories set explicitly
+    static inline Level defaultLevel = Debug; //Everything else, on top of Qt's own rules
+    static inline QString filePath;
+    static inline qint64 maxBytes = 10 * 1024 * 1024;
+    static inline int keepFiles = 5;
+    static inline bool console = true;
+
+    static inline QFile* file = nullptr; //Writer thread only
+    static inline qint64 fileBytes = 0; //Counted here, asking QFile for its size flushes the buffer
+    static inline qint64 cachedSecond = -1;
+    static inline QString cachedPrefix;
+};
+
+#endif // LOGGER_H
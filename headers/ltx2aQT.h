@@ -26,6 +26,7 @@ public:
 signals:
     void cardScanned(UserEntry data);
     void errorOccurred(QString error);
+    void opened();
 public slots:
     void start();
     void stop();
@@ -50,8 +51,10 @@ public slots:
     void stop();
 signals:
     void cardScanned();
+    void readerReady(bool ok); //Emitted once the serial port is opened or found missing
 private:
     QQueue<struct UserEntry> scanned;
+    bool readyReported = false;
     QThread* thread;
     SerialWorker* worker;
 };
@@ -0,0 +1,38 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef METRICSSERVER_H
+#define METRICSSERVER_H
+
+#include <QObject>
+#include <QHttpServer>
+#include <QTcpServer>
+#include <QHostAddress>
+#include <QJsonObject>
+#include "headers/printermanager.h"
+
+//Prometheus text exposition on /metrics. Counters and histograms come from the perf registry's atomics,
+//fleet state is read from the printer manager when scraped, so nothing on a hot path waits for a scrape
+class MetricsServer : public QObject {
+    Q_OBJECT
+public:
+    explicit MetricsServer(PrinterManager* pm, QObject* parent = nullptr);
+    void loadConfig(QJsonObject cfg);
+    bool listen(const QHostAddress &address, quint16 port);
+    quint16 port() const;
+    QByteArray render() const;
+private:
+    static QString metricName(const QString &registryName); //"transfer.ftps_bytes" becomes "kiosk_transfer_ftps_bytes"
+    static QString label(const QString &value); //Quoted and escaped
+    static QString number(double value);
+    void renderRegistry(QString &out) const;
+    void renderFleet(QString &out) const;
+    PrinterManager* pm;
+    QHttpServer server;
+    QTcpServer* tcp = nullptr;
+};
+
+#endif // METRICSSERVER_H
@@ -0,0 +1,88 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef MQTTBROKER_H
+#define MQTTBROKER_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QSslConfiguration>
+#include <QHash>
+#include <QMap>
+#include <QTimer>
+#include <functional>
+
+class MqttBroker : public QObject { //Minimal MQTT 3.1.1 broker, QoS 0/1 with retained messages
+    Q_OBJECT
+public:
+    using LocalHandler = std::function<void(const QString &topic, const QByteArray &payload)>;
+    explicit MqttBroker(QObject* parent = nullptr);
+    ~MqttBroker();
+    bool listen(const QHostAddress &address, quint16 port);
+    bool listenEncrypted(const QHostAddress &address, quint16 port, const QSslConfiguration &sslConfig);
+    void close();
+    void setAuthenticator(std::function<bool(const QString &clientId, const QString &username, const QString &password)> auth);
+    void publish(const QString &topic, const QByteArray &payload, quint8 qos = 0, bool retain = false); //In-process publish, delivered without a socket round trip
+    quint64 subscribe(const QString &filter, LocalHandler handler); //In-process subscriber
+    void unsubscribe(quint64 handle);
+    int clientCount() const;
+    static bool topicMatches(const QString &filter, const QString &topic);
+signals:
+    void clientConnected(const QString &clientId);
+    void clientDisconnected(const QString &clientId);
+private:
+    struct Session {
+        QTcpSocket* socket = nullptr;
+        QString clientId;
+        QByteArray buffer;
+        bool connected = false;
+        quint16 keepAlive = 0; //seconds
+        qint64 lastActivity = 0;
+        quint16 nextPacketId = 1;
+        QHash<quint16, QByteArray> inflight; //QoS 1 deliveries waiting for PUBACK
+        QHash<quint16, qint64> inflightSentAt;
+        QStringList filters;
+        QString willTopic;
+        QByteArray willMessage;
+        quint8 willQos = 0;
+        bool willRetain = false;
+    };
+    struct TrieNode {
+        QHash<QString, TrieNode*> children;
+        QHash<Session*, quint8> sessions; //Subscribed clients and granted QoS
+        QList<quint64> localHandlers;
+        ~TrieNode() { qDeleteAll(children); }
+    };
+    void acceptConnections();
+    void readClient(Session* s);
+    bool handlePacket(Session* s, quint8 header, const QByteArray &body);
+    bool handleConnect(Session* s, const QByteArray &body);
+    void handlePublish(Session* s, quint8 header, const QByteArray &body);
+    void handleSubscribe(Session* s, const QByteArray &body);
+    void handleUnsubscribe(Session* s, const QByteArray &body);
+    void dropClient(Session* s, bool graceful);
+    void route(const QString &topic, const QByteArray &payload, quint8 qos, bool retain);
+    void collect(TrieNode* node, const QStringList &levels, int depth, QHash<Session*, quint8> &sessions, QList<quint64> &handlers);
+    void insertFilter(const QString &filter, Session* s, quint8 qos, quint64 handler);
+    void removeFilter(const QString &filter, Session* s, quint64 handler);
+    void deliver(Session* s, const QString &topic, const QByteArray &payload, quint8 qos, bool retain);
+    void checkSessions();
+    static QByteArray encodePacket(quint8 header, const QByteArray &body);
+    static QByteArray encodeString(const QByteArray &s);
+    QTcpServer* server = nullptr;
+    QList<Session*> sessions;
+    TrieNode root;
+    QMap<QString, QByteArray> retained;
+    qint64 retainedBytes = 0; //Payload bytes held in retained, bounded like the topic count
+    QHash<quint64, LocalHandler> handlers;
+    QHash<quint64, QString> handlerFilters;
+    quint64 nextHandler = 1;
+    std::function<bool(const QString &, const QString &, const QString &)> authenticator;
+    QTimer sessionTimer;
+};
+
+#endif // MQTTBROKER_H
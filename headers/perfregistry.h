@@ -0,0 +1,82 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef PERFREGISTRY_H
+#define PERFREGISTRY_H
+
+#include <QString>
+#include <QStringList>
+#include <QJsonObject>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <atomic>
+#include <deque>
+
+//Log-linear latency histogram in microseconds, 16 buckets per power of two keeps any reading within about 6%
+class LatencyHistogram {
+public:
+    explicit LatencyHistogram(const QString &name) : name(name) {}
+    void record(qint64 micros); //Lock free, safe from any thread
+    void reset();
+    struct Snapshot {
+        QString name;
+        quint64 count = 0;
+        double meanUs = 0;
+        quint64 sumUs = 0;
+        qint64 maxUs = 0;
+        QList<quint64> buckets;
+        qint64 percentile(double q) const; //Upper edge of the bucket holding the q quantile
+    };
+    Snapshot snapshot() const;
+    const QString name;
+    static qint64 bucketLower(int index);
+    static constexpr int SUB_BITS = 4;
+    static constexpr int BUCKETS = (36 - SUB_BITS + 1) * (1 << SUB_BITS); //Up to 2^36 us, about 19 hours
+private:
+    static int bucketOf(qint64 micros);
+    std::atomic<quint64> counts[BUCKETS] = {};
+    std::atomic<quint64> sum = 0;
+    std::atomic<qint64> max = 0;
+};
+
+class PerfCounter {
+public:
+    explicit PerfCounter(const QString &name) : name(name) {}
+    void add(qint64 n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    qint64 get() const { return value.load(std::memory_order_relaxed); }
+    void reset() { value.store(0, std::memory_order_relaxed); }
+    const QString name;
+private:
+    std::atomic<qint64> value = 0;
+};
+
+//Process wide, entries are created on first use and live until exit so callers can keep the pointer in a static
+class PerfRegistry {
+public:
+    static LatencyHistogram* histogram(const QString &name);
+    static PerfCounter* counter(const QString &name);
+    static QList<LatencyHistogram::Snapshot> histograms();
+    static QList<QPair<QString, qint64>> counters(); //Name and value, sorted by name
+    static QStringList report(const QString &filter = QString());
+    static QJsonObject toJson();
+    static void reset();
+    static QString formatMicros(qint64 micros);
+private:
+    static inline QMutex lock; //Registration and listing only, never taken while recording
+    static inline std::deque<LatencyHistogram> histogramList;
+    static inline std::deque<PerfCounter> counterList;
+};
+
+class PerfTimer { //Records the time until it goes out of scope
+public:
+    explicit PerfTimer(LatencyHistogram* histogram) : histogram(histogram) { timer.start(); }
+    ~PerfTimer() { histogram->record(timer.nsecsElapsed() / 1000); }
+private:
+    LatencyHistogram* histogram;
+    QElapsedTimer timer;
+};
+
+#endif // PERFREGISTRY_H
@@ -0,0 +1,58 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef PRINTARCHIVE_H
+#define PRINTARCHIVE_H
+
+#include <QObject>
+#include <QJsonObject>
+#include <QDir>
+#include <QMap>
+#include <QSet>
+#include <functional>
+#include "headers/databaseservice.h"
+
+//Past job files, zstd compressed and stored once per content hash, with a full text index of every time they were printed
+class PrintArchive : public QObject {
+    Q_OBJECT
+public:
+    struct Match {
+        QString hash;
+        QString fileName;
+        QString user;
+        QString printer;
+        qint64 printedAt = 0;
+        QString model; //Brand and model of the printer it was sliced for, empty for files archived before it was recorded
+    };
+    explicit PrintArchive(DatabaseService* dbs, QObject* parent = nullptr);
+    void loadConfig(QJsonObject cfg);
+    bool isEnabled() const;
+    void store(const QString &filepath, const QMap<QString, QString> &properties, const QString &userId, const QString &printerName, const QString &printerModel); //Compresses on the thread pool
+    QFuture<Eo<QList<Match>>> search(const QString &query, int limit = 10); //Words match prefixes of file name, user, printer and slicer metadata
+    void restore(const Match &match, std::function<void(const QString &filepath)> done); //Empty path on failure
+    QString summary() const;
+    static QString ftsQuery(const QString &text);
+    static bool compressFile(const QString &source, const QString &target, int level, const QString &expectedHash, qint64 &size, qint64 &storedSize); //Refused if the content no longer hashes to expectedHash
+    static bool decompressFile(const QString &source, const QString &target);
+private:
+    QString blobPath(const QString &hash) const;
+    void index(const QString &hash, const QString &fileName, const QString &userId, const QString &printerName, const QString &metadata, qint64 printedAt);
+    void enforceRetention(const QString &keep);
+    DatabaseService* dbs;
+    bool enabled = true;
+    QDir directory;
+    QDir restoreDirectory;
+    int level = 9;
+    qint64 maxBytes = 2048LL * 1024 * 1024;
+    QSet<QString> compressing; //Hashes on the thread pool, a second print of the same file only indexes
+    quint64 stored = 0;
+    quint64 deduplicated = 0;
+    quint64 evicted = 0;
+    qint64 bytesIn = 0;
+    qint64 bytesOut = 0;
+};
+
+#endif // PRINTARCHIVE_H
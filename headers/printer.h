@@ -9,6 +9,9 @@
 
 #include <QObject>
 #include <QNetworkAccessManager>
+#include "headers/gcodecompactor.h"
+#include "headers/transferscheduler.h"
+#include "headers/streamhasher.h"
 
 class Printer : public QObject {
     Q_OBJECT
@@ -17,20 +20,52 @@ public:
     Printer(QString name, QString model, QObject* parent = 0);
     Printer(QString name, QString model, QString brand, QObject* parent = 0);
     virtual void startPrint(const QString &gcodeFilepath) = 0;
+    virtual void setHostname(QString hostname) = 0;
+    virtual QString getHostname() = 0;
+    virtual void startConnection() {};
+    virtual void probeConnection() {}; //Check a live connection is still healthy
+    virtual void stageFile(const QString &gcodeFilepath) { emit fileStaged(gcodeFilepath, false); }; //Upload without starting, drivers that can't stage just print on startStaged
+    virtual void startStaged(const QString &gcodeFilepath) { startPrint(gcodeFilepath); };
+    virtual void discardStaged(const QString &gcodeFilepath) { Q_UNUSED(gcodeFilepath) };
+    virtual bool isIdle() { return false; }; //Last known state allows new work, drivers that can't tell are never preheated
+    virtual bool setTargetTemperatures(int nozzle, int bed) { Q_UNUSED(nozzle) Q_UNUSED(bed) return false; }; //0 turns the heater off, false when the driver has no way to set them
     void setName(QString name);
     void setModel(QString model);
     void setBrand(QString brand);
+    void setCompaction(const QString &compaction); //"none", "strip" or "binary"
     QString getName();
     QString getModel();
     QString getBrand();
-    bool connectionStatus;
+    QString getCompaction();
+    void setTransferScheduler(TransferScheduler* scheduler);
+    void setFileDigest(const QString &filepath, const FileDigest &digest); //Taken at intake, saves drivers hashing the spool again
+    bool connectionStatus = false;
 signals:
     void connectionUpdated(bool status);
+    void healthReport(bool ok, const QString &detail); //Outcome of uploads and commands, feeds the connection supervisor
+    void fileStaged(const QString &gcodeFilepath, bool success);
+    void transferCompacted(const QString &fileName, qint64 bytesIn, qint64 bytesOut, qint64 elapsedMs);
 protected:
     QString name;
     QString model;
     QString brand;
+    QString compaction = "none";
     QNetworkAccessManager manager;
+    GCodeCompactor* createCompactor(const QString &filepath, bool binarySupported); //nullptr when the file goes as is
+    //Uploads wait for a slot from the fleet scheduler, start gets the ticket to report back with
+    quint64 scheduleTransfer(const QString &filepath, bool interactive, std::function<void(quint64)> start);
+    void promoteTransfer(quint64 ticket);
+    void cancelTransfer(quint64 ticket);
+    void finishTransfer(quint64 ticket, bool success);
+    qint64 transferRateLimit(quint64 ticket);
+    FileDigest fileDigest(const QString &filepath);
+    bool spoolIntact(const QString &filepath); //Spool file still has the size it was received with
+    void releaseDigest(const QString &filepath); //The job was started or dropped, nothing will ask for it again
+    QString traceJob(const QString &filepath); //Job id for trace spans, empty for files that didn't come through intake
+private:
+    QMap<QString, FileDigest> digests;
+    TransferScheduler* scheduler = nullptr;
+    quint64 unscheduledTickets = 0;
 };
 
 
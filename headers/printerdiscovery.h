@@ -0,0 +1,76 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef PRINTERDISCOVERY_H
+#define PRINTERDISCOVERY_H
+
+#include <QObject>
+#include <QUdpSocket>
+#include <QHostAddress>
+#include <QTimer>
+#include <QMap>
+
+struct DiscoveredPrinter {
+    QString key; //Bambu serial number (SSDP USN) or mDNS service instance name
+    QString brand; //"BambuLab" or "Prusa"
+    QString model;
+    QString name;
+    QHostAddress address;
+    quint16 port = 0;
+    qint64 firstSeen = 0; //ms since epoch
+    qint64 lastSeen = 0; //ms since epoch
+};
+
+class PrinterDiscovery : public QObject { //Listens for printers announcing themselves on the LAN
+    Q_OBJECT
+public:
+    PrinterDiscovery(quint16 ssdpPort = 2021, quint16 mdnsPort = 5353, const QHostAddress &mdnsGroup = QHostAddress("224.0.0.251"), QObject* parent = nullptr);
+    bool start();
+    void stop();
+    void setQueryInterval(int ms);
+    void setStaleTimeout(qint64 ms);
+    QList<DiscoveredPrinter> devices() const;
+    bool contains(const QString &key) const;
+    DiscoveredPrinter device(const QString &key) const;
+    //Datagram handlers are public so a fake announcer can feed them directly
+    void handleSsdpDatagram(const QByteArray &data, const QHostAddress &sender);
+    void handleMdnsDatagram(const QByteArray &data, const QHostAddress &sender);
+    void expireAt(qint64 now); //Drops stale devices and mDNS records past their TTL, the timer passes the current time
+    int mdnsRecordCount() const; //Partial mDNS records held, bounded by their TTLs
+public slots:
+    void sendMdnsQuery();
+signals:
+    void deviceDiscovered(const DiscoveredPrinter &device);
+    void deviceAddressChanged(const DiscoveredPrinter &device, const QHostAddress &oldAddress);
+    void deviceLost(const DiscoveredPrinter &device);
+private:
+    void readSsdp();
+    void readMdns();
+    void updateDevice(DiscoveredPrinter d);
+    void expireDevices();
+    static QString bambuModelName(const QString &devModel);
+    quint16 ssdpPort;
+    quint16 mdnsPort;
+    QHostAddress mdnsGroup;
+    qint64 staleTimeout = 30 * 60 * 1000;
+    QUdpSocket ssdpSocket;
+    QUdpSocket mdnsSocket;
+    QTimer queryTimer;
+    QTimer expiryTimer;
+    QMap<QString, DiscoveredPrinter> table;
+    template <typename T>
+    struct MdnsRecord {
+        T value;
+        qint64 expires = 0; //ms since epoch, the announcer's TTL
+    };
+    //mDNS records arrive split across packets, keep the pieces until an instance can be resolved or its TTL runs out
+    QMap<QString, MdnsRecord<QPair<QString, quint16>>> mdnsServices; //instance -> (target host, port)
+    QMap<QString, MdnsRecord<QMap<QString, QString>>> mdnsTxt; //instance -> txt records
+    QMap<QString, MdnsRecord<QHostAddress>> mdnsHosts; //host -> address
+    inline static const QStringList prusaServiceTypes = {"_prusa-link._tcp.local", "_octoprint._tcp.local", "_http._tcp.local"};
+};
+
+#endif // PRINTERDISCOVERY_H
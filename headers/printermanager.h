@@ -4,6 +4,8 @@
 
 #include "headers/octoprintemulator.h"
 #include "headers/bambuemulator.h"
+#include "headers/printerdiscovery.h"
+#include "headers/connectionsupervisor.h"
 
 class PrinterManager : public QObject {
     Q_OBJECT
@@ -14,16 +16,51 @@ public:
     Printer* getPrinter(quint32 id);
     void removePrinter(quint32 id);
     void loadConfig(QJsonObject config);
-    void startPrint(quint32 id, const QString &filepath, QJsonObject properties = QJsonObject());
+    void connectPrinters();
+    bool startPrint(quint32 id, const QString &filepath, QJsonObject properties = QJsonObject());
+    qint64 resolveDispatchTarget(quint32 id); //Healthy printer that can run a job sliced for printer id, -1 if none
+    void registerJob(const QString &filepath, const QMap<QString, QString> &properties); //Keeps the intake digests for whichever printer gets the job
+    void forgetJob(const QString &filepath); //Loaded job was abandoned
+    void stageJob(quint32 id, const QString &filepath); //Upload ahead of authorization, startPrint then only sends the start command
+    void discardStagedJob();
+    void preheatJob(quint32 id, const QMap<QString, QString> &properties); //Warm an idle printer while the user authenticates
+    void cancelPreheat();
+    ConnectionSupervisor* supervisor();
+    TransferScheduler* transferScheduler();
+    QList<quint32> printerIds() const;
+    QList<DiscoveredPrinter> unregisteredPrinters();
 signals:
     void jobLoaded(quint32 id, const QString &filepath, QMap<QString, QString> properties);
     void jobInfoLoaded(QVariantMap properties);
+    void unregisteredPrinterFound(const DiscoveredPrinter &device);
+    void unregisteredPrinterLost(const DiscoveredPrinter &device);
+    void printerAddressChanged(quint32 id, const QString &oldHostname, const QString &newHostname);
+    void printersConnected(int online, int total); //First connection attempt of every printer has resolved
 private:
+    void startDiscovery(QJsonObject discoveryConfig);
+    void deviceSeen(const DiscoveredPrinter &device);
+    void deviceGone(const DiscoveredPrinter &device);
+    qint64 matchDevice(const DiscoveredPrinter &device);
+    PrinterDiscovery* discovery = nullptr;
+    ConnectionSupervisor health;
+    TransferScheduler transfers;
+    QMap<quint32, QString> printerSerials; //Printer id -> serial / mDNS instance used to follow address changes
     quint16 baseOctPort = 21111;
     quint32 nextId = 0;
     QMap<quint32, Printer*> printers;
     QMap<quint32, OctoprintEmulator*> octEmus;
     BambuEmulator* bblEmu = nullptr;
+    bool preUpload = true;
+    qint64 stagedPrinter = -1;
+    QString stagedFilepath;
+    QMap<QString, FileDigest> jobDigests; //Spool path -> digests taken at intake
+    QTimer stageTimer; //Staged files are removed if the job is never started
+    QTimer preheatTimer; //Heaters are turned off if the job is never started
+    bool preheatEnabled = false;
+    int preheatNozzle = 170; //Below oozing temperature, the start G-code takes it the rest of the way
+    QMap<QString, int> preheatBed; //Filament type -> bed temperature
+    qint64 preheatedPrinter = -1;
+    QJsonObject bblEmuConfig;
 };
 
 #endif // PRINTERMANAGER_H
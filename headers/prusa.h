@@ -11,6 +11,7 @@
 #include <QFile>
 #include <QNetworkReply>
 #include <QNetworkAccessManager>
+#include <QJsonObject>
 #include "printer.h"
 
 class Prusa : public Printer {
@@ -19,15 +20,36 @@ public:
     Prusa(QObject* parent = 0);
     Prusa(QString name, QString model, QString hostname, QString apiKey, QString storageType = "usb", QObject* parent = 0);
     void startPrint(const QString &gcodeFilepath) override;
+    void startConnection() override;
+    void probeConnection() override;
+    void stageFile(const QString &gcodeFilepath) override;
+    void startStaged(const QString &gcodeFilepath) override;
+    void discardStaged(const QString &gcodeFilepath) override;
+    bool isIdle() override;
     void setStorageType(QString storageType);
-    void setHostname(QString hostname);
+    void setHostname(QString hostname) override;
+    QString getHostname() override;
     void setApiKey(QString apiKey);
 protected:
     QString hostname;
     QString apiKey;
     QString storageType;
+    QJsonObject latestStatus;
 private:
-    void sendGCode(QString filepath);
+    struct StagedUpload {
+        quint64 ticket = 0; //Transfer scheduler slot
+        bool queued = true; //Waiting for the scheduler
+        QNetworkReply* reply = nullptr; //Set while the upload is running
+        bool ready = false;
+        bool startWhenReady = false; //Authorized before the upload finished
+    };
+    QNetworkReply* sendGCode(QString filepath, bool printAfterUpload = true);
+    void startStoredFile(const QString &fileName, const QString &jobId);
+    void beginStagedUpload(const QString &filepath);
+    void dropStaged(const QString &filepath); //discardStaged without releasing the digest, for a restage
+    void trackTransfer(quint64 ticket, QNetworkReply* reply, const QString &filepath, bool printAfter); //Frees the scheduler slot when the upload ends
+    QString remoteFileName(const QString &filepath); //Name on the printer, bgcode when compacting to binary
+    QMap<QString, StagedUpload> staged; //Local filepath -> upload state
     //bool testConnection();
 };
 
@@ -19,8 +19,21 @@
 #include <QSqlDatabase>
 #include <QQmlApplicationEngine>
 #include <QSqlRecord>
+#include <QSqlQuery>
+#include <QElapsedTimer>
+#include <tuple>
+#include <utility>
 #include "printermanager.h"
 #include "headers/errors.hpp"
+#include "headers/statementcache.h"
+#include "headers/databaseservice.h"
+#include "headers/userdirectory.h"
+#include "headers/quotaengine.h"
+#include "headers/rosterimporter.h"
+#include "headers/journalsync.h"
+#include "headers/printarchive.h"
+#include "headers/commandengine.h"
+#include "headers/metricsserver.h"
 
 
 enum AppState {
@@ -51,35 +64,84 @@ class QTBackend : public QObject {
     Q_OBJECT
 public:
     explicit QTBackend(QQmlApplicationEngine* eng, QObject* parent = 0);
+    bool openDatabase();
+    Error migrateJournal(); //Idempotent, run again after anything recreates users or printLog
     void setRoot(QObject* root);
+    void setIdle();
+    PrinterManager* printerManager();
     void loadConfig(QJsonObject cfg);
     void showMessage(QString message, QString acceptText="OK", int redirectState = 0);
     void cardScanned(const QString &id);
     Error queryDatabase(const QString &query);
     Eo<QMap<QString, QVariant>> queryDatabase(const QString &query, const QMap<QString, QVariant> &values);
     Eo<QList<QMap<QString, QVariant>>> queryDatabaseMultirow(const QString &query, const QMap<QString, QVariant> &values);
+    Error execute(const QString &query, const QMap<QString, QVariant> &values); //Statements without a result set
+    //Typed rows read by column index, in SELECT order, without building a map per row
+    template<typename... Ts>
+    Eo<std::tuple<Ts...>> queryRow(const QString &query, const QMap<QString, QVariant> &values);
+    template<typename... Ts>
+    Eo<QList<std::tuple<Ts...>>> queryRows(const QString &query, const QMap<QString, QVariant> &values);
+    template<typename T, typename Mapper>
+    Eo<QList<T>> queryRowsAs(const QString &query, const QMap<QString, QVariant> &values, Mapper map); //map(const QSqlQuery &) fills a struct
+    QString databaseStats() const;
 protected:
     QString version = "0.3.3-alpha";
     QJsonObject config;
     //Services
     QSqlDatabase db;
+    StatementCache statements;
+    DatabaseService dbs; //Worker thread connection for everything on the card scan path
+    UserDirectory users; //Card taps are authorized from here
+    QuotaEngine quotas;
+    RosterImporter roster;
+    JournalSync journal;
+    PrintArchive archive;
+    CommandEngine commands; //Staff terminal
     PrinterManager pm;
+    MetricsServer metrics; //Prometheus scrape endpoint
     //QML stuff
     QQmlApplicationEngine* engine;
-    QObject* root;
+    QObject* root = nullptr;
     //App state variables
     QString loadedPrintFilepath;
     quint32 loadedPrinterId = 0;
     QString currentUserID = "";
     QString currentStaffID = "";
+    quint64 scanSerial = 0;
+    AppState previousAppstate = AppState::Idle; //Last state appstateChanged saw, so only a real return to Idle drops the job
+    QElapsedTimer scanTimer; //Since the last card tap, for the latency histograms
+    qint64 scanTraceStart = 0;
     User* currentUser = nullptr;
     Staff* currentStaff = nullptr;
     QFile* loadedPrint = nullptr; //Selected print file
     QMap<QString, QString> loadedPrintInfo; //Print file info
+    QList<PrintArchive::Match> reprintMatches; //Last reprint search, for picking by number
+    quint8 terminalLevel = 1; //Authorization level of the staff member signed in to the terminal
 private:
     DWORD findProcessId(const QString &processName);
     void bringWindowToFront(DWORD pid);
     double parseDuration(const QString &durationString);
+    Error migrateUsageRollups(); //printLog indexes and trigger maintained usage totals
+    Error migrateArchive();
+    void loadPrintFile(const QString &filepath, quint32 printerId);
+    void registerCommands();
+    void openTerminal(const QString &cardid);
+    void reprint(const QString &query);
+    void loadArchived(const PrintArchive::Match &match);
+    void usageReport(const QStringList &args);
+    void rosterImported(const RosterImporter::Report &report);
+    void authorizeUser(const UserRecord &user, quint64 scan);
+    void authorizeQuota(quint8 authLevel, quint64 scan);
+    bool scanStillCurrent(quint64 scan, const QString &filepath); //The scan is the latest and its job is still waiting for a card
+    QString dumpPath(const QString &fileName); //Inside the dumps directory, empty unless fileName is a plain file name
+    void authorizeStaff(const UserRecord &staff, quint64 scan);
+    void dispatchAuthorizedPrint();
+    void recordPrintStart(const QString &userId); //Stats update and print log entry in one transaction
+    QSqlQuery* runQuery(const QString &query, const QMap<QString, QVariant> &values, std::optional<Error> &error); //Executed cached statement or nullptr
+    template<typename... Ts, std::size_t... I>
+    static std::tuple<Ts...> readRow(const QSqlQuery &q, std::index_sequence<I...>) {
+        return std::tuple<Ts...>(q.value(int(I)).template value<Ts>()...);
+    }
     AppState appstate();
 
 
@@ -94,11 +156,42 @@ signals:
     void tPrint(const QString &newtext);
 private slots:
     void jobLoaded(quint32 id, const QString &filepath, const QMap<QString, QString> &printInfo);
+    void appstateChanged();
 public slots:
     Q_INVOKABLE void orcaButtonClicked();
     Q_INVOKABLE void helpButtonClicked();
     Q_INVOKABLE void fileUploaded(const QUrl &fileUrl);
     Q_INVOKABLE void processCommand(const QString &command, const QString &tcltxt = "", const QString &tcctxt = "");
+    Q_INVOKABLE QString completeCommand(const QString &command); //Tab completion, prints the choices when there are several
 };
 
+template<typename... Ts>
+Eo<std::tuple<Ts...>> QTBackend::queryRow(const QString &query, const QMap<QString, QVariant> &values) {
+    std::optional<Error> error;
+    QSqlQuery* q = runQuery(query, values, error);
+    if (q == nullptr) return Eo<std::tuple<Ts...>>(*error);
+    if (!q->next()) return Eo<std::tuple<Ts...>>("DatabaseQueryError", "No matching row", El::Warning);
+    std::tuple<Ts...> row = readRow<Ts...>(*q, std::index_sequence_for<Ts...>{});
+    q->finish();
+    return Eo<std::tuple<Ts...>>(row);
+}
+
+template<typename... Ts>
+Eo<QList<std::tuple<Ts...>>> QTBackend::queryRows(const QString &query, const QMap<QString, QVariant> &values) {
+    return queryRowsAs<std::tuple<Ts...>>(query, values, [](const QSqlQuery &q) {
+        return readRow<Ts...>(q, std::index_sequence_for<Ts...>{});
+    });
+}
+
+template<typename T, typename Mapper>
+Eo<QList<T>> QTBackend::queryRowsAs(const QString &query, const QMap<QString, QVariant> &values, Mapper map) {
+    std::optional<Error> error;
+    QSqlQuery* q = runQuery(query, values, error);
+    if (q == nullptr) return Eo<QList<T>>(*error);
+    QList<T> rows;
+    while (q->next()) rows.append(map(*q));
+    q->finish();
+    return Eo<QList<T>>(rows);
+}
+
 #endif // QTBACKEND_H
@@ -0,0 +1,71 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef QUOTAENGINE_H
+#define QUOTAENGINE_H
+
+#include <QObject>
+#include <QJsonObject>
+#include <QHash>
+#include <QMap>
+#include <QList>
+#include <QStringList>
+#include <functional>
+#include "headers/databaseservice.h"
+
+class QuotaEngine : public QObject { //Per user class limits on hours, filament and job counts over rolling or fixed windows
+    Q_OBJECT
+public:
+    struct Decision {
+        bool allowed = true;
+        QString reason; //Shown to the user when a job is refused
+    };
+    explicit QuotaEngine(DatabaseService* dbs, QObject* parent = nullptr);
+    void loadConfig(QJsonObject cfg);
+    void check(const QString &userId, quint8 authLevel, double hours, double grams, std::function<void(const Decision &)> done); //done runs immediately for cached users
+    void recordJob(const QString &userId, qint64 start, double hours, double grams); //Keeps a cached history current after a print is accounted
+    void invalidate(); //Drop cached histories, the next check reloads from printLog
+    QString summary() const;
+private:
+    struct Window {
+        QString label; //"this week", "this semester"
+        qint64 seconds = 0; //Rolling length, 0 for a fixed window
+        qint64 since = 0; //Fixed window start in epoch seconds
+        double hours = -1; //Negative means unlimited
+        double grams = -1;
+        int jobs = -1;
+    };
+    struct Policy {
+        double maxJobHours = -1;
+        int maxConcurrentJobs = -1;
+        QList<Window> windows;
+    };
+    struct History { //A user's jobs inside the longest window, with running totals for range sums
+        QList<qint64> starts;
+        QList<double> endsAt; //Estimated finish in epoch seconds
+        QList<double> hoursSum = {0}; //hoursSum[i] covers jobs before i
+        QList<double> gramsSum = {0};
+        qsizetype first = 0; //Jobs before this have left every window
+        quint64 lastUsed = 0;
+    };
+    const Policy* policyFor(quint8 authLevel) const;
+    qint64 horizon(const Policy &policy, qint64 now) const; //Oldest start any window still counts
+    static Decision evaluate(const Policy &policy, History &history, double hours, double grams, qint64 now, qint64 horizon);
+    static void append(History &history, qint64 start, double hours, double grams);
+    void remember(const QString &userId, History history);
+    DatabaseService* dbs;
+    QMap<QString, Policy> policies; //By user class
+    QStringList levelClasses; //User class for each authLevel
+    QHash<QString, History> histories;
+    int maxUsers = 512;
+    quint64 useClock = 0;
+    quint64 checks = 0;
+    quint64 cacheHits = 0;
+    quint64 refusals = 0;
+    qint64 evaluateNs = 0;
+};
+
+#endif // QUOTAENGINE_H
@@ -0,0 +1,79 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef ROSTERIMPORTER_H
+#define ROSTERIMPORTER_H
+
+#include <QObject>
+#include <QThread>
+#include <QStringList>
+#include <QHash>
+#include <atomic>
+#include "headers/databaseservice.h"
+
+class RosterImporter : public QObject { //Loads a semester roster into users without blocking the kiosk
+    Q_OBJECT
+public:
+    struct Report {
+        QString file;
+        int rows = 0;
+        int imported = 0;
+        int rejected = 0;
+        int replaced = 0; //Earlier rows for a card that appears again, not errors
+        QStringList errors; //"line N: reason", capped so a broken file can't flood the terminal
+        qint64 elapsedMs = 0;
+        bool cancelled = false;
+    };
+    explicit RosterImporter(DatabaseService* dbs, QObject* parent = nullptr);
+    ~RosterImporter();
+    bool start(const QString &filepath, int maxAuthLevel); //CSV with a header row, or a JSON array of objects, false if an import is running
+    void cancel(); //Stops after the current batch, committed batches stay
+    bool isRunning() const;
+    void setBatchSize(int rows);
+signals:
+    void progress(int processed, int total); //Every tenth of the file
+    void finished(const RosterImporter::Report &report);
+private:
+    enum Field : quint16 { //Columns a row supplies, only those are overwritten on existing users
+        FirstName = 1,
+        LastName = 2,
+        Email = 4,
+        Umass = 8,
+        Cics = 16,
+        Trained = 32,
+        AuthLevel = 64
+    };
+    struct Row {
+        int line = 0;
+        quint16 fields = 0;
+        QString id;
+        QString firstName;
+        QString lastName;
+        QString email;
+        bool umass = false;
+        bool cics = false;
+        bool trained = false;
+        int authLevel = 0;
+    };
+    void run(const QString &filepath);
+    bool readCsv(const QString &filepath, QList<Row> &rows, Report &report);
+    bool readJson(const QString &filepath, QList<Row> &rows, Report &report);
+    static QStringList splitCsvRecord(const QString &record);
+    static bool parseBool(const QString &value, bool &ok);
+    bool setField(Row &row, const QString &column, const QString &value, QString &error); //False with error set when the value is invalid
+    QString upsertSql(quint16 fields);
+    DbStatement upsert(const Row &row);
+    void rejectRow(Report &report, int line, const QString &reason);
+    DatabaseService* dbs;
+    QThread* worker = nullptr;
+    std::atomic<bool> cancelRequested = false;
+    int batchSize = 500;
+    int maxAuthLevel = 0; //The importing user's own level, nobody can be granted more
+    QHash<quint16, QString> sqlByFields; //Worker thread only
+    static const int MAX_REPORTED_ERRORS = 50;
+};
+
+#endif // ROSTERIMPORTER_H
@@ -0,0 +1,54 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef STARTUPPIPELINE_H
+#define STARTUPPIPELINE_H
+
+#include <QObject>
+#include <QMap>
+#include <QSet>
+#include <QElapsedTimer>
+#include <functional>
+
+class StartupPipeline : public QObject { //Runs startup stages as soon as their dependencies are done
+    Q_OBJECT
+public:
+    using Done = std::function<void()>;
+    explicit StartupPipeline(QObject* parent = nullptr);
+    void addStage(const QString &name, const QStringList &dependsOn, std::function<void()> fn); //Runs on the GUI thread
+    void addAsyncStage(const QString &name, const QStringList &dependsOn, std::function<void(Done)> fn); //Finishes when done() is called
+    void addWorkerStage(const QString &name, const QStringList &dependsOn, std::function<void()> fn, std::function<void()> onFinished = {}); //fn runs on the thread pool, onFinished on the GUI thread
+    void addBarrier(const QString &name, const QStringList &stages);
+    void start();
+    bool isFinished(const QString &stage) const;
+    qint64 elapsed() const;
+signals:
+    void stageFinished(const QString &name, qint64 durationMs);
+    void barrierReached(const QString &name, qint64 elapsedMs);
+    void finished(qint64 elapsedMs);
+private:
+    struct Stage {
+        QString name;
+        QStringList dependsOn;
+        std::function<void(Done)> run;
+        bool started = false;
+        bool done = false;
+        qint64 startedAt = 0;
+        qint64 finishedAt = 0;
+    };
+    void schedule();
+    void complete(const QString &name);
+    void checkBarriers();
+    void logSummary();
+    QMap<QString, Stage> stages;
+    QStringList order; //Insertion order, used for logging
+    QMap<QString, QStringList> barriers;
+    QSet<QString> reachedBarriers;
+    QElapsedTimer clock;
+    bool running = false;
+};
+
+#endif // STARTUPPIPELINE_H
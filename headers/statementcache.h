@@ -0,0 +1,46 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef STATEMENTCACHE_H
+#define STATEMENTCACHE_H
+
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QString>
+#include <memory>
+#include <unordered_map>
+
+class StatementCache { //Prepared statements kept by SQL text so hot queries skip SQLite's parse and plan step
+public:
+    struct Stats {
+        quint64 hits = 0;
+        quint64 misses = 0;
+        quint64 executions = 0;
+        qint64 totalNs = 0;
+        qint64 maxNs = 0;
+    };
+    explicit StatementCache(int capacity = 64);
+    void setDatabase(const QSqlDatabase &db);
+    QSqlQuery* acquire(const QString &sql); //Prepared with every placeholder reset to NULL, nullptr if preparing failed
+    QString lastPrepareError() const;
+    void recordExecution(qint64 nanoseconds);
+    void clear(); //Statements must go before the connection closes
+    Stats stats() const;
+    QString summary() const;
+private:
+    struct Entry {
+        std::unique_ptr<QSqlQuery> query;
+        quint64 lastUsed = 0;
+    };
+    QSqlDatabase db;
+    std::unordered_map<QString, Entry> statements; //QHash needs copyable values
+    int capacity;
+    quint64 useClock = 0; //Orders entries for least recently used eviction
+    QString prepareError;
+    Stats counters;
+};
+
+#endif // STATEMENTCACHE_H
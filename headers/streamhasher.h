@@ -0,0 +1,44 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef STREAMHASHER_H
+#define STREAMHASHER_H
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QMap>
+#include <QString>
+
+struct FileDigest { //Digests taken while a job was received, travel with the job in its properties
+    QString md5; //Lower case hex
+    QString xxh64; //Lower case hex
+    qint64 size = -1;
+    QString jobId; //Trace correlation id given at intake
+    bool isValid() const { return size >= 0; };
+    static FileDigest fromProperties(const QMap<QString, QString> &properties);
+};
+
+class StreamHasher { //MD5 for printer protocols and XXH64 for cache keys and dedup, both in one pass over the data
+public:
+    StreamHasher();
+    void addData(const char* data, qint64 length);
+    void addData(const QByteArray &data);
+    QString md5Hex() const;
+    quint64 xxh64() const;
+    QString xxh64Hex() const;
+    qint64 size() const;
+    FileDigest digest() const;
+    void attachTo(QMap<QString, QString> &properties) const; //Adds md5, xxh64 and size
+private:
+    void consumeStripe(const uchar* stripe);
+    QCryptographicHash md5;
+    quint64 v1, v2, v3, v4;
+    uchar buffer[32];
+    int buffered = 0;
+    qint64 total = 0;
+};
+
+#endif // STREAMHASHER_H
@@ -0,0 +1,55 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef TRACERECORDER_H
+#define TRACERECORDER_H
+
+#include <QString>
+#include <QJsonObject>
+#include <QMutex>
+#include <QList>
+#include <atomic>
+
+//Per job spans in a bounded ring, exported in the Chrome / Perfetto trace event format.
+//Jobs are identified by the "jobId" property given at intake and carried with the job's properties and spool path
+class TraceRecorder {
+public:
+    static QString newJob(); //Correlation id for a job entering the kiosk
+    static qint64 now(); //Microseconds since the epoch, monotonic within a run
+    static void span(const QString &jobId, const QString &name, qint64 startUs, const QJsonObject &args = QJsonObject());
+    static void span(const QString &jobId, const QString &name, qint64 startUs, qint64 endUs, const QJsonObject &args);
+    static void instant(const QString &jobId, const QString &name, const QJsonObject &args = QJsonObject());
+    static void setCapacity(int events);
+    static QJsonObject exportWindow(qint64 fromUs, qint64 toUs); //Events overlapping the window
+    static int size();
+
+    class Span { //Recorded when it goes out of scope, args can be filled in meanwhile
+    public:
+        Span(const QString &jobId, const QString &name) : jobId(jobId), name(name), start(now()) {}
+        ~Span() { TraceRecorder::span(jobId, name, start, args); }
+        QString jobId;
+        QJsonObject args;
+    private:
+        QString name;
+        qint64 start;
+    };
+private:
+    struct Event {
+        QString jobId;
+        QString name;
+        qint64 startUs = 0;
+        qint64 endUs = -1; //-1 for an instant
+        QJsonObject args;
+    };
+    static void record(Event &&event);
+    static inline QMutex lock;
+    static inline QList<Event> ring;
+    static inline qsizetype head = 0; //Next slot to overwrite once the ring is full
+    static inline int capacity = 20000;
+    static inline std::atomic<quint64> nextJob = 1;
+};
+
+#endif // TRACERECORDER_H
@@ -0,0 +1,73 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef TRANSFERSCHEDULER_H
+#define TRANSFERSCHEDULER_H
+
+#include <QObject>
+#include <QPointer>
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QList>
+#include <QMap>
+#include <functional>
+
+class TransferScheduler : public QObject { //Admits printer uploads one link at a time under a shared bandwidth budget
+    Q_OBJECT
+public:
+    enum Priority {
+        Interactive, //A user is waiting at the kiosk for the print to start
+        Background //Staging ahead of authorization
+    };
+    explicit TransferScheduler(QObject* parent = nullptr);
+    void loadConfig(QJsonObject cfg);
+    //start runs later on this thread once the transfer is admitted, link identifies the printer for throughput estimates
+    quint64 enqueue(QObject* link, const QString &label, qint64 bytes, Priority priority, std::function<void(quint64)> start);
+    void promote(quint64 ticket); //The user authorized a job still waiting as background work
+    void cancel(quint64 ticket); //Drops a waiting transfer or frees the slot of a running one
+    void finish(quint64 ticket, bool success);
+    qint64 rateLimit(quint64 ticket) const; //Bytes per second a running transfer should stay under, 0 is unlimited
+    double estimatedThroughput(QObject* link) const; //Bytes per second
+    struct Status {
+        quint64 ticket = 0;
+        QString label;
+        qint64 bytes = 0;
+        bool running = false;
+        bool interactive = false;
+        qint64 elapsedMs = 0; //Waiting, or transferring once running
+        qint64 rate = 0;
+    };
+    QList<Status> snapshot() const; //Running transfers first, then the queue in arrival order
+private:
+    struct Transfer {
+        quint64 ticket = 0;
+        QPointer<QObject> link;
+        QString label;
+        qint64 bytes = 0;
+        Priority priority = Background;
+        std::function<void(quint64)> start;
+        QElapsedTimer waiting; //Since enqueue, then since start
+        qint64 waitedMs = 0;
+        qint64 rate = 0; //Share of the bandwidth cap given at start
+    };
+    void pump();
+    void schedulePump();
+    qint64 expectedMs(const Transfer &t) const;
+    bool isUrgent(const Transfer &t) const;
+    QList<Transfer> waiting;
+    QMap<quint64, Transfer> active;
+    QMap<QObject*, double> throughput; //EWMA of measured link throughput, bytes per second
+    quint64 nextTicket = 1;
+    bool pumpPending = false;
+    int maxConcurrent = 2;
+    qint64 bandwidthCap = 0; //Total upload bytes per second, 0 is unlimited
+    double defaultThroughput = 1024 * 1024; //Assumed for links not measured yet
+    qint64 backgroundMaxWaitMs = 300000; //Background work waiting this long competes as interactive
+    static constexpr double EWMA_WEIGHT = 0.3;
+    static constexpr qint64 MIN_SAMPLE_BYTES = 64 * 1024; //Smaller transfers mostly measure latency
+};
+
+#endif // TRANSFERSCHEDULER_H
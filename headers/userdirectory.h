@@ -0,0 +1,60 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#ifndef USERDIRECTORY_H
+#define USERDIRECTORY_H
+
+#include <QObject>
+#include <QString>
+#include <QList>
+#include <QTimer>
+#include "headers/databaseservice.h"
+
+struct UserRecord { //The columns a card tap is authorized on
+    bool cics = false;
+    bool trained = false;
+    quint8 authLevel = 0;
+};
+
+class UserDirectory : public QObject { //Memory resident copy of the users table so card taps never wait on SQLite
+    Q_OBJECT
+public:
+    explicit UserDirectory(DatabaseService* dbs, QObject* parent = nullptr);
+    void load(); //Full reload in the background, lookups keep using the old table until it is swapped in
+    void setPollInterval(int msecs); //How often to check whether another connection changed the database
+    bool isLoaded() const;
+    const UserRecord* find(const QString &cardId); //nullptr on a miss, callers fall back to the database
+    void insert(const QString &cardId, const UserRecord &record);
+    QFuture<Eo<int>> setTrained(const QString &cardId); //Write through, the cache changes before the database does and is rolled back if the write fails
+    int size() const;
+    QString summary() const;
+signals:
+    void reloaded(int users);
+private:
+    struct Slot {
+        QString id;
+        quint32 hash = 0; //Zero marks a free slot
+        UserRecord record;
+    };
+    static quint32 hashId(const QString &cardId);
+    qsizetype slotOf(const QString &cardId, quint32 hash) const; //-1 when absent
+    static void place(QList<Slot> &table, const QString &cardId, quint32 hash, const UserRecord &record, int &probes);
+    void checkVersion();
+    DatabaseService* dbs;
+    QList<Slot> table; //Open addressing with linear probing, capacity is a power of two at most half full
+    int count = 0;
+    int longestProbe = 0;
+    bool loaded = false;
+    bool reloading = false;
+    bool reloadQueued = false;
+    qint64 dataVersion = -1;
+    QTimer pollTimer;
+    quint64 hits = 0;
+    quint64 misses = 0;
+    quint64 reloads = 0;
+};
+
+#endif // USERDIRECTORY_H
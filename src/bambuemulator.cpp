@@ -3,32 +3,123 @@
 #include <QDebug>
 #include <QCoreApplication>
 #include <QDir>
-BambuEmulator::BambuEmulator(QObject* parent) : QObject(parent) {
-    mosquito = new QProcess(parent);
+#include <QFile>
+#include <QSslKey>
+#include <QSslCertificate>
+#include <QJsonDocument>
+#include <QJsonArray>
 
-    QString mosquitoPath = "C:/Program Files/mosquitto/mosquitto.exe";
-    QString configPath = QDir(QCoreApplication::applicationDirPath()).filePath("mosq.conf");
+BambuEmulator::BambuEmulator(QJsonObject config, QObject* parent) : QObject(parent) {
+    //Slicers connect to the kiosk like they would to a printer in LAN mode: user bblp, access code as password
+    accessCode = config.value("accessCode").toString();
+    if (accessCode.isEmpty()) qWarning() << "Bambu emulator has no accessCode, only the per printer codes can log in";
+    broker.setAuthenticator([this](const QString &, const QString &username, const QString &password) {
+        return checkAccessCode(username, password);
+    });
+    ftps.setAuthenticator([this](const QString &username, const QString &password) {
+        return checkAccessCode(username, password);
+    });
+    ftps.setSpoolDirectory(config.value("spoolDirectory").toString("uploaded/bambu"));
+    QJsonArray passivePorts = config.value("passivePorts").toArray();
+    if (passivePorts.size() == 2) ftps.setPassivePortRange(passivePorts[0].toInt(), passivePorts[1].toInt());
 
-    mosquito->start(mosquitoPath, QStringList() << "-c" << configPath << "-v");
-    if (!mosquito->waitForStarted(2000)) {
-        qCritical() << "Failed to start mosquito";
-        return;
-    };
+    quint16 port = config.value("port").toInt(8883);
+    quint16 ftpsPort = config.value("ftpsPort").toInt(990);
+    QDir appDir = QDir(QCoreApplication::applicationDirPath());
+    QString certPath = appDir.filePath(config.value("certificate").toString("bambu_emulator_cert.pem"));
+    QString keyPath = appDir.filePath(config.value("privateKey").toString("bambu_emulator_key.pem"));
+
+    QList<QSslCertificate> certs = QSslCertificate::fromPath(certPath);
+    QFile keyFile(keyPath);
+    if (!certs.isEmpty() && keyFile.open(QIODevice::ReadOnly)) {
+        QByteArray keyData = keyFile.readAll();
+        keyFile.close();
+        QSslKey key(keyData, QSsl::Rsa, QSsl::Pem);
+        if (key.isNull()) key = QSslKey(keyData, QSsl::Ec, QSsl::Pem);
 
-    QObject::connect(mosquito, &QProcess::readyReadStandardOutput, this, [this](){
-        qDebug() << "[mosq]" << this->mosquito->readAllStandardOutput();
+        QSslConfiguration sslConfig = QSslConfiguration::defaultConfiguration();
+        sslConfig.setLocalCertificate(certs.first());
+        sslConfig.setPrivateKey(key);
+        sslConfig.setPeerVerifyMode(QSslSocket::VerifyNone);
+        broker.listenEncrypted(QHostAddress::Any, port, sslConfig);
+        ftps.listen(QHostAddress::Any, ftpsPort, sslConfig);
+    } else { //Slicers require TLS, but a plain listener still works for local tools
+        qWarning() << "Bambu emulator certificate not found at" << certPath << "- MQTT and FTP listeners are not encrypted";
+        broker.listen(QHostAddress::Any, port);
+        ftps.listen(QHostAddress::Any, ftpsPort);
+    }
+
+    broker.subscribe("device/+/request", [this](const QString &topic, const QByteArray &payload) {
+        handleRequest(topic, payload);
     });
-    QObject::connect(mosquito, QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished), [](int code, QProcess::ExitStatus){ qDebug() << "mosquitto exited" << code; });
+    QObject::connect(&broker, &MqttBroker::clientConnected, this, [](const QString &clientId) { qDebug() << "[mqtt] client connected" << clientId; });
+    QObject::connect(&broker, &MqttBroker::clientDisconnected, this, [](const QString &clientId) { qDebug() << "[mqtt] client disconnected" << clientId; });
+    QObject::connect(&ftps, &FtpsServer::uploadFinished, this, &BambuEmulator::handleUpload);
+    QObject::connect(&ftps, &FtpsServer::uploadFailed, this, [](const QString &fileName, const QString &error) { qWarning() << "[ftps] upload of" << fileName << "failed:" << error; });
+}
+
+bool BambuEmulator::checkAccessCode(const QString &username, const QString &password) const {
+    //The listeners bind every interface, so with no code configured nobody gets in rather than everybody
+    if (username != "bblp" || password.isEmpty()) return false;
+    return (!accessCode.isEmpty() && password == accessCode) || printerCodes.values().contains(password);
+}
+
+void BambuEmulator::handleUpload(const QString &filepath, const QString &password, QMap<QString, QString> properties) {
+    if (printers.isEmpty()) {
+        qWarning() << "Bambu upload received but no BambuLab printers are configured";
+        return;
+    }
+    //The access code the slicer logged in with selects the printer, the shared code falls back to the first one
+    quint32 id = printers.firstKey();
+    for (auto it = printerCodes.constBegin(); it != printerCodes.constEnd(); ++it) {
+        if (it.value() == password && printers.contains(it.key())) {
+            id = it.key();
+            break;
+        }
+    }
+
+    QVariantMap propertiesForJS; //Convert to QVariantMap for use in QML
+    for (auto it = properties.constBegin(); it != properties.constEnd(); ++it) {
+        propertiesForJS.insert(it.key(), it.value());
+    }
+    emit jobInfoLoaded(propertiesForJS);
+    emit jobLoaded(id, filepath, properties);
+}
+
+void BambuEmulator::handleRequest(const QString &topic, const QByteArray &payload) {
+    QJsonObject request = QJsonDocument::fromJson(payload).object();
+    QString reportTopic = topic.section('/', 0, 1) + "/report";
+    if (request.value("pushing").toObject().value("command").toString() == "pushall") { //Slicer asks for full state when it connects
+        broker.publish(reportTopic, QJsonDocument(idleReport()).toJson(QJsonDocument::Compact));
+    }
+}
+
+QJsonObject BambuEmulator::idleReport() {
+    return QJsonObject{
+        {"print", QJsonObject{
+            {"command", "push_status"},
+            {"msg", 0},
+            {"sequence_id", "0"},
+            {"gcode_state", "IDLE"},
+            {"mc_percent", 0},
+            {"mc_remaining_time", 0},
+            {"sdcard", true},
+            {"wifi_signal", "-40dBm"}
+        }}
+    };
 }
 
-void BambuEmulator::addPrinter(quint32 id, BambuLab* printer) {
+void BambuEmulator::addPrinter(quint32 id, BambuLab* printer, const QString &emulatorAccessCode) {
     printers.insert(id, printer);
+    if (!emulatorAccessCode.isEmpty()) printerCodes.insert(id, emulatorAccessCode);
 }
 
 void BambuEmulator::removePrinter(quint32 id) {
     printers.remove(id);
+    printerCodes.remove(id);
 }
 
 BambuEmulator::~BambuEmulator() {
-    mosquito->terminate();
+    ftps.close();
+    broker.close();
 }
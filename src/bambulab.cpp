@@ -9,6 +9,9 @@
 #include <QFileInfo>
 #include <QJsonObject>
 #include <QJsonArray>
+#include "headers/perfregistry.h"
+#include "headers/tracerecorder.h"
+#include "headers/logger.h"
 
 BambuLab::BambuLab(QObject* parent) : Printer(parent), mqtt() {}
 
@@ -20,9 +23,19 @@ BambuLab::BambuLab(QString name, QString model, QString hostname, QString access
 
     mqtt = new QMqttClient();
     ftps = new FtpsClient();
+    ftpsThread = new QThread(this); //Keeps curl's blocking transfers off the GUI thread
+    ftps->moveToThread(ftpsThread);
+    QObject::connect(ftpsThread, &QThread::finished, ftps, &QObject::deleteLater);
+    QObject::connect(ftps, &FtpsClient::finished, this, &BambuLab::uploadFinished);
+    ftpsThread->start();
+    initMqtt(); //Connection is started by PrinterManager once all printers are configured
+}
 
-    qDebug() << "Connecting to BambuLab printer...";
-    this->startConnection();
+BambuLab::~BambuLab() {
+    if (ftpsThread == nullptr) return;
+    ftps->abort();
+    ftpsThread->quit();
+    ftpsThread->wait();
 }
 
 void BambuLab::updateState() {
@@ -36,10 +49,24 @@ void BambuLab::updateState() {
         qWarning() << "Message is not JSON Object";
         return;
     }
-    latestReport = doc.object();
-
+    //Periodic reports only carry changed fields, merge them into the last full report
+    QJsonObject update = doc.object().value("print").toObject();
+    QString sequence = update.value("sequence_id").toString();
+    if (!sequence.isEmpty() && update.value("command").toString() != "push_status" && awaitingAck.contains(sequence)) {
+        static LatencyHistogram* ackTime = PerfRegistry::histogram("mqtt.publish_to_ack");
+        AwaitingAck ack = awaitingAck.take(sequence);
+        ackTime->record(ack.sent.nsecsElapsed() / 1000);
+        TraceRecorder::span(ack.jobId, "mqtt command", ack.traceStart, QJsonObject{{"printer", name}, {"command", update.value("command").toString()}, {"result", update.value("result").toString()}});
+        TraceRecorder::instant(ack.jobId, "printer ack", QJsonObject{{"printer", name}});
+    }
+    if (update.value("command").toString() != "push_status") return;
+    QJsonObject print = latestReport.value("print").toObject();
+    for (auto it = update.constBegin(); it != update.constEnd(); ++it) {
+        print.insert(it.key(), it.value());
+    }
+    latestReport.insert("print", print);
 
-    QJsonObject amsInfo = latestReport.value("print").toObject().value("ams").toObject();
+    QJsonObject amsInfo = update.value("ams").toObject();
     if (amsInfo.value("ams_exist_bits") == "1") {
         this->hasAms = true;
         amsList.clear();
@@ -60,43 +87,47 @@ void BambuLab::updateState() {
     }
 }
 
-void BambuLab::startConnection() {
-    //Setup mqtt client
-    mqtt->setHostname(hostname);
-    mqtt->setPort(port);
-    mqtt->setUsername(username);
-    mqtt->setPassword(accessCode);
-    mqtt->setClientId("PCM 3DP Kiosk Service");
-
-
-    //TLS Encryption, no cerificate validation
-    //QSslSocket* sslSocket = new QSslSocket(mqtt);
-    QSslConfiguration sslConfig = QSslConfiguration::defaultConfiguration();
-    sslConfig.setPeerVerifyMode(QSslSocket::VerifyNone);
-    sslConfig.setProtocol(QSsl::TlsV1_2OrLater);
-    //sslSocket->setSslConfiguration(sslConfig);
-    //mqtt->setTransport(sslSocket, QMqttClient::SecureSocket);
-
-
-
+void BambuLab::initMqtt() {
     QObject::connect(mqtt, &QMqttClient::connected, this, [this]() {
-        qDebug() << "Connected to MQTT broker!";
+        qCDebug(lcBambu) << "Connected to MQTT broker!";
         emit this->connectionUpdated(true);
         this->connectionStatus = true;
+        this->failureReported = false;
 
         this->mqtt->subscribe(reportFilter);
     });
 
     QObject::connect(mqtt, &QMqttClient::disconnected, this, [this]() {
-        qDebug() << "Disconnected from broker.";
-        emit this->connectionUpdated(false);
+        qCDebug(lcBambu) << "Disconnected from broker.";
+        if (!this->failureReported) emit this->connectionUpdated(false);
+        this->failureReported = true;
         this->connectionStatus = false;
+        if (reconnectPending) { //Hostname changed while connected, connect to the new address
+            reconnectPending = false;
+            startConnection();
+        }
+    });
 
+    QObject::connect(mqtt, &QMqttClient::errorChanged, this, [this](QMqttClient::ClientError error) {
+        if (error == QMqttClient::NoError) return;
+        qWarning() << "MQTT error:" << error;
+        if (mqtt->state() != QMqttClient::Disconnected || this->failureReported) return; //Usually disconnected already reported it
+        this->failureReported = true;
+        emit this->connectionUpdated(false); //Connection attempt refused
     });
 
     QObject::connect(mqtt, &QMqttClient::messageReceived, this, [this](const QByteArray &message, const QMqttTopicName &topic) {
+        static PerfCounter* received = PerfRegistry::counter("mqtt.received");
+        static PerfCounter* receivedBytes = PerfRegistry::counter("mqtt.received_bytes");
+        received->add();
+        receivedBytes->add(message.size());
         if (this->reportFilter.match(topic)) {
             latestReportBytes = message;
+            reportAge.start();
+            if (probePending) { //The printer answered, clears a Degraded left by a failed upload
+                probePending = false;
+                emit this->healthReport(true, "");
+            }
             if (!requestTopic.isValid()) {
                 QStringList topicparts = topic.name().split("/");
                 topicparts.pop_back();
@@ -105,79 +136,247 @@ void BambuLab::startConnection() {
                 requestTopic = QMqttTopicName(topicparts.join("/"));
                 mqtt->subscribe(requestFiler);
                 updateState();
-                qDebug() << "LatestReport: "<<latestReport;
+                qCDebug(lcBambu) << "LatestReport: "<<latestReport;
+            } else {
+                updateState();
             }
         } else if (this->requestFiler.match(topic)) {
-            qDebug() << "Response recieved on topic" << topic.name() << ":" << message;
+            qCDebug(lcBambu) << "Response recieved on topic" << topic.name() << ":" << message;
         } else {
-            qDebug() << "Message received on topic" << topic.name() << ":" << message;
+            qCDebug(lcBambu) << "Message received on topic" << topic.name() << ":" << message;
         }
     });
+}
+
+void BambuLab::startConnection() {
+    qCDebug(lcBambu) << "Connecting to BambuLab printer...";
+    if (mqtt->state() != QMqttClient::Disconnected) { //A timed out attempt is still connecting, close it and start over once it is gone
+        failureReported = true; //The supervisor already counted this attempt
+        reconnectPending = true;
+        mqtt->disconnectFromHost();
+        return;
+    }
+    failureReported = false; //A new attempt, its failure counts once
+    probePending = false;
+    //Setup mqtt client
+    mqtt->setHostname(hostname);
+    mqtt->setPort(port);
+    mqtt->setUsername(username);
+    mqtt->setPassword(accessCode);
+    mqtt->setClientId("PCM 3DP Kiosk Service");
+
+
+    //TLS Encryption, no cerificate validation
+    //QSslSocket* sslSocket = new QSslSocket(mqtt);
+    QSslConfiguration sslConfig = QSslConfiguration::defaultConfiguration();
+    sslConfig.setPeerVerifyMode(QSslSocket::VerifyNone);
+    sslConfig.setProtocol(QSsl::TlsV1_2OrLater);
+    //sslSocket->setSslConfiguration(sslConfig);
+    //mqtt->setTransport(sslSocket, QMqttClient::SecureSocket);
 
     mqtt->connectToHostEncrypted(sslConfig);
 }
 
+void BambuLab::probeConnection() {
+    if (!connectionStatus) return; //The supervisor reconnects, nothing to probe
+    if (probePending) { //Asked last time and nothing came back
+        probePending = false;
+        emit this->healthReport(false, "no status report after pushall");
+        return;
+    }
+    if (reportAge.isValid() && !reportAge.hasExpired(60000)) return emit this->healthReport(true, "");
+    if (!requestTopic.isValid()) return;
+    QJsonObject request{
+        {"pushing", QJsonObject {
+            {"sequence_id", QString::number(this->sequenceId++)},
+            {"command", "pushall"}
+        }}
+    };
+    probePending = true;
+    this->mqtt->publish(requestTopic, QJsonDocument(request).toJson(QJsonDocument::Compact));
+}
+
 void BambuLab::setHostname(QString hostname) {
+    if (this->hostname == hostname) return;
     this->hostname = hostname;
+    if (mqtt != nullptr && mqtt->state() != QMqttClient::Disconnected) { //Reconnect once the old session is closed
+        reconnectPending = true;
+        mqtt->disconnectFromHost();
+    }
+}
+
+QString BambuLab::getHostname() {
+    return this->hostname;
 }
 
 void BambuLab::setAccessCode(QString accessCode) {
     this->accessCode = accessCode;
 }
 
+static bool isBambuPrintFile(const QString &filePath) {
+    QString fileName = QFileInfo(filePath).fileName();
+    return fileName.endsWith(".gcode.3mf") || fileName.endsWith(".gcode");
+}
+
 void BambuLab::startPrint(const QString &filePath) {
-    QFileInfo fInfo = QFileInfo(filePath);
-    if (fInfo.fileName().endsWith(".gcode.3mf")) {
-        startPrintProject(filePath);
-    } else if (fInfo.fileName().startsWith(".gcode")) {
-        startPrintGCode(filePath);
-    } else {
+    if (!isBambuPrintFile(filePath)) {
         qCritical() << "Invalid print file for bambu";
+        return;
     }
+    if (!connectionStatus || !requestTopic.isValid()) return;
+    for (PendingUpload &upload : pendingUploads) {
+        if (upload.filepath == filePath && !upload.discarded) { //Already on its way, start once it lands
+            upload.startAfter = true;
+            return;
+        }
+    }
+    for (PendingUpload &upload : scheduledUploads) {
+        if (upload.filepath == filePath) { //Still waiting for a transfer slot, the user is waiting now
+            upload.startAfter = true;
+            promoteTransfer(upload.ticket);
+            return;
+        }
+    }
+    sendGCode(filePath, true);
+}
+
+void BambuLab::stageFile(const QString &filePath) {
+    if (!isBambuPrintFile(filePath) || !connectionStatus || !requestTopic.isValid()) {
+        emit fileStaged(filePath, false);
+        return;
+    }
+    sendGCode(filePath, false);
+}
+
+void BambuLab::startStaged(const QString &filePath) {
+    if (stagedFiles.remove(filePath)) return sendStartCommand(filePath);
+    startPrint(filePath); //Joins a running upload or falls back to a full upload
+}
+
+void BambuLab::discardStaged(const QString &filePath) {
+    if (stagedFiles.remove(filePath)) deleteRemote(filePath);
+    for (auto it = scheduledUploads.begin(); it != scheduledUploads.end();) {
+        if (it->filepath != filePath) {
+            ++it;
+            continue;
+        }
+        cancelTransfer(it.key());
+        it = scheduledUploads.erase(it);
+    }
+    for (int i = 0; i < pendingUploads.size(); i++) {
+        PendingUpload &upload = pendingUploads[i];
+        if (upload.filepath != filePath || upload.discarded) continue;
+        upload.discarded = true;
+        upload.startAfter = false;
+        *upload.cancelled = true; //Stops curl if it is sending, or skips the upload if it has not started
+    }
+    releaseJob(filePath);
+}
+
+void BambuLab::uploadFinished(bool success, const QString &error) {
+    if (pendingUploads.isEmpty()) return;
+    PendingUpload upload = pendingUploads.dequeue();
+    finishTransfer(upload.ticket, success);
+    TraceRecorder::span(traceJob(upload.filepath), upload.startAfter ? "upload" : "staging upload", upload.traceStart,
+                        QJsonObject{{"printer", name}, {"protocol", "ftps"}, {"ok", success}, {"discarded", upload.discarded}});
+    if (upload.discarded) {
+        if (success) deleteRemote(upload.filepath); //Finished before the abort reached curl
+        releaseJob(upload.filepath);
+        return;
+    }
+    if (!success) {
+        qCritical() << "FTPS ERROR:" << error;
+        emit this->healthReport(false, "FTPS upload failed: " + error);
+        if (upload.startAfter) releaseJob(upload.filepath);
+        else emit fileStaged(upload.filepath, false); //Kept, starting it falls back to a full upload
+        return;
+    }
+    if (upload.startAfter) {
+        sendStartCommand(upload.filepath);
+    } else {
+        stagedFiles.insert(upload.filepath);
+        emit fileStaged(upload.filepath, true);
+    }
+}
+
+bool BambuLab::isIdle() {
+    if (!connectionStatus) return false;
+    QString state = latestReport.value("print").toObject().value("gcode_state").toString();
+    return state == "IDLE" || state == "FINISH" || state == "FAILED";
+}
+
+bool BambuLab::setTargetTemperatures(int nozzle, int bed) {
+    if (!connectionStatus || !requestTopic.isValid()) return false;
+    QJsonObject request{
+        {"print", QJsonObject {
+            {"sequence_id", QString::number(this->sequenceId)},
+            {"command", "gcode_line"},
+            {"param", QString("M140 S%1\nM104 S%2\n").arg(bed).arg(nozzle)}
+        }}
+    };
+    publishRequest(request);
+    return true;
+}
+
+void BambuLab::sendStartCommand(const QString &filePath) {
+    if (QFileInfo(filePath).fileName().endsWith(".gcode.3mf")) startPrintProject(filePath);
+    else startPrintGCode(filePath);
+    releaseJob(filePath);
+}
+
+void BambuLab::deleteRemote(const QString &filePath) {
+    QMetaObject::invokeMethod(ftps, [client = ftps, host = hostname, user = username, code = accessCode, remote = "/" + QFileInfo(filePath).fileName()]() {
+        client->deleteFile(host, user, code, remote);
+    });
+}
+
+void BambuLab::releaseJob(const QString &filePath) {
+    if (stagedFiles.contains(filePath)) return;
+    for (const PendingUpload &upload : scheduledUploads) {
+        if (upload.filepath == filePath) return;
+    }
+    for (const PendingUpload &upload : pendingUploads) {
+        if (upload.filepath == filePath) return; //Discarded ones too, their trace span is written when curl returns
+    }
+    releaseDigest(filePath);
 }
 
 void BambuLab::startPrintGCode(const QString &fileName) {
     if (!connectionStatus) return;
     if (!requestTopic.isValid()) return;
-    QObject::connect(ftps, &FtpsClient::finished, this, [this, &fileName](bool success, const QString &error) {
-        if (success) {
-            QJsonObject request{
-                {"print", QJsonObject {
-                    {"sequence_id", QString::number(this->sequenceId)},
-                    {"command", "gcode_file"},
-                    {"param", storageType + "/" + QFileInfo(fileName).fileName()}
-                }}
-            };
-            this->mqtt->publish(requestTopic, QJsonDocument(request).toJson(QJsonDocument::Compact));
-            this->sequenceId++;
-            qDebug() <<"Sending print request"<< QJsonDocument(request).toJson(QJsonDocument::Compact);
-        } else {
-            qCritical() << "FTPS ERROR: " <<error;
-        }
-    });
-    sendGCode(fileName);
+    QJsonObject request{
+        {"print", QJsonObject {
+            {"sequence_id", QString::number(this->sequenceId)},
+            {"command", "gcode_file"},
+            {"param", storageType + "/" + QFileInfo(fileName).fileName()}
+        }}
+    };
+    publishRequest(request, traceJob(fileName));
+    qCDebug(lcBambu) <<"Sending print request"<< QJsonDocument(request).toJson(QJsonDocument::Compact);
 }
 
 void BambuLab::startPrintProject(const QString &fileName) {
     if (!connectionStatus) return;
     if (!requestTopic.isValid()) return;
-    QObject::connect(ftps, &FtpsClient::finished, this, [this, &fileName](bool success, const QString &error) {
-        if (success) {
-            BambuPrintOptions opt(QFileInfo(fileName).fileName());
-            opt.setAmsMapping(QList<qint8>{3});
-            requestPrintProject(opt);
-        } else {
-            qCritical() << "FTPS ERROR:" << error;
-        }
-    });
-    sendGCode(fileName);
+    BambuPrintOptions opt(QFileInfo(fileName).fileName());
+    opt.md5 = fileDigest(fileName).md5.toUpper(); //The printer checks the project against it, empty skips the check
+    opt.setAmsMapping(QList<qint8>{3});
+    requestPrintProject(opt, traceJob(fileName));
 }
 
 void BambuLab::setStorageType(const QString &storage) {
     this->storageType = storage;
 }
 
-void BambuLab::requestPrintProject(const BambuPrintOptions &options) {
+void BambuLab::setEmulatorAccessCode(const QString &code) {
+    this->emulatorAccessCode = code;
+}
+
+QString BambuLab::getEmulatorAccessCode() {
+    return emulatorAccessCode;
+}
+
+void BambuLab::requestPrintProject(const BambuPrintOptions &options, const QString &jobId) {
     if (!connectionStatus) return;
     if (!requestTopic.isValid()) return;
     QJsonObject request{
@@ -200,15 +399,36 @@ void BambuLab::requestPrintProject(const BambuPrintOptions &options) {
                               {"ams_mapping", options.amsMapping},
                               {"file", ""},
                               {"url", "file:///mnt/"+options.storageType+"/"+options.fileName},
-                              {"md5", ""}
+                              {"md5", options.md5}
         }}
     };
+    publishRequest(request, jobId);
+    qCDebug(lcBambu) <<"Sending print request"<< QJsonDocument(request);
+}
+
+void BambuLab::publishRequest(const QJsonObject &request, const QString &jobId) {
+    static PerfCounter* unanswered = PerfRegistry::counter("mqtt.unacked");
+    static PerfCounter* published = PerfRegistry::counter("mqtt.published");
+    //Requests the printer never answered are dropped after a minute so the map stays small
+    for (auto it = awaitingAck.begin(); it != awaitingAck.end();) {
+        if (!it->sent.hasExpired(60000)) {
+            ++it;
+            continue;
+        }
+        unanswered->add();
+        it = awaitingAck.erase(it);
+    }
+    AwaitingAck ack;
+    ack.sent.start();
+    ack.jobId = jobId;
+    ack.traceStart = TraceRecorder::now();
+    awaitingAck.insert(QString::number(sequenceId), ack);
     this->mqtt->publish(requestTopic, QJsonDocument(request).toJson(QJsonDocument::Compact));
+    published->add();
     this->sequenceId++;
-    qDebug() <<"Sending print request"<< QJsonDocument(request);
 }
 
-void BambuLab::sendGCode(QString filepath) {
+void BambuLab::sendGCode(QString filepath, bool startAfterUpload) {
 
     // //Read gcode file
     QFileInfo fileInfo(filepath);
@@ -220,5 +440,32 @@ void BambuLab::sendGCode(QString filepath) {
     // QByteArray fileData = file.readAll();
     // file.close();
 
-    ftps->uploadFile(filepath, hostname, username, accessCode, "/"+fileInfo.fileName());
+    quint64 ticket = scheduleTransfer(filepath, startAfterUpload, [this](quint64 ticket) { beginUpload(ticket); });
+    scheduledUploads.insert(ticket, PendingUpload{filepath, startAfterUpload, false, ticket});
+}
+
+void BambuLab::beginUpload(quint64 ticket) {
+    if (!scheduledUploads.contains(ticket)) return cancelTransfer(ticket); //Discarded while queued
+    PendingUpload upload = scheduledUploads.take(ticket);
+    QFileInfo fileInfo(upload.filepath);
+    if (!spoolIntact(upload.filepath)) {
+        finishTransfer(ticket, false);
+        if (upload.startAfter) { //The user is waiting on the print, nothing else would tell them
+            releaseJob(upload.filepath);
+            emit this->healthReport(false, "Spool file " + fileInfo.fileName() + " changed since it was received, not sending it");
+        } else emit fileStaged(upload.filepath, false);
+        return;
+    }
+
+    //curl blocks, so uploads run one after another on the FTPS thread and finish in queue order
+    upload.traceStart = TraceRecorder::now();
+    pendingUploads.enqueue(upload);
+    //Bambu firmware only reads ASCII G-code, so binary compaction is downgraded to stripping
+    GCodeCompactor* compactor = fileInfo.fileName().endsWith(".gcode") ? createCompactor(upload.filepath, false) : nullptr;
+    QMetaObject::invokeMethod(ftps, [client = ftps, filepath = upload.filepath, host = hostname, user = username, code = accessCode, remote = "/" + fileInfo.fileName(), compactor, rate = transferRateLimit(ticket), cancelled = upload.cancelled]() {
+        if (compactor != nullptr) compactor->open(QIODevice::ReadOnly); //curl pulls the stream straight from the worker
+        client->setSendSpeedLimit(rate);
+        client->uploadFile(filepath, host, user, code, remote, compactor, cancelled);
+        if (compactor != nullptr) compactor->deleteLater();
+    });
 }
@@ -0,0 +1,276 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/commandengine.h"
+#include <QThreadPool>
+#include <QDebug>
+#include <algorithm>
+
+CommandEngine::CommandEngine(QObject* parent) : QObject(parent) {
+    trie.append(Node()); //Root
+    connect(&pager, &QTimer::timeout, this, &CommandEngine::flush);
+}
+
+void CommandEngine::loadConfig(QJsonObject cfg) {
+    pageSize = qBound(1, cfg.value("pageSize").toInt(40), 1000);
+}
+
+void CommandEngine::add(const Command &command) {
+    int index = commands.size();
+    commands.append(command);
+    insert(command.name.toLower(), index);
+    for (const QString &alias : command.aliases) insert(alias.toLower(), index);
+}
+
+void CommandEngine::insert(const QString &key, int command) {
+    int node = 0;
+    for (QChar c : key) {
+        int next = trie[node].next.value(c, -1);
+        if (next < 0) {
+            next = trie.size();
+            trie.append(Node());
+            trie[node].next.insert(c, next);
+        }
+        node = next;
+    }
+    if (trie[node].command >= 0) qWarning() << "Terminal command" << key << "registered twice";
+    trie[node].command = command;
+}
+
+int CommandEngine::find(const QString &name) const {
+    int node = 0;
+    for (QChar c : name) {
+        node = trie[node].next.value(c, -1);
+        if (node < 0) return -1;
+    }
+    return trie[node].command;
+}
+
+QList<int> CommandEngine::withPrefix(const QString &prefix) const {
+    int node = 0;
+    for (QChar c : prefix) {
+        node = trie[node].next.value(c, -1);
+        if (node < 0) return {};
+    }
+    //Everything below the prefix node, an alias and its command only count once
+    QList<int> found;
+    QList<int> stack = {node};
+    while (!stack.isEmpty()) {
+        const Node &n = trie[stack.takeLast()];
+        if (n.command >= 0 && !found.contains(n.command)) found.append(n.command);
+        for (int child : n.next) stack.append(child);
+    }
+    return found;
+}
+
+Eo<QStringList> CommandEngine::tokenize(const QString &line, bool allowOpenQuote) {
+    QStringList tokens;
+    QString current;
+    bool inToken = false;
+    QChar quote;
+    for (qsizetype i = 0; i < line.size(); i++) {
+        QChar c = line[i];
+        if (!quote.isNull()) {
+            if (c == quote) quote = QChar();
+            else if (c == '\\' && quote == '"' && i + 1 < line.size() && (line[i + 1] == '"' || line[i + 1] == '\\')) current += line[++i];
+            else current += c;
+        } else if (c.isSpace()) {
+            if (inToken) tokens.append(current);
+            current.clear();
+            inToken = false;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+            inToken = true; //"" is an empty argument, not a missing one
+        } else {
+            current += c;
+            inToken = true;
+        }
+    }
+    if (!quote.isNull() && !allowOpenQuote) {
+        return Eo<QStringList>(Error("CommandSyntaxError", QString("expected closing quotation to match opening quotation at: ") + quote + current, El::Trivial));
+    }
+    if (inToken) tokens.append(current);
+    return tokens;
+}
+
+Eo<QVariantMap> CommandEngine::parse(const Command &command, const QStringList &tokens) const {
+    QVariantMap parsed;
+    auto fail = [&command](const QString &message) {
+        return Eo<QVariantMap>(Error("CommandArgumentError", message + ", usage: " + usage(command), El::Trivial));
+    };
+    for (int i = 0; i < command.args.size(); i++) {
+        const Arg &arg = command.args[i];
+        if (i >= tokens.size()) {
+            if (arg.optional) break;
+            return fail(command.name + " needs " + arg.name);
+        }
+        const QString &token = tokens[i];
+        switch (arg.type) {
+        case ArgType::Text:
+            parsed.insert(arg.name, tokens.mid(i).join(" "));
+            return parsed;
+        case ArgType::Int: {
+            bool ok = false;
+            qint64 value = token.toLongLong(&ok);
+            if (!ok) return fail(arg.name + " must be a whole number, not '" + token + "'");
+            parsed.insert(arg.name, value);
+            break;
+        }
+        case ArgType::Number: {
+            bool ok = false;
+            double value = token.toDouble(&ok);
+            if (!ok) return fail(arg.name + " must be a number, not '" + token + "'");
+            parsed.insert(arg.name, value);
+            break;
+        }
+        case ArgType::Choice: {
+            QStringList allowed = arg.values ? arg.values() : QStringList();
+            auto match = std::find_if(allowed.cbegin(), allowed.cend(), [&token](const QString &v) { return v.compare(token, Qt::CaseInsensitive) == 0; });
+            if (match == allowed.cend()) return fail("unknown " + arg.name + " '" + token + "'");
+            parsed.insert(arg.name, *match);
+            break;
+        }
+        case ArgType::Word:
+            parsed.insert(arg.name, token);
+            break;
+        }
+    }
+    if (tokens.size() > command.args.size()) return fail(command.name + " takes " + QString::number(command.args.size()) + " arguments");
+    return parsed;
+}
+
+void CommandEngine::execute(const QString &line, quint8 authLevel) {
+    Eo<QStringList> tokens = tokenize(line);
+    if (tokens.isError()) return printError(tokens.errorString());
+    QStringList words = tokens.get();
+    if (words.isEmpty()) return;
+    QString name = words.takeFirst().toLower();
+    int index = find(name);
+    if (index < 0) return printError("unknown command '" + name + "'");
+    const Command &command = commands[index];
+    if (command.authLevel > authLevel) return printError(command.name + " needs authorization level " + QString::number(command.authLevel));
+    Eo<QVariantMap> args = parse(command, words);
+    if (args.isError()) return printError(args.errorString());
+    Invocation invocation;
+    invocation.name = command.name;
+    invocation.tokens = words;
+    invocation.args = args.get();
+    invocation.authLevel = authLevel;
+    command.run(invocation);
+}
+
+CommandEngine::Completion CommandEngine::complete(const QString &line, quint8 authLevel) const {
+    Completion result;
+    result.line = line;
+    QStringList tokens = tokenize(line, true).get();
+    bool closed = !tokenize(line).isError();
+    if (tokens.isEmpty() || (closed && !line.isEmpty() && line.back().isSpace())) tokens.append(QString()); //Completing a new word
+    QString partial = tokens.last();
+
+    QStringList options;
+    if (tokens.size() == 1) {
+        for (int index : withPrefix(partial.toLower())) {
+            if (commands[index].authLevel <= authLevel) options.append(commands[index].name);
+        }
+    } else {
+        int index = find(tokens.first().toLower());
+        if (index < 0 || commands[index].authLevel > authLevel) return result;
+        const Command &command = commands[index];
+        int position = tokens.size() - 2;
+        if (position >= command.args.size() && (command.args.isEmpty() || command.args.last().type != ArgType::Text)) return result;
+        const Arg &arg = command.args[qMin(position, int(command.args.size()) - 1)];
+        if (arg.values) {
+            for (const QString &v : arg.values()) {
+                if (v.startsWith(partial, Qt::CaseInsensitive)) options.append(v);
+            }
+        }
+    }
+    options.removeDuplicates();
+    options.sort(Qt::CaseInsensitive);
+    result.candidates = options;
+    if (options.isEmpty()) return result;
+
+    //Extend to the longest prefix every candidate shares
+    QString common = options.first();
+    for (const QString &option : options) {
+        qsizetype n = 0;
+        while (n < common.size() && n < option.size() && common[n].toLower() == option[n].toLower()) n++;
+        common.truncate(n);
+    }
+    if (common.size() < partial.size()) return result;
+    tokens.last() = common;
+    QStringList rebuilt;
+    for (const QString &token : tokens) rebuilt.append(token.contains(' ') || token.isEmpty() ? "\"" + token + "\"" : token);
+    if (rebuilt.last() == "\"\"") rebuilt.removeLast();
+    result.line = rebuilt.join(" ") + (options.size() == 1 ? " " : "");
+    return result;
+}
+
+QString CommandEngine::usage(const Command &command) {
+    QStringList parts = {command.name};
+    for (const Arg &arg : command.args) {
+        QString shown = arg.name;
+        if (arg.type == ArgType::Choice && arg.values) shown = arg.values().join(" | ");
+        if (arg.type == ArgType::Text) shown += "...";
+        parts.append(arg.optional ? "[" + shown + "]" : shown);
+    }
+    return parts.join(" ");
+}
+
+QStringList CommandEngine::names(quint8 authLevel) const {
+    QStringList list;
+    for (const Command &command : commands) {
+        if (command.authLevel <= authLevel) list.append(command.name);
+    }
+    return list;
+}
+
+QStringList CommandEngine::help(quint8 authLevel, const QString &name) const {
+    if (!name.isEmpty()) {
+        int index = find(name.toLower());
+        if (index < 0 || commands[index].authLevel > authLevel) return {"No command named '" + name + "'"};
+        const Command &command = commands[index];
+        QStringList lines = {usage(command), "\t" + command.summary};
+        if (!command.aliases.isEmpty()) lines.append("\talso: " + command.aliases.join(", "));
+        return lines;
+    }
+    QList<const Command*> visible;
+    for (const Command &command : commands) {
+        if (command.authLevel <= authLevel) visible.append(&command);
+    }
+    std::sort(visible.begin(), visible.end(), [](const Command* a, const Command* b) { return a->name < b->name; });
+    QStringList lines = {"Command List:"};
+    for (const Command* command : visible) lines.append("\t" + usage(*command) + " - " + command->summary);
+    lines.append("Tab completes commands and arguments, help command shows one in detail");
+    return lines;
+}
+
+void CommandEngine::print(const QString &text) {
+    print(QStringList{text});
+}
+
+void CommandEngine::print(const QStringList &lines) {
+    pending.append(lines);
+    if (!pager.isActive()) pager.start(0);
+}
+
+void CommandEngine::printError(const QString &text) {
+    print("<font color='red'>Error: " + text.toHtmlEscaped() + "</font>");
+}
+
+void CommandEngine::flush() {
+    QStringList page;
+    while (!pending.isEmpty() && page.size() < pageSize) page.append(pending.dequeue());
+    if (pending.isEmpty()) pager.stop();
+    if (!page.isEmpty()) emit output(page.join("\n"));
+}
+
+void CommandEngine::gather(std::function<QStringList()> work) {
+    QThreadPool::globalInstance()->start([this, work]() {
+        QStringList lines = work();
+        QMetaObject::invokeMethod(this, [this, lines]() { print(lines); }, Qt::QueuedConnection);
+    });
+}
@@ -0,0 +1,202 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/connectionsupervisor.h"
+#include <QRandomGenerator>
+#include <QDateTime>
+#include <QJsonObject>
+#include <QDebug>
+
+ConnectionSupervisor::ConnectionSupervisor(QObject* parent) : QObject(parent) {
+    healthTimer.setInterval(30000);
+    connect(&healthTimer, &QTimer::timeout, this, &ConnectionSupervisor::healthCheck);
+    healthTimer.start();
+}
+
+void ConnectionSupervisor::loadConfig(QJsonObject cfg) {
+    maxConcurrentAttempts = qMax(1, cfg.value("maxConcurrentReconnects").toInt(maxConcurrentAttempts));
+    baseBackoff = cfg.value("baseBackoffMs").toInteger(baseBackoff);
+    maxBackoff = cfg.value("maxBackoffMs").toInteger(maxBackoff);
+    attemptTimeoutMs = cfg.value("attemptTimeoutMs").toInteger(attemptTimeoutMs);
+    breakerThreshold = qMax(1, cfg.value("breakerThreshold").toInt(breakerThreshold));
+    breakerCooldown = cfg.value("breakerCooldownMs").toInteger(breakerCooldown);
+    healthTimer.setInterval(cfg.value("healthCheckIntervalMs").toInt(healthTimer.interval()));
+}
+
+void ConnectionSupervisor::addPrinter(quint32 id, Printer* printer) {
+    Entry e;
+    e.printer = printer;
+    e.retryTimer = new QTimer(this);
+    e.retryTimer->setSingleShot(true);
+    e.attemptTimeout = new QTimer(this);
+    e.attemptTimeout->setSingleShot(true);
+    entries.insert(id, e);
+
+    connect(e.retryTimer, &QTimer::timeout, this, [this, id]() {
+        if (!entries.contains(id)) return;
+        Entry &e = entries[id];
+        if (e.breakerOpen && QDateTime::currentMSecsSinceEpoch() - e.breakerOpenedAt >= breakerCooldown) {
+            //Half-open, let one operation through and trip again on the next failure
+            e.breakerOpen = false;
+            e.consecutiveFailures = breakerThreshold - 1;
+            qInfo() << "Printer" << e.printer->getName() << "circuit half-open";
+        }
+        if (e.printer->connectionStatus) {
+            if (!e.breakerOpen) setState(id, HealthState::Degraded);
+            else scheduleReconnect(id);
+        } else {
+            connectPrinter(id);
+        }
+    });
+    connect(e.attemptTimeout, &QTimer::timeout, this, [this, id]() {
+        reportFailure(id, "connection attempt timed out");
+    });
+    connect(printer, &Printer::connectionUpdated, this, [this, id](bool status) {
+        if (status) reportSuccess(id);
+        else reportFailure(id, "disconnected");
+    });
+    connect(printer, &Printer::healthReport, this, [this, id](bool ok, const QString &detail) {
+        if (ok) reportSuccess(id);
+        else reportFailure(id, detail);
+    });
+}
+
+void ConnectionSupervisor::removePrinter(quint32 id) {
+    if (!entries.contains(id)) return;
+    Entry e = entries.take(id);
+    if (e.inFlight) activeAttempts--;
+    reconnectQueue.removeAll(id);
+    disconnect(e.printer, nullptr, this, nullptr);
+    e.retryTimer->deleteLater();
+    e.attemptTimeout->deleteLater();
+    pumpQueue();
+}
+
+void ConnectionSupervisor::connectPrinter(quint32 id) {
+    if (!entries.contains(id)) return;
+    Entry &e = entries[id];
+    if (e.queued || e.inFlight) return;
+    e.retryTimer->stop();
+    if (e.state != HealthState::Online) setState(id, HealthState::Connecting);
+    e.queued = true;
+    reconnectQueue.enqueue(id);
+    pumpQueue();
+}
+
+void ConnectionSupervisor::pumpQueue() {
+    while (activeAttempts < maxConcurrentAttempts && !reconnectQueue.isEmpty()) {
+        quint32 id = reconnectQueue.dequeue();
+        if (!entries.contains(id)) continue;
+        Entry &e = entries[id];
+        e.queued = false;
+        e.inFlight = true;
+        activeAttempts++;
+        e.attemptTimeout->start(attemptTimeoutMs);
+        e.printer->startConnection();
+    }
+}
+
+void ConnectionSupervisor::finishAttempt(quint32 id) {
+    Entry &e = entries[id];
+    if (!e.inFlight) return;
+    e.inFlight = false;
+    e.attemptTimeout->stop();
+    activeAttempts--;
+    QTimer::singleShot(0, this, &ConnectionSupervisor::pumpQueue); //Free slot goes to the next waiting printer
+}
+
+void ConnectionSupervisor::reportSuccess(quint32 id) {
+    if (!entries.contains(id)) return;
+    finishAttempt(id);
+    Entry &e = entries[id];
+    e.consecutiveFailures = 0;
+    e.attempt = 0;
+    e.breakerOpen = false;
+    e.retryTimer->stop();
+    setState(id, HealthState::Online);
+}
+
+void ConnectionSupervisor::reportFailure(quint32 id, const QString &reason) {
+    if (!entries.contains(id)) return;
+    finishAttempt(id);
+    Entry &e = entries[id];
+    e.consecutiveFailures++;
+    qWarning() << "Printer" << e.printer->getName() << "health failure (" << e.consecutiveFailures << "):" << reason;
+
+    if (!e.breakerOpen && e.consecutiveFailures >= breakerThreshold) {
+        e.breakerOpen = true;
+        e.breakerOpenedAt = QDateTime::currentMSecsSinceEpoch();
+        qWarning() << "Printer" << e.printer->getName() << "circuit open, routing jobs elsewhere";
+    }
+
+    if (e.printer->connectionStatus && !e.breakerOpen) { //Still connected, only the operation failed
+        setState(id, HealthState::Degraded);
+        return;
+    }
+    setState(id, HealthState::Offline);
+    scheduleReconnect(id);
+}
+
+void ConnectionSupervisor::scheduleReconnect(quint32 id) {
+    Entry &e = entries[id];
+    if (e.queued || e.inFlight || e.retryTimer->isActive()) return;
+    qint64 delay = backoffDelay(e.attempt++);
+    if (e.breakerOpen) {
+        qint64 remaining = breakerCooldown - (QDateTime::currentMSecsSinceEpoch() - e.breakerOpenedAt);
+        delay = qMax(delay, remaining);
+    }
+    qDebug() << "Reconnecting to" << e.printer->getName() << "in" << delay << "ms";
+    e.retryTimer->start(delay);
+}
+
+qint64 ConnectionSupervisor::backoffDelay(int attempt) const {
+    //Exponential backoff with jitter so printers that dropped together don't retry together
+    qint64 delay = qMin(maxBackoff, baseBackoff << qMin(attempt, 16));
+    return delay / 2 + QRandomGenerator::global()->bounded(delay / 2 + 1);
+}
+
+void ConnectionSupervisor::healthCheck() {
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        if (it->inFlight || it->queued) continue;
+        if (it->state == HealthState::Online || it->state == HealthState::Degraded) it->printer->probeConnection();
+    }
+}
+
+void ConnectionSupervisor::setState(quint32 id, HealthState s) {
+    Entry &e = entries[id];
+    if (e.state == s) return;
+    e.state = s;
+    qInfo() << "Printer" << e.printer->getName() << "is" << stateName(s);
+    emit stateChanged(id, s);
+}
+
+HealthState ConnectionSupervisor::state(quint32 id) const {
+    return entries.value(id).state;
+}
+
+bool ConnectionSupervisor::isDispatchable(quint32 id) const {
+    if (!entries.contains(id)) return false;
+    const Entry &e = entries[id];
+    return !e.breakerOpen && (e.state == HealthState::Online || e.state == HealthState::Degraded);
+}
+
+bool ConnectionSupervisor::isBreakerOpen(quint32 id) const {
+    return entries.value(id).breakerOpen;
+}
+
+QString ConnectionSupervisor::stateName(HealthState s) {
+    switch (s) {
+    case HealthState::Connecting:
+        return "connecting";
+    case HealthState::Online:
+        return "online";
+    case HealthState::Degraded:
+        return "degraded";
+    case HealthState::Offline:
+        return "offline";
+    }
+    return "unknown";
+}
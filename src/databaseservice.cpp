@@ -0,0 +1,289 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/databaseservice.h"
+#include "headers/perfregistry.h"
+#include <QMutexLocker>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QSqlRecord>
+#include <QSqlError>
+#include <QDebug>
+#include <limits>
+
+DatabaseService::DatabaseService(QObject* parent) : QObject(parent) {
+    connectionName = QString("dbservice-%1").arg(quintptr(this), 0, 16);
+}
+
+DatabaseService::~DatabaseService() {
+    stop();
+}
+
+bool DatabaseService::start(const QString &databaseName) {
+    QMutexLocker lock(&mutex);
+    if (running) return true;
+    this->databaseName = databaseName;
+    stopping = false;
+    openFailed = false;
+    worker = QThread::create([this]() { run(); });
+    worker->setObjectName("DatabaseService");
+    worker->start();
+    while (!running && !openFailed) opened.wait(&mutex); //The connection has to be opened on the thread that uses it
+    return running;
+}
+
+void DatabaseService::stop() {
+    {
+        QMutexLocker lock(&mutex);
+        if (worker == nullptr) return;
+        stopping = true;
+        wake.wakeAll();
+    }
+    worker->wait();
+    delete worker;
+    worker = nullptr;
+}
+
+void DatabaseService::setMaxBatch(int statements) {
+    QMutexLocker lock(&mutex);
+    maxBatch = qMax(1, statements);
+}
+
+quint64 DatabaseService::lastWrite() const {
+    QMutexLocker lock(&mutex);
+    return lastWriteSequence;
+}
+
+QFuture<Eo<DbRows>> DatabaseService::read(const QString &sql, const QMap<QString, QVariant> &values, quint64 after) {
+    Request request{Read, {{sql, values}}, std::make_shared<QPromise<Eo<DbRows>>>(), nullptr, nullptr, {}};
+    request.after = after;
+    QFuture<Eo<DbRows>> future = request.rows->future();
+    enqueue(std::move(request));
+    return future;
+}
+
+QFuture<Eo<int>> DatabaseService::write(const QString &sql, const QMap<QString, QVariant> &values) {
+    Request request{Write, {{sql, values}}, nullptr, std::make_shared<QPromise<Eo<int>>>(), nullptr, {}};
+    QFuture<Eo<int>> future = request.affected->future();
+    enqueue(std::move(request));
+    return future;
+}
+
+QFuture<Eo<QList<DbRows>>> DatabaseService::transaction(const QList<DbStatement> &statements) {
+    Request request{Transaction, statements, nullptr, nullptr, std::make_shared<QPromise<Eo<QList<DbRows>>>>(), {}};
+    QFuture<Eo<QList<DbRows>>> future = request.results->future();
+    enqueue(std::move(request));
+    return future;
+}
+
+void DatabaseService::enqueue(Request request) {
+    if (request.rows) request.rows->start();
+    if (request.affected) request.affected->start();
+    if (request.results) request.results->start();
+    request.queued.start();
+
+    QMutexLocker lock(&mutex);
+    if (!running || stopping) {
+        lock.unlock();
+        return fail(request, Error("DatabaseServiceError", "Database service is not running", El::Warning));
+    }
+    request.sequence = nextSequence++;
+    if (request.kind != Read) lastWriteSequence = request.sequence;
+    if (request.kind == Read) reads.enqueue(std::move(request));
+    else writes.enqueue(std::move(request));
+    wake.wakeOne();
+}
+
+void DatabaseService::run() {
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", connectionName);
+        db.setDatabaseName(databaseName);
+        bool ok = db.open();
+        if (ok) {
+            QSqlQuery pragma(db);
+            pragma.exec("PRAGMA busy_timeout=5000"); //Per connection, the GUI connection may hold the write lock briefly
+            pragma.exec("PRAGMA synchronous=NORMAL");
+            statements.setDatabase(db);
+        } else qCritical() << "Database service could not open" << databaseName << db.lastError().text();
+        {
+            QMutexLocker lock(&mutex);
+            running = ok;
+            openFailed = !ok;
+            opened.wakeAll();
+        }
+
+        while (ok) {
+            QList<Request> batch;
+            {
+                QMutexLocker lock(&mutex);
+                while (reads.isEmpty() && writes.isEmpty() && !stopping) wake.wait(&mutex);
+                //Reads sit on the card scan path, bulk writes can wait. A read that asked to see a write waits only for that one and the ones before it
+                quint64 oldestWrite = writes.isEmpty() ? std::numeric_limits<quint64>::max() : writes.head().sequence;
+                qsizetype ready = -1;
+                for (qsizetype i = 0; i < reads.size() && ready < 0; i++) {
+                    if (reads[i].after < oldestWrite) ready = i;
+                }
+                if (ready >= 0) batch.append(reads.takeAt(ready));
+                else if (!writes.isEmpty() && writes.head().kind == Transaction) batch.append(writes.dequeue());
+                else {
+                    while (!writes.isEmpty() && writes.head().kind == Write && batch.size() < maxBatch) batch.append(writes.dequeue());
+                }
+                if (batch.isEmpty()) break; //Stopping with nothing left
+                longestWaitMs = qMax(longestWaitMs, batch.first().queued.elapsed());
+            }
+            if (batch.first().kind == Read) serveRead(batch.first());
+            else if (batch.first().kind == Transaction) serveTransaction(batch.first());
+            else serveWrites(batch);
+        }
+
+        statements.clear();
+        db.close();
+        QMutexLocker lock(&mutex);
+        running = false;
+    }
+    QSqlDatabase::removeDatabase(connectionName);
+}
+
+QSqlQuery* DatabaseService::exec(const DbStatement &statement, QString &error) {
+    QSqlQuery* q = statements.acquire(statement.sql);
+    if (q == nullptr) {
+        error = statements.lastPrepareError();
+        return nullptr;
+    }
+    for (auto it = statement.values.constBegin(); it != statement.values.constEnd(); ++it) {
+        q->bindValue((it.key().startsWith(":")) ? it.key() : ":" + it.key(), it.value());
+    }
+    QElapsedTimer timer;
+    timer.start();
+    bool success = q->exec();
+    statements.recordExecution(timer.nsecsElapsed());
+    if (!success || !q->isActive()) {
+        error = q->lastError().text();
+        return nullptr;
+    }
+    return q;
+}
+
+void DatabaseService::serveRead(Request &request) {
+    QString error;
+    QSqlQuery* q = exec(request.statements.first(), error);
+    if (q == nullptr) return fail(request, Error("DatabaseQueryError", error, El::Warning));
+    DbRows rows;
+    const int columns = q->record().count();
+    while (q->next()) {
+        DbRow row;
+        row.reserve(columns);
+        for (int i = 0; i < columns; i++) row.append(q->value(i));
+        rows.append(row);
+    }
+    q->finish();
+    static PerfCounter* served = PerfRegistry::counter("db.reads");
+    served->add();
+    {
+        QMutexLocker lock(&mutex);
+        readCount++;
+    }
+    request.rows->addResult(Eo<DbRows>(rows));
+    request.rows->finish();
+}
+
+void DatabaseService::serveWrites(QList<Request> &batch) {
+    QSqlDatabase db = QSqlDatabase::database(connectionName, false);
+    bool grouped = batch.size() > 1 && db.transaction(); //One fsync for the whole batch
+    QList<Eo<int>> outcomes;
+    outcomes.reserve(batch.size());
+    for (Request &request : batch) {
+        QString error;
+        QSqlQuery* q = exec(request.statements.first(), error);
+        if (q == nullptr) {
+            emit writeFailed(request.statements.first().sql, error);
+            outcomes.append(Eo<int>("DatabaseQueryError", error, El::Warning));
+            continue;
+        }
+        outcomes.append(Eo<int>(q->numRowsAffected()));
+        q->finish();
+    }
+    if (grouped && !db.commit()) {
+        Error error("DatabaseTransactionError", db.lastError().text(), El::Warning);
+        db.rollback();
+        for (Request &request : batch) fail(request, error);
+        return;
+    }
+    static PerfCounter* written = PerfRegistry::counter("db.writes");
+    static PerfCounter* batches = PerfRegistry::counter("db.write_batches");
+    written->add(batch.size());
+    batches->add();
+    {
+        QMutexLocker lock(&mutex);
+        writeCount += batch.size();
+        batchCount++;
+    }
+    for (int i = 0; i < batch.size(); i++) {
+        batch[i].affected->addResult(outcomes[i]);
+        batch[i].affected->finish();
+    }
+}
+
+void DatabaseService::serveTransaction(Request &request) {
+    QSqlDatabase db = QSqlDatabase::database(connectionName, false);
+    if (!db.transaction()) return fail(request, Error("DatabaseTransactionError", db.lastError().text(), El::Warning));
+    QList<DbRows> results;
+    for (const DbStatement &statement : std::as_const(request.statements)) {
+        QString error;
+        QSqlQuery* q = exec(statement, error);
+        if (q == nullptr) {
+            db.rollback();
+            emit writeFailed(statement.sql, error);
+            return fail(request, Error("DatabaseQueryError", error, El::Warning));
+        }
+        DbRows rows;
+        const int columns = q->record().count();
+        while (q->next()) {
+            DbRow row;
+            for (int i = 0; i < columns; i++) row.append(q->value(i));
+            rows.append(row);
+        }
+        q->finish(); //SQLite won't commit while a RETURNING statement is still open
+        results.append(rows);
+    }
+    if (!db.commit()) {
+        Error error("DatabaseTransactionError", db.lastError().text(), El::Warning);
+        db.rollback();
+        return fail(request, error);
+    }
+    static PerfCounter* transactions = PerfRegistry::counter("db.transactions");
+    transactions->add();
+    {
+        QMutexLocker lock(&mutex);
+        writeCount += request.statements.size();
+        batchCount++;
+    }
+    request.results->addResult(Eo<QList<DbRows>>(results));
+    request.results->finish();
+}
+
+void DatabaseService::fail(Request &request, const Error &error) {
+    static PerfCounter* failures = PerfRegistry::counter("db.failures");
+    failures->add();
+    if (request.rows) {
+        request.rows->addResult(Eo<DbRows>(error));
+        request.rows->finish();
+    }
+    if (request.affected) {
+        request.affected->addResult(Eo<int>(error));
+        request.affected->finish();
+    }
+    if (request.results) {
+        request.results->addResult(Eo<QList<DbRows>>(error));
+        request.results->finish();
+    }
+}
+
+QString DatabaseService::summary() const {
+    QMutexLocker lock(&mutex);
+    return QString("%1 reads, %2 writes in %3 commits, %4 reads / %5 writes queued, longest queue wait %6 ms")
+        .arg(readCount).arg(writeCount).arg(batchCount).arg(reads.size()).arg(writes.size()).arg(longestWaitMs);
+}
@@ -1,5 +1,5 @@
 #include "headers/errorhandler.hpp"
-#include <QDateTime>
+#include "headers/logger.h"
 
 Error Error::handle(QString t, QString m, ErrorLevel l) {
     Error _new = Error(t, m, l);
@@ -32,37 +32,25 @@ void ErrorHandler::handle(const Error &err) {
     }
 }
 
-QString ErrorHandler::genLogLine(const QString &lvl, const QString &content) {
-    return QDateTime::currentDateTimeUtc().toString("yyyy-MM-ddThh:mm:ss.zzzZ") + " " + lvl + " [ErrorHandler]: " + content;
-}
-
 void ErrorHandler::printLn(ErrorLevel lvl, const QString &content) {
-    QString lvlindicator;
+    //Handed to the logger's ring, the writer thread timestamps and formats it
     switch (lvl) {
     default:
     case El::None:
-        lvlindicator = "NONE";
-        qDebug() << genLogLine(lvlindicator, content);
-        break;
     case El::Debug:
-        lvlindicator = "DEBUG";
-        qDebug() << genLogLine(lvlindicator, content);
+        qCDebug(lcErrors).noquote() << content;
         break;
     case El::Trivial:
-        lvlindicator = "TRIVIAL";
-        qInfo() << genLogLine(lvlindicator, content);
+        qCInfo(lcErrors).noquote() << content;
         break;
     case El::Warning:
-        lvlindicator = "WARNING";
-        qWarning() << genLogLine(lvlindicator, content);
+        qCWarning(lcErrors).noquote() << content;
         break;
     case El::Critical:
-        lvlindicator = "CRITICAL";
-        qCritical() << genLogLine(lvlindicator, content);
+        qCCritical(lcErrors).noquote() << content;
         break;
     case El::Fatal:
-        lvlindicator = "FATAL";
-        qFatal() << genLogLine(lvlindicator, content);
+        qCFatal(lcErrors).noquote() << content;
         break;
     }
 };
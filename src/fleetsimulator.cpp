@@ -0,0 +1,625 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/fleetsimulator.h"
+#include <QCoreApplication>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QRegularExpression>
+#include <QSslCertificate>
+#include <QSslKey>
+#include <QFileInfo>
+#include <QFile>
+#include <QDir>
+#include <QDateTime>
+#include <QUrl>
+#include <QDebug>
+#include <algorithm>
+
+VirtualPrinter::VirtualPrinter(const QString &name, const SimSettings &settings, QObject* parent) : QObject(parent) {
+    this->name = name;
+    this->settings = settings;
+    tickTimer.setInterval(1000);
+    connect(&tickTimer, &QTimer::timeout, this, &VirtualPrinter::tick);
+    outageTimer.setInterval(60000);
+    connect(&outageTimer, &QTimer::timeout, this, [this]() {
+        if (offline || QRandomGenerator::global()->generateDouble() >= this->settings.outageRate) return;
+        qInfo() << "[sim]" << this->name << "dropping off the network for" << this->settings.outageSeconds << "s";
+        stop();
+        offline = true;
+        QTimer::singleShot(this->settings.outageSeconds * 1000, this, [this]() {
+            if (start()) qInfo() << "[sim]" << this->name << "back online";
+        });
+    });
+}
+
+QString VirtualPrinter::getName() const {
+    return name;
+}
+
+bool VirtualPrinter::isPrinting() const {
+    return !jobFile.isEmpty() && !finished;
+}
+
+bool VirtualPrinter::startJob(const QString &file) {
+    if (isPrinting()) return false;
+    jobFile = file;
+    jobId++;
+    progress = 0;
+    finished = false;
+    nozzleTarget = 215;
+    bedTarget = 60;
+    jobTimer.start();
+    emit jobStarted(name, file);
+    stateChanged();
+    return true;
+}
+
+void VirtualPrinter::stopJob() {
+    jobFile.clear();
+    finished = false;
+    progress = 0;
+    nozzleTarget = 0;
+    bedTarget = 0;
+    stateChanged();
+}
+
+bool VirtualPrinter::injectError() {
+    return settings.errorRate > 0 && QRandomGenerator::global()->generateDouble() < settings.errorRate;
+}
+
+void VirtualPrinter::tick() {
+    //Temperatures approach their targets exponentially, like a PID loop that is a little too slow
+    double noise = QRandomGenerator::global()->generateDouble() - 0.5;
+    nozzle += ((nozzleTarget > 0 ? nozzleTarget : 25) - nozzle) * 0.2 + noise * 0.6;
+    bed += ((bedTarget > 0 ? bedTarget : 25) - bed) * 0.1 + noise * 0.4;
+    if (!isPrinting()) return;
+    progress = qMin(100.0, jobTimer.elapsed() * 100.0 / (settings.printSeconds * 1000.0));
+    if (progress >= 100) {
+        finished = true;
+        nozzleTarget = 0;
+        bedTarget = 0;
+        emit jobFinished(name, jobFile);
+        stateChanged();
+    }
+}
+
+//----------------------------------------------------------------------------------------------------
+
+VirtualPrusa::VirtualPrusa(const QString &name, const QString &apiKey, const QHostAddress &address, quint16 port, const SimSettings &settings, QObject* parent) : VirtualPrinter(name, settings, parent) {
+    this->apiKey = apiKey;
+    this->address = address;
+    this->port = port;
+    connect(&server, &QTcpServer::pendingConnectionAvailable, this, &VirtualPrusa::acceptConnections);
+    drainTimer.setInterval(100);
+    connect(&drainTimer, &QTimer::timeout, this, &VirtualPrusa::drain);
+}
+
+bool VirtualPrusa::start() {
+    if (!server.isListening() && !server.listen(address, port)) {
+        qCritical() << "[sim]" << name << "failed to listen on" << address << port << server.errorString();
+        return false;
+    }
+    offline = false;
+    tickTimer.start();
+    if (settings.outageRate > 0) outageTimer.start();
+    if (settings.bandwidth > 0) drainTimer.start();
+    return true;
+}
+
+void VirtualPrusa::stop() {
+    server.close();
+    drainTimer.stop();
+    const QList<Connection*> open = connections;
+    for (Connection* c : open) {
+        c->socket->disconnect(this);
+        c->socket->abort();
+        dropConnection(c);
+    }
+}
+
+QJsonObject VirtualPrusa::kioskConfig() const {
+    return QJsonObject{
+        {"brand", "Prusa"},
+        {"name", name},
+        {"model", "MK4"},
+        {"hostname", QString("%1:%2").arg(address.toString()).arg(port)},
+        {"apiKey", apiKey},
+        {"storageType", "usb"}
+    };
+}
+
+void VirtualPrusa::acceptConnections() {
+    while (server.hasPendingConnections()) {
+        Connection* c = new Connection();
+        c->socket = server.nextPendingConnection();
+        connections.append(c);
+        if (settings.bandwidth > 0) { //Drained by the timer, a full buffer pushes back on the sender
+            c->socket->setReadBufferSize(qMax<qint64>(4096, settings.bandwidth / 10));
+        } else {
+            connect(c->socket, &QTcpSocket::readyRead, this, [this, c]() { readConnection(c, c->socket->readAll()); });
+        }
+        connect(c->socket, &QTcpSocket::disconnected, this, [this, c]() { dropConnection(c); });
+    }
+}
+
+void VirtualPrusa::drain() {
+    if (connections.isEmpty()) return;
+    qint64 share = qMax<qint64>(1, settings.bandwidth / 10 / connections.size()); //The link is shared like a real Wi-Fi module
+    const QList<Connection*> open = connections;
+    for (Connection* c : open) {
+        if (!connections.contains(c) || c->socket->bytesAvailable() == 0) continue;
+        readConnection(c, c->socket->read(share));
+    }
+}
+
+void VirtualPrusa::readConnection(Connection* c, const QByteArray &data) {
+    c->buffer.append(data);
+    while (true) {
+        if (!c->headerDone) {
+            int end = c->buffer.indexOf("\r\n\r\n");
+            if (end < 0) {
+                if (c->buffer.size() > 65536) c->socket->abort();
+                return;
+            }
+            QList<QByteArray> lines = c->buffer.left(end).split('\n');
+            c->buffer.remove(0, end + 4);
+            QList<QByteArray> requestLine = lines.takeFirst().trimmed().split(' ');
+            if (requestLine.size() < 2) {
+                c->socket->abort();
+                return;
+            }
+            c->method = QString::fromLatin1(requestLine[0]).toUpper();
+            c->path = QUrl::fromPercentEncoding(requestLine[1].split('?').first());
+            c->headers.clear();
+            for (const QByteArray &line : lines) {
+                int colon = line.indexOf(':');
+                if (colon < 0) continue;
+                c->headers.insert(QString::fromLatin1(line.left(colon)).trimmed().toLower(), QString::fromUtf8(line.mid(colon + 1)).trimmed());
+            }
+            c->contentLength = c->headers.value("content-length").toLongLong();
+            c->bodyReceived = 0;
+            c->headerDone = true;
+            c->uploadTimer.start();
+        }
+        //Upload bodies are counted, not kept, so a 100 printer fleet stays light
+        qint64 take = qMin<qint64>(c->buffer.size(), c->contentLength - c->bodyReceived);
+        c->bodyReceived += take;
+        c->buffer.remove(0, take);
+        if (c->bodyReceived < c->contentLength) return;
+        handleRequest(c);
+        c->headerDone = false;
+        if (c->buffer.isEmpty()) return;
+    }
+}
+
+void VirtualPrusa::handleRequest(Connection* c) {
+    if (c->headers.value("x-api-key") != apiKey) return respond(c, 401);
+    const QString &path = c->path;
+    if (c->method == "GET" && path == "/api/version") {
+        return respond(c, 200, QJsonDocument(QJsonObject{{"api", "2.0.0"}, {"server", "2.1.2"}, {"text", "PrusaLink"}, {"hostname", name}}).toJson(QJsonDocument::Compact));
+    }
+    if (c->method == "GET" && path == "/api/v1/status") return respond(c, 200, QJsonDocument(statusObject()).toJson(QJsonDocument::Compact));
+    if (c->method == "GET" && path == "/api/v1/job") {
+        if (jobFile.isEmpty()) return respond(c, 204);
+        return respond(c, 200, QJsonDocument(jobObject()).toJson(QJsonDocument::Compact));
+    }
+    if (c->method == "DELETE" && path.startsWith("/api/v1/job/")) {
+        if (!isPrinting() || path.section('/', 4, 4).toUInt() != jobId) return respond(c, 409);
+        stopJob();
+        return respond(c, 204);
+    }
+    if (!path.startsWith("/api/v1/files/")) return respond(c, 404);
+
+    QString fileName = path.section('/', 5); //Storage is section 4, the simulator keeps one flat storage
+    if (fileName.isEmpty()) return respond(c, 404);
+    if (c->method == "PUT") {
+        if (injectError()) {
+            emit uploadRefused(name, "injected failure");
+            return respond(c, 503);
+        }
+        bool printAfter = c->headers.value("print-after-upload") == "?1";
+        if (files.contains(fileName) && c->headers.value("overwrite") != "?1") return respond(c, 409);
+        if (printAfter && isPrinting()) return respond(c, 409);
+        files.insert(fileName, c->bodyReceived);
+        emit uploadReceived(name, c->bodyReceived, c->uploadTimer.elapsed());
+        if (printAfter) startJob(fileName);
+        return respond(c, 201);
+    }
+    if (c->method == "POST") { //Start printing a stored file
+        if (!files.contains(fileName)) return respond(c, 404);
+        if (isPrinting()) return respond(c, 409);
+        if (injectError()) return respond(c, 503);
+        startJob(fileName);
+        return respond(c, 204);
+    }
+    if (c->method == "DELETE") {
+        if (isPrinting() && jobFile == fileName) return respond(c, 409);
+        return respond(c, files.remove(fileName) > 0 ? 204 : 404);
+    }
+    if (c->method == "GET" || c->method == "HEAD") {
+        if (!files.contains(fileName)) return respond(c, 404);
+        return respond(c, 200, QJsonDocument(QJsonObject{{"name", fileName}, {"size", files.value(fileName)}, {"type", "PRINT_FILE"}}).toJson(QJsonDocument::Compact));
+    }
+    respond(c, 405);
+}
+
+void VirtualPrusa::respond(Connection* c, int status, const QByteArray &body) {
+    static const QMap<int, QByteArray> reasons = {
+        {200, "OK"}, {201, "Created"}, {204, "No Content"}, {401, "Unauthorized"}, {404, "Not Found"},
+        {405, "Method Not Allowed"}, {409, "Conflict"}, {503, "Service Unavailable"}
+    };
+    bool close = c->headers.value("connection").toLower() == "close";
+    QByteArray response = "HTTP/1.1 " + QByteArray::number(status) + " " + reasons.value(status, "Error") + "\r\n";
+    if (!body.isEmpty()) response += "Content-Type: application/json\r\n";
+    response += "Content-Length: " + QByteArray::number(body.size()) + "\r\n";
+    response += close ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n";
+    response += body;
+
+    QTcpSocket* socket = c->socket;
+    auto send = [socket, response, close]() {
+        socket->write(response);
+        if (close) socket->disconnectFromHost();
+    };
+    if (settings.latencyMs > 0) QTimer::singleShot(settings.latencyMs, socket, send); //Socket as context, skipped if the client went away
+    else send();
+}
+
+void VirtualPrusa::dropConnection(Connection* c) {
+    if (!connections.contains(c)) return;
+    connections.removeAll(c);
+    c->socket->deleteLater();
+    delete c;
+}
+
+QJsonObject VirtualPrusa::statusObject() const {
+    QString state = isPrinting() ? "PRINTING" : (finished ? "FINISHED" : "IDLE");
+    QJsonObject status{
+        {"storage", QJsonObject{{"path", "/usb/"}, {"name", "usb"}, {"read_only", false}}},
+        {"printer", QJsonObject{
+            {"state", state},
+            {"temp_nozzle", qRound(nozzle * 10) / 10.0},
+            {"target_nozzle", nozzleTarget},
+            {"temp_bed", qRound(bed * 10) / 10.0},
+            {"target_bed", bedTarget},
+            {"axis_z", isPrinting() ? qRound(progress * 2) / 10.0 : 0.0},
+            {"flow", 100},
+            {"speed", 100},
+            {"fan_hotend", nozzle > 50 ? 7800 : 0},
+            {"fan_print", isPrinting() ? 5200 : 0}
+        }}
+    };
+    if (!jobFile.isEmpty()) {
+        status.insert("job", QJsonObject{
+            {"id", qint64(jobId)},
+            {"progress", qRound(progress)},
+            {"time_remaining", qMax(0, int(settings.printSeconds * (100 - progress) / 100))},
+            {"time_printing", jobTimer.elapsed() / 1000}
+        });
+    }
+    return status;
+}
+
+QJsonObject VirtualPrusa::jobObject() const {
+    return QJsonObject{
+        {"id", qint64(jobId)},
+        {"state", isPrinting() ? "PRINTING" : "FINISHED"},
+        {"progress", qRound(progress)},
+        {"time_remaining", qMax(0, int(settings.printSeconds * (100 - progress) / 100))},
+        {"time_printing", jobTimer.elapsed() / 1000},
+        {"file", QJsonObject{
+            {"name", jobFile},
+            {"display_name", jobFile},
+            {"path", "/usb"},
+            {"size", files.value(jobFile)}
+        }}
+    };
+}
+
+//----------------------------------------------------------------------------------------------------
+
+VirtualBambu::VirtualBambu(const QString &name, const QString &serial, const QString &accessCode, const QHostAddress &address, const SimSettings &settings, const QSslConfiguration &ssl, QObject* parent) : VirtualPrinter(name, settings, parent) {
+    this->serial = serial;
+    this->accessCode = accessCode;
+    this->address = address;
+    this->ssl = ssl;
+    spoolDir = "simulator_spool/" + serial;
+
+    broker.setAuthenticator([this](const QString &, const QString &username, const QString &password) {
+        return username == "bblp" && password == this->accessCode;
+    });
+    broker.subscribe("device/" + serial + "/request", [this](const QString &, const QByteArray &payload) {
+        handleRequest(payload);
+    });
+
+    ftps.setAuthenticator([this](const QString &username, const QString &password) {
+        return username == "bblp" && password == this->accessCode;
+    });
+    ftps.setSpoolDirectory(spoolDir);
+    ftps.setRateLimit(settings.bandwidth);
+    connect(&ftps, &FtpsServer::uploadStarted, this, [this](const QString &fileName, const QString &) {
+        uploadTimers[fileName].start();
+    });
+    connect(&ftps, &FtpsServer::uploadFinished, this, [this](const QString &filepath, const QString &, const QMap<QString, QString> &) {
+        QString fileName = QFileInfo(filepath).fileName();
+        emit uploadReceived(this->name, QFileInfo(filepath).size(), uploadTimers.take(fileName).elapsed());
+    });
+    connect(&ftps, &FtpsServer::uploadFailed, this, [this](const QString &fileName, const QString &error) {
+        uploadTimers.remove(fileName);
+        emit uploadRefused(this->name, error);
+    });
+
+    reportTimer.setInterval(settings.reportIntervalMs);
+    connect(&reportTimer, &QTimer::timeout, this, [this]() { publishReport(false); });
+}
+
+void VirtualBambu::setPorts(quint16 mqttPort, quint16 ftpsPort) {
+    this->mqttPort = mqttPort;
+    this->ftpsPort = ftpsPort;
+}
+
+bool VirtualBambu::start() {
+    bool encrypted = !ssl.localCertificate().isNull();
+    bool ok = encrypted ? broker.listenEncrypted(address, mqttPort, ssl) : broker.listen(address, mqttPort);
+    ok = ok && ftps.listen(address, ftpsPort, ssl);
+    if (!ok) {
+        qCritical() << "[sim]" << name << "failed to listen on" << address;
+        stop();
+        return false;
+    }
+    offline = false;
+    tickTimer.start();
+    reportTimer.start();
+    if (settings.outageRate > 0) outageTimer.start();
+    return true;
+}
+
+void VirtualBambu::stop() {
+    reportTimer.stop();
+    ftps.close();
+    broker.close();
+}
+
+QJsonObject VirtualBambu::kioskConfig() const {
+    return QJsonObject{
+        {"brand", "BambuLab"},
+        {"name", name},
+        {"model", "X1C"},
+        {"hostname", address.toString()},
+        {"accessCode", accessCode},
+        {"serial", serial},
+        {"port", mqttPort},
+        {"storageType", "sdcard"}
+    };
+}
+
+void VirtualBambu::handleRequest(const QByteArray &payload) {
+    QJsonObject request = QJsonDocument::fromJson(payload).object();
+    if (request.value("pushing").toObject().value("command").toString() == "pushall") return publishReport(true);
+    QJsonObject print = request.value("print").toObject();
+    QString command = print.value("command").toString();
+    if (command.isEmpty()) return;
+
+    QString error;
+    if (command == "project_file" || command == "gcode_file") {
+        QString file = (command == "project_file") ? QUrl(print.value("url").toString()).fileName() : QFileInfo(print.value("param").toString()).fileName();
+        if (!QFile::exists(QDir(spoolDir).filePath(file))) error = "file not found";
+        else if (isPrinting()) error = "printer busy";
+        else if (injectError()) {
+            error = "injected failure";
+            gcodeState = "FAILED";
+            printError = 0x0500C011; //Mirrors the "SD card read error" HMS code
+        } else startJob(file);
+    } else if (command == "stop") {
+        stopJob();
+    } else if (command == "gcode_line") { //Preheat commands move the targets like the firmware would
+        static const QRegularExpression temp("M(104|140)\\s+S(\\d+)");
+        QRegularExpressionMatchIterator it = temp.globalMatch(print.value("param").toString());
+        while (it.hasNext()) {
+            QRegularExpressionMatch m = it.next();
+            if (m.captured(1) == "104") nozzleTarget = m.captured(2).toDouble();
+            else bedTarget = m.captured(2).toDouble();
+        }
+    }
+
+    QJsonObject response{
+        {"command", command},
+        {"sequence_id", print.value("sequence_id")},
+        {"result", error.isEmpty() ? "success" : "failed"}
+    };
+    if (!error.isEmpty()) response.insert("reason", error);
+    broker.publish("device/" + serial + "/report", QJsonDocument(QJsonObject{{"print", response}}).toJson(QJsonDocument::Compact));
+    if (!error.isEmpty()) emit uploadRefused(name, command + " " + error);
+    if (gcodeState == "FAILED") publishReport(false);
+}
+
+void VirtualBambu::stateChanged() {
+    gcodeState = isPrinting() ? "RUNNING" : (finished ? "FINISH" : "IDLE");
+    printError = 0;
+    publishReport(false);
+}
+
+void VirtualBambu::publishReport(bool full) {
+    //Periodic reports only carry the fields that move, pushall answers with the whole state like the firmware
+    int totalLayers = 250;
+    QJsonObject print{
+        {"command", "push_status"},
+        {"msg", full ? 0 : 1},
+        {"sequence_id", QString::number(reportSequence++)},
+        {"nozzle_temper", qRound(nozzle * 10) / 10.0},
+        {"nozzle_target_temper", nozzleTarget},
+        {"bed_temper", qRound(bed * 10) / 10.0},
+        {"bed_target_temper", bedTarget},
+        {"mc_percent", qRound(progress)},
+        {"mc_remaining_time", isPrinting() ? qMax(0, int(settings.printSeconds * (100 - progress) / 100 / 60)) : 0},
+        {"gcode_state", gcodeState},
+        {"print_error", printError},
+        {"layer_num", isPrinting() ? int(progress * totalLayers / 100) : 0},
+        {"wifi_signal", QString("-%1dBm").arg(QRandomGenerator::global()->bounded(38, 60))}
+    };
+    if (full) {
+        print.insert("total_layer_num", totalLayers);
+        print.insert("subtask_name", jobFile);
+        print.insert("gcode_file", jobFile);
+        print.insert("sdcard", true);
+        print.insert("nozzle_diameter", "0.4");
+        print.insert("spd_lvl", 2);
+        QJsonArray trays;
+        const QStringList colors = {"FFFFFFFF", "000000FF", "F72323FF", "0A2989FF"};
+        for (int i = 0; i < colors.size(); i++) {
+            trays.append(QJsonObject{{"id", QString::number(i)}, {"tray_type", "PLA"}, {"tray_color", colors[i]}, {"remain", 80}});
+        }
+        print.insert("ams", QJsonObject{
+            {"ams_exist_bits", "1"},
+            {"tray_now", "0"},
+            {"ams", QJsonArray{QJsonObject{{"id", "0"}, {"humidity", "4"}, {"temp", "24.1"}, {"tray", trays}}}}
+        });
+    }
+    broker.publish("device/" + serial + "/report", QJsonDocument(QJsonObject{{"print", print}}).toJson(QJsonDocument::Compact));
+}
+
+//----------------------------------------------------------------------------------------------------
+
+FleetSimulator::FleetSimulator(QObject* parent) : QObject(parent) {
+    connect(&statsTimer, &QTimer::timeout, this, &FleetSimulator::printStats);
+}
+
+void FleetSimulator::loadConfig(QJsonObject cfg) {
+    prusaCount = qBound(0, cfg.value("prusaCount").toInt(prusaCount), 100);
+    bambuCount = qBound(0, cfg.value("bambuCount").toInt(bambuCount), 100);
+    if (prusaCount + bambuCount == 0) prusaCount = 1;
+    prusaBasePort = cfg.value("prusaBasePort").toInt(prusaBasePort);
+    bambuSubnet = cfg.value("bambuSubnet").toString(bambuSubnet);
+    bambuMqttPort = cfg.value("bambuMqttPort").toInt(bambuMqttPort);
+    bambuFtpsPort = cfg.value("bambuFtpsPort").toInt(bambuFtpsPort);
+    certificate = cfg.value("certificate").toString(certificate);
+    privateKey = cfg.value("privateKey").toString(privateKey);
+    statsIntervalMs = cfg.value("statsIntervalSeconds").toInt(statsIntervalMs / 1000) * 1000;
+
+    settings.bandwidth = qint64(cfg.value("bandwidthKBps").toDouble(settings.bandwidth / 1024.0) * 1024);
+    settings.errorRate = qBound(0.0, cfg.value("errorRate").toDouble(settings.errorRate), 1.0);
+    settings.outageRate = qBound(0.0, cfg.value("outageRate").toDouble(settings.outageRate), 1.0);
+    settings.outageSeconds = cfg.value("outageSeconds").toInt(settings.outageSeconds);
+    settings.latencyMs = cfg.value("latencyMs").toInt(settings.latencyMs);
+    settings.printSeconds = qMax(1, cfg.value("printSeconds").toInt(settings.printSeconds));
+    settings.reportIntervalMs = qMax(100, cfg.value("reportIntervalMs").toInt(settings.reportIntervalMs));
+    journalPort = cfg.value("journalPort").toInt(journalPort);
+    journalDir = cfg.value("journalDir").toString(journalDir);
+    journalFailureRate = qBound(0.0, cfg.value("journalFailureRate").toDouble(journalFailureRate), 1.0);
+}
+
+bool FleetSimulator::start() {
+    QSslConfiguration ssl;
+    if (bambuCount > 0) {
+        QDir appDir = QDir(QCoreApplication::applicationDirPath());
+        QList<QSslCertificate> certs = QSslCertificate::fromPath(appDir.filePath(certificate));
+        QFile keyFile(appDir.filePath(privateKey));
+        if (!certs.isEmpty() && keyFile.open(QIODevice::ReadOnly)) {
+            QByteArray keyData = keyFile.readAll();
+            QSslKey key(keyData, QSsl::Rsa, QSsl::Pem);
+            if (key.isNull()) key = QSslKey(keyData, QSsl::Ec, QSsl::Pem);
+            ssl = QSslConfiguration::defaultConfiguration();
+            ssl.setLocalCertificate(certs.first());
+            ssl.setPrivateKey(key);
+            ssl.setPeerVerifyMode(QSslSocket::VerifyNone);
+        } else {
+            qWarning() << "[sim] certificate not found, virtual Bambu printers run without TLS and the BambuLab driver will not connect";
+        }
+    }
+
+    for (int i = 0; i < prusaCount; i++) {
+        QString name = QString("Sim Prusa %1").arg(i + 1);
+        fleet.append(new VirtualPrusa(name, QString("simkey%1").arg(i + 1), QHostAddress::LocalHost, prusaBasePort + i, settings, this));
+    }
+    for (int i = 0; i < bambuCount; i++) {
+        QString name = QString("Sim Bambu %1").arg(i + 1);
+        QString serial = QString("00M00SIM%1").arg(i + 1, 7, 10, QChar('0'));
+        QString code = QString::number(10000000 + i * 7919);
+        VirtualBambu* bbl = new VirtualBambu(name, serial, code, QHostAddress(bambuSubnet + QString::number(i + 1)), settings, ssl, this);
+        bbl->setPorts(bambuMqttPort, bambuFtpsPort);
+        fleet.append(bbl);
+    }
+
+    int online = 0;
+    for (VirtualPrinter* p : fleet) {
+        connect(p, &VirtualPrinter::uploadReceived, this, [this](const QString &printer, qint64 bytes, qint64 elapsedMs) {
+            uploads++;
+            bytesReceived += bytes;
+            uploadTimes.append(elapsedMs);
+            qInfo() << "[sim]" << printer << "received" << bytes << "bytes in" << elapsedMs << "ms";
+        });
+        connect(p, &VirtualPrinter::uploadRefused, this, [this](const QString &printer, const QString &reason) {
+            refused++;
+            qInfo() << "[sim]" << printer << "refused:" << reason;
+        });
+        connect(p, &VirtualPrinter::jobStarted, this, [this](const QString &printer, const QString &file) {
+            jobsStarted++;
+            qInfo() << "[sim]" << printer << "started" << file << "at" << QDateTime::currentMSecsSinceEpoch(); //Epoch ms to line up with kiosk logs
+        });
+        if (p->start()) online++;
+    }
+    qInfo() << "[sim]" << online << "of" << fleet.size() << "virtual printers listening (" << prusaCount << "Prusa," << bambuCount << "Bambu )";
+
+    if (journalPort > 0) { //Central print log stand-in for the kiosk's journal sync
+        journal = new JournalServer(QDir(QCoreApplication::applicationDirPath()).filePath(journalDir), this);
+        journal->setFailureRate(journalFailureRate);
+        connect(journal, &JournalServer::batchStored, this, [](const QString &kiosk, int entries, qint64 acked) {
+            qInfo() << "[sim] journal stored" << entries << "entries from" << kiosk << "through" << acked;
+        });
+        if (!journal->listen(QHostAddress::LocalHost, journalPort)) {
+            delete journal;
+            journal = nullptr;
+        }
+    }
+
+    uptime.start();
+    if (statsIntervalMs > 0) statsTimer.start(statsIntervalMs);
+    return online > 0;
+}
+
+bool FleetSimulator::writeKioskConfig(const QString &filepath) const {
+    QJsonArray printers;
+    for (VirtualPrinter* p : fleet) printers.append(p->kioskConfig());
+    QJsonObject config{
+        {"printers", printers},
+        {"discovery", QJsonObject{{"enabled", false}}}, //Addresses are fixed, nothing to discover
+        {"bambuEmulator", QJsonObject{{"port", 18883}, {"ftpsPort", 10990}}} //Keep the kiosk's own listeners off the simulated printers' ports
+    };
+    if (journal) config.insert("journal", QJsonObject{{"endpoint", QString("http://127.0.0.1:%1/journal").arg(journal->port())}, {"intervalSeconds", 5}});
+    QFile f(filepath);
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qCritical() << "[sim] unable to write kiosk configuration to" << filepath;
+        return false;
+    }
+    f.write(QJsonDocument(config).toJson(QJsonDocument::Indented));
+    f.close();
+    qInfo() << "[sim] kiosk configuration written to" << QFileInfo(f).absoluteFilePath();
+    return true;
+}
+
+void FleetSimulator::printStats() {
+    int printing = 0;
+    for (VirtualPrinter* p : fleet) {
+        if (p->isPrinting()) printing++;
+    }
+    QString timing = "n/a";
+    if (!uploadTimes.isEmpty()) {
+        std::sort(uploadTimes.begin(), uploadTimes.end());
+        timing = QString("p50 %1 ms, p95 %2 ms, max %3 ms")
+                     .arg(uploadTimes[uploadTimes.size() / 2])
+                     .arg(uploadTimes[qMin<qsizetype>(uploadTimes.size() - 1, uploadTimes.size() * 95 / 100)])
+                     .arg(uploadTimes.last());
+    }
+    qInfo().noquote() << QString("[sim] %1 s up | %2 printing | %3 uploads (%4 refused), %5 MB | %6 jobs started | upload time %7")
+                             .arg(uptime.elapsed() / 1000)
+                             .arg(printing)
+                             .arg(uploads)
+                             .arg(refused)
+                             .arg(bytesReceived / 1048576.0, 0, 'f', 1)
+                             .arg(jobsStarted)
+                             .arg(timing);
+    uploadTimes.clear();
+}
@@ -1,4 +1,5 @@
 #include "headers/ftpsclient.h"
+#include "headers/perfregistry.h"
 
 size_t FtpsClient::write_data(void *ptr, size_t size, size_t nmemb, void *stream) {
     return fwrite(ptr, size, nmemb, static_cast<FILE*>(stream));
@@ -15,28 +16,58 @@ FtpsClient::~FtpsClient() {
 }
 
 size_t FtpsClient::readCallback(void *ptr, size_t size, size_t nmemb, void *stream) {
-    QFile *file = static_cast<QFile*>(stream);
-    qint64 bytesRead = file->read(static_cast<char*>(ptr), size * nmemb);
+    FtpsClient *uploader = static_cast<FtpsClient*>(stream);
+    QIODevice *device = uploader->m_source;
+    qint64 bytesRead = device->read(static_cast<char*>(ptr), size * nmemb);
+    while (bytesRead == 0 && device->isSequential() && !device->atEnd()) { //Streamed source still producing
+        device->waitForReadyRead(1000);
+        bytesRead = device->read(static_cast<char*>(ptr), size * nmemb);
+    }
+    if (bytesRead > 0) uploader->m_bytesSent += bytesRead; //A streamed source has no meaningful pos()
     return bytesRead < 0 ? 0 : static_cast<size_t>(bytesRead);
 }
 
 int FtpsClient::progressCallback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
     FtpsClient *uploader = static_cast<FtpsClient*>(clientp);
+    if (uploader->m_abort || (uploader->m_cancelled && *uploader->m_cancelled)) return 1; //Non zero makes curl stop the transfer
     emit uploader->progress(ulnow, ultotal);
     return 0;
 }
 
-void FtpsClient::uploadFile(const QString &localFile, const QString &host, const QString &username, const QString &password, const QString &remotePath) {
-    m_file = new QFile(localFile);
-    if (!m_file->open(QIODevice::ReadOnly)) {
-        emit finished(false, "Cannot open file: " + localFile);
+void FtpsClient::abort() {
+    m_abort = true;
+}
+
+void FtpsClient::setSendSpeedLimit(qint64 bytesPerSecond) {
+    m_sendSpeedLimit = bytesPerSecond;
+}
+
+void FtpsClient::uploadFile(const QString &localFile, const QString &host, const QString &username, const QString &password, const QString &remotePath, QIODevice* source, std::shared_ptr<std::atomic_bool> cancelled) {
+    //The flags are never cleared here, a discard can arrive while the job is still waiting in the thread's queue
+    if (m_abort || (cancelled && *cancelled)) {
+        emit finished(false, "Upload aborted");
         return;
     }
+    m_cancelled = cancelled;
+    m_source = source;
+    m_bytesSent = 0;
+    if (m_source == nullptr) {
+        m_file = new QFile(localFile);
+        if (!m_file->open(QIODevice::ReadOnly)) {
+            delete m_file;
+            m_file = nullptr;
+            emit finished(false, "Cannot open file: " + localFile);
+            return;
+        }
+        m_source = m_file;
+    }
 
     m_curl = curl_easy_init();
     if (!m_curl) {
+        delete m_file;
+        m_file = nullptr;
+        m_source = nullptr;
         emit finished(false, "Failed to init libcurl");
-        m_file->close();
         return;
     }
 
@@ -54,8 +85,9 @@ void FtpsClient::uploadFile(const QString &localFile, const QString &host, const
 
     // Read data from file
     curl_easy_setopt(m_curl, CURLOPT_UPLOAD, 1L);
-    curl_easy_setopt(m_curl, CURLOPT_READDATA, m_file);
+    curl_easy_setopt(m_curl, CURLOPT_READDATA, this);
     curl_easy_setopt(m_curl, CURLOPT_READFUNCTION, &FtpsClient::readCallback);
+    if (m_sendSpeedLimit > 0) curl_easy_setopt(m_curl, CURLOPT_MAX_SEND_SPEED_LARGE, static_cast<curl_off_t>(m_sendSpeedLimit));
 
     // Progress
     curl_easy_setopt(m_curl, CURLOPT_NOPROGRESS, 0L);
@@ -66,15 +98,50 @@ void FtpsClient::uploadFile(const QString &localFile, const QString &host, const
     // curl_easy_setopt(m_curl, CURLOPT_VERBOSE, 1L);
 
     // Perform upload
+    static LatencyHistogram* uploadTime = PerfRegistry::histogram("transfer.ftps");
+    static PerfCounter* uploadBytes = PerfRegistry::counter("transfer.ftps_bytes");
+    static PerfCounter* uploadFailures = PerfRegistry::counter("transfer.ftps_failures");
+    QElapsedTimer timer;
+    timer.start();
     CURLcode res = curl_easy_perform(m_curl);
     if (res != CURLE_OK) {
+        uploadFailures->add();
         m_errorString = curl_easy_strerror(res);
         emit finished(false, m_errorString);
     } else {
+        uploadTime->record(timer.nsecsElapsed() / 1000);
+        uploadBytes->add(m_bytesSent);
         emit finished(true, "");
     }
 
-    m_file->close();
+    delete m_file;
+    m_file = nullptr;
+    m_source = nullptr;
+    m_cancelled.reset();
     curl_easy_cleanup(m_curl);
     m_curl = nullptr;
 }
+
+void FtpsClient::deleteFile(const QString &host, const QString &username, const QString &password, const QString &remotePath) {
+    CURL* curl = curl_easy_init();
+    if (!curl) return;
+
+    QString url = QString("ftps://%1:990/").arg(host);
+    QByteArray command = "DELE " + remotePath.toUtf8();
+    struct curl_slist* commands = curl_slist_append(nullptr, command.constData());
+
+    curl_easy_setopt(curl, CURLOPT_URL, url.toUtf8().constData());
+    curl_easy_setopt(curl, CURLOPT_USERNAME, username.toUtf8().constData());
+    curl_easy_setopt(curl, CURLOPT_PASSWORD, password.toUtf8().constData());
+    curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_ALL);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    curl_easy_setopt(curl, CURLOPT_QUOTE, commands);
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L); //Only run the quote command, no listing
+
+    CURLcode res = curl_easy_perform(curl);
+    if (res != CURLE_OK) qWarning() << "FTPS delete of" << remotePath << "failed:" << curl_easy_strerror(res);
+
+    curl_slist_free_all(commands);
+    curl_easy_cleanup(curl);
+}
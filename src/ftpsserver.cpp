@@ -0,0 +1,322 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/ftpsserver.h"
+#include "headers/perfregistry.h"
+#include "headers/tracerecorder.h"
+#include <QSslServer>
+#include <QFileInfo>
+#include <QDir>
+#include <QDebug>
+
+FtpsServer::FtpsServer(QObject* parent) : QObject(parent) {}
+
+FtpsServer::~FtpsServer() {
+    close();
+}
+
+bool FtpsServer::listen(const QHostAddress &address, quint16 port, const QSslConfiguration &sslConfig) {
+    close();
+    ssl = sslConfig;
+    encrypted = !sslConfig.localCertificate().isNull();
+    if (encrypted) { //Implicit FTPS, TLS starts before the greeting
+        QSslServer* sslServer = new QSslServer(this);
+        sslServer->setSslConfiguration(ssl);
+        server = sslServer;
+    } else {
+        server = new QTcpServer(this);
+    }
+    connect(server, &QTcpServer::pendingConnectionAvailable, this, &FtpsServer::acceptControl);
+    if (!server->listen(address, port)) {
+        qCritical() << "FTPS server failed to listen on port" << port << server->errorString();
+        return false;
+    }
+    return true;
+}
+
+void FtpsServer::close() {
+    const QList<Session*> open = sessions;
+    for (Session* s : open) dropSession(s);
+    if (server != nullptr) {
+        server->close();
+        server->deleteLater();
+        server = nullptr;
+    }
+}
+
+void FtpsServer::setAuthenticator(std::function<bool(const QString &, const QString &)> auth) {
+    authenticator = auth;
+}
+
+void FtpsServer::setSpoolDirectory(const QString &dir) {
+    spoolDir = dir;
+}
+
+void FtpsServer::setPassivePortRange(quint16 first, quint16 last) {
+    passiveFirst = first;
+    passiveLast = last;
+}
+
+void FtpsServer::setRateLimit(qint64 bytesPerSecond) {
+    rateLimit = bytesPerSecond;
+}
+
+void FtpsServer::acceptControl() {
+    while (server->hasPendingConnections()) {
+        Session* s = new Session();
+        s->control = server->nextPendingConnection();
+        sessions.append(s);
+        connect(s->control, &QTcpSocket::readyRead, this, [this, s]() { readControl(s); });
+        connect(s->control, &QTcpSocket::disconnected, this, [this, s]() { dropSession(s); });
+        reply(s, "220 PCM Kiosk FTPS ready");
+    }
+}
+
+void FtpsServer::reply(Session* s, const QString &line) {
+    s->control->write(line.toUtf8() + "\r\n");
+}
+
+void FtpsServer::readControl(Session* s) {
+    s->lineBuffer.append(s->control->readAll());
+    if (s->lineBuffer.size() > 8192) return dropSession(s); //No legitimate command is this long
+    int end;
+    while ((end = s->lineBuffer.indexOf('\n')) >= 0) {
+        QString line = QString::fromUtf8(s->lineBuffer.left(end)).trimmed();
+        s->lineBuffer.remove(0, end + 1);
+        if (line.isEmpty()) continue;
+        int space = line.indexOf(' ');
+        QString command = (space < 0) ? line.toUpper() : line.left(space).toUpper();
+        QString argument = (space < 0) ? "" : line.mid(space + 1);
+        handleCommand(s, command, argument);
+        if (!sessions.contains(s)) return; //QUIT
+    }
+}
+
+void FtpsServer::handleCommand(Session* s, const QString &command, const QString &argument) {
+    if (command == "USER") {
+        s->username = argument;
+        s->authenticated = false;
+        return reply(s, "331 Password required");
+    }
+    if (command == "PASS") {
+        s->password = argument;
+        s->authenticated = !authenticator || authenticator(s->username, s->password);
+        return reply(s, s->authenticated ? "230 Logged in" : "530 Login incorrect");
+    }
+    if (command == "QUIT") {
+        reply(s, "221 Goodbye");
+        s->control->flush();
+        return dropSession(s);
+    }
+    if (command == "FEAT") return reply(s, "211-Features:\r\n PASV\r\n EPSV\r\n PBSZ\r\n PROT\r\n UTF8\r\n211 End");
+    if (command == "SYST") return reply(s, "215 UNIX Type: L8");
+    if (command == "NOOP") return reply(s, "200 OK");
+    if (command == "OPTS") return reply(s, "200 OK");
+    if (!s->authenticated) return reply(s, "530 Please login with USER and PASS");
+
+    if (command == "PBSZ") return reply(s, "200 PBSZ=0");
+    if (command == "PROT") {
+        s->protectData = argument.trimmed().toUpper() == "P";
+        if (s->protectData && !encrypted) return reply(s, "536 Data protection not available");
+        return reply(s, "200 Protection level set");
+    }
+    if (command == "TYPE") return reply(s, "200 Type set");
+    if (command == "PWD") return reply(s, "257 \"/\" is the current directory");
+    if (command == "CWD" || command == "CDUP") return reply(s, "250 OK"); //Everything lands in the spool
+    if (command == "SIZE" || command == "MDTM") return reply(s, "550 File not available");
+    if (command == "PASV" || command == "EPSV") {
+        if (!openPassive(s)) return reply(s, "425 Cannot open data connection");
+        quint16 port = s->passive->serverPort();
+        if (command == "EPSV") return reply(s, QString("229 Entering Extended Passive Mode (|||%1|)").arg(port));
+        quint32 ip = s->control->localAddress().toIPv4Address();
+        return reply(s, QString("227 Entering Passive Mode (%1,%2,%3,%4,%5,%6)")
+                            .arg((ip >> 24) & 0xFF).arg((ip >> 16) & 0xFF).arg((ip >> 8) & 0xFF).arg(ip & 0xFF)
+                            .arg(port >> 8).arg(port & 0xFF));
+    }
+    if (command == "LIST" || command == "NLST") {
+        if (s->passive == nullptr) return reply(s, "425 Use PASV first");
+        s->listing = true;
+        reply(s, "150 Here comes the directory listing");
+        if (s->data != nullptr) closeData(s);
+        return;
+    }
+    if (command == "STOR") {
+        if (s->passive == nullptr) return reply(s, "425 Use PASV first");
+        QString name = QFileInfo(argument.trimmed()).fileName();
+        if (name.isEmpty()) return reply(s, "501 Missing file name");
+        discardTransfer(s, "replaced by a new upload"); //A client that never finished the last one
+        QDir dir(spoolDir);
+        if (!dir.exists()) dir.mkpath(".");
+        s->file = new QFile(dir.filePath(name));
+        if (!s->file->open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            delete s->file;
+            s->file = nullptr;
+            return reply(s, "553 Cannot create file");
+        }
+        s->fileName = name;
+        s->parser = new GCodeStreamParser(name);
+        s->received = 0;
+        s->storeTimer.start();
+        s->jobId = TraceRecorder::newJob();
+        s->traceStart = TraceRecorder::now();
+        s->storing = true;
+        reply(s, "150 Ok to send data");
+        emit uploadStarted(name, s->password);
+        if (!s->earlyData.isEmpty()) {
+            consumeData(s, s->earlyData);
+            s->earlyData.clear();
+        }
+        if (s->data != nullptr && s->data->bytesAvailable() > 0) consumeData(s, s->data->readAll());
+        if (s->data != nullptr && s->data->state() == QAbstractSocket::UnconnectedState) finishTransfer(s);
+        return;
+    }
+    if (command == "DELE") {
+        QFile::remove(QDir(spoolDir).filePath(QFileInfo(argument.trimmed()).fileName()));
+        return reply(s, "250 Deleted");
+    }
+    if (command == "ABOR") {
+        discardTransfer(s, "aborted by the client");
+        closeData(s);
+        return reply(s, "226 Aborted");
+    }
+    reply(s, "502 Command not implemented");
+}
+
+bool FtpsServer::openPassive(Session* s) {
+    closeData(s);
+    if (s->protectData) {
+        QSslServer* sslServer = new QSslServer(this);
+        sslServer->setSslConfiguration(ssl);
+        s->passive = sslServer;
+    } else {
+        s->passive = new QTcpServer(this);
+    }
+    connect(s->passive, &QTcpServer::pendingConnectionAvailable, this, [this, s]() { acceptData(s); });
+    QHostAddress local(s->control->localAddress().toIPv4Address());
+    if (passiveFirst == 0) return s->passive->listen(local, 0);
+    for (quint32 port = passiveFirst; port <= passiveLast; port++) {
+        if (s->passive->listen(local, port)) return true;
+    }
+    return false;
+}
+
+void FtpsServer::acceptData(Session* s) {
+    if (!s->passive->hasPendingConnections()) return;
+    QTcpSocket* socket = s->passive->nextPendingConnection();
+    if (s->data != nullptr || socket->peerAddress().toIPv4Address() != s->control->peerAddress().toIPv4Address()) { //Only the logged in client may connect
+        socket->abort();
+        socket->deleteLater();
+        return;
+    }
+    s->data = socket;
+    if (rateLimit > 0) { //A full read buffer stops Qt reading from the socket, so the sender is held back by TCP
+        socket->setReadBufferSize(qMax<qint64>(4096, rateLimit / 10));
+        s->throttle = new QTimer(this);
+        s->throttle->setInterval(100);
+        connect(s->throttle, &QTimer::timeout, this, [this, s]() { readData(s); });
+        s->throttle->start();
+    } else {
+        connect(socket, &QTcpSocket::readyRead, this, [this, s]() { readData(s); });
+    }
+    connect(socket, &QTcpSocket::disconnected, this, [this, s]() {
+        if (s->storing) finishTransfer(s);
+    });
+    if (s->listing) closeData(s);
+}
+
+void FtpsServer::readData(Session* s) {
+    if (s->data == nullptr) return;
+    QByteArray chunk = (s->throttle != nullptr) ? s->data->read(qMax<qint64>(1, rateLimit / 10)) : s->data->readAll();
+    if (chunk.isEmpty()) return;
+    if (s->storing) consumeData(s, chunk);
+    else s->earlyData.append(chunk);
+}
+
+void FtpsServer::consumeData(Session* s, const QByteArray &chunk) {
+    //Written straight to the spool and scanned for metadata as it arrives
+    s->file->write(chunk);
+    s->parser->feed(chunk);
+    s->received += chunk.size();
+}
+
+void FtpsServer::finishTransfer(Session* s) {
+    if (!s->storing) return;
+    if (s->data != nullptr && s->data->bytesAvailable() > 0) consumeData(s, s->data->readAll());
+    s->storing = false;
+    QString path = QFileInfo(*s->file).absoluteFilePath();
+    bool ok = s->file->error() == QFileDevice::NoError;
+    s->file->close();
+    delete s->file;
+    s->file = nullptr;
+    qint64 parseStart = TraceRecorder::now();
+    QMap<QString, QString> properties = s->parser->finish(path);
+    TraceRecorder::span(s->jobId, "parse", parseStart);
+    properties.insert("jobId", s->jobId);
+    delete s->parser;
+    s->parser = nullptr;
+    closeData(s);
+
+    if (!ok) {
+        reply(s, "451 Failed to write file");
+        emit uploadFailed(s->fileName, "write error");
+        return;
+    }
+    reply(s, "226 Transfer complete");
+    static LatencyHistogram* intakeTime = PerfRegistry::histogram("intake.ftps");
+    static PerfCounter* intakeBytes = PerfRegistry::counter("intake.ftps_bytes");
+    intakeTime->record(s->storeTimer.nsecsElapsed() / 1000);
+    intakeBytes->add(s->received);
+    TraceRecorder::span(s->jobId, "intake", s->traceStart, QJsonObject{{"source", "ftps"}, {"file", s->fileName}, {"bytes", s->received}});
+    qDebug() << "FTPS received" << s->fileName << s->received << "bytes";
+    emit uploadFinished(path, s->password, properties);
+}
+
+void FtpsServer::discardTransfer(Session* s, const QString &reason) {
+    if (!s->storing) return;
+    s->storing = false;
+    s->file->close();
+    s->file->remove();
+    delete s->file;
+    s->file = nullptr;
+    delete s->parser;
+    s->parser = nullptr;
+    emit uploadFailed(s->fileName, reason);
+}
+
+void FtpsServer::closeData(Session* s) {
+    if (s->listing) {
+        s->listing = false;
+        if (s->data != nullptr) reply(s, "226 Transfer complete"); //Spool contents are not exposed
+    }
+    if (s->throttle != nullptr) {
+        s->throttle->stop();
+        s->throttle->deleteLater();
+        s->throttle = nullptr;
+    }
+    if (s->data != nullptr) {
+        s->data->disconnect(this);
+        s->data->disconnectFromHost();
+        s->data->deleteLater();
+        s->data = nullptr;
+    }
+    if (s->passive != nullptr && !s->storing) {
+        s->passive->close();
+        s->passive->deleteLater();
+        s->passive = nullptr;
+    }
+    s->earlyData.clear();
+}
+
+void FtpsServer::dropSession(Session* s) {
+    if (!sessions.contains(s)) return;
+    sessions.removeAll(s);
+    discardTransfer(s, "connection lost");
+    closeData(s);
+    s->control->disconnect(this);
+    s->control->disconnectFromHost();
+    s->control->deleteLater();
+    delete s;
+}
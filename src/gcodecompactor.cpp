@@ -0,0 +1,526 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/gcodecompactor.h"
+#include <QtEndian>
+#include <QMutexLocker>
+#include <QSet>
+#include <QDebug>
+
+//Comment metadata kept when stripping, printers and PrusaLink show these and GCodeParser reads them
+static const QList<QByteArray> KEPT_METADATA = {
+    "printer_model", "filament_type", "nozzle_diameter", "bed_temperature", "temperature", "layer_height",
+    "fill_density", "max_layer_z", "filament used [mm]", "filament used [g]", "total filament used [g]",
+    "estimated printing time (normal mode)", "printer_settings_id", "filament_settings_id", "print_settings_id"
+};
+
+//Which metadata goes in the bgcode printer and print metadata blocks, everything goes in slicer metadata
+static const QList<QString> PRINTER_METADATA = {
+    "printer_model", "filament_type", "nozzle_diameter", "bed_temperature", "brim_width", "fill_density", "layer_height",
+    "temperature", "ironing", "support_material", "max_layer_z", "extruder_colour", "filament used [mm]", "filament used [g]",
+    "estimated printing time (normal mode)"
+};
+static const QList<QString> PRINT_METADATA = {
+    "filament used [mm]", "filament used [cm3]", "filament used [g]", "filament cost", "total filament used [g]",
+    "total filament cost", "estimated printing time (normal mode)", "estimated first layer printing time (normal mode)"
+};
+
+//bgcode block types
+static const quint16 BLOCK_FILE_METADATA = 0;
+static const quint16 BLOCK_GCODE = 1;
+static const quint16 BLOCK_SLICER_METADATA = 2;
+static const quint16 BLOCK_PRINTER_METADATA = 3;
+static const quint16 BLOCK_PRINT_METADATA = 4;
+static const quint16 BLOCK_THUMBNAIL = 5;
+static const quint16 COMPRESSION_HEATSHRINK_12_4 = 3;
+static const quint16 ENCODING_MEATPACK = 1;
+
+template <typename T>
+static void appendLE(QByteArray &out, T value) {
+    T le = qToLittleEndian(value);
+    out.append(reinterpret_cast<const char*>(&le), sizeof(T));
+}
+
+GCodeCompactor::GCodeCompactor(const QString &sourcePath, Mode mode, QObject* parent) : QIODevice(parent) {
+    this->sourcePath = sourcePath;
+    this->mode = mode;
+}
+
+GCodeCompactor::~GCodeCompactor() {
+    close();
+}
+
+bool GCodeCompactor::open(OpenMode openMode) {
+    if (openMode & QIODevice::WriteOnly) return false;
+    if (!QIODevice::open(openMode | QIODevice::Unbuffered)) return false;
+    timer.start();
+    worker = QThread::create([this]() { run(); });
+    worker->start();
+    return true;
+}
+
+void GCodeCompactor::close() {
+    if (worker != nullptr) {
+        {
+            QMutexLocker lock(&mutex);
+            cancelled = true;
+            notFull.wakeAll();
+        }
+        worker->wait();
+        delete worker;
+        worker = nullptr;
+    }
+    QIODevice::close();
+}
+
+bool GCodeCompactor::isSequential() const {
+    return true;
+}
+
+bool GCodeCompactor::atEnd() const {
+    QMutexLocker lock(&mutex);
+    return done && chunks.isEmpty();
+}
+
+qint64 GCodeCompactor::bytesAvailable() const {
+    QMutexLocker lock(&mutex);
+    return queuedBytes + QIODevice::bytesAvailable();
+}
+
+bool GCodeCompactor::waitForReadyRead(int msecs) {
+    QMutexLocker lock(&mutex);
+    while (chunks.isEmpty() && !done) {
+        if (!notEmpty.wait(&mutex, msecs < 0 ? ULONG_MAX : msecs)) return false;
+    }
+    return !chunks.isEmpty();
+}
+
+qint64 GCodeCompactor::bytesIn() const {
+    QMutexLocker lock(&mutex);
+    return inCount;
+}
+
+qint64 GCodeCompactor::bytesOut() const {
+    QMutexLocker lock(&mutex);
+    return outCount;
+}
+
+qint64 GCodeCompactor::readData(char* data, qint64 maxSize) {
+    QMutexLocker lock(&mutex);
+    qint64 copied = 0;
+    while (copied < maxSize && !chunks.isEmpty()) {
+        const QByteArray &head = chunks.head();
+        qint64 n = qMin(maxSize - copied, head.size() - chunkOffset);
+        memcpy(data + copied, head.constData() + chunkOffset, n);
+        copied += n;
+        chunkOffset += n;
+        if (chunkOffset == head.size()) {
+            chunks.dequeue();
+            chunkOffset = 0;
+        }
+    }
+    queuedBytes -= copied;
+    notFull.wakeAll();
+    if (copied == 0 && done) return -1; //End of stream
+    return copied;
+}
+
+qint64 GCodeCompactor::writeData(const char*, qint64) {
+    return -1;
+}
+
+GCodeCompactor::Mode GCodeCompactor::modeFor(const QString &setting, const QString &fileName) {
+    if (!fileName.toLower().endsWith(".gcode")) return Passthrough; //Already binary, or a project archive
+    if (setting == "binary") return Binary;
+    if (setting == "strip") return StripComments;
+    return Passthrough;
+}
+
+QString GCodeCompactor::outputName(const QString &fileName, Mode mode) {
+    if (mode != Binary) return fileName;
+    return fileName.left(fileName.size() - QString(".gcode").size()) + ".bgcode";
+}
+
+bool GCodeCompactor::push(const QByteArray &chunk) {
+    if (chunk.isEmpty()) return true;
+    {
+        QMutexLocker lock(&mutex);
+        while (queuedBytes >= MAX_QUEUED && !cancelled) notFull.wait(&mutex);
+        if (cancelled) return false;
+        chunks.enqueue(chunk);
+        queuedBytes += chunk.size();
+        outCount += chunk.size();
+        notEmpty.wakeAll();
+    }
+    emit readyRead();
+    return true;
+}
+
+void GCodeCompactor::run() {
+    QFile source(sourcePath);
+    if (!source.open(QIODevice::ReadOnly)) {
+        qWarning() << "Compactor cannot open" << sourcePath;
+    } else if (mode == StripComments) {
+        runStrip(source);
+    } else if (mode == Binary) {
+        runBinary(source);
+    } else {
+        runPassthrough(source);
+    }
+    qint64 in, out;
+    {
+        QMutexLocker lock(&mutex);
+        done = true;
+        notEmpty.wakeAll();
+        in = inCount;
+        out = outCount;
+    }
+    emit readyRead();
+    emit readChannelFinished();
+    emit compactionFinished(in, out, timer.elapsed());
+}
+
+void GCodeCompactor::runPassthrough(QFile &source) {
+    while (!source.atEnd()) {
+        QByteArray chunk = source.read(256 * 1024);
+        {
+            QMutexLocker lock(&mutex);
+            inCount += chunk.size();
+        }
+        if (!push(chunk)) return;
+    }
+}
+
+void GCodeCompactor::runStrip(QFile &source) {
+    QByteArray out;
+    bool inThumbnail = false;
+    qint64 read = 0;
+    while (!source.atEnd()) {
+        QByteArray line = source.readLine();
+        read += line.size();
+        if (inThumbnail) {
+            if (isThumbnailEnd(line)) inThumbnail = false;
+            continue;
+        }
+        if (isThumbnailStart(line)) {
+            inThumbnail = true;
+            continue;
+        }
+        QByteArray stripped = stripLine(line);
+        if (stripped.isEmpty()) continue;
+        out += stripped;
+        out += '\n';
+        if (out.size() >= 256 * 1024) {
+            {
+                QMutexLocker lock(&mutex);
+                inCount = read;
+            }
+            if (!push(out)) return;
+            out.clear();
+        }
+    }
+    {
+        QMutexLocker lock(&mutex);
+        inCount = read;
+    }
+    push(out);
+}
+
+void GCodeCompactor::runBinary(QFile &source) {
+    //Metadata sits at the end of an ASCII file but must lead a binary one, so it is collected in a first pass
+    QList<QPair<QString, QString>> metadata;
+    QList<Thumbnail> thumbnails;
+    scanMetadata(source, metadata, thumbnails);
+    source.seek(0);
+
+    QByteArray header = "GCDE";
+    appendLE<quint32>(header, 1); //Version
+    appendLE<quint16>(header, 1); //CRC32 checksums
+    QByteArray iniParams;
+    appendLE<quint16>(iniParams, 0); //INI encoding
+
+    QByteArray printerIni, printIni, slicerIni;
+    for (const auto &kv : metadata) {
+        QByteArray entry = (kv.first + "=" + kv.second + "\n").toUtf8();
+        if (PRINTER_METADATA.contains(kv.first)) printerIni += entry;
+        if (PRINT_METADATA.contains(kv.first)) printIni += entry;
+        slicerIni += entry;
+    }
+
+    QByteArray out = header;
+    out += block(BLOCK_FILE_METADATA, iniParams, "Producer=PCM 3DP Kiosk\n", false);
+    out += block(BLOCK_PRINTER_METADATA, iniParams, printerIni, false);
+    for (const Thumbnail &t : thumbnails) {
+        QByteArray params;
+        appendLE<quint16>(params, t.format);
+        appendLE<quint16>(params, t.width);
+        appendLE<quint16>(params, t.height);
+        out += block(BLOCK_THUMBNAIL, params, QByteArray::fromBase64(t.base64), false);
+    }
+    out += block(BLOCK_PRINT_METADATA, iniParams, printIni, false);
+    out += block(BLOCK_SLICER_METADATA, iniParams, slicerIni, false);
+    if (!push(out)) return;
+
+    QByteArray gcodeParams;
+    appendLE<quint16>(gcodeParams, ENCODING_MEATPACK);
+    QByteArray pending;
+    bool inThumbnail = false;
+    qint64 read = 0;
+    while (!source.atEnd()) {
+        QByteArray line = source.readLine();
+        read += line.size();
+        if (inThumbnail) {
+            if (isThumbnailEnd(line)) inThumbnail = false;
+            continue;
+        }
+        if (isThumbnailStart(line)) {
+            inThumbnail = true;
+            continue;
+        }
+        QByteArray stripped = stripLine(line);
+        if (stripped.isEmpty() || stripped.startsWith(';')) continue; //Metadata already went into the metadata blocks
+        if (pending.size() + stripped.size() + 1 > GCODE_BLOCK_SIZE) {
+            {
+                QMutexLocker lock(&mutex);
+                inCount = read;
+            }
+            if (!push(block(BLOCK_GCODE, gcodeParams, meatpackEncode(pending), true))) return;
+            pending.clear();
+        }
+        pending += stripped;
+        pending += '\n';
+    }
+    {
+        QMutexLocker lock(&mutex);
+        inCount = read;
+    }
+    if (!pending.isEmpty()) push(block(BLOCK_GCODE, gcodeParams, meatpackEncode(pending), true));
+}
+
+void GCodeCompactor::scanMetadata(QFile &source, QList<QPair<QString, QString>> &metadata, QList<Thumbnail> &thumbnails) {
+    Thumbnail* current = nullptr;
+    QSet<QString> seen;
+    while (!source.atEnd()) {
+        QByteArray line = source.readLine().trimmed();
+        if (!line.startsWith(';')) continue;
+        if (current != nullptr) {
+            if (isThumbnailEnd(line)) current = nullptr;
+            else current->base64 += line.mid(1).trimmed();
+            continue;
+        }
+        if (isThumbnailStart(line)) { //"; thumbnail_QOI begin 16x16 1234"
+            Thumbnail t;
+            if (line.contains("thumbnail_JPG")) t.format = 1;
+            else if (line.contains("thumbnail_QOI")) t.format = 2;
+            QList<QByteArray> parts = line.split(' ');
+            int sizeIndex = parts.indexOf("begin") + 1;
+            if (sizeIndex > 0 && sizeIndex < parts.size()) {
+                QList<QByteArray> dims = parts[sizeIndex].split('x');
+                if (dims.size() == 2) {
+                    t.width = dims[0].toUShort();
+                    t.height = dims[1].toUShort();
+                }
+            }
+            thumbnails.append(t);
+            current = &thumbnails.last();
+            continue;
+        }
+        int eq = line.indexOf(" = ");
+        if (!line.startsWith("; ") || eq < 0) continue;
+        QString key = QString::fromUtf8(line.mid(2, eq - 2)).trimmed();
+        if (key.isEmpty() || seen.contains(key)) continue;
+        seen.insert(key);
+        metadata.append({key, QString::fromUtf8(line.mid(eq + 3)).trimmed()});
+    }
+}
+
+QByteArray GCodeCompactor::stripLine(const QByteArray &line) {
+    QByteArray trimmed = line.trimmed();
+    if (trimmed.startsWith(';')) {
+        int eq = trimmed.indexOf(" = ");
+        if (eq < 0 || !trimmed.startsWith("; ")) return QByteArray();
+        return KEPT_METADATA.contains(trimmed.mid(2, eq - 2)) ? trimmed : QByteArray();
+    }
+    int comment = trimmed.indexOf(';');
+    if (comment >= 0) trimmed = trimmed.left(comment).trimmed();
+    return trimmed;
+}
+
+bool GCodeCompactor::isThumbnailStart(const QByteArray &line) {
+    return line.startsWith("; thumbnail") && line.contains(" begin");
+}
+
+bool GCodeCompactor::isThumbnailEnd(const QByteArray &line) {
+    return line.startsWith("; thumbnail") && line.contains(" end");
+}
+
+QByteArray GCodeCompactor::block(quint16 type, const QByteArray &params, const QByteArray &data, bool compress) {
+    QByteArray payload = data;
+    quint16 compression = 0;
+    if (compress) {
+        QByteArray packed = heatshrinkCompress(data);
+        if (packed.size() < data.size()) { //Incompressible blocks are stored as is
+            payload = packed;
+            compression = COMPRESSION_HEATSHRINK_12_4;
+        }
+    }
+    QByteArray out;
+    appendLE<quint16>(out, type);
+    appendLE<quint16>(out, compression);
+    appendLE<quint32>(out, data.size());
+    if (compression != 0) appendLE<quint32>(out, payload.size());
+    out += params;
+    out += payload;
+    appendLE<quint32>(out, crc32(out)); //Covers header, parameters and data
+    return out;
+}
+
+QByteArray GCodeCompactor::meatpackEncode(const QByteArray &gcode) {
+    //MeatPack packs the 15 most common G-code characters into nibbles, spaces dropped and replaced by 'E' in the table
+    static const quint8 SIGNAL = 0xFF;
+    static const quint8 ENABLE_PACKING = 251;
+    static const quint8 RESET_ALL = 249;
+    static const quint8 ENABLE_NO_SPACES = 247;
+    static const quint8 UNPACKABLE = 0xF;
+    quint8 table[256];
+    memset(table, 0xFF, sizeof(table));
+    for (char c = '0'; c <= '9'; c++) table[quint8(c)] = c - '0';
+    table[quint8('.')] = 10;
+    table[quint8('E')] = 11;
+    table[quint8('\n')] = 12;
+    table[quint8('G')] = 13;
+    table[quint8('X')] = 14;
+    auto packable = [&table](char c) { return table[quint8(c)] != 0xFF; };
+    auto nibble = [&table](char c) { return table[quint8(c)] == 0xFF ? UNPACKABLE : table[quint8(c)]; };
+
+    QByteArray out;
+    out.reserve(gcode.size() * 6 / 10);
+    out.append(char(SIGNAL)).append(char(SIGNAL)).append(char(ENABLE_PACKING));
+    out.append(char(SIGNAL)).append(char(SIGNAL)).append(char(ENABLE_NO_SPACES));
+
+    qsizetype start = 0;
+    while (start < gcode.size()) {
+        qsizetype end = gcode.indexOf('\n', start);
+        if (end < 0) end = gcode.size();
+        QByteArray line = gcode.mid(start, end - start).trimmed();
+        start = end + 1;
+        if (line.size() < 2) continue;
+        int g = line.indexOf('G');
+        if (g >= 0 && g + 1 < line.size() && line[g + 1] >= '0' && line[g + 1] <= '9') { //Movement lines lose their spaces
+            line.replace('e', 'E').replace('x', 'X').replace('g', 'G');
+            line.replace(" ", "");
+        }
+        line += '\n';
+        for (qsizetype i = 0; i < line.size(); i += 2) {
+            char c1 = line[i];
+            char c2 = (i + 1 < line.size()) ? line[i + 1] : '\n';
+            bool p1 = packable(c1);
+            bool p2 = packable(c2);
+            if (p1 && p2) {
+                out.append(char((nibble(c2) << 4) | nibble(c1)));
+            } else if (p1) {
+                out.append(char((UNPACKABLE << 4) | nibble(c1)));
+                out.append(c2);
+            } else if (p2) {
+                out.append(char((nibble(c2) << 4) | UNPACKABLE));
+                out.append(c1);
+            } else {
+                out.append(char(0xFF));
+                out.append(c1);
+                out.append(c2);
+            }
+        }
+    }
+    out.append(char(SIGNAL)).append(char(SIGNAL)).append(char(RESET_ALL));
+    return out;
+}
+
+QByteArray GCodeCompactor::heatshrinkCompress(const QByteArray &data) {
+    //LZSS with a 4096 byte window and 16 byte lookahead, the stream the firmware's heatshrink decoder expects
+    static const int WINDOW_BITS = 12;
+    static const int LOOKAHEAD_BITS = 4;
+    static const int WINDOW = 1 << WINDOW_BITS;
+    static const int MAX_MATCH = 1 << LOOKAHEAD_BITS;
+    static const int MIN_MATCH = 3; //Shorter references cost more bits than literals
+    static const int HASH_SIZE = 1 << 13;
+    static const int MAX_CHAIN = 48;
+
+    const quint8* in = reinterpret_cast<const quint8*>(data.constData());
+    const int n = data.size();
+    QByteArray out;
+    out.reserve(n / 2);
+    quint32 bits = 0;
+    int bitCount = 0;
+    auto put = [&](quint32 value, int count) {
+        for (int i = count - 1; i >= 0; i--) {
+            bits = (bits << 1) | ((value >> i) & 1);
+            if (++bitCount == 8) {
+                out.append(char(bits));
+                bits = 0;
+                bitCount = 0;
+            }
+        }
+    };
+
+    QVector<int> head(HASH_SIZE, -1);
+    QVector<int> prev(n, -1);
+    auto hash = [in](int p) { return ((in[p] << 5) ^ (in[p + 1] << 3) ^ in[p + 2]) & (HASH_SIZE - 1); };
+    auto insert = [&](int p) {
+        if (p + 2 >= n) return;
+        int h = hash(p);
+        prev[p] = head[h];
+        head[h] = p;
+    };
+
+    int pos = 0;
+    while (pos < n) {
+        int bestLength = 0;
+        int bestDistance = 0;
+        if (pos + MIN_MATCH <= n) {
+            int limit = qMin(MAX_MATCH, n - pos);
+            int candidate = head[hash(pos)];
+            for (int chain = 0; candidate >= 0 && pos - candidate <= WINDOW && chain < MAX_CHAIN; chain++) {
+                int length = 0;
+                while (length < limit && in[candidate + length] == in[pos + length]) length++;
+                if (length > bestLength) {
+                    bestLength = length;
+                    bestDistance = pos - candidate;
+                    if (length == limit) break;
+                }
+                candidate = prev[candidate];
+            }
+        }
+        if (bestLength >= MIN_MATCH) {
+            put(0, 1);
+            put(bestDistance - 1, WINDOW_BITS);
+            put(bestLength - 1, LOOKAHEAD_BITS);
+            for (int i = 0; i < bestLength; i++) insert(pos + i);
+            pos += bestLength;
+        } else {
+            put(1, 1);
+            put(in[pos], 8);
+            insert(pos);
+            pos++;
+        }
+    }
+    if (bitCount > 0) out.append(char(bits << (8 - bitCount)));
+    return out;
+}
+
+quint32 GCodeCompactor::crc32(const QByteArray &data, quint32 crc) {
+    static const QVector<quint32> table = []() {
+        QVector<quint32> t(256);
+        for (quint32 i = 0; i < 256; i++) {
+            quint32 c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (char byte : data) crc = table[(crc ^ quint8(byte)) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
@@ -5,6 +5,7 @@
 */
 
 #include "headers/gcodeparser.h"
+#include "headers/perfregistry.h"
 #include <QFileInfo>
 #include <QDebug>
 #include <zip.h>
@@ -12,6 +13,8 @@
 #define min(x, y) ((x<y) ? x : y)
 
 QMap<QString, QString> GCodeParser::parseFile(QString filepath) {
+    static LatencyHistogram* parseTime = PerfRegistry::histogram("gcode.parse_file");
+    PerfTimer timer(parseTime);
     if (!QFile::exists(filepath)) {
         qWarning() << "File does not exist" << filepath;
         return QMap<QString, QString>();
@@ -226,3 +229,72 @@ QVector<QString> GCodeParser::readBGCode(QFile f) {
     f.close();
     return QVector<QString>();
 }
+
+GCodeStreamParser::GCodeStreamParser(const QString &fileName) {
+    this->fileName = fileName;
+}
+
+void GCodeStreamParser::feed(const QByteArray &chunk) {
+    hasher.addData(chunk);
+    total += chunk.size();
+    int toHead = min(chunk.size(), HEAD_SIZE - head.size());
+    if (toHead > 0) head.append(chunk.first(toHead));
+    if (toHead < chunk.size()) tail.append(chunk.mid(toHead));
+    if (tail.size() > TAIL_SIZE*2) tail = tail.last(TAIL_SIZE); //Only the end of the file is needed
+}
+
+QCache<QString, QMap<QString, QString>> GCodeStreamParser::parseCache(32);
+
+QString GCodeStreamParser::cacheSummary() {
+    QMutexLocker lock(&cacheMutex);
+    return QString("%1 / %2 parsed files, %3 hits, %4 misses").arg(parseCache.size()).arg(parseCache.maxCost()).arg(cacheHits.load()).arg(cacheMisses.load());
+}
+
+QMap<QString, QString> GCodeStreamParser::parseLocalFile(const QString &filepath) {
+    QFile file(filepath);
+    if (!file.open(QIODevice::ReadOnly)) return GCodeParser::parseFile(filepath); //Reports the missing file
+    GCodeStreamParser parser(QFileInfo(filepath).fileName());
+    while (!file.atEnd()) parser.feed(file.read(1024 * 1024));
+    return parser.finish(filepath);
+}
+
+QMap<QString, QString> GCodeStreamParser::finish(const QString &filepath) {
+    static LatencyHistogram* finishTime = PerfRegistry::histogram("gcode.stream_finish");
+    static PerfCounter* registryHits = PerfRegistry::counter("gcode.cache_hits");
+    static PerfCounter* registryMisses = PerfRegistry::counter("gcode.cache_misses");
+    PerfTimer timer(finishTime);
+    QString lower = fileName.toLower();
+    QMap<QString, QString> output;
+    QString key = hasher.xxh64Hex();
+    bool cached = false;
+    {
+        QMutexLocker lock(&cacheMutex);
+        if (QMap<QString, QString>* hit = parseCache.object(key)) {
+            output = *hit;
+            cached = true;
+        }
+    }
+    if (cached) { //Parsing below runs unlocked, two threads missing on the same file both parse it
+        cacheHits++;
+        registryHits->add();
+    } else if (lower.endsWith(".gcode")) {
+        //Head plus the last TAIL_SIZE bytes lays out exactly like the regions readGCode slices from a whole file
+        QByteArray raw = head + ((tail.size() > TAIL_SIZE) ? tail.last(TAIL_SIZE) : tail);
+        output = GCodeParser::parseGCode(GCodeParser::readGCode(raw));
+    } else if (lower.endsWith(".bgcode")) {
+        QString plainText = QString(head.first(min(head.size(), GCodeParser::BLINE_COUNT*60)));
+        plainText.replace(QChar(0xFFFD), "\n");
+        output = GCodeParser::parseBGCode(plainText.split("\n"));
+    } else {
+        output = GCodeParser::parseFile(filepath); //Zip based projects need the central directory at the end of the file
+    }
+    if (!output.isEmpty() && !cached) {
+        QMutexLocker lock(&cacheMutex);
+        if (!parseCache.contains(key)) parseCache.insert(key, new QMap<QString, QString>(output));
+        cacheMisses++;
+        registryMisses->add();
+    }
+    output.insert("filename", fileName);
+    hasher.attachTo(output);
+    return output;
+}
@@ -0,0 +1,102 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/journalserver.h"
+#include <QHttpServerRequest>
+#include <QHttpServerResponse>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QFile>
+#include <QRegularExpression>
+#include <QRandomGenerator>
+#include <QDebug>
+
+JournalServer::JournalServer(const QString &directory, QObject* parent) : QObject(parent), directory(directory) {
+    this->directory.mkpath(".");
+    server.route("/journal", QHttpServerRequest::Method::Post, this, [this](const QHttpServerRequest &request) {
+        return receive(request);
+    });
+    server.route("/journal/<arg>", QHttpServerRequest::Method::Get, this, [this](const QString &kiosk) {
+        return QHttpServerResponse(QJsonObject{{"kiosk", kiosk}, {"acked", recover(kiosk)}});
+    });
+}
+
+bool JournalServer::listen(const QHostAddress &address, quint16 port) {
+    tcp = new QTcpServer(this);
+    if (!tcp->listen(address, port) || !server.bind(tcp)) {
+        qCritical() << "[sim] journal server could not listen on port" << port;
+        return false;
+    }
+    qInfo() << "[sim] journal server on" << address.toString() + ":" + QString::number(tcp->serverPort()) << "storing in" << directory.absolutePath();
+    return true;
+}
+
+quint16 JournalServer::port() const {
+    return tcp ? tcp->serverPort() : 0;
+}
+
+void JournalServer::setFailureRate(double rate) {
+    failureRate = qBound(0.0, rate, 1.0);
+}
+
+QString JournalServer::fileFor(const QString &kiosk) const {
+    QString safe = kiosk;
+    safe.replace(QRegularExpression("[^A-Za-z0-9_.-]"), "_");
+    return directory.filePath("journal_" + safe + ".jsonl");
+}
+
+qint64 JournalServer::recover(const QString &kiosk) {
+    auto known = acked.constFind(kiosk);
+    if (known != acked.constEnd()) return known.value();
+    qint64 last = 0;
+    QFile f(fileFor(kiosk));
+    if (f.open(QIODevice::ReadOnly)) {
+        while (!f.atEnd()) {
+            QJsonObject entry = QJsonDocument::fromJson(f.readLine()).object();
+            last = qMax(last, entry.value("seq").toInteger());
+        }
+    }
+    acked.insert(kiosk, last);
+    return last;
+}
+
+QHttpServerResponse JournalServer::receive(const QHttpServerRequest &request) {
+    if (failureRate > 0 && QRandomGenerator::global()->generateDouble() < failureRate) {
+        return QHttpServerResponse("Simulated outage", QHttpServerResponder::StatusCode::ServiceUnavailable);
+    }
+    QByteArray body = request.body();
+    if (request.headers().value("X-Journal-Encoding") == "qcompress") body = qUncompress(body);
+    QJsonParseError parseError;
+    QJsonObject batch = QJsonDocument::fromJson(body, &parseError).object();
+    if (parseError.error != QJsonParseError::NoError || !batch.value("kiosk").isString()) {
+        return QHttpServerResponse("Malformed batch", QHttpServerResponder::StatusCode::BadRequest);
+    }
+    QString kiosk = batch.value("kiosk").toString();
+    qint64 current = recover(kiosk);
+
+    //The kiosk sends from where it thinks we are, anything else is a replay or a gap, tell it where to resume
+    if (batch.value("after").toInteger(-1) != current) {
+        return QHttpServerResponse(QJsonObject{{"acked", current}}, QHttpServerResponder::StatusCode::Conflict);
+    }
+    QFile f(fileFor(kiosk));
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        return QHttpServerResponse("Unable to store batch", QHttpServerResponder::StatusCode::InternalServerError);
+    }
+    int stored = 0;
+    for (const QJsonValue &value : batch.value("entries").toArray()) {
+        QJsonObject entry = value.toObject();
+        qint64 seq = entry.value("seq").toInteger();
+        if (seq <= current) continue; //Already have it
+        f.write(QJsonDocument(entry).toJson(QJsonDocument::Compact) + "\n");
+        current = seq;
+        stored++;
+    }
+    f.close();
+    acked.insert(kiosk, current);
+    emit batchStored(kiosk, stored, current);
+    return QHttpServerResponse(QJsonObject{{"acked", current}});
+}
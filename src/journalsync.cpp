@@ -0,0 +1,178 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/journalsync.h"
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QSysInfo>
+#include <QRandomGenerator>
+#include <QDebug>
+
+JournalSync::JournalSync(DatabaseService* dbs, QObject* parent) : QObject(parent) {
+    this->dbs = dbs;
+    timer.setSingleShot(true);
+    connect(&timer, &QTimer::timeout, this, &JournalSync::sync);
+}
+
+void JournalSync::loadConfig(QJsonObject cfg) {
+    endpoint = QUrl(cfg.value("endpoint").toString());
+    kioskId = cfg.value("kioskId").toString(QSysInfo::machineHostName());
+    token = cfg.value("token").toString().toUtf8();
+    batchSize = qBound(1, cfg.value("batchSize").toInt(500), 5000);
+    intervalMs = qMax(1, cfg.value("intervalSeconds").toInt(30)) * 1000;
+    enabled = endpoint.isValid() && !endpoint.isEmpty();
+    if (!enabled) return;
+    qInfo() << "Syncing the print journal to" << endpoint.toString() << "as" << kioskId;
+    timer.start(2000); //Let the database come up first
+}
+
+void JournalSync::nudge() {
+    if (!enabled || inFlight || failures > 0) return; //An offline link keeps its backoff
+    if (!timer.isActive() || timer.remainingTime() > 1000) timer.start(1000); //Coalesce a burst of prints into one batch
+}
+
+void JournalSync::sync() {
+    if (!enabled || inFlight) return;
+    inFlight = true;
+    if (acked < 0) { //First run, pick up where the last session stopped
+        dbs->read("SELECT value FROM journalState WHERE key = 'ackedSeq'").then(this, [this](Eo<DbRows> result) {
+            inFlight = false;
+            if (result.isError()) {
+                lastError = result.errorString();
+                return retryLater();
+            }
+            acked = result.get().isEmpty() ? 0 : result.get().first()[0].toLongLong();
+            sync();
+        });
+        return;
+    }
+    dbs->read("SELECT seq, kind, createdAt, payload FROM journal WHERE seq > :after ORDER BY seq LIMIT :n", {
+        {":after", acked},
+        {":n", batchSize}
+    }).then(this, [this](Eo<DbRows> result) {
+        if (result.isError()) {
+            inFlight = false;
+            lastError = result.errorString();
+            return retryLater();
+        }
+        if (result.get().isEmpty()) { //Caught up
+            inFlight = false;
+            timer.start(intervalMs);
+            return;
+        }
+        send(result.get());
+    });
+}
+
+void JournalSync::send(const DbRows &entries) {
+    QJsonArray batch;
+    for (const DbRow &entry : entries) {
+        batch.append(QJsonObject{
+            {"seq", entry[0].toLongLong()},
+            {"kind", entry[1].toString()},
+            {"at", entry[2].toLongLong()},
+            {"data", QJsonDocument::fromJson(entry[3].toByteArray()).object()}
+        });
+    }
+    QByteArray json = QJsonDocument(QJsonObject{
+        {"kiosk", kioskId},
+        {"after", acked}, //What the kiosk thinks the server already has
+        {"entries", batch}
+    }).toJson(QJsonDocument::Compact);
+    QByteArray body = qCompress(json, 6);
+    rawBytes += json.size();
+    compressedBytes += body.size();
+
+    QNetworkRequest request(endpoint);
+    request.setHeader(QNetworkRequest::ContentTypeHeader, "application/octet-stream");
+    request.setRawHeader("X-Journal-Encoding", "qcompress");
+    request.setRawHeader("X-Kiosk", kioskId.toUtf8());
+    if (!token.isEmpty()) request.setRawHeader("Authorization", "Bearer " + token);
+    request.setTransferTimeout(15000);
+    QNetworkReply* reply = network.post(request, body);
+    qint64 lastSent = entries.last()[0].toLongLong();
+    int count = entries.size();
+    connect(reply, &QNetworkReply::finished, this, [this, reply, lastSent, count]() { finished(reply, lastSent, count); });
+}
+
+void JournalSync::finished(QNetworkReply* reply, qint64 lastSent, int count) {
+    reply->deleteLater();
+    inFlight = false;
+    int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    QJsonObject response = QJsonDocument::fromJson(reply->readAll()).object();
+
+    //409 means the server holds a different position than we sent from, it tells us where to resume
+    if ((reply->error() != QNetworkReply::NoError && status != 409) || !response.contains("acked")) {
+        lastError = reply->error() != QNetworkReply::NoError ? reply->errorString() : "reply without acked sequence";
+        return retryLater();
+    }
+    qint64 serverAcked = response.value("acked").toInteger();
+    if (status == 409) return resync(serverAcked);
+    entriesSent += count;
+    batchesSent++;
+    reachable();
+    setAcked(serverAcked);
+
+    //A full batch means there is probably more waiting, keep going until caught up
+    bool more = serverAcked >= lastSent && count >= batchSize;
+    timer.start(more ? 0 : intervalMs);
+}
+
+void JournalSync::resync(qint64 serverAcked) {
+    //Only resume from a position this kiosk actually has. A server ahead of the local journal means the
+    //kioskId is shared with another kiosk or the database was replaced, adopting it would skip entries forever
+    inFlight = true;
+    dbs->read("SELECT ifnull(MAX(seq), 0) FROM journal").then(this, [this, serverAcked](Eo<DbRows> result) {
+        inFlight = false;
+        if (result.isError()) {
+            lastError = result.errorString();
+            return retryLater();
+        }
+        qint64 localMax = result.get().isEmpty() ? 0 : result.get().first()[0].toLongLong();
+        if (serverAcked < 0 || serverAcked > localMax) {
+            lastError = QString("server is at sequence %1 but the local journal ends at %2, check that kioskId %3 is unique")
+                .arg(serverAcked).arg(localMax).arg(kioskId);
+            return retryLater();
+        }
+        qInfo() << "Journal server is at sequence" << serverAcked << "not" << acked << ", resuming from there";
+        reachable();
+        setAcked(serverAcked);
+        timer.start(0);
+    });
+}
+
+void JournalSync::reachable() {
+    if (failures > 0) qInfo() << "Journal server reachable again after" << failures << "failed attempts";
+    failures = 0;
+    lastError.clear();
+    lastSuccess = QDateTime::currentDateTime();
+}
+
+void JournalSync::setAcked(qint64 seq) {
+    if (seq == acked) return;
+    acked = seq;
+    dbs->write("INSERT INTO journalState (key, value) VALUES ('ackedSeq', :v) ON CONFLICT (key) DO UPDATE SET value = excluded.value", {{":v", seq}});
+}
+
+void JournalSync::retryLater() {
+    //Exponential backoff with jitter so a fleet of kiosks doesn't return at the same moment
+    failures++;
+    qint64 delay = qMin<qint64>(300000, 5000LL << qMin(failures - 1, 6));
+    delay += QRandomGenerator::global()->bounded(delay / 5 + 1);
+    if (failures == 1 || failures % 10 == 0) qWarning() << "Journal sync failed:" << lastError << "- retrying in" << delay / 1000 << "s";
+    timer.start(int(delay));
+}
+
+QString JournalSync::summary() const {
+    if (!enabled) return "disabled";
+    double ratio = rawBytes > 0 ? 100.0 * compressedBytes / rawBytes : 0;
+    return QString("%1 entries in %2 batches to %3, acked through %4, compressed to %5%, last success %6%7")
+        .arg(entriesSent).arg(batchesSent).arg(endpoint.host()).arg(acked).arg(ratio, 0, 'f', 0)
+        .arg(lastSuccess.isValid() ? lastSuccess.toString("HH:mm:ss") : "never")
+        .arg(failures > 0 ? QString(", %1 failures: %2").arg(failures).arg(lastError) : QString());
+}
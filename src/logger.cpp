@@ -0,0 +1,328 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/logger.h"
+#include "headers/perfregistry.h"
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QFileInfo>
+#include <QDir>
+#include <QTimeZone>
+#include <QDeadlineTimer>
+#include <cstdio>
+#include <cstring>
+
+Q_LOGGING_CATEGORY(lcErrors, "kiosk.errors")
+Q_LOGGING_CATEGORY(lcBambu, "kiosk.bambu")
+Q_LOGGING_CATEGORY(lcPrusa, "kiosk.prusa")
+Q_LOGGING_CATEGORY(lcOctoprint, "kiosk.octoprint")
+
+void Logger::install() {
+    if (writer != nullptr) return;
+    for (int i = 0; i < CAPACITY; i++) ring[i].sequence.store(i, std::memory_order_relaxed);
+    coarseMs.store(QDateTime::currentMSecsSinceEpoch(), std::memory_order_relaxed);
+    filePath = QDir(QCoreApplication::applicationDirPath()).filePath("logs/kiosk.jsonl");
+    running = true;
+    reopen = true;
+    writer = QThread::create([]() { run(); });
+    writer->setObjectName("Logger");
+    writer->start(QThread::LowPriority);
+    previousHandler = qInstallMessageHandler(handleMessage);
+    previousFilter = QLoggingCategory::installFilter(filter);
+}
+
+void Logger::loadConfig(QJsonObject cfg) {
+    {
+        QMutexLocker locker(&configLock);
+        if (cfg.contains("file")) {
+            QString path = cfg.value("file").toString();
+            filePath = QDir::isRelativePath(path) ? QDir(QCoreApplication::applicationDirPath()).filePath(path) : path;
+        }
+        maxBytes = qMax(1, cfg.value("maxMegabytes").toInt(10)) * 1024LL * 1024LL;
+        keepFiles = qBound(1, cfg.value("keepFiles").toInt(5), 100);
+        console = cfg.value("console").toBool(true);
+        defaultLevel = parseLevel(cfg.value("level").toString("debug"));
+        levels = defaultLevels;
+        QJsonObject categories = cfg.value("categories").toObject();
+        for (auto it = categories.constBegin(); it != categories.constEnd(); ++it) {
+            bool ok = false;
+            Level level = parseLevel(it.value().toString(), &ok);
+            if (ok) levels.insert(it.key().toUtf8(), level);
+        }
+    }
+    reopen = true;
+    applyLevels();
+}
+
+bool Logger::setLevel(const QString &category, const QString &level) {
+    bool ok = false;
+    Level parsed = parseLevel(level, &ok);
+    if (!ok) return false;
+    {
+        QMutexLocker locker(&configLock);
+        if (category == "default") defaultLevel = parsed;
+        else levels.insert(category.toUtf8(), parsed);
+    }
+    applyLevels();
+    return true;
+}
+
+void Logger::shutdown() {
+    if (writer == nullptr) return;
+    qInstallMessageHandler(previousHandler); //Anything logged during teardown goes to Qt's handler
+    running = false;
+    writer->wait();
+    delete writer;
+    writer = nullptr;
+}
+
+QStringList Logger::summary() {
+    QStringList lines;
+    QMutexLocker locker(&configLock);
+    lines.append(QString("Writing %1, rotated at %2 MB, %3 kept").arg(filePath).arg(maxBytes / 1024 / 1024).arg(keepFiles));
+    lines.append(QString("%1 written, %2 queued, %3 dropped since start").arg(written.load()).arg(enqueuePos.load() - written.load())
+                     .arg(PerfRegistry::counter("log.dropped")->get() + qint64(dropped.load())));
+    lines.append("default: " + levelName(defaultLevel));
+    QStringList named;
+    for (auto it = levels.constBegin(); it != levels.constEnd(); ++it) named.append(QString::fromUtf8(it.key()) + ": " + levelName(it.value()));
+    named.sort();
+    return lines + named;
+}
+
+QString Logger::levelName(Level level) {
+    switch (level) {
+    case Debug:
+        return "debug";
+    case Info:
+        return "info";
+    case Warning:
+        return "warning";
+    case Critical:
+        return "critical";
+    case Fatal:
+        return "fatal";
+    case Off:
+        return "off";
+    }
+    return "unknown";
+}
+
+Logger::Level Logger::parseLevel(const QString &name, bool* ok) {
+    static const QStringList names{"debug", "info", "warning", "critical", "fatal", "off"};
+    int index = int(names.indexOf(name.toLower()));
+    if (ok) *ok = index >= 0;
+    return index >= 0 ? Level(index) : Debug;
+}
+
+void Logger::filter(QLoggingCategory* category) {
+    if (previousFilter) previousFilter(category); //Qt's rules first, QT_LOGGING_RULES and the quiet qt.* categories
+    static const QtMsgType types[] = {QtDebugMsg, QtInfoMsg, QtWarningMsg, QtCriticalMsg};
+    static const Level typeLevels[] = {Debug, Info, Warning, Critical};
+    QMutexLocker locker(&configLock);
+    auto it = levels.constFind(QByteArray(category->categoryName()));
+    for (int i = 0; i < 4; i++) {
+        if (it != levels.constEnd()) category->setEnabled(types[i], typeLevels[i] >= it.value()); //Named categories are set outright
+        else category->setEnabled(types[i], category->isEnabled(types[i]) && typeLevels[i] >= defaultLevel);
+    }
+}
+
+void Logger::applyLevels() {
+    //Installing again runs the filter over every existing category
+    QLoggingCategory::CategoryFilter replaced = QLoggingCategory::installFilter(filter);
+    if (replaced != filter) previousFilter = replaced;
+}
+
+void Logger::handleMessage(QtMsgType type, const QMessageLogContext &context, const QString &message) {
+    Level level = Debug;
+    switch (type) {
+    case QtDebugMsg:
+        level = Debug;
+        break;
+    case QtInfoMsg:
+        level = Info;
+        break;
+    case QtWarningMsg:
+        level = Warning;
+        break;
+    case QtCriticalMsg:
+        level = Critical;
+        break;
+    case QtFatalMsg:
+        level = Fatal;
+        break;
+    }
+    bool queued = push(level, context.category ? context.category : "default", message, context);
+    if (level != Fatal) return;
+
+    //Qt aborts once this returns, give the writer a moment to get the message on disk
+    quint64 mine = enqueuePos.load(std::memory_order_acquire);
+    QDeadlineTimer deadline(2000);
+    while (queued && running && written.load(std::memory_order_acquire) < mine && !deadline.hasExpired()) QThread::msleep(5);
+    if (!queued || !running) fprintf(stderr, "FATAL %s\n", qPrintable(message));
+}
+
+bool Logger::push(Level level, const char* category, const QString &message, const QMessageLogContext &context) {
+    //Bounded multi producer ring: each slot's sequence says whose turn it is, so producers only race on the enqueue counter
+    quint64 pos = enqueuePos.load(std::memory_order_relaxed);
+    Slot* slot = nullptr;
+    for (;;) {
+        slot = &ring[pos & (CAPACITY - 1)];
+        quint64 sequence = slot->sequence.load(std::memory_order_acquire);
+        qint64 diff = qint64(sequence) - qint64(pos);
+        if (diff == 0) {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            dropped.fetch_add(1, std::memory_order_relaxed); //Full, the caller never waits for the disk
+            return false;
+        } else {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+    Record &r = slot->record;
+    r.timeMs = coarseMs.load(std::memory_order_relaxed);
+    r.level = level;
+    qstrncpy(r.category, category, sizeof(r.category));
+    r.message = message; //Shares the string, no copy
+    r.file = context.file;
+    r.line = context.line;
+    r.thread = quintptr(QThread::currentThreadId());
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+void Logger::run() {
+    while (true) {
+        coarseMs.store(QDateTime::currentMSecsSinceEpoch(), std::memory_order_relaxed);
+        if (reopen.exchange(false)) openFile();
+        int count = drain();
+        quint64 lost = dropped.exchange(0, std::memory_order_relaxed);
+        if (lost > 0) {
+            static PerfCounter* droppedCounter = PerfRegistry::counter("log.dropped");
+            droppedCounter->add(qint64(lost));
+            Record note;
+            note.timeMs = coarseMs.load(std::memory_order_relaxed);
+            note.level = Warning;
+            qstrncpy(note.category, "kiosk.logger", sizeof(note.category));
+            note.message = QString("%1 messages dropped, the log ring was full").arg(lost);
+            write(note);
+        }
+        if (count > 0 || lost > 0) {
+            if (file) file->flush();
+            continue; //Keep going while there is a backlog
+        }
+        if (!running) break;
+        QThread::msleep(10);
+    }
+    drain();
+    if (file) {
+        file->close();
+        delete file;
+        file = nullptr;
+    }
+}
+
+int Logger::drain() {
+    static PerfCounter* writtenCounter = PerfRegistry::counter("log.written");
+    int count = 0;
+    while (count < CAPACITY) { //One lap at most, so the clock and flags are refreshed during a flood
+        Slot &slot = ring[dequeuePos & (CAPACITY - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != dequeuePos + 1) break;
+        Record record = std::move(slot.record);
+        slot.sequence.store(dequeuePos + CAPACITY, std::memory_order_release);
+        dequeuePos++;
+        write(record);
+        written.fetch_add(1, std::memory_order_release);
+        count++;
+    }
+    if (count > 0) writtenCounter->add(count);
+    return count;
+}
+
+QString Logger::timestamp(qint64 ms) {
+    //Formatting a date is the slow part, the text is reused until the second changes
+    qint64 second = ms / 1000;
+    if (second != cachedSecond) {
+        cachedSecond = second;
+        cachedPrefix = QDateTime::fromSecsSinceEpoch(second, QTimeZone::UTC).toString("yyyy-MM-ddThh:mm:ss");
+    }
+    return cachedPrefix + QString(".%1Z").arg(ms % 1000, 3, 10, QChar('0'));
+}
+
+void Logger::write(const Record &record) {
+    QString ts = timestamp(record.timeMs);
+    QJsonObject line{
+        {"ts", ts},
+        {"level", levelName(record.level)},
+        {"cat", QString::fromLatin1(record.category)},
+        {"msg", record.message},
+        {"thread", QString::number(record.thread, 16)}
+    };
+    if (record.file) line.insert("src", QString("%1:%2").arg(QFileInfo(QString::fromUtf8(record.file)).fileName()).arg(record.line));
+    QByteArray json = QJsonDocument(line).toJson(QJsonDocument::Compact);
+    json.append('\n');
+
+    bool echo = false;
+    qint64 limit = 0;
+    {
+        QMutexLocker locker(&configLock);
+        echo = console;
+        limit = maxBytes;
+    }
+    if (echo) {
+        fprintf(stderr, "%s %s [%s] %s\n", qPrintable(ts), qPrintable(levelName(record.level).toUpper()), record.category, qPrintable(record.message));
+        if (record.level >= Warning) fflush(stderr);
+    }
+    if (file == nullptr) return;
+    if (fileBytes + json.size() > limit && fileBytes > 0) rotate();
+    if (file == nullptr) return;
+    file->write(json);
+    fileBytes += json.size();
+}
+
+void Logger::openFile() {
+    QString path;
+    {
+        QMutexLocker locker(&configLock);
+        path = filePath;
+    }
+    if (file && file->fileName() == path) return;
+    if (file) {
+        file->close();
+        delete file;
+    }
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    file = new QFile(path);
+    if (!file->open(QIODevice::WriteOnly | QIODevice::Append)) {
+        fprintf(stderr, "Logger: unable to open %s: %s\n", qPrintable(path), qPrintable(file->errorString()));
+        delete file;
+        file = nullptr;
+        return;
+    }
+    fileBytes = file->size();
+}
+
+void Logger::rotate() {
+    //kiosk.jsonl becomes kiosk.1.jsonl, the oldest file past the limit is deleted
+    int keep = 5;
+    {
+        QMutexLocker locker(&configLock);
+        keep = keepFiles;
+    }
+    QFileInfo info(file->fileName());
+    QString stem = info.absolutePath() + "/" + info.completeBaseName();
+    QString suffix = info.suffix().isEmpty() ? QString() : "." + info.suffix();
+    file->close();
+    QFile::remove(stem + "." + QString::number(keep) + suffix);
+    for (int i = keep - 1; i >= 1; i--) QFile::rename(stem + "." + QString::number(i) + suffix, stem + "." + QString::number(i + 1) + suffix);
+    QFile::rename(info.absoluteFilePath(), stem + ".1" + suffix);
+    fileBytes = 0;
+    if (!file->open(QIODevice::WriteOnly | QIODevice::Append)) {
+        fprintf(stderr, "Logger: unable to reopen %s after rotation\n", qPrintable(info.absoluteFilePath()));
+        delete file;
+        file = nullptr;
+    }
+}
@@ -22,8 +22,17 @@ void LTx2A::start() {
         scanned.enqueue(data); //Add the card id to queue
         emit cardScanned(); //Emit the cardScanned event (called a signal in QT)
     });
-    QObject::connect(worker, &SerialWorker::errorOccurred, [](const QString &error) {
+    QObject::connect(worker, &SerialWorker::errorOccurred, this, [this](const QString &error) {
         qWarning() << "Serial Error Occurred: " << error; //Print error
+        if (!readyReported) { //Failed before the port opened
+            readyReported = true;
+            emit readerReady(false);
+        }
+    });
+    QObject::connect(worker, &SerialWorker::opened, this, [this]() {
+        if (readyReported) return;
+        readyReported = true;
+        emit readerReady(true);
     });
     thread->start(); //Run the thread
 }
@@ -89,10 +98,13 @@ void SerialWorker::start() {
 
     if (!serial->open(QIODevice::ReadOnly)) { //Open serial connection as read only
         emit errorOccurred(serial->errorString()); //Handle error opening connection
+        return;
     }
+    emit opened();
 }
 
 void SerialWorker::stop() {
+    if (serial == nullptr) return; //Port was never found
     serial->close(); //End serial connection
 }
 
@@ -15,6 +15,9 @@
 #include <QQuickWindow>
 #include <QFile>
 #include <QDir>
+#include "headers/startuppipeline.h"
+#include "headers/logger.h"
+#include "headers/errorhandler.hpp"
 
 //Atyrnal 10/29/2025
 
@@ -41,48 +44,7 @@ QJsonObject readJsonFile(const QString &filepath, quint64 maxSize = 0) {
     return obj;
 }
 
-int main(int argc, char *argv[])
-{
-    QGuiApplication app(argc, argv); //Create a QT gui app
-
-    rfidReader.start(); //Initialize the RFID reader
-    QObject::connect(&app, &QCoreApplication::aboutToQuit, &rfidReader, &LTx2A::stop); //Connect the aboutToQuit app event to the rfidReader's stop function
-
-    QQmlApplicationEngine engine; //Qt engine creation
-    QObject::connect( //Exit if object creation fails
-        &engine,
-        &QQmlApplicationEngine::objectCreationFailed,
-        &app,
-        []() { QCoreApplication::exit(-1); },
-        Qt::QueuedConnection);
-
-    QTBackend bk(&engine);
-    engine.loadFromModule("PCMakerspace3DPKiosk", "Main"); //Load the QML Main.qml declarative ui file
-
-    QObject* root = engine.rootObjects().at(0); //Get the root object (in this case the Window)
-    bk.setRoot(root);
-
-
-    QJsonObject config = readJsonFile(QDir(QCoreApplication::applicationDirPath()).filePath("debug_configuration.json"), 1000000);
-    if (config.value("_error").toString("should never happen") != "false") {
-        qCritical() << config.value("_error").toString("Error: Parsed JSON object missing error status specifier");
-    } else {
-        bk.loadConfig(config);
-    }
-
-
-    QQuickWindow* window = qobject_cast<QQuickWindow*>(root); //Cast to QWindow
-    QIcon icon = QIcon("PCMakerspace3DPKiosk/resources/PC-Logo.ico");
-    window->setIcon(icon); //Set window icon
-
-    //runs when RFID card is scanned successfully
-    QObject::connect(&rfidReader, &LTx2A::cardScanned, &bk, [&bk]() { //Connect the rfidReader cardScanned event to the lambda
-        if (rfidReader.hasNext()) { //If the cards scanned queue is not empty
-            QString cardid = rfidReader.getNext().id.replace("\"", "").trimmed();
-            bk.cardScanned(cardid);
-        }
-    });
-
+void initDemoDatabase(QTBackend &bk) {
     QSqlQuery query2("DROP TABLE users"); //Demo stuff
 
     QSqlQuery query("CREATE TABLE IF NOT EXISTS users (" //Demo Stuff
@@ -133,6 +95,94 @@ int main(int argc, char *argv[])
 
     auto result = bk.queryDatabase("SELECT firstName FROM users WHERE id = :id LIMIT 1", QMap<QString, QVariant>{{":id", "09936544703440683676"}});
     qDebug() << result;
+}
+
+int main(int argc, char *argv[])
+{
+    QGuiApplication app(argc, argv); //Create a QT gui app
+    Logger::install(); //Before anything logs, the config can move the file once it is read
+
+    QObject::connect(&app, &QCoreApplication::aboutToQuit, &rfidReader, &LTx2A::stop); //Connect the aboutToQuit app event to the rfidReader's stop function
+
+    QQmlApplicationEngine engine; //Qt engine creation
+    QObject::connect( //Exit if object creation fails
+        &engine,
+        &QQmlApplicationEngine::objectCreationFailed,
+        &app,
+        []() { QCoreApplication::exit(-1); },
+        Qt::QueuedConnection);
+
+    QTBackend bk(&engine);
+    QJsonObject config;
+
+    //Startup stages run as soon as their dependencies finish, the UI goes idle before printers are online
+    StartupPipeline startup;
+
+    startup.addStage("database", {}, [&bk]() {
+        if (!bk.openDatabase()) return;
+        initDemoDatabase(bk);
+        ErrorHandler::softHandle(bk.migrateJournal()); //The demo users table was just recreated without its trigger
+    });
+
+    startup.addStage("qml", {}, [&engine, &bk]() {
+        engine.loadFromModule("PCMakerspace3DPKiosk", "Main"); //Load the QML Main.qml declarative ui file
+        if (engine.rootObjects().isEmpty()) return;
+
+        QObject* root = engine.rootObjects().at(0); //Get the root object (in this case the Window)
+        bk.setRoot(root);
+        root->setProperty("appstate", AppState::Loading); //Spinner until the interactive barrier is reached
+
+        QQuickWindow* window = qobject_cast<QQuickWindow*>(root); //Cast to QWindow
+        QIcon icon = QIcon("PCMakerspace3DPKiosk/resources/PC-Logo.ico");
+        window->setIcon(icon); //Set window icon
+    });
+
+    startup.addWorkerStage("config", {}, [&config]() {
+        config = readJsonFile(QDir(QCoreApplication::applicationDirPath()).filePath("debug_configuration.json"), 1000000);
+    });
+
+    startup.addAsyncStage("serial", {}, [](StartupPipeline::Done done) {
+        QObject::connect(&rfidReader, &LTx2A::readerReady, &rfidReader, [done](bool ok) {
+            if (!ok) qWarning() << "RFID reader unavailable, card scans disabled";
+            done();
+        }, Qt::SingleShotConnection);
+        rfidReader.start(); //Initialize the RFID reader, port enumeration happens on the reader's thread
+    });
+
+    startup.addStage("cardReader", {"database", "qml"}, [&bk]() {
+        //runs when RFID card is scanned successfully
+        QObject::connect(&rfidReader, &LTx2A::cardScanned, &bk, [&bk]() { //Connect the rfidReader cardScanned event to the lambda
+            if (rfidReader.hasNext()) { //If the cards scanned queue is not empty
+                QString cardid = rfidReader.getNext().id.replace("\"", "").trimmed();
+                bk.cardScanned(cardid);
+            }
+        });
+    });
+
+    startup.addStage("printers", {"config", "qml"}, [&bk, &config]() {
+        if (config.value("_error").toString("should never happen") != "false") {
+            qCritical() << config.value("_error").toString("Error: Parsed JSON object missing error status specifier");
+        } else {
+            bk.loadConfig(config);
+        }
+    });
+
+    startup.addAsyncStage("printerConnections", {"printers"}, [&bk](StartupPipeline::Done done) {
+        QObject::connect(bk.printerManager(), &PrinterManager::printersConnected, bk.printerManager(), [done](int online, int total) {
+            qInfo() << online << "of" << total << "printers connected";
+            done();
+        }, Qt::SingleShotConnection);
+        bk.printerManager()->connectPrinters();
+    });
+
+    startup.addBarrier("interactive", {"database", "qml", "cardReader"});
+    QObject::connect(&startup, &StartupPipeline::barrierReached, &bk, [&bk](const QString &name) {
+        if (name == "interactive") bk.setIdle();
+    });
+
+    startup.start();
 
-    return app.exec(); //run the app
+    int code = app.exec(); //run the app
+    Logger::shutdown();
+    return code;
 }
@@ -0,0 +1,149 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/metricsserver.h"
+#include "headers/perfregistry.h"
+#include <QHttpServerRequest>
+#include <QHttpServerResponse>
+#include <QRegularExpression>
+#include <QMap>
+#include <QDebug>
+#include <cmath>
+
+MetricsServer::MetricsServer(PrinterManager* pm, QObject* parent) : QObject(parent), pm(pm) {
+    server.route("/metrics", QHttpServerRequest::Method::Get, this, [this]() {
+        return QHttpServerResponse("text/plain; version=0.0.4; charset=utf-8", render());
+    });
+}
+
+void MetricsServer::loadConfig(QJsonObject cfg) {
+    //Loopback unless configured, set "address" to 0.0.0.0 for a scraper on another machine
+    int port = cfg.value("port").toInt(9105);
+    if (tcp != nullptr || port <= 0 || !cfg.value("enabled").toBool(true)) return;
+    QHostAddress address(cfg.value("address").toString("127.0.0.1"));
+    if (address.isNull()) {
+        qWarning() << "Metrics: invalid address" << cfg.value("address").toString();
+        return;
+    }
+    listen(address, quint16(port));
+}
+
+bool MetricsServer::listen(const QHostAddress &address, quint16 port) {
+    tcp = new QTcpServer(this);
+    if (!tcp->listen(address, port) || !server.bind(tcp)) {
+        qWarning() << "Metrics: could not listen on port" << port << tcp->errorString();
+        tcp->deleteLater();
+        tcp = nullptr;
+        return false;
+    }
+    qInfo() << "Metrics on" << address.toString() + ":" + QString::number(tcp->serverPort()) + "/metrics";
+    return true;
+}
+
+quint16 MetricsServer::port() const {
+    return tcp ? tcp->serverPort() : 0;
+}
+
+QString MetricsServer::metricName(const QString &registryName) {
+    static const QRegularExpression invalid("[^a-zA-Z0-9_]");
+    return "kiosk_" + QString(registryName).replace(invalid, "_");
+}
+
+QString MetricsServer::label(const QString &value) {
+    QString escaped = value;
+    escaped.replace("\\", "\\\\").replace("\"", "\\\"").replace("\n", "\\n");
+    return "\"" + escaped + "\"";
+}
+
+QString MetricsServer::number(double value) {
+    if (std::isinf(value)) return value > 0 ? "+Inf" : "-Inf";
+    return QString::number(value, 'g', 12);
+}
+
+QByteArray MetricsServer::render() const {
+    QString out;
+    out.reserve(32 * 1024);
+    renderRegistry(out);
+    renderFleet(out);
+    return out.toUtf8();
+}
+
+void MetricsServer::renderRegistry(QString &out) const {
+    //Latency histograms, bucket edges on powers of two are exact edges of the registry's log-linear buckets
+    for (const LatencyHistogram::Snapshot &s : PerfRegistry::histograms()) {
+        QString name = metricName(s.name) + "_seconds";
+        out += "# HELP " + name + " Latency of " + s.name + "\n";
+        out += "# TYPE " + name + " histogram\n";
+        quint64 cumulative = 0;
+        int next = 0;
+        for (int power = 7; power <= 26; power++) { //128 us to about 67 s
+            int edge = (power - LatencyHistogram::SUB_BITS + 1) * (1 << LatencyHistogram::SUB_BITS); //First bucket starting at 2^power us
+            for (; next < edge && next < s.buckets.size(); next++) cumulative += s.buckets[next];
+            out += name + "_bucket{le=" + label(number(double(1LL << power) / 1e6)) + "} " + QString::number(cumulative) + "\n";
+        }
+        out += name + "_bucket{le=\"+Inf\"} " + QString::number(s.count) + "\n";
+        out += name + "_sum " + number(double(s.sumUs) / 1e6) + "\n";
+        out += name + "_count " + QString::number(s.count) + "\n";
+    }
+
+    //Counters, and a hit ratio for every pair named like "<cache>_hits" and "<cache>_misses"
+    QList<QPair<QString, qint64>> counters = PerfRegistry::counters();
+    QMap<QString, qint64> hits;
+    QMap<QString, qint64> misses;
+    for (const QPair<QString, qint64> &c : counters) {
+        QString name = metricName(c.first) + "_total";
+        out += "# TYPE " + name + " counter\n";
+        out += name + " " + QString::number(c.second) + "\n";
+        if (c.first.endsWith("_hits")) hits.insert(c.first.chopped(5), c.second);
+        else if (c.first.endsWith("_misses")) misses.insert(c.first.chopped(7), c.second);
+    }
+    out += "# HELP kiosk_cache_hit_ratio Hits over lookups since start or the last perf reset\n";
+    out += "# TYPE kiosk_cache_hit_ratio gauge\n";
+    for (auto it = hits.constBegin(); it != hits.constEnd(); ++it) {
+        qint64 lookups = it.value() + misses.value(it.key());
+        double ratio = lookups > 0 ? double(it.value()) / lookups : 0;
+        out += "kiosk_cache_hit_ratio{cache=" + label(metricName(it.key()).mid(6)) + "} " + number(ratio) + "\n";
+    }
+}
+
+void MetricsServer::renderFleet(QString &out) const {
+    //Scrapes are served on the interface thread, so printer state is read directly
+    const QList<HealthState> states{HealthState::Connecting, HealthState::Online, HealthState::Degraded, HealthState::Offline};
+    QString state = "# HELP kiosk_printer_state Connection health, 1 for the current state\n# TYPE kiosk_printer_state gauge\n";
+    QString busy = "# HELP kiosk_printer_busy 1 while the printer is printing or preparing\n# TYPE kiosk_printer_busy gauge\n";
+    QString breaker = "# HELP kiosk_printer_breaker_open 1 while reconnects are suspended after repeated failures\n# TYPE kiosk_printer_breaker_open gauge\n";
+    for (quint32 id : pm->printerIds()) {
+        Printer* p = pm->getPrinter(id);
+        QString labels = "printer=" + label(p->getName()) + ",id=" + label(QString::number(id));
+        HealthState current = pm->supervisor()->state(id);
+        for (HealthState s : states) {
+            state += "kiosk_printer_state{" + labels + ",state=" + label(ConnectionSupervisor::stateName(s)) + "} " + (s == current ? "1" : "0") + "\n";
+        }
+        busy += "kiosk_printer_busy{" + labels + "} " + (p->isIdle() ? "0" : "1") + "\n";
+        breaker += "kiosk_printer_breaker_open{" + labels + "} " + (pm->supervisor()->isBreakerOpen(id) ? "1" : "0") + "\n";
+    }
+    out += state + busy + breaker;
+
+    int running = 0;
+    int waiting = 0;
+    qint64 runningBytes = 0;
+    qint64 waitingBytes = 0;
+    for (const TransferScheduler::Status &t : pm->transferScheduler()->snapshot()) {
+        if (t.running) {
+            running++;
+            runningBytes += t.bytes;
+        } else {
+            waiting++;
+            waitingBytes += t.bytes;
+        }
+    }
+    out += "# HELP kiosk_transfer_queue_depth Printer uploads by scheduler state\n# TYPE kiosk_transfer_queue_depth gauge\n";
+    out += "kiosk_transfer_queue_depth{state=\"running\"} " + QString::number(running) + "\n";
+    out += "kiosk_transfer_queue_depth{state=\"waiting\"} " + QString::number(waiting) + "\n";
+    out += "# HELP kiosk_transfer_queue_bytes Size of the printer uploads by scheduler state\n# TYPE kiosk_transfer_queue_bytes gauge\n";
+    out += "kiosk_transfer_queue_bytes{state=\"running\"} " + QString::number(runningBytes) + "\n";
+    out += "kiosk_transfer_queue_bytes{state=\"waiting\"} " + QString::number(waitingBytes) + "\n";
+}
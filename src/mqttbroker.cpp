@@ -0,0 +1,487 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/mqttbroker.h"
+#include <QSslServer>
+#include <QDateTime>
+#include <QUuid>
+#include <QDebug>
+
+//MQTT 3.1.1 control packet types (upper nibble of the fixed header)
+static const quint8 MQTT_CONNECT = 1;
+static const quint8 MQTT_PUBLISH = 3;
+static const quint8 MQTT_PUBACK = 4;
+static const quint8 MQTT_PUBREL = 6;
+static const quint8 MQTT_SUBSCRIBE = 8;
+static const quint8 MQTT_UNSUBSCRIBE = 10;
+static const quint8 MQTT_PINGREQ = 12;
+static const quint8 MQTT_DISCONNECT = 14;
+
+static const int MAX_PACKET_SIZE = 4 * 1024 * 1024;
+//Any authenticated client can retain, a misbehaving one must not grow the kiosk's memory without limit
+static const int MAX_RETAINED_TOPICS = 1024;
+static const qint64 MAX_RETAINED_BYTES = 16 * 1024 * 1024;
+
+static quint16 readU16(const QByteArray &b, int p) {
+    return (quint16(quint8(b[p])) << 8) | quint8(b[p + 1]);
+}
+
+static bool readMqttString(const QByteArray &body, int &p, QByteArray &out) {
+    if (p + 2 > body.size()) return false;
+    int len = readU16(body, p);
+    p += 2;
+    if (p + len > body.size()) return false;
+    out = body.mid(p, len);
+    p += len;
+    return true;
+}
+
+static bool validFilter(const QString &filter) {
+    if (filter.isEmpty()) return false;
+    QStringList levels = filter.split('/');
+    for (int i = 0; i < levels.size(); i++) {
+        const QString &l = levels[i];
+        if (l.contains('#') && (l != "#" || i != levels.size() - 1)) return false;
+        if (l.contains('+') && l != "+") return false;
+    }
+    return true;
+}
+
+MqttBroker::MqttBroker(QObject* parent) : QObject(parent) {
+    sessionTimer.setInterval(5000);
+    connect(&sessionTimer, &QTimer::timeout, this, &MqttBroker::checkSessions);
+}
+
+MqttBroker::~MqttBroker() {
+    close();
+}
+
+bool MqttBroker::listen(const QHostAddress &address, quint16 port) {
+    close();
+    server = new QTcpServer(this);
+    connect(server, &QTcpServer::pendingConnectionAvailable, this, &MqttBroker::acceptConnections);
+    if (!server->listen(address, port)) {
+        qCritical() << "MQTT broker failed to listen on port" << port << server->errorString();
+        return false;
+    }
+    sessionTimer.start();
+    return true;
+}
+
+bool MqttBroker::listenEncrypted(const QHostAddress &address, quint16 port, const QSslConfiguration &sslConfig) {
+    close();
+    QSslServer* sslServer = new QSslServer(this);
+    sslServer->setSslConfiguration(sslConfig);
+    connect(sslServer, &QSslServer::errorOccurred, this, [](QSslSocket*, QAbstractSocket::SocketError error) {
+        qWarning() << "MQTT broker TLS error:" << error;
+    });
+    server = sslServer;
+    connect(server, &QTcpServer::pendingConnectionAvailable, this, &MqttBroker::acceptConnections); //Emitted after the TLS handshake
+    if (!server->listen(address, port)) {
+        qCritical() << "MQTT broker failed to listen on port" << port << server->errorString();
+        return false;
+    }
+    sessionTimer.start();
+    return true;
+}
+
+void MqttBroker::close() {
+    sessionTimer.stop();
+    const QList<Session*> open = sessions;
+    for (Session* s : open) dropClient(s, true);
+    if (server != nullptr) {
+        server->close();
+        server->deleteLater();
+        server = nullptr;
+    }
+}
+
+void MqttBroker::setAuthenticator(std::function<bool(const QString &, const QString &, const QString &)> auth) {
+    authenticator = auth;
+}
+
+int MqttBroker::clientCount() const {
+    return sessions.size();
+}
+
+void MqttBroker::acceptConnections() {
+    while (server->hasPendingConnections()) {
+        QTcpSocket* socket = server->nextPendingConnection();
+        Session* s = new Session();
+        s->socket = socket;
+        s->lastActivity = QDateTime::currentMSecsSinceEpoch();
+        sessions.append(s);
+        connect(socket, &QTcpSocket::readyRead, this, [this, s]() { readClient(s); });
+        connect(socket, &QTcpSocket::disconnected, this, [this, s]() { dropClient(s, false); });
+    }
+}
+
+void MqttBroker::readClient(Session* s) {
+    s->buffer.append(s->socket->readAll());
+    s->lastActivity = QDateTime::currentMSecsSinceEpoch();
+    while (s->buffer.size() >= 2) {
+        //Decode the variable length "remaining length" field
+        qint64 length = 0;
+        qint64 multiplier = 1;
+        int pos = 1;
+        quint8 byte = 0;
+        do {
+            if (pos >= s->buffer.size()) return; //Need more data
+            if (pos > 4) return dropClient(s, false); //Malformed length
+            byte = quint8(s->buffer[pos++]);
+            length += (byte & 0x7F) * multiplier;
+            multiplier *= 128;
+        } while (byte & 0x80);
+        if (length > MAX_PACKET_SIZE) return dropClient(s, false);
+        if (s->buffer.size() < pos + length) return;
+
+        quint8 header = quint8(s->buffer[0]);
+        QByteArray body = s->buffer.mid(pos, length);
+        s->buffer.remove(0, pos + length);
+        if (!handlePacket(s, header, body)) return; //Session was dropped
+    }
+}
+
+bool MqttBroker::handlePacket(Session* s, quint8 header, const QByteArray &body) {
+    quint8 type = header >> 4;
+    if (!s->connected && type != MQTT_CONNECT) { //First packet must be CONNECT
+        dropClient(s, false);
+        return false;
+    }
+    switch (type) {
+    case MQTT_CONNECT:
+        if (s->connected || !handleConnect(s, body)) {
+            dropClient(s, false);
+            return false;
+        }
+        return true;
+    case MQTT_PUBLISH:
+        handlePublish(s, header, body);
+        return true;
+    case MQTT_PUBACK:
+        if (body.size() >= 2) {
+            quint16 id = readU16(body, 0);
+            s->inflight.remove(id);
+            s->inflightSentAt.remove(id);
+        }
+        return true;
+    case MQTT_PUBREL: //Second half of an incoming QoS 2 handshake
+        if (body.size() >= 2) s->socket->write(encodePacket(0x70, body.left(2)));
+        return true;
+    case MQTT_SUBSCRIBE:
+        handleSubscribe(s, body);
+        return true;
+    case MQTT_UNSUBSCRIBE:
+        handleUnsubscribe(s, body);
+        return true;
+    case MQTT_PINGREQ:
+        s->socket->write(QByteArray::fromHex("d000"));
+        return true;
+    case MQTT_DISCONNECT:
+        dropClient(s, true);
+        return false;
+    default:
+        dropClient(s, false);
+        return false;
+    }
+}
+
+bool MqttBroker::handleConnect(Session* s, const QByteArray &body) {
+    int p = 0;
+    QByteArray protocol;
+    if (!readMqttString(body, p, protocol)) return false;
+    if (p + 4 > body.size()) return false;
+    quint8 level = quint8(body[p]);
+    quint8 flags = quint8(body[p + 1]);
+    s->keepAlive = readU16(body, p + 2);
+    p += 4;
+    if (protocol != "MQTT" && protocol != "MQIsdp") return false;
+    if (level != 4 && level != 3) {
+        s->socket->write(QByteArray::fromHex("20020001")); //Unacceptable protocol version
+        return false;
+    }
+
+    QByteArray clientId, willTopic, willMessage, username, password;
+    if (!readMqttString(body, p, clientId)) return false;
+    if (flags & 0x04) {
+        if (!readMqttString(body, p, willTopic) || !readMqttString(body, p, willMessage)) return false;
+        s->willTopic = QString::fromUtf8(willTopic);
+        s->willMessage = willMessage;
+        s->willQos = qMin((flags >> 3) & 0x03, 1);
+        s->willRetain = flags & 0x20;
+    }
+    if ((flags & 0x80) && !readMqttString(body, p, username)) return false;
+    if ((flags & 0x40) && !readMqttString(body, p, password)) return false;
+
+    s->clientId = clientId.isEmpty() ? QUuid::createUuid().toString(QUuid::WithoutBraces) : QString::fromUtf8(clientId);
+    if (authenticator && !authenticator(s->clientId, QString::fromUtf8(username), QString::fromUtf8(password))) {
+        s->socket->write(QByteArray::fromHex("20020005")); //Not authorized
+        return false;
+    }
+
+    //A reconnecting client takes over its old session
+    const QList<Session*> open = sessions;
+    for (Session* other : open) {
+        if (other != s && other->connected && other->clientId == s->clientId) dropClient(other, false);
+    }
+
+    s->connected = true;
+    s->socket->write(QByteArray::fromHex("20020000"));
+    emit clientConnected(s->clientId);
+    return true;
+}
+
+void MqttBroker::handlePublish(Session* s, quint8 header, const QByteArray &body) {
+    quint8 qos = (header >> 1) & 0x03;
+    bool retain = header & 0x01;
+    int p = 0;
+    QByteArray topic;
+    if (!readMqttString(body, p, topic)) return;
+    if (qos > 0) {
+        if (p + 2 > body.size()) return;
+        QByteArray id = body.mid(p, 2);
+        p += 2;
+        s->socket->write(encodePacket(qos == 1 ? 0x40 : 0x50, id)); //PUBACK or PUBREC
+    }
+    QString topicName = QString::fromUtf8(topic);
+    if (topicName.contains('+') || topicName.contains('#')) return;
+    route(topicName, body.mid(p), qMin<quint8>(qos, 1), retain);
+}
+
+void MqttBroker::handleSubscribe(Session* s, const QByteArray &body) {
+    if (body.size() < 2) return;
+    QByteArray ack = body.left(2);
+    QStringList granted;
+    int p = 2;
+    while (p < body.size()) {
+        QByteArray filter;
+        if (!readMqttString(body, p, filter) || p >= body.size()) break;
+        quint8 qos = qMin<quint8>(quint8(body[p++]) & 0x03, 1);
+        QString f = QString::fromUtf8(filter);
+        if (!validFilter(f)) {
+            ack.append(char(0x80));
+            continue;
+        }
+        insertFilter(f, s, qos, 0);
+        if (!s->filters.contains(f)) s->filters.append(f);
+        ack.append(char(qos));
+        granted.append(f);
+    }
+    s->socket->write(encodePacket(0x90, ack));
+
+    //Send matching retained messages with the retain flag set
+    for (auto it = retained.constBegin(); it != retained.constEnd(); ++it) {
+        for (const QString &f : std::as_const(granted)) {
+            if (topicMatches(f, it.key())) {
+                deliver(s, it.key(), it.value(), 0, true);
+                break;
+            }
+        }
+    }
+}
+
+void MqttBroker::handleUnsubscribe(Session* s, const QByteArray &body) {
+    if (body.size() < 2) return;
+    int p = 2;
+    while (p < body.size()) {
+        QByteArray filter;
+        if (!readMqttString(body, p, filter)) break;
+        QString f = QString::fromUtf8(filter);
+        removeFilter(f, s, 0);
+        s->filters.removeAll(f);
+    }
+    s->socket->write(encodePacket(0xB0, body.left(2)));
+}
+
+void MqttBroker::dropClient(Session* s, bool graceful) {
+    if (!sessions.contains(s)) return;
+    sessions.removeAll(s);
+    for (const QString &f : std::as_const(s->filters)) removeFilter(f, s, 0);
+    s->socket->disconnect(this);
+    if (s->socket->state() != QAbstractSocket::UnconnectedState) s->socket->abort();
+    s->socket->deleteLater();
+    if (s->connected) {
+        if (!graceful && !s->willTopic.isEmpty()) route(s->willTopic, s->willMessage, s->willQos, s->willRetain);
+        emit clientDisconnected(s->clientId);
+    }
+    delete s;
+}
+
+void MqttBroker::publish(const QString &topic, const QByteArray &payload, quint8 qos, bool retain) {
+    route(topic, payload, qMin<quint8>(qos, 1), retain);
+}
+
+quint64 MqttBroker::subscribe(const QString &filter, LocalHandler handler) {
+    if (!validFilter(filter)) return 0;
+    quint64 id = nextHandler++;
+    handlers.insert(id, handler);
+    handlerFilters.insert(id, filter);
+    insertFilter(filter, nullptr, 0, id);
+    const QMap<QString, QByteArray> snapshot = retained;
+    for (auto it = snapshot.constBegin(); it != snapshot.constEnd(); ++it) {
+        if (topicMatches(filter, it.key())) handler(it.key(), it.value());
+    }
+    return id;
+}
+
+void MqttBroker::unsubscribe(quint64 handle) {
+    if (!handlers.contains(handle)) return;
+    removeFilter(handlerFilters.take(handle), nullptr, handle);
+    handlers.remove(handle);
+}
+
+void MqttBroker::route(const QString &topic, const QByteArray &payload, quint8 qos, bool retain) {
+    if (retain) {
+        qint64 previous = retained.value(topic).size();
+        if (payload.isEmpty()) {
+            retained.remove(topic);
+            retainedBytes -= previous;
+        } else if ((!retained.contains(topic) && retained.size() >= MAX_RETAINED_TOPICS) || retainedBytes - previous + payload.size() > MAX_RETAINED_BYTES) {
+            qWarning() << "MQTT broker retained store is full, delivering" << topic << "without retaining it";
+        } else {
+            retained.insert(topic, payload);
+            retainedBytes += payload.size() - previous;
+        }
+    }
+    QHash<Session*, quint8> targets;
+    QList<quint64> local;
+    collect(&root, topic.split('/'), 0, targets, local);
+    for (auto it = targets.constBegin(); it != targets.constEnd(); ++it) {
+        deliver(it.key(), topic, payload, qMin(qos, it.value()), false);
+    }
+    for (quint64 id : std::as_const(local)) {
+        if (handlers.contains(id)) handlers.value(id)(topic, payload); //Handler may unsubscribe others, look it up each time
+    }
+}
+
+void MqttBroker::collect(TrieNode* node, const QStringList &levels, int depth, QHash<Session*, quint8> &targets, QList<quint64> &local) {
+    auto merge = [&targets, &local](TrieNode* n) {
+        for (auto it = n->sessions.constBegin(); it != n->sessions.constEnd(); ++it) {
+            targets[it.key()] = qMax(targets.value(it.key(), 0), it.value());
+        }
+        for (quint64 id : std::as_const(n->localHandlers)) {
+            if (!local.contains(id)) local.append(id);
+        }
+    };
+    if (depth == levels.size()) {
+        merge(node);
+        if (node->children.contains("#")) merge(node->children.value("#")); //"a/#" also matches "a"
+        return;
+    }
+    bool systemTopic = depth == 0 && levels[0].startsWith('$'); //Wildcards don't match $SYS style topics
+    if (!systemTopic) {
+        if (node->children.contains("#")) merge(node->children.value("#"));
+        if (node->children.contains("+")) collect(node->children.value("+"), levels, depth + 1, targets, local);
+    }
+    if (node->children.contains(levels[depth])) collect(node->children.value(levels[depth]), levels, depth + 1, targets, local);
+}
+
+void MqttBroker::insertFilter(const QString &filter, Session* s, quint8 qos, quint64 handler) {
+    TrieNode* node = &root;
+    const QStringList levels = filter.split('/');
+    for (const QString &level : levels) {
+        TrieNode* child = node->children.value(level, nullptr);
+        if (child == nullptr) {
+            child = new TrieNode();
+            node->children.insert(level, child);
+        }
+        node = child;
+    }
+    if (s != nullptr) node->sessions.insert(s, qos);
+    else if (!node->localHandlers.contains(handler)) node->localHandlers.append(handler);
+}
+
+void MqttBroker::removeFilter(const QString &filter, Session* s, quint64 handler) {
+    const QStringList levels = filter.split('/');
+    QList<TrieNode*> path{&root}; //Every node down to the filter's, for pruning on the way back up
+    for (const QString &level : levels) {
+        TrieNode* child = path.last()->children.value(level, nullptr);
+        if (child == nullptr) return;
+        path.append(child);
+    }
+    TrieNode* node = path.last();
+    if (s != nullptr) node->sessions.remove(s);
+    else node->localHandlers.removeAll(handler);
+    //Unsubscribed filters would otherwise leave their branch behind, and clients can make up any number of them
+    for (qsizetype i = levels.size(); i > 0; i--) {
+        TrieNode* n = path[i];
+        if (!n->sessions.isEmpty() || !n->localHandlers.isEmpty() || !n->children.isEmpty()) break;
+        path[i - 1]->children.remove(levels[i - 1]);
+        delete n;
+    }
+}
+
+void MqttBroker::deliver(Session* s, const QString &topic, const QByteArray &payload, quint8 qos, bool retain) {
+    QByteArray body = encodeString(topic.toUtf8());
+    quint8 header = 0x30 | (qos << 1) | (retain ? 0x01 : 0x00);
+    quint16 id = 0;
+    if (qos > 0) {
+        id = s->nextPacketId++;
+        if (s->nextPacketId == 0) s->nextPacketId = 1;
+        body.append(char(id >> 8));
+        body.append(char(id & 0xFF));
+    }
+    body.append(payload);
+    QByteArray packet = encodePacket(header, body);
+    if (qos > 0) {
+        s->inflight.insert(id, packet);
+        s->inflightSentAt.insert(id, QDateTime::currentMSecsSinceEpoch());
+    }
+    s->socket->write(packet);
+}
+
+void MqttBroker::checkSessions() {
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    const QList<Session*> open = sessions;
+    for (Session* s : open) {
+        bool expired = s->connected ? (s->keepAlive > 0 && now - s->lastActivity > s->keepAlive * 1500LL) : (now - s->lastActivity > 10000);
+        if (expired) {
+            dropClient(s, false);
+            continue;
+        }
+        for (auto it = s->inflightSentAt.begin(); it != s->inflightSentAt.end(); ++it) { //Resend unacknowledged QoS 1 deliveries
+            if (now - it.value() < 10000) continue;
+            QByteArray packet = s->inflight.value(it.key());
+            packet[0] = char(quint8(packet[0]) | 0x08); //DUP flag
+            s->socket->write(packet);
+            it.value() = now;
+        }
+    }
+}
+
+bool MqttBroker::topicMatches(const QString &filter, const QString &topic) {
+    const QStringList f = filter.split('/');
+    const QStringList t = topic.split('/');
+    if (!t.isEmpty() && t[0].startsWith('$') && (f[0] == "+" || f[0] == "#")) return false;
+    for (int i = 0; i < f.size(); i++) {
+        if (f[i] == "#") return true;
+        if (i >= t.size()) return false;
+        if (f[i] != "+" && f[i] != t[i]) return false;
+    }
+    return f.size() == t.size();
+}
+
+QByteArray MqttBroker::encodePacket(quint8 header, const QByteArray &body) {
+    QByteArray packet;
+    packet.append(char(header));
+    qint64 length = body.size();
+    do { //Variable length encoding, 7 bits per byte
+        quint8 byte = length % 128;
+        length /= 128;
+        if (length > 0) byte |= 0x80;
+        packet.append(char(byte));
+    } while (length > 0);
+    packet.append(body);
+    return packet;
+}
+
+QByteArray MqttBroker::encodeString(const QByteArray &s) {
+    QByteArray out;
+    out.append(char(s.size() >> 8));
+    out.append(char(s.size() & 0xFF));
+    out.append(s);
+    return out;
+}
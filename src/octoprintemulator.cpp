@@ -13,6 +13,9 @@
 #include <QDir>
 #include <QHttpServerResponse>
 #include "headers/gcodeparser.h"
+#include "headers/perfregistry.h"
+#include "headers/tracerecorder.h"
+#include "headers/logger.h"
 
 OctoprintEmulator::OctoprintEmulator(quint16 port, QObject* parent) : QObject(parent), server(), port() {
     /*server.route("/api/printer", []() {
@@ -32,7 +35,7 @@ OctoprintEmulator::OctoprintEmulator(quint16 port, QObject* parent) : QObject(pa
     });*/
 
     server.route("/api/version", []() { //Hey OctoPrint is over here!!! //emulate octoprint version api endpoint
-        qDebug() << "/api/version called!";
+        qCDebug(lcOctoprint) << "/api/version called!";
         return QJsonObject {
             {"api", "0.1"},
             {"version", "1.3.10"},
@@ -42,7 +45,14 @@ OctoprintEmulator::OctoprintEmulator(quint16 port, QObject* parent) : QObject(pa
 
     //This is the api endpoint OrcaSlicer calls to upload the print file
     server.route("/api/files/<arg>", this, [this](const QString &location, const QHttpServerRequest &request) -> QHttpServerResponse {
-        qDebug() << "/api/files called!";
+        qCDebug(lcOctoprint) << "/api/files called!";
+        static LatencyHistogram* intakeTime = PerfRegistry::histogram("intake.octoprint");
+        static PerfCounter* intakeBytes = PerfRegistry::counter("intake.octoprint_bytes");
+        PerfTimer timer(intakeTime);
+        intakeBytes->add(request.body().size());
+        TraceRecorder::Span intake(TraceRecorder::newJob(), "intake");
+        intake.args.insert("source", "octoprint");
+        intake.args.insert("bytes", qint64(request.body().size()));
 
         //Ensure the content type matches the expected for file upload
         if (!request.headers().contains("Content-Type") || !request.headers().value("Content-Type").contains("multipart/form-data")) {
@@ -128,14 +138,25 @@ OctoprintEmulator::OctoprintEmulator(quint16 port, QObject* parent) : QObject(pa
         if (!file.open(QIODevice::WriteOnly)) {
             return QHttpServerResponse("Failed to write file", QHttpServerResponder::StatusCode::InternalServerError);
         }
-        file.write(fileData);
+        qint64 written = file.write(fileData);
         file.close();
+        if (written != fileData.size()) { //A short spool file would print as a truncated job
+            return QHttpServerResponse("Failed to write file", QHttpServerResponder::StatusCode::InternalServerError);
+        }
 
         this->fileInfo = new QFileInfo(filePath); //Store file info about saved file
 
-        // Parse the gcode properties
-        QMap<QString, QString> properties = GCodeParser::parseFile(fileInfo->absoluteFilePath());
+        // Parse the gcode properties and hash the upload from the body already in memory
+        intake.args.insert("file", originalFileName);
+        QMap<QString, QString> properties;
+        {
+            TraceRecorder::Span parse(intake.jobId, "parse");
+            GCodeStreamParser parser(originalFileName);
+            parser.feed(fileData);
+            properties = parser.finish(fileInfo->absoluteFilePath());
+        }
         properties.insert("filename", originalFileName); //insert the filename into the properties
+        properties.insert("jobId", intake.jobId);
         QVariantMap propertiesForJS; //Convert to QVariantMap for use in QML
         for (auto it = properties.constBegin(); it != properties.constEnd(); ++it) {
             propertiesForJS.insert(it.key(), it.value());
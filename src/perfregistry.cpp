@@ -0,0 +1,161 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/perfregistry.h"
+#include <QJsonArray>
+#include <QDateTime>
+#include <QtAlgorithms>
+#include <algorithm>
+
+int LatencyHistogram::bucketOf(qint64 micros) {
+    quint64 v = quint64(qBound<qint64>(0, micros, (1LL << 36) - 1));
+    if (v < (1 << SUB_BITS)) return int(v); //Exact below 16 us
+    int exponent = 63 - int(qCountLeadingZeroBits(v));
+    return (exponent - SUB_BITS + 1) * (1 << SUB_BITS) + int((v >> (exponent - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+}
+
+qint64 LatencyHistogram::bucketLower(int index) {
+    if (index < (1 << SUB_BITS)) return index;
+    int exponent = index / (1 << SUB_BITS) + SUB_BITS - 1;
+    qint64 sub = index % (1 << SUB_BITS);
+    return ((1LL << SUB_BITS) + sub) << (exponent - SUB_BITS);
+}
+
+void LatencyHistogram::record(qint64 micros) {
+    counts[bucketOf(micros)].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(quint64(qMax<qint64>(0, micros)), std::memory_order_relaxed);
+    qint64 seen = max.load(std::memory_order_relaxed);
+    while (micros > seen && !max.compare_exchange_weak(seen, micros, std::memory_order_relaxed)) {}
+}
+
+void LatencyHistogram::reset() {
+    for (std::atomic<quint64> &c : counts) c.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const {
+    //Counted from the buckets so the percentiles agree with the total even while other threads record
+    Snapshot s;
+    s.name = name;
+    s.buckets.reserve(BUCKETS);
+    for (const std::atomic<quint64> &c : counts) {
+        quint64 n = c.load(std::memory_order_relaxed);
+        s.buckets.append(n);
+        s.count += n;
+    }
+    s.maxUs = max.load(std::memory_order_relaxed);
+    s.sumUs = sum.load(std::memory_order_relaxed);
+    s.meanUs = s.count > 0 ? double(s.sumUs) / s.count : 0;
+    return s;
+}
+
+qint64 LatencyHistogram::Snapshot::percentile(double q) const {
+    if (count == 0) return 0;
+    quint64 rank = quint64(qMax(1.0, q * count));
+    quint64 seen = 0;
+    for (int i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if (seen >= rank) return qMin(maxUs, i + 1 < BUCKETS ? bucketLower(i + 1) - 1 : maxUs);
+    }
+    return maxUs;
+}
+
+LatencyHistogram* PerfRegistry::histogram(const QString &name) {
+    QMutexLocker locker(&lock);
+    for (LatencyHistogram &h : histogramList) {
+        if (h.name == name) return &h;
+    }
+    return &histogramList.emplace_back(name);
+}
+
+PerfCounter* PerfRegistry::counter(const QString &name) {
+    QMutexLocker locker(&lock);
+    for (PerfCounter &c : counterList) {
+        if (c.name == name) return &c;
+    }
+    return &counterList.emplace_back(name);
+}
+
+QList<LatencyHistogram::Snapshot> PerfRegistry::histograms() {
+    QMutexLocker locker(&lock);
+    QList<LatencyHistogram::Snapshot> list;
+    for (const LatencyHistogram &h : histogramList) list.append(h.snapshot());
+    std::sort(list.begin(), list.end(), [](const LatencyHistogram::Snapshot &a, const LatencyHistogram::Snapshot &b) { return a.name < b.name; });
+    return list;
+}
+
+QList<QPair<QString, qint64>> PerfRegistry::counters() {
+    QMutexLocker locker(&lock);
+    QList<QPair<QString, qint64>> list;
+    for (const PerfCounter &c : counterList) list.append({c.name, c.get()});
+    std::sort(list.begin(), list.end());
+    return list;
+}
+
+QString PerfRegistry::formatMicros(qint64 micros) {
+    if (micros < 1000) return QString::number(micros) + " us";
+    if (micros < 1000000) return QString::number(micros / 1000.0, 'f', micros < 10000 ? 2 : 1) + " ms";
+    return QString::number(micros / 1000000.0, 'f', 2) + " s";
+}
+
+QStringList PerfRegistry::report(const QString &filter) {
+    QStringList lines;
+    for (const LatencyHistogram::Snapshot &s : histograms()) {
+        if (!s.name.contains(filter, Qt::CaseInsensitive)) continue;
+        if (s.count == 0) {
+            lines.append(s.name + ": no samples");
+            continue;
+        }
+        lines.append(QString("%1: %2 samples, p50 %3, p90 %4, p99 %5, max %6, mean %7").arg(s.name).arg(s.count)
+                         .arg(formatMicros(s.percentile(0.5)), formatMicros(s.percentile(0.9)), formatMicros(s.percentile(0.99)),
+                              formatMicros(s.maxUs), formatMicros(qint64(s.meanUs))));
+    }
+    QMutexLocker locker(&lock);
+    QStringList counted;
+    for (const PerfCounter &c : counterList) {
+        if (c.name.contains(filter, Qt::CaseInsensitive)) counted.append(c.name + ": " + QString::number(c.get()));
+    }
+    counted.sort();
+    return lines + counted;
+}
+
+QJsonObject PerfRegistry::toJson() {
+    QJsonObject histogramsJson;
+    for (const LatencyHistogram::Snapshot &s : histograms()) {
+        //Only occupied buckets, as [lower bound us, count], enough to rebuild the distribution offline
+        QJsonArray buckets;
+        for (int i = 0; i < s.buckets.size(); i++) {
+            if (s.buckets[i] > 0) buckets.append(QJsonArray{LatencyHistogram::bucketLower(i), qint64(s.buckets[i])});
+        }
+        histogramsJson.insert(s.name, QJsonObject{
+            {"count", qint64(s.count)},
+            {"meanUs", s.meanUs},
+            {"p50Us", s.percentile(0.5)},
+            {"p90Us", s.percentile(0.9)},
+            {"p99Us", s.percentile(0.99)},
+            {"p999Us", s.percentile(0.999)},
+            {"maxUs", s.maxUs},
+            {"buckets", buckets}
+        });
+    }
+    QJsonObject countersJson;
+    {
+        QMutexLocker locker(&lock);
+        for (const PerfCounter &c : counterList) countersJson.insert(c.name, c.get());
+    }
+    return QJsonObject{
+        {"generatedAt", QDateTime::currentDateTimeUtc().toString(Qt::ISODateWithMs)},
+        {"histograms", histogramsJson},
+        {"counters", countersJson}
+    };
+}
+
+void PerfRegistry::reset() {
+    QMutexLocker locker(&lock);
+    for (LatencyHistogram &h : histogramList) h.reset();
+    for (PerfCounter &c : counterList) c.reset();
+}
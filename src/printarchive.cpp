@@ -0,0 +1,244 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/printarchive.h"
+#include "headers/streamhasher.h"
+#include <QCoreApplication>
+#include <QThreadPool>
+#include <QSaveFile>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QRegularExpression>
+#include <QDebug>
+#include <zstd.h>
+
+PrintArchive::PrintArchive(DatabaseService* dbs, QObject* parent) : QObject(parent) {
+    this->dbs = dbs;
+    loadConfig(QJsonObject());
+}
+
+void PrintArchive::loadConfig(QJsonObject cfg) {
+    QDir appDir(QCoreApplication::applicationDirPath());
+    enabled = cfg.value("enabled").toBool(true);
+    directory = QDir(appDir.filePath(cfg.value("directory").toString("archive")));
+    restoreDirectory = QDir(appDir.filePath(cfg.value("restoreDirectory").toString("reprint")));
+    level = qBound(1, cfg.value("level").toInt(9), ZSTD_maxCLevel());
+    maxBytes = qint64(cfg.value("maxSizeMB").toDouble(2048) * 1024 * 1024);
+}
+
+bool PrintArchive::isEnabled() const {
+    return enabled;
+}
+
+QString PrintArchive::blobPath(const QString &hash) const {
+    return directory.filePath(hash.left(2) + "/" + hash + ".zst"); //Fan out so no directory grows huge
+}
+
+void PrintArchive::store(const QString &filepath, const QMap<QString, QString> &properties, const QString &userId, const QString &printerName, const QString &printerModel) {
+    if (!enabled) return;
+    QString hash = properties.value("xxh64");
+    if (hash.isEmpty() || !QFile::exists(filepath)) return;
+    QString fileName = properties.value("filename", QFileInfo(filepath).fileName());
+    qint64 printedAt = QDateTime::currentSecsSinceEpoch();
+    QStringList metadata;
+    for (const QString &key : {"printer", "filamentType", "printer_settings", "print_settings", "filament_settings", "duration", "weight"}) {
+        if (properties.contains(key)) metadata.append(properties.value(key));
+    }
+    QString meta = metadata.join(" ");
+
+    dbs->read("SELECT 1 FROM archive WHERE hash = :h", {{":h", hash}}).then(this, [this, filepath, hash, fileName, userId, printerName, printerModel, meta, printedAt](Eo<DbRows> existing) {
+        if (existing.isError()) return;
+        if (!existing.get().isEmpty() || compressing.contains(hash)) { //Same content printed again, only the index grows
+            deduplicated++;
+            dbs->write("UPDATE archive SET lastUsed = :t, model = ifnull(model, :m) WHERE hash = :h", {{":t", printedAt}, {":m", printerModel}, {":h", hash}});
+            return index(hash, fileName, userId, printerName, meta, printedAt);
+        }
+        compressing.insert(hash);
+        QString target = blobPath(hash);
+        int lvl = level;
+        QThreadPool::globalInstance()->start([this, filepath, target, lvl, hash, fileName, userId, printerName, printerModel, meta, printedAt]() {
+            QDir().mkpath(QFileInfo(target).path());
+            qint64 size = 0;
+            qint64 storedSize = 0;
+            bool ok = compressFile(filepath, target, lvl, hash, size, storedSize);
+            QMetaObject::invokeMethod(this, [this, ok, size, storedSize, filepath, hash, fileName, userId, printerName, printerModel, meta, printedAt]() {
+                compressing.remove(hash);
+                if (!ok) {
+                    qWarning() << "Could not archive" << filepath << "- unreadable, or replaced since it was printed";
+                    return;
+                }
+                stored++;
+                bytesIn += size;
+                bytesOut += storedSize;
+                dbs->write("INSERT INTO archive (hash, fileName, size, storedSize, createdAt, lastUsed, model) VALUES (:h, :fn, :sz, :ss, :t, :t, :m) "
+                           "ON CONFLICT (hash) DO UPDATE SET lastUsed = excluded.lastUsed", {
+                               {":h", hash}, {":fn", fileName}, {":sz", size}, {":ss", storedSize}, {":t", printedAt}, {":m", printerModel}
+                           });
+                index(hash, fileName, userId, printerName, meta, printedAt);
+                enforceRetention(hash);
+            }, Qt::QueuedConnection);
+        });
+    });
+}
+
+void PrintArchive::index(const QString &hash, const QString &fileName, const QString &userId, const QString &printerName, const QString &metadata, qint64 printedAt) {
+    //Names come from users so staff can search for a person, the card id keeps the entry findable after a rename
+    dbs->write("INSERT INTO archiveIndex (fileName, user, printer, metadata, hash, printedAt) "
+               "VALUES (:fn, ifnull((SELECT firstName || ' ' || lastName FROM users WHERE id = :uid), '') || ' ' || :uid, :pr, :md, :h, :t)", {
+                   {":fn", fileName}, {":uid", userId}, {":pr", printerName}, {":md", metadata}, {":h", hash}, {":t", printedAt}
+               });
+}
+
+void PrintArchive::enforceRetention(const QString &keep) {
+    dbs->read("SELECT total(storedSize) FROM archive").then(this, [this, keep](Eo<DbRows> total) {
+        if (total.isError() || total.get().isEmpty()) return;
+        qint64 excess = qint64(total.get().first()[0].toDouble()) - maxBytes;
+        if (excess <= 0) return;
+        //Least recently printed files go first
+        dbs->read("SELECT hash, storedSize FROM archive WHERE hash != :keep ORDER BY lastUsed LIMIT 500", {{":keep", keep}}).then(this, [this, excess](Eo<DbRows> oldest) {
+            if (oldest.isError()) return;
+            qint64 freed = 0;
+            QList<DbStatement> removals;
+            QStringList hashes;
+            for (const DbRow &row : oldest.get()) {
+                if (freed >= excess) break;
+                QString hash = row[0].toString();
+                hashes.append(hash);
+                freed += row[1].toLongLong();
+                removals.append({"DELETE FROM archive WHERE hash = :h", {{":h", hash}}});
+                removals.append({"DELETE FROM archiveIndex WHERE hash = :h", {{":h", hash}}});
+            }
+            if (removals.isEmpty()) return;
+            //Blobs go only once the rows are gone, a failed delete must not leave rows pointing at nothing
+            dbs->transaction(removals).then(this, [this, hashes, freed](Eo<QList<DbRows>> result) {
+                if (result.isError()) return;
+                for (const QString &hash : hashes) QFile::remove(blobPath(hash));
+                evicted += quint64(hashes.size());
+                qInfo() << "Archive over its size limit, removed" << hashes.size() << "files," << freed / 1048576 << "MB";
+            });
+        });
+    });
+}
+
+QString PrintArchive::ftsQuery(const QString &text) {
+    //Every word must match the start of a token somewhere, quoting keeps FTS5 syntax out of staff input
+    QStringList terms;
+    static const QRegularExpression separators("[\\s\"]+");
+    for (const QString &word : text.split(separators, Qt::SkipEmptyParts)) terms.append("\"" + word + "\"*");
+    return terms.join(" AND ");
+}
+
+QFuture<Eo<QList<PrintArchive::Match>>> PrintArchive::search(const QString &query, int limit) {
+    return dbs->read("SELECT archiveIndex.hash, archiveIndex.fileName, user, printer, printedAt, archive.model FROM archiveIndex "
+                     "LEFT JOIN archive ON archive.hash = archiveIndex.hash WHERE archiveIndex MATCH :q "
+                     "ORDER BY bm25(archiveIndex), printedAt DESC LIMIT :n", {
+                         {":q", ftsQuery(query)}, {":n", limit}
+                     }).then([](Eo<DbRows> rows) {
+        if (rows.isError()) return Eo<QList<Match>>(*rows.error());
+        QList<Match> matches;
+        for (const DbRow &row : rows.get()) matches.append({row[0].toString(), row[1].toString(), row[2].toString(), row[3].toString(), row[4].toLongLong(), row[5].toString()});
+        return Eo<QList<Match>>(matches);
+    });
+}
+
+void PrintArchive::restore(const Match &match, std::function<void(const QString &filepath)> done) {
+    QString source = blobPath(match.hash);
+    QString name = match.fileName;
+    name.replace(QRegularExpression("[\\\\/:*?\"<>|]"), "_");
+    restoreDirectory.mkpath(".");
+    QString target = restoreDirectory.filePath(name);
+    QThreadPool::globalInstance()->start([this, source, target, done]() {
+        bool ok = decompressFile(source, target);
+        QMetaObject::invokeMethod(this, [ok, target, done]() { done(ok ? target : QString()); }, Qt::QueuedConnection);
+    });
+}
+
+bool PrintArchive::compressFile(const QString &source, const QString &target, int level, const QString &expectedHash, qint64 &size, qint64 &storedSize) {
+    QFile in(source);
+    QSaveFile out(target); //Renamed into place on commit, a crash never leaves half a blob under its hash
+    if (!in.open(QIODevice::ReadOnly) || !out.open(QIODevice::WriteOnly)) return false;
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+    ZSTD_CCtx_setPledgedSrcSize(cctx, in.size());
+    QByteArray inBuf(ZSTD_CStreamInSize(), Qt::Uninitialized);
+    QByteArray outBuf(ZSTD_CStreamOutSize(), Qt::Uninitialized);
+    StreamHasher hasher; //The spool file may have been replaced by the next upload since the job was hashed at intake
+    bool ok = true;
+    bool last = false;
+    while (ok && !last) {
+        qint64 n = in.read(inBuf.data(), inBuf.size());
+        if (n < 0) {
+            ok = false;
+            break;
+        }
+        hasher.addData(inBuf.constData(), n);
+        last = in.atEnd();
+        ZSTD_inBuffer input{inBuf.constData(), size_t(n), 0};
+        bool flushed = false;
+        while (!flushed) {
+            ZSTD_outBuffer output{outBuf.data(), size_t(outBuf.size()), 0};
+            size_t remaining = ZSTD_compressStream2(cctx, &output, &input, last ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(remaining)) {
+                ok = false;
+                break;
+            }
+            out.write(outBuf.constData(), qint64(output.pos));
+            flushed = last ? remaining == 0 : input.pos == input.size;
+        }
+    }
+    ZSTD_freeCCtx(cctx);
+    if (!ok || hasher.xxh64Hex() != expectedHash) {
+        out.cancelWriting();
+        return false;
+    }
+    if (!out.commit()) return false;
+    size = hasher.size();
+    storedSize = QFileInfo(target).size();
+    return true;
+}
+
+bool PrintArchive::decompressFile(const QString &source, const QString &target) {
+    QFile in(source);
+    QSaveFile out(target);
+    if (!in.open(QIODevice::ReadOnly) || !out.open(QIODevice::WriteOnly)) return false;
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    QByteArray inBuf(ZSTD_DStreamInSize(), Qt::Uninitialized);
+    QByteArray outBuf(ZSTD_DStreamOutSize(), Qt::Uninitialized);
+    bool ok = true;
+    size_t lastResult = 0;
+    while (ok && !in.atEnd()) {
+        qint64 n = in.read(inBuf.data(), inBuf.size());
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        ZSTD_inBuffer input{inBuf.constData(), size_t(n), 0};
+        while (input.pos < input.size) {
+            ZSTD_outBuffer output{outBuf.data(), size_t(outBuf.size()), 0};
+            lastResult = ZSTD_decompressStream(dctx, &output, &input);
+            if (ZSTD_isError(lastResult)) {
+                ok = false;
+                break;
+            }
+            out.write(outBuf.constData(), qint64(output.pos));
+        }
+    }
+    ZSTD_freeDCtx(dctx);
+    if (!ok || lastResult != 0) { //Non-zero means the frame was cut short
+        out.cancelWriting();
+        return false;
+    }
+    return out.commit();
+}
+
+QString PrintArchive::summary() const {
+    if (!enabled) return "disabled";
+    double ratio = bytesIn > 0 ? 100.0 * bytesOut / bytesIn : 0;
+    return QString("%1 files stored this session (%2% of original size), %3 reprints deduplicated, %4 evicted, limit %5 MB")
+        .arg(stored).arg(ratio, 0, 'f', 1).arg(deduplicated).arg(evicted).arg(maxBytes / 1048576);
+}
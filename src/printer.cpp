@@ -6,6 +6,9 @@
 
 
 #include "headers/printer.h"
+#include <QFileInfo>
+#include <QTimer>
+#include <QDebug>
 
 Printer::Printer(QObject* parent) : QObject(parent) {}
 
@@ -43,3 +46,86 @@ QString Printer::getModel() {
 QString Printer::getBrand() {
     return this->brand;
 }
+
+void Printer::setCompaction(const QString &compaction) {
+    this->compaction = compaction;
+}
+
+QString Printer::getCompaction() {
+    return this->compaction;
+}
+
+void Printer::setTransferScheduler(TransferScheduler* scheduler) {
+    this->scheduler = scheduler;
+}
+
+quint64 Printer::scheduleTransfer(const QString &filepath, bool interactive, std::function<void(quint64)> start) {
+    if (scheduler == nullptr) { //Standalone driver, start on the next event loop pass like the scheduler would
+        quint64 ticket = ++unscheduledTickets;
+        QTimer::singleShot(0, this, [start, ticket]() { start(ticket); });
+        return ticket;
+    }
+    TransferScheduler::Priority priority = interactive ? TransferScheduler::Interactive : TransferScheduler::Background;
+    return scheduler->enqueue(this, name, QFileInfo(filepath).size(), priority, start);
+}
+
+void Printer::promoteTransfer(quint64 ticket) {
+    if (scheduler != nullptr) scheduler->promote(ticket);
+}
+
+void Printer::cancelTransfer(quint64 ticket) {
+    if (scheduler != nullptr) scheduler->cancel(ticket);
+}
+
+void Printer::finishTransfer(quint64 ticket, bool success) {
+    if (scheduler != nullptr) scheduler->finish(ticket, success);
+}
+
+qint64 Printer::transferRateLimit(quint64 ticket) {
+    return scheduler != nullptr ? scheduler->rateLimit(ticket) : 0;
+}
+
+void Printer::setFileDigest(const QString &filepath, const FileDigest &digest) {
+    if (digest.isValid()) digests.insert(filepath, digest);
+    else digests.remove(filepath);
+}
+
+FileDigest Printer::fileDigest(const QString &filepath) {
+    return digests.value(filepath);
+}
+
+QString Printer::traceJob(const QString &filepath) {
+    return digests.value(filepath).jobId;
+}
+
+void Printer::releaseDigest(const QString &filepath) {
+    digests.remove(filepath);
+}
+
+bool Printer::spoolIntact(const QString &filepath) {
+    FileDigest digest = digests.value(filepath);
+    if (!digest.isValid()) return true; //Nothing to compare against
+    qint64 size = QFileInfo(filepath).size();
+    if (size == digest.size) return true;
+    qCritical() << "Spool file" << filepath << "is" << size << "bytes but" << digest.size << "were received, not sending it";
+    return false;
+}
+
+GCodeCompactor* Printer::createCompactor(const QString &filepath, bool binarySupported) {
+    GCodeCompactor::Mode mode = GCodeCompactor::modeFor(compaction, filepath);
+    if (mode == GCodeCompactor::Binary && !binarySupported) {
+        qWarning() << name << "can't print binary G-code, stripping comments instead";
+        mode = GCodeCompactor::StripComments;
+    }
+    if (mode == GCodeCompactor::Passthrough || !QFileInfo::exists(filepath)) return nullptr; //Missing files fail in the driver's own upload path
+    GCodeCompactor* compactor = new GCodeCompactor(filepath, mode);
+    QString fileName = QFileInfo(filepath).fileName();
+    QObject::connect(compactor, &GCodeCompactor::compactionFinished, this, [this, fileName](qint64 bytesIn, qint64 bytesOut, qint64 elapsedMs) {
+        double reduction = bytesIn > 0 ? 100.0 * (bytesIn - bytesOut) / bytesIn : 0;
+        double throughput = elapsedMs > 0 ? (bytesIn / 1048576.0) / (elapsedMs / 1000.0) : 0;
+        qInfo().noquote() << QString("%1: %2 compacted %3 -> %4 bytes (%5% smaller) at %6 MB/s")
+                                 .arg(name, fileName).arg(bytesIn).arg(bytesOut).arg(reduction, 0, 'f', 1).arg(throughput, 0, 'f', 1);
+        emit this->transferCompacted(fileName, bytesIn, bytesOut, elapsedMs);
+    });
+    return compactor;
+}
@@ -0,0 +1,328 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/printerdiscovery.h"
+#include <QNetworkDatagram>
+#include <QDateTime>
+#include <QDebug>
+
+//DNS record types used by mDNS service discovery
+static const quint16 DNS_A = 1;
+static const quint16 DNS_PTR = 12;
+static const quint16 DNS_TXT = 16;
+static const quint16 DNS_SRV = 33;
+
+static quint16 readU16(const QByteArray &msg, int offset) {
+    return (quint16(quint8(msg[offset])) << 8) | quint8(msg[offset + 1]);
+}
+
+//Read a (possibly compressed) DNS name, offset is moved past the name in the record
+static bool readDnsName(const QByteArray &msg, int &offset, QString &out) {
+    QStringList labels;
+    int pos = offset;
+    bool jumped = false;
+    int hops = 0;
+    while (pos < msg.size()) {
+        quint8 len = quint8(msg[pos]);
+        if (len == 0) {
+            if (!jumped) offset = pos + 1;
+            out = labels.join(".");
+            return true;
+        }
+        if ((len & 0xC0) == 0xC0) { //Compression pointer
+            if (pos + 1 >= msg.size() || ++hops > 16) return false;
+            int ptr = ((len & 0x3F) << 8) | quint8(msg[pos + 1]);
+            if (!jumped) offset = pos + 2;
+            jumped = true;
+            pos = ptr;
+            continue;
+        }
+        if (pos + 1 + len > msg.size()) return false;
+        labels.append(QString::fromUtf8(msg.constData() + pos + 1, len));
+        pos += 1 + len;
+    }
+    return false;
+}
+
+template <typename T>
+static void storeRecord(QMap<QString, T> &records, const QString &key, const T &record, quint32 ttl) {
+    if (ttl == 0) records.remove(key); //Goodbye packet, the announcer is going away
+    else records.insert(key, record);
+}
+
+template <typename T>
+static void pruneRecords(QMap<QString, T> &records, qint64 now) {
+    for (auto it = records.begin(); it != records.end();) {
+        if (it->expires <= now) it = records.erase(it);
+        else ++it;
+    }
+}
+
+static void writeDnsName(QByteArray &msg, const QString &name) {
+    for (const QString &label : name.split(".", Qt::SkipEmptyParts)) {
+        QByteArray l = label.toUtf8();
+        msg.append(char(l.size()));
+        msg.append(l);
+    }
+    msg.append('\0');
+}
+
+PrinterDiscovery::PrinterDiscovery(quint16 ssdpPort, quint16 mdnsPort, const QHostAddress &mdnsGroup, QObject* parent) : QObject(parent) {
+    this->ssdpPort = ssdpPort;
+    this->mdnsPort = mdnsPort;
+    this->mdnsGroup = mdnsGroup;
+
+    connect(&ssdpSocket, &QUdpSocket::readyRead, this, &PrinterDiscovery::readSsdp);
+    connect(&mdnsSocket, &QUdpSocket::readyRead, this, &PrinterDiscovery::readMdns);
+
+    queryTimer.setInterval(60000);
+    connect(&queryTimer, &QTimer::timeout, this, &PrinterDiscovery::sendMdnsQuery);
+    expiryTimer.setInterval(30000);
+    connect(&expiryTimer, &QTimer::timeout, this, &PrinterDiscovery::expireDevices);
+}
+
+bool PrinterDiscovery::start() {
+    bool ok = true;
+    //Bambu printers broadcast SSDP NOTIFY messages on UDP 2021
+    if (!ssdpSocket.bind(QHostAddress::AnyIPv4, ssdpPort, QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint)) {
+        qWarning() << "Discovery: unable to bind SSDP port" << ssdpPort << ssdpSocket.errorString();
+        ok = false;
+    }
+    //PrusaLink answers mDNS queries on the multicast group
+    if (!mdnsSocket.bind(QHostAddress::AnyIPv4, mdnsPort, QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint)) {
+        qWarning() << "Discovery: unable to bind mDNS port" << mdnsPort << mdnsSocket.errorString();
+        ok = false;
+    } else if (mdnsGroup.isMulticast() && !mdnsSocket.joinMulticastGroup(mdnsGroup)) {
+        qWarning() << "Discovery: unable to join mDNS group" << mdnsGroup << mdnsSocket.errorString();
+    }
+    queryTimer.start();
+    expiryTimer.start();
+    QTimer::singleShot(0, this, &PrinterDiscovery::sendMdnsQuery);
+    return ok;
+}
+
+void PrinterDiscovery::stop() {
+    queryTimer.stop();
+    expiryTimer.stop();
+    ssdpSocket.close();
+    mdnsSocket.close();
+}
+
+void PrinterDiscovery::setQueryInterval(int ms) {
+    queryTimer.setInterval(ms);
+}
+
+void PrinterDiscovery::setStaleTimeout(qint64 ms) {
+    staleTimeout = ms;
+}
+
+QList<DiscoveredPrinter> PrinterDiscovery::devices() const {
+    return table.values();
+}
+
+bool PrinterDiscovery::contains(const QString &key) const {
+    return table.contains(key);
+}
+
+DiscoveredPrinter PrinterDiscovery::device(const QString &key) const {
+    return table.value(key);
+}
+
+void PrinterDiscovery::readSsdp() {
+    while (ssdpSocket.hasPendingDatagrams()) {
+        QNetworkDatagram dg = ssdpSocket.receiveDatagram();
+        handleSsdpDatagram(dg.data(), dg.senderAddress());
+    }
+}
+
+void PrinterDiscovery::readMdns() {
+    while (mdnsSocket.hasPendingDatagrams()) {
+        QNetworkDatagram dg = mdnsSocket.receiveDatagram();
+        handleMdnsDatagram(dg.data(), dg.senderAddress());
+    }
+}
+
+void PrinterDiscovery::handleSsdpDatagram(const QByteArray &data, const QHostAddress &sender) {
+    //Parse the "Header: value" lines of the NOTIFY message
+    QMap<QString, QString> headers;
+    const QList<QByteArray> lines = data.split('\n');
+    for (const QByteArray &rawLine : lines) {
+        QString line = QString::fromUtf8(rawLine).trimmed();
+        int sep = line.indexOf(':');
+        if (sep <= 0) continue;
+        headers.insert(line.left(sep).trimmed().toLower(), line.mid(sep + 1).trimmed());
+    }
+    if (!headers.value("nt").contains("bambulab", Qt::CaseInsensitive) && !headers.contains("devmodel.bambu.com")) return; //Not a Bambu printer
+    if (!headers.contains("usn")) return;
+
+    DiscoveredPrinter d;
+    d.key = headers.value("usn");
+    d.brand = "BambuLab";
+    d.model = bambuModelName(headers.value("devmodel.bambu.com"));
+    d.name = headers.value("devname.bambu.com", d.key);
+    QHostAddress location(headers.value("location"));
+    d.address = location.isNull() ? QHostAddress(sender.toIPv4Address()) : location;
+    d.port = 8883;
+    updateDevice(d);
+}
+
+void PrinterDiscovery::handleMdnsDatagram(const QByteArray &data, const QHostAddress &sender) {
+    if (data.size() < 12) return;
+    quint16 flags = readU16(data, 2);
+    if (!(flags & 0x8000)) return; //Only responses carry records we care about
+    int qdCount = readU16(data, 4);
+    int rrCount = readU16(data, 6) + readU16(data, 8) + readU16(data, 10);
+
+    int offset = 12;
+    QString name;
+    for (int i = 0; i < qdCount; i++) { //Skip echoed questions
+        if (!readDnsName(data, offset, name)) return;
+        offset += 4;
+    }
+
+    QStringList instances; //Instances mentioned in this packet
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    for (int i = 0; i < rrCount; i++) {
+        if (!readDnsName(data, offset, name)) return;
+        if (offset + 10 > data.size()) return;
+        quint16 type = readU16(data, offset);
+        quint32 ttl = (quint32(readU16(data, offset + 4)) << 16) | readU16(data, offset + 6); //Seconds
+        qint64 expires = now + qint64(ttl) * 1000;
+        quint16 rdLength = readU16(data, offset + 8);
+        int rdata = offset + 10;
+        offset = rdata + rdLength;
+        if (offset > data.size()) return;
+
+        if (type == DNS_PTR) {
+            int p = rdata;
+            QString instance;
+            if (!readDnsName(data, p, instance)) continue;
+            bool prusaService = false;
+            for (const QString &service : prusaServiceTypes) {
+                if (name.compare(service, Qt::CaseInsensitive) == 0) prusaService = true;
+            }
+            if (prusaService && !instances.contains(instance)) instances.append(instance);
+        } else if (type == DNS_SRV && rdLength >= 7) {
+            int p = rdata + 6;
+            QString target;
+            if (!readDnsName(data, p, target)) continue;
+            storeRecord(mdnsServices, name, {{target, readU16(data, rdata + 4)}, expires}, ttl);
+            if (!instances.contains(name)) instances.append(name);
+        } else if (type == DNS_TXT) {
+            QMap<QString, QString> txt;
+            int p = rdata;
+            while (p < rdata + rdLength) {
+                int len = quint8(data[p]);
+                QString entry = QString::fromUtf8(data.constData() + p + 1, qMin(len, rdata + rdLength - p - 1));
+                int eq = entry.indexOf('=');
+                if (eq > 0) txt.insert(entry.left(eq).toLower(), entry.mid(eq + 1));
+                p += 1 + len;
+            }
+            storeRecord(mdnsTxt, name, {txt, expires}, ttl);
+        } else if (type == DNS_A && rdLength == 4) {
+            quint32 ip = (quint32(quint8(data[rdata])) << 24) | (quint32(quint8(data[rdata + 1])) << 16) | (quint32(quint8(data[rdata + 2])) << 8) | quint8(data[rdata + 3]);
+            storeRecord(mdnsHosts, name.toLower(), {QHostAddress(ip), expires}, ttl);
+        }
+    }
+
+    //Resolve every instance we have enough records for
+    for (const QString &instance : instances) {
+        if (!mdnsServices.contains(instance)) continue;
+        QMap<QString, QString> txt = mdnsTxt.value(instance).value;
+        QString lowered = instance.toLower();
+        bool isPrusa = lowered.contains("_prusa-link.") || lowered.contains("prusa");
+        for (auto it = txt.constBegin(); it != txt.constEnd() && !isPrusa; ++it) {
+            isPrusa = it.value().contains("prusa", Qt::CaseInsensitive);
+        }
+        if (!isPrusa) continue;
+
+        QPair<QString, quint16> srv = mdnsServices.value(instance).value;
+        DiscoveredPrinter d;
+        d.key = instance;
+        d.brand = "Prusa";
+        d.model = txt.value("printer_type", txt.value("model", "Unknown"));
+        d.name = instance.section('.', 0, 0);
+        d.address = mdnsHosts.contains(srv.first.toLower()) ? mdnsHosts.value(srv.first.toLower()).value : QHostAddress(sender.toIPv4Address());
+        d.port = srv.second;
+        updateDevice(d);
+    }
+}
+
+void PrinterDiscovery::sendMdnsQuery() {
+    if (mdnsSocket.state() != QAbstractSocket::BoundState) return;
+    QByteArray q;
+    q.append(QByteArray(4, '\0')); //id 0, standard query
+    q.append(char(0));
+    q.append(char(prusaServiceTypes.size()));
+    q.append(QByteArray(6, '\0'));
+    for (const QString &service : prusaServiceTypes) {
+        writeDnsName(q, service);
+        q.append(char(0));
+        q.append(char(DNS_PTR));
+        q.append(char(0x80)); //Unicast response bit, lets us work when another responder owns 5353
+        q.append(char(1));
+    }
+    mdnsSocket.writeDatagram(q, mdnsGroup, mdnsPort);
+}
+
+void PrinterDiscovery::updateDevice(DiscoveredPrinter d) {
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    d.lastSeen = now;
+    if (!table.contains(d.key)) {
+        d.firstSeen = now;
+        table.insert(d.key, d);
+        qDebug() << "Discovered" << d.brand << "printer" << d.name << "at" << d.address.toString();
+        emit deviceDiscovered(d);
+        return;
+    }
+    DiscoveredPrinter &existing = table[d.key];
+    d.firstSeen = existing.firstSeen;
+    QHostAddress oldAddress = existing.address;
+    existing = d;
+    if (oldAddress != d.address) { //DHCP handed the printer a new address
+        qInfo() << "Printer" << d.name << "moved from" << oldAddress.toString() << "to" << d.address.toString();
+        emit deviceAddressChanged(d, oldAddress);
+    }
+}
+
+void PrinterDiscovery::expireDevices() {
+    expireAt(QDateTime::currentMSecsSinceEpoch());
+}
+
+void PrinterDiscovery::expireAt(qint64 now) {
+    //Announcers that vanished or changed name never send a goodbye, their records would otherwise stay forever
+    pruneRecords(mdnsServices, now);
+    pruneRecords(mdnsTxt, now);
+    pruneRecords(mdnsHosts, now);
+    for (auto it = table.begin(); it != table.end();) {
+        if (now - it->lastSeen > staleTimeout) {
+            DiscoveredPrinter lost = it.value();
+            it = table.erase(it);
+            emit deviceLost(lost);
+        } else {
+            ++it;
+        }
+    }
+}
+
+int PrinterDiscovery::mdnsRecordCount() const {
+    return mdnsServices.size() + mdnsTxt.size() + mdnsHosts.size();
+}
+
+QString PrinterDiscovery::bambuModelName(const QString &devModel) {
+    static const QMap<QString, QString> models = {
+        {"3DPrinter-X1-Carbon", "X1C"},
+        {"BL-P001", "X1C"},
+        {"3DPrinter-X1", "X1"},
+        {"BL-P002", "X1"},
+        {"C13", "X1E"},
+        {"C11", "P1P"},
+        {"C12", "P1S"},
+        {"N1", "A1 mini"},
+        {"N2S", "A1"},
+    };
+    return models.value(devModel, devModel.isEmpty() ? "Unknown" : devModel);
+}
@@ -1,9 +1,24 @@
 #include "headers/printermanager.h"
 #include "headers/prusa.h"
 #include "headers/bambulab.h"
+#include "headers/tracerecorder.h"
+#include <QJsonArray>
+#include <QSharedPointer>
+#include <QTimer>
 
 PrinterManager::PrinterManager(QObject* parent) : QObject(parent) {
-
+    stageTimer.setSingleShot(true);
+    stageTimer.setInterval(600000);
+    connect(&stageTimer, &QTimer::timeout, this, [this]() {
+        qInfo() << "Staged job was not started in time, removing it from the printer";
+        discardStagedJob();
+    });
+    preheatTimer.setSingleShot(true);
+    preheatTimer.setInterval(600000);
+    connect(&preheatTimer, &QTimer::timeout, this, [this]() {
+        qInfo() << "Preheated job was not started in time, turning the heaters off";
+        cancelPreheat();
+    });
 }
 
 // PrinterManager::~PrinterManager() {
@@ -19,6 +34,7 @@ PrinterManager::PrinterManager(QObject* parent) : QObject(parent) {
 // }
 
 void PrinterManager::loadConfig(QJsonObject config){
+    bblEmuConfig = config.value("bambuEmulator").toObject();
     QJsonArray prntrs = config.value("printers").toArray(QJsonArray());
     for (int i = 0; i < prntrs.size(); i++) {
         if (!prntrs[i].isObject()) continue;
@@ -34,7 +50,9 @@ void PrinterManager::loadConfig(QJsonObject config){
                 printer.value("apiKey").toString(),
                 printer.value("storageType").toString("usb")
             );
-            addPrinter(prs);
+            prs->setCompaction(printer.value("compaction").toString("none"));
+            quint32 id = addPrinter(prs);
+            if (printer.value("serial").isString()) printerSerials.insert(id, printer.value("serial").toString());
         } else if (brand == "BambuLab") {
             if (!printer.contains("hostname") || !printer.contains("accessCode") || !printer.value("hostname").isString() || !printer.value("accessCode").isString()) continue;
             BambuLab* bbl = new BambuLab(
@@ -46,10 +64,155 @@ void PrinterManager::loadConfig(QJsonObject config){
                 printer.value("port").toInteger(8883)
             );
             bbl->setStorageType(printer.value("storageType").toString("sdcard"));
-            addPrinter(bbl);
+            bbl->setEmulatorAccessCode(printer.value("emulatorAccessCode").toString());
+            bbl->setCompaction(printer.value("compaction").toString("none"));
+            quint32 id = addPrinter(bbl);
+            if (printer.value("serial").isString()) printerSerials.insert(id, printer.value("serial").toString());
         } else continue;
     }
     qDebug() << "Loaded Printer Configuration: " << printers;
+
+    health.loadConfig(config.value("health").toObject());
+    transfers.loadConfig(config.value("transfers").toObject());
+
+    QJsonObject stagingConfig = config.value("staging").toObject();
+    preUpload = stagingConfig.value("enabled").toBool(true);
+    stageTimer.setInterval(stagingConfig.value("timeoutSeconds").toInt(600) * 1000);
+
+    QJsonObject preheatConfig = config.value("preheat").toObject();
+    preheatEnabled = preheatConfig.value("enabled").toBool(false);
+    preheatNozzle = preheatConfig.value("nozzle").toInt(170);
+    preheatTimer.setInterval(preheatConfig.value("timeoutSeconds").toInt(600) * 1000);
+    preheatBed = {{"PLA", 60}, {"PETG", 80}, {"ABS", 100}, {"ASA", 100}, {"TPU", 45}, {"PC", 110}, {"PA", 90}};
+    QJsonObject bedTemps = preheatConfig.value("bed").toObject();
+    for (auto it = bedTemps.constBegin(); it != bedTemps.constEnd(); ++it) {
+        preheatBed.insert(it.key().toUpper(), it.value().toInt());
+    }
+
+    QJsonObject discoveryConfig = config.value("discovery").toObject();
+    if (discoveryConfig.value("enabled").toBool(true)) startDiscovery(discoveryConfig);
+}
+
+void PrinterManager::startDiscovery(QJsonObject discoveryConfig) {
+    if (discovery != nullptr) return;
+    discovery = new PrinterDiscovery(
+        discoveryConfig.value("ssdpPort").toInt(2021),
+        discoveryConfig.value("mdnsPort").toInt(5353),
+        QHostAddress(discoveryConfig.value("mdnsGroup").toString("224.0.0.251")),
+        this
+    );
+    discovery->setQueryInterval(discoveryConfig.value("queryIntervalSeconds").toInt(60) * 1000);
+    discovery->setStaleTimeout(discoveryConfig.value("staleAfterSeconds").toInt(1800) * 1000LL);
+    connect(discovery, &PrinterDiscovery::deviceDiscovered, this, &PrinterManager::deviceSeen);
+    connect(discovery, &PrinterDiscovery::deviceAddressChanged, this, [this](const DiscoveredPrinter &device, const QHostAddress &) {
+        deviceSeen(device);
+    });
+    connect(discovery, &PrinterDiscovery::deviceLost, this, &PrinterManager::deviceGone);
+    discovery->start();
+}
+
+qint64 PrinterManager::matchDevice(const DiscoveredPrinter &device) {
+    for (auto it = printerSerials.constBegin(); it != printerSerials.constEnd(); ++it) { //Serial is stable across DHCP leases
+        if (it.value() == device.key) return it.key();
+    }
+    QString address = device.address.toString();
+    for (auto it = printers.constBegin(); it != printers.constEnd(); ++it) {
+        if (it.value()->getBrand() != device.brand) continue;
+        QString host = it.value()->getHostname().section(':', 0, 0);
+        if (host == address && !printerSerials.contains(it.key())) return it.key();
+    }
+    return -1;
+}
+
+void PrinterManager::deviceSeen(const DiscoveredPrinter &device) {
+    qint64 match = matchDevice(device);
+    if (match < 0) {
+        qInfo() << "Unregistered" << device.brand << "printer found:" << device.name << device.address.toString();
+        emit unregisteredPrinterFound(device);
+        return;
+    }
+    quint32 id = match;
+    printerSerials.insert(id, device.key); //Remember the identity so later address changes are followed
+
+    Printer* p = printers.value(id);
+    QString newHostname = device.address.toString();
+    if (device.brand == "Prusa" && device.port != 0 && device.port != 80) newHostname += ":" + QString::number(device.port);
+    QString oldHostname = p->getHostname();
+    if (oldHostname.section(':', 0, 0) == device.address.toString()) return;
+    if (QHostAddress(oldHostname.section(':', 0, 0)).isNull()) return; //Configured by DNS name, the name already follows the printer
+    qInfo() << "Printer" << p->getName() << "address drifted from" << oldHostname << "to" << newHostname;
+    p->setHostname(newHostname);
+    emit printerAddressChanged(id, oldHostname, newHostname);
+}
+
+void PrinterManager::deviceGone(const DiscoveredPrinter &device) {
+    //Discovery has already dropped it from its table, so it no longer shows in unregisteredPrinters()
+    if (matchDevice(device) >= 0) return;
+    qInfo() << "Unregistered" << device.brand << "printer gone:" << device.name << device.address.toString();
+    emit unregisteredPrinterLost(device);
+}
+
+QList<DiscoveredPrinter> PrinterManager::unregisteredPrinters() {
+    QList<DiscoveredPrinter> output;
+    if (discovery == nullptr) return output;
+    const QList<DiscoveredPrinter> devices = discovery->devices();
+    for (const DiscoveredPrinter &d : devices) {
+        if (matchDevice(d) < 0) output.append(d);
+    }
+    return output;
+}
+
+void PrinterManager::connectPrinters() {
+    if (printers.isEmpty()) {
+        emit printersConnected(0, 0);
+        return;
+    }
+    QSharedPointer<int> remaining(new int(printers.size()));
+    QSharedPointer<int> online(new int(0));
+    int total = printers.size();
+    for (auto it = printers.constBegin(); it != printers.constEnd(); ++it) {
+        Printer* p = it.value();
+        QSharedPointer<QMetaObject::Connection> conn(new QMetaObject::Connection);
+        *conn = connect(p, &Printer::connectionUpdated, this, [this, conn, remaining, online, total](bool status) {
+            disconnect(*conn);
+            if (*remaining <= 0) return; //Already reported by the timeout
+            if (status) (*online)++;
+            if (--(*remaining) == 0) emit printersConnected(*online, total);
+        });
+        health.connectPrinter(it.key()); //Supervisor limits how many printers connect at once
+    }
+    QTimer::singleShot(30000, this, [this, remaining, online, total]() { //Don't wait forever on printers that never answer
+        if (*remaining <= 0) return;
+        *remaining = 0;
+        emit printersConnected(*online, total);
+    });
+}
+
+ConnectionSupervisor* PrinterManager::supervisor() {
+    return &health;
+}
+
+TransferScheduler* PrinterManager::transferScheduler() {
+    return &transfers;
+}
+
+QList<quint32> PrinterManager::printerIds() const {
+    return printers.keys();
+}
+
+qint64 PrinterManager::resolveDispatchTarget(quint32 id) {
+    if (!printers.contains(id)) return -1;
+    if (health.isDispatchable(id)) return id;
+    //Jobs are sliced for a model, so only an identical printer can take over
+    Printer* original = printers.value(id);
+    qint64 fallback = -1;
+    for (auto it = printers.constBegin(); it != printers.constEnd(); ++it) {
+        if (it.key() == id || !health.isDispatchable(it.key())) continue;
+        if (it.value()->getBrand() != original->getBrand() || it.value()->getModel() != original->getModel()) continue;
+        if (health.state(it.key()) == HealthState::Online) return it.key();
+        if (fallback < 0) fallback = it.key();
+    }
+    return fallback;
 }
 
 Printer* PrinterManager::getPrinter(quint32 id) {
@@ -60,16 +223,26 @@ Printer* PrinterManager::getPrinter(quint32 id) {
 quint32 PrinterManager::addPrinter(Printer* p) {
     quint32 id = nextId++;
     printers.insert(id, p);
+    health.addPrinter(id, p);
+    p->setTransferScheduler(&transfers);
     if (p->getBrand() == "BambuLab") {
         BambuLab* bblp = dynamic_cast<BambuLab*>(p);
         if (bblp == nullptr) {
             p->setBrand("Unknown");
         } else {
             if (bblEmu == nullptr) {
-                bblEmu = new BambuEmulator();
+                bblEmu = new BambuEmulator(bblEmuConfig, this);
+                QObject::connect(bblEmu, &BambuEmulator::jobLoaded, this, [this](quint32 printerId, const QString &filepath, QMap<QString, QString> properties) {
+                    properties.insert("brand", printers[printerId]->getBrand());
+                    properties.insert("id", QString::number(printerId));
+                    emit this->jobLoaded(printerId, filepath, properties);
+                });
+                QObject::connect(bblEmu, &BambuEmulator::jobInfoLoaded, this, [this](QVariantMap properties) {
+                    emit this->jobInfoLoaded(properties);
+                });
             }
 
-            bblEmu->addPrinter(id, bblp);
+            bblEmu->addPrinter(id, bblp, bblp->getEmulatorAccessCode());
             return id;
         }
     }
@@ -91,20 +264,88 @@ void PrinterManager::removePrinter(quint32 id) {
     if (bblEmu != nullptr && printers[id]->getBrand() == "BambuLab") {
         bblEmu->removePrinter(id);
     }
+    health.removePrinter(id);
     printers.remove(id);
     if (octEmus.contains(id)) {
         octEmus.remove(id);
     }
 }
 
-void PrinterManager::startPrint(quint32 id, const QString &filepath, QJsonObject properties) {
-    if (!printers.contains(id)) return;
-    Printer* p = printers[id];
-    if (p->getBrand() == "BambuLab") {
-        p->startPrint(filepath);
-    } else {
-        p->startPrint(filepath);
+bool PrinterManager::startPrint(quint32 id, const QString &filepath, QJsonObject properties) {
+    qint64 target = resolveDispatchTarget(id);
+    if (target < 0) {
+        qWarning() << "No healthy printer available for job" << filepath;
+        discardStagedJob();
+        cancelPreheat();
+        return false;
     }
+    if (target != id) qInfo() << "Printer" << printers[id]->getName() << "is unhealthy, sending job to" << printers[target]->getName();
+    if (preheatedPrinter != target) cancelPreheat();
+    preheatTimer.stop();
+    preheatedPrinter = -1; //The start G-code takes over the heaters
+    FileDigest digest = jobDigests.take(filepath); //Handed to the printer below now that one was chosen
+    TraceRecorder::instant(digest.jobId, "dispatch", QJsonObject{
+        {"printer", printers[target]->getName()}, {"staged", stagedPrinter == target && stagedFilepath == filepath}, {"rerouted", target != id}
+    });
+    if (stagedPrinter == target && stagedFilepath == filepath) { //Already on the printer, only the start command is left
+        stageTimer.stop();
+        stagedPrinter = -1;
+        stagedFilepath.clear();
+        printers[target]->startStaged(filepath);
+        return true;
+    }
+    discardStagedJob();
+    printers[target]->setFileDigest(filepath, digest);
+    printers[target]->startPrint(filepath);
+    return true;
+}
+
+void PrinterManager::stageJob(quint32 id, const QString &filepath) {
+    discardStagedJob();
+    if (!preUpload) return;
+    qint64 target = resolveDispatchTarget(id);
+    if (target < 0) return;
+    stagedPrinter = target;
+    stagedFilepath = filepath;
+    stageTimer.start();
+    TraceRecorder::instant(jobDigests.value(filepath).jobId, "stage", QJsonObject{{"printer", printers[target]->getName()}});
+    printers[target]->setFileDigest(filepath, jobDigests.value(filepath));
+    printers[target]->stageFile(filepath);
+}
+
+void PrinterManager::registerJob(const QString &filepath, const QMap<QString, QString> &properties) {
+    jobDigests.clear(); //One job is loaded at a time, an earlier one was started or abandoned
+    jobDigests.insert(filepath, FileDigest::fromProperties(properties));
 }
 
+void PrinterManager::forgetJob(const QString &filepath) {
+    jobDigests.remove(filepath);
+}
+
+void PrinterManager::preheatJob(quint32 id, const QMap<QString, QString> &properties) {
+    cancelPreheat();
+    if (!preheatEnabled) return;
+    qint64 target = resolveDispatchTarget(id);
+    if (target < 0 || !printers[target]->isIdle()) return; //Never touch the heaters of a printer that is busy
+    QString filament = properties.value("filamentType").section(';', 0, 0).trimmed().toUpper(); //Multi material jobs list every extruder
+    if (!preheatBed.contains(filament)) return;
+    if (!printers[target]->setTargetTemperatures(preheatNozzle, preheatBed.value(filament))) return; //Prusa has no temperature endpoint
+    preheatedPrinter = target;
+    preheatTimer.start();
+    qDebug() << "Preheating" << printers[target]->getName() << "for" << filament;
+}
 
+void PrinterManager::cancelPreheat() {
+    if (preheatedPrinter < 0) return;
+    preheatTimer.stop();
+    if (printers.contains(preheatedPrinter)) printers[preheatedPrinter]->setTargetTemperatures(0, 0);
+    preheatedPrinter = -1;
+}
+
+void PrinterManager::discardStagedJob() {
+    if (stagedPrinter < 0) return;
+    stageTimer.stop();
+    if (printers.contains(stagedPrinter)) printers[stagedPrinter]->discardStaged(stagedFilepath);
+    stagedPrinter = -1;
+    stagedFilepath.clear();
+}
@@ -6,9 +6,13 @@
 
 
 #include "headers/prusa.h"
+#include "headers/perfregistry.h"
+#include "headers/tracerecorder.h"
+#include "headers/logger.h"
 #include <QHttpMultiPart>
 #include <QFileInfo>
 #include <QJsonObject>
+#include <QJsonDocument>
 
 Prusa::Prusa(QObject* parent) : Printer(parent) {
     //connect(&manager, &QNetworkAccessManager::authenticationRequired, this, &PrusaLink::provideAuth);
@@ -25,6 +29,10 @@ void Prusa::setHostname(QString hostname) {
     this->hostname = hostname;
 }
 
+QString Prusa::getHostname() {
+    return this->hostname;
+}
+
 void Prusa::setApiKey(QString apiKey) {
     this->apiKey = apiKey;
 }
@@ -34,7 +42,61 @@ void Prusa::setStorageType(QString storageType) {
 }
 
 void Prusa::startPrint(const QString &fileName) {
-    sendGCode(fileName);
+    scheduleTransfer(fileName, true, [this, fileName](quint64 ticket) {
+        trackTransfer(ticket, sendGCode(fileName), fileName, true);
+        releaseDigest(fileName); //Print-After-Upload, nothing asks for it after this
+    });
+}
+
+void Prusa::trackTransfer(quint64 ticket, QNetworkReply* reply, const QString &filepath, bool printAfter) {
+    static LatencyHistogram* uploadTime = PerfRegistry::histogram("transfer.prusalink");
+    static PerfCounter* uploadFailures = PerfRegistry::counter("transfer.prusalink_failures");
+    static PerfCounter* uploadBytes = PerfRegistry::counter("transfer.prusalink_bytes");
+    if (reply == nullptr) {
+        uploadFailures->add();
+        return finishTransfer(ticket, false);
+    }
+    QElapsedTimer timer;
+    timer.start();
+    QString jobId = traceJob(filepath);
+    qint64 traceStart = TraceRecorder::now();
+    QObject::connect(reply, &QNetworkReply::uploadProgress, this, [reply](qint64 sent, qint64) {
+        reply->setProperty("bytesSent", sent); //Compacted uploads are smaller than the file on disk
+    });
+    QObject::connect(reply, &QNetworkReply::finished, this, [this, ticket, reply, timer, jobId, traceStart, printAfter]() {
+        bool ok = reply->error() == QNetworkReply::NoError;
+        if (ok) {
+            uploadTime->record(timer.nsecsElapsed() / 1000);
+            uploadBytes->add(reply->property("bytesSent").toLongLong());
+        } else uploadFailures->add();
+        TraceRecorder::span(jobId, printAfter ? "upload" : "staging upload", traceStart, QJsonObject{{"printer", name}, {"protocol", "prusalink"}, {"ok", ok}});
+        if (ok && printAfter) TraceRecorder::instant(jobId, "printer ack", QJsonObject{{"printer", name}}); //Print-After-Upload, the reply is the start
+        finishTransfer(ticket, ok);
+    });
+}
+
+void Prusa::startConnection() {
+    probeConnection(); //PrusaLink is stateless HTTP, connecting is just a status check
+}
+
+void Prusa::probeConnection() {
+    QUrl statusUrl(QString("http://%1/api/v1/status").arg(hostname));
+    QNetworkRequest statusReq(statusUrl);
+    statusReq.setRawHeader("X-Api-Key", apiKey.toUtf8());
+    statusReq.setTransferTimeout(5000);
+
+    QNetworkReply* statusReply = manager.get(statusReq);
+    QObject::connect(statusReply, &QNetworkReply::finished, this, [this, statusReply]() {
+        bool ok = statusReply->error() == QNetworkReply::NoError;
+        if (ok) {
+            latestStatus = QJsonDocument::fromJson(statusReply->readAll()).object();
+        } else {
+            qWarning() << "Prusa status check failed:" << statusReply->errorString();
+        }
+        statusReply->deleteLater();
+        this->connectionStatus = ok;
+        emit this->connectionUpdated(ok);
+    });
 }
 
 /*bool Prusa::testConnection() {
@@ -46,42 +108,159 @@ void Prusa::startPrint(const QString &fileName) {
 
 }*/
 
-void Prusa::sendGCode(QString filepath) {
+void Prusa::stageFile(const QString &filepath) {
+    dropStaged(filepath);
+    quint64 ticket = scheduleTransfer(filepath, false, [this, filepath](quint64 ticket) {
+        if (!staged.contains(filepath) || staged[filepath].ticket != ticket) return cancelTransfer(ticket); //Discarded while queued
+        beginStagedUpload(filepath);
+    });
+    staged.insert(filepath, StagedUpload{ticket});
+}
 
-    //Read gcode file
-    QFileInfo fileInfo(filepath);
-    QFile file = QFile(filepath);
-    if (!file.open(QIODevice::ReadOnly)) {
-        qWarning() << "Cannot open file for upload:" << filepath;
+void Prusa::beginStagedUpload(const QString &filepath) {
+    StagedUpload &upload = staged[filepath];
+    upload.queued = false;
+    QNetworkReply* reply = sendGCode(filepath, false);
+    trackTransfer(upload.ticket, reply, filepath, false);
+    if (reply == nullptr) {
+        bool startNow = upload.startWhenReady;
+        emit fileStaged(filepath, false);
+        if (startNow) startStaged(filepath); //Falls back to a normal upload
+        return;
+    }
+    upload.reply = reply;
+    QObject::connect(reply, &QNetworkReply::finished, this, [this, filepath, reply]() {
+        if (!staged.contains(filepath) || staged[filepath].reply != reply) return; //Discarded meanwhile
+        bool ok = reply->error() == QNetworkReply::NoError;
+        StagedUpload &upload = staged[filepath];
+        upload.reply = nullptr;
+        upload.ready = ok;
+        bool startNow = upload.startWhenReady;
+        emit this->fileStaged(filepath, ok);
+        if (startNow) startStaged(filepath);
+    });
+}
+
+void Prusa::startStaged(const QString &filepath) {
+    if (!staged.contains(filepath)) return startPrint(filepath);
+    StagedUpload &upload = staged[filepath];
+    if (upload.queued || upload.reply != nullptr) { //Still uploading, start the moment it lands
+        upload.startWhenReady = true;
+        if (upload.queued) promoteTransfer(upload.ticket); //The user is waiting now
         return;
     }
-    QByteArray fileData = file.readAll();
-    file.close();
+    bool ready = upload.ready;
+    staged.remove(filepath);
+    if (!ready) return startPrint(filepath); //Staging failed, fall back to a normal upload
+    startStoredFile(remoteFileName(filepath), traceJob(filepath));
+    releaseDigest(filepath);
+}
+
+void Prusa::discardStaged(const QString &filepath) {
+    dropStaged(filepath);
+    releaseDigest(filepath);
+}
+
+void Prusa::dropStaged(const QString &filepath) {
+    if (!staged.contains(filepath)) return;
+    StagedUpload upload = staged.take(filepath);
+    if (upload.queued) return cancelTransfer(upload.ticket);
+    if (upload.reply != nullptr) { //PrusaLink drops incomplete uploads
+        upload.reply->abort();
+        return;
+    }
+    if (!upload.ready) return;
+    QUrl fileUrl(QString("http://%1/api/v1/files/%2/%3").arg(hostname, storageType, remoteFileName(filepath)));
+    QNetworkRequest deleteReq(fileUrl);
+    deleteReq.setRawHeader("X-Api-Key", apiKey.toUtf8());
+    QNetworkReply* deleteReply = manager.deleteResource(deleteReq);
+    QObject::connect(deleteReply, &QNetworkReply::finished, deleteReply, [deleteReply]() {
+        if (deleteReply->error() != QNetworkReply::NoError) qWarning() << "Failed to remove staged file:" << deleteReply->errorString();
+        deleteReply->deleteLater();
+    });
+}
+
+bool Prusa::isIdle() {
+    QString state = latestStatus.value("printer").toObject().value("state").toString();
+    return state == "IDLE" || state == "READY" || state == "FINISHED" || state == "STOPPED";
+}
+
+void Prusa::startStoredFile(const QString &fileName, const QString &jobId) {
+    //POST to a stored file starts printing it
+    QUrl fileUrl(QString("http://%1/api/v1/files/%2/%3").arg(hostname, storageType, fileName));
+    QNetworkRequest startReq(fileUrl);
+    startReq.setRawHeader("X-Api-Key", apiKey.toUtf8());
+    QNetworkReply* startReply = manager.post(startReq, QByteArray());
+    qint64 traceStart = TraceRecorder::now();
+    QObject::connect(startReply, &QNetworkReply::finished, this, [this, startReply, jobId, traceStart]() {
+        bool ok = startReply->error() == QNetworkReply::NoError;
+        TraceRecorder::span(jobId, "start command", traceStart, QJsonObject{{"printer", name}, {"ok", ok}});
+        if (ok) TraceRecorder::instant(jobId, "printer ack", QJsonObject{{"printer", name}});
+        if (startReply->error() != QNetworkReply::NoError) {
+            qWarning() << "Start print failed:" << startReply->errorString();
+            emit this->healthReport(false, "start failed: " + startReply->errorString());
+        } else {
+            emit this->healthReport(true, "");
+        }
+        startReply->deleteLater();
+    });
+}
+
+QString Prusa::remoteFileName(const QString &filepath) {
+    QString fileName = QFileInfo(filepath).fileName();
+    return GCodeCompactor::outputName(fileName, GCodeCompactor::modeFor(compaction, fileName));
+}
+
+QNetworkReply* Prusa::sendGCode(QString filepath, bool printAfterUpload) {
+    if (!spoolIntact(filepath)) return nullptr;
 
     //upload the file to the printer via its API
-    QUrl uploadUrl(QString("http://%1/api/v1/files/%2/%3").arg(hostname, storageType, fileInfo.fileName()));
+    QUrl uploadUrl(QString("http://%1/api/v1/files/%2/%3").arg(hostname, storageType, remoteFileName(filepath)));
     QNetworkRequest uploadReq(uploadUrl);
     uploadReq.setHeader(QNetworkRequest::ContentTypeHeader, "application/octet-stream");
-    uploadReq.setHeader(QNetworkRequest::ContentLengthHeader, QByteArray::number(fileData.size()));
     uploadReq.setRawHeader("X-Api-Key", apiKey.toUtf8());
-    uploadReq.setRawHeader("Print-After-Upload", "?1"); //Ensure the print starts imidately
+    if (printAfterUpload) uploadReq.setRawHeader("Print-After-Upload", "?1"); //Ensure the print starts imidately
     uploadReq.setRawHeader("Overwrite", "?1");
 
-
-    QNetworkReply *uploadReply = manager.put(uploadReq, fileData);
+    QNetworkReply *uploadReply = nullptr;
+    GCodeCompactor* compactor = createCompactor(filepath, true); //Every PrusaLink printer with a v1 API reads bgcode
+    if (compactor != nullptr) {
+        //PrusaLink wants a Content-Length, so the network stack collects the compacted stream before sending
+        compactor->open(QIODevice::ReadOnly);
+        uploadReply = manager.put(uploadReq, compactor);
+        compactor->setParent(uploadReply);
+    } else {
+        //Read gcode file
+        QFile file = QFile(filepath);
+        if (!file.open(QIODevice::ReadOnly)) {
+            qWarning() << "Cannot open file for upload:" << filepath;
+            return nullptr;
+        }
+        QByteArray fileData = file.readAll();
+        file.close();
+        uploadReq.setHeader(QNetworkRequest::ContentLengthHeader, QByteArray::number(fileData.size()));
+        uploadReply = manager.put(uploadReq, fileData);
+    }
 
     //When uploadreply recieved
     QObject::connect(uploadReply, &QNetworkReply::finished, uploadReply, [=]() {
         //Log if the upload succeeded or failed
+        if (uploadReply->error() == QNetworkReply::OperationCanceledError) { //Staged upload discarded, not a printer fault
+            uploadReply->deleteLater();
+            return;
+        }
         if (uploadReply->error() != QNetworkReply::NoError) {
             qWarning() << "Upload failed:" << uploadReply->errorString();
+            emit this->healthReport(false, "upload failed: " + uploadReply->errorString());
             uploadReply->deleteLater();
             return;
         }
         QByteArray resp = uploadReply->readAll();
-        qDebug() << "Upload succeeded response:" << resp;
+        qCDebug(lcPrusa) << "Upload succeeded response:" << resp;
+        emit this->healthReport(true, "");
         uploadReply->deleteLater();
     });
+    return uploadReply;
 }
 
 /*void PrusaLink::sendGCode(QString filepath, QString hostname, QString password, QString storageName) {
@@ -116,7 +295,7 @@ void Prusa::sendGCode(QString filepath) {
             return;
         }
         QByteArray resp = uploadReply->readAll();
-        qDebug() << "Upload succeeded response:" << resp;
+        qCDebug(lcPrusa) << "Upload succeeded response:" << resp;
 
         // 2) Start the print job
         QUrl printUrl(QString("http://%1/api/v1/job").arg(hostname));
@@ -137,7 +316,7 @@ void Prusa::sendGCode(QString filepath) {
             if (printReply->error() != QNetworkReply::NoError) {
                 qWarning() << "Start print failed:" << printReply->errorString();
             } else {
-                qDebug() << "Print started, response:" << printReply->readAll();
+                qCDebug(lcPrusa) << "Print started, response:" << printReply->readAll();
             }
             printReply->deleteLater();
         });
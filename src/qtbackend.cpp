@@ -9,22 +9,27 @@
 #include <QDebug>
 #include <QUrl>
 #include "headers/gcodeparser.h"
+#include "headers/perfregistry.h"
+#include "headers/tracerecorder.h"
+#include "headers/logger.h"
 #include <QSqlQuery>
 #include <QSqlError>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QDir>
+#include <QJsonDocument>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <functional>
 #include <QRegularExpression>
 #include <QQmlContext>
 #include "headers/errorhandler.hpp"
 
 
 
-QTBackend::QTBackend(QQmlApplicationEngine* eng, QObject* parent) : QObject(parent) {
+QTBackend::QTBackend(QQmlApplicationEngine* eng, QObject* parent) : QObject(parent), users(&dbs), quotas(&dbs), roster(&dbs), journal(&dbs), archive(&dbs), metrics(&pm) {
     ErrorHandler::bk = this;
-    db = QSqlDatabase::addDatabase("QSQLITE");
-    db.setDatabaseName("kioskdb.db");
-
-    if (!db.open()) { //Ensure DB connection
-        Error::handle("DatabaseConnectionError", "Unable to open database", El::Fatal); //Should exit program
-    }
 
     engine = eng;
     engine->rootContext()->setContextProperty("backend", this);
@@ -32,81 +37,273 @@ QTBackend::QTBackend(QQmlApplicationEngine* eng, QObject* parent) : QObject(pare
 
     connect(this, &QTBackend::printLoaded, this, &QTBackend::jobLoaded);
     connect(&pm, &PrinterManager::jobLoaded, this, &QTBackend::jobLoaded);
+    connect(&roster, &RosterImporter::progress, this, [this](int processed, int total) {
+        emit tPrint(QString("Imported %1 / %2 rows").arg(processed).arg(total));
+    });
+    connect(&roster, &RosterImporter::finished, this, &QTBackend::rosterImported);
+    connect(&commands, &CommandEngine::output, this, &QTBackend::tPrint);
+    registerCommands();
 
 }
 
 
-//Utility functions
+bool QTBackend::openDatabase() {
+    db = QSqlDatabase::addDatabase("QSQLITE");
+    db.setDatabaseName("kioskdb.db");
 
-Error QTBackend::queryDatabase(const QString &query) {
-    QSqlQuery q; //Create query
-    q.prepare(query); //Prepare query
-    if(q.exec()) { //execute the query and return result
-        return Error::None();
-    } else {
-        return Error("DatabaseQueryError", q.lastError().text(), El::Warning);
+    if (!db.open()) { //Ensure DB connection
+        Error::handle("DatabaseConnectionError", "Unable to open database", El::Fatal); //Should exit program
+        return false;
     }
+    statements.setDatabase(db);
+
+    //WAL lets readers run during the accounting write, NORMAL only syncs at checkpoints and stays consistent on power loss
+    ErrorHandler::softHandle(queryDatabase("PRAGMA journal_mode=WAL"));
+    ErrorHandler::softHandle(queryDatabase("PRAGMA synchronous=NORMAL"));
+    ErrorHandler::softHandle(queryDatabase("PRAGMA busy_timeout=5000"));
+
+    //Older databases predate the print log file hash
+    QSqlQuery columns("PRAGMA table_info(printLog)");
+    bool hasFileHash = false;
+    while (columns.next()) {
+        if (columns.value("name").toString() == "fileHash") hasFileHash = true;
+    }
+    if (!hasFileHash) ErrorHandler::softHandle(queryDatabase("ALTER TABLE printLog ADD COLUMN fileHash TEXT"));
+    ErrorHandler::softHandle(migrateUsageRollups());
+    ErrorHandler::softHandle(migrateJournal());
+    ErrorHandler::softHandle(migrateArchive());
+
+    //Card scans and print accounting go through a second connection so a locked or slow disk can't stall the UI
+    if (!dbs.start(db.databaseName())) {
+        Error::handle("DatabaseConnectionError", "Unable to start database service", El::Fatal);
+        return false;
+    }
+    users.load();
+    return true;
 }
 
-Eo<QMap<QString, QVariant>> QTBackend::queryDatabase(const QString &query, const QMap<QString, QVariant> &values) {
-    using eop = Eo<QMap<QString, QVariant>>;
-    QSqlQuery q; //Create query
-    q.prepare(query); //Prepare query
-    for (auto it = values.constBegin(); it != values.constEnd(); ++it) { //insert values (parameterized to prevent sql injection vulnerability)
-        q.bindValue((it.key().startsWith(":")) ? it.key() : ":" + it.key(), it.value());
+
+Error QTBackend::migrateUsageRollups() {
+    //Indexes for staff lookups into the raw log
+    const QStringList indexes = {
+        "CREATE INDEX IF NOT EXISTS printLogUser ON printLog (user, timestamp)",
+        "CREATE INDEX IF NOT EXISTS printLogPrinter ON printLog (printerName, timestamp)",
+        "CREATE INDEX IF NOT EXISTS printLogTimestamp ON printLog (timestamp)"
+    };
+    for (const QString &index : indexes) {
+        Error e = queryDatabase(index);
+        if (e.isError()) return e;
     }
+    //Edits to a logged print move its totals, takes OLD out like the delete trigger and puts NEW in like the insert trigger
+    const QString updateTrigger =
+        "CREATE TRIGGER IF NOT EXISTS printLogRollupUpdate AFTER UPDATE OF user, printerName, timestamp, durationHours, weight ON printLog BEGIN "
+            "UPDATE usageByUser SET jobs = jobs - 1, hours = hours - OLD.durationHours, grams = grams - OLD.weight WHERE user = OLD.user; "
+            "UPDATE usageByPrinter SET jobs = jobs - 1, hours = hours - OLD.durationHours, grams = grams - OLD.weight WHERE printerName = OLD.printerName; "
+            "UPDATE usageByDay SET jobs = jobs - 1, hours = hours - OLD.durationHours, grams = grams - OLD.weight WHERE day = date(CAST(OLD.timestamp AS INTEGER), 'unixepoch', 'localtime'); "
+            "INSERT INTO usageByUser (user, jobs, hours, grams, lastPrint) VALUES (NEW.user, 1, NEW.durationHours, NEW.weight, CAST(NEW.timestamp AS INTEGER)) "
+                "ON CONFLICT (user) DO UPDATE SET jobs = jobs + 1, hours = hours + excluded.hours, grams = grams + excluded.grams, lastPrint = max(ifnull(lastPrint, 0), excluded.lastPrint); "
+            "INSERT INTO usageByPrinter (printerName, jobs, hours, grams, lastPrint) VALUES (NEW.printerName, 1, NEW.durationHours, NEW.weight, CAST(NEW.timestamp AS INTEGER)) "
+                "ON CONFLICT (printerName) DO UPDATE SET jobs = jobs + 1, hours = hours + excluded.hours, grams = grams + excluded.grams, lastPrint = max(ifnull(lastPrint, 0), excluded.lastPrint); "
+            "INSERT INTO usageByDay (day, jobs, hours, grams) VALUES (date(CAST(NEW.timestamp AS INTEGER), 'unixepoch', 'localtime'), 1, NEW.durationHours, NEW.weight) "
+                "ON CONFLICT (day) DO UPDATE SET jobs = jobs + 1, hours = hours + excluded.hours, grams = grams + excluded.grams; "
+        "END";
+    auto existing = queryRow<int>("SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'usageByUser'", {});
+    if (existing.isError()) return *existing.error();
+    if (std::get<0>(existing.get()) > 0) return queryDatabase(updateTrigger); //Rollups created before the update trigger existed
+
+    //Rollups are kept current by triggers so staff queries read one row per user, printer or day
+    const QStringList schema = {
+        "CREATE TABLE usageByUser (user TEXT PRIMARY KEY, jobs INTEGER NOT NULL DEFAULT 0, hours REAL NOT NULL DEFAULT 0, grams REAL NOT NULL DEFAULT 0, lastPrint INTEGER)",
+        "CREATE TABLE usageByPrinter (printerName TEXT PRIMARY KEY, jobs INTEGER NOT NULL DEFAULT 0, hours REAL NOT NULL DEFAULT 0, grams REAL NOT NULL DEFAULT 0, lastPrint INTEGER)",
+        "CREATE TABLE usageByDay (day TEXT PRIMARY KEY, jobs INTEGER NOT NULL DEFAULT 0, hours REAL NOT NULL DEFAULT 0, grams REAL NOT NULL DEFAULT 0)",
+        "CREATE INDEX usageByUserHours ON usageByUser (hours)",
+        "CREATE TRIGGER printLogRollupInsert AFTER INSERT ON printLog BEGIN "
+            "INSERT INTO usageByUser (user, jobs, hours, grams, lastPrint) VALUES (NEW.user, 1, NEW.durationHours, NEW.weight, CAST(NEW.timestamp AS INTEGER)) "
+                "ON CONFLICT (user) DO UPDATE SET jobs = jobs + 1, hours = hours + excluded.hours, grams = grams + excluded.grams, lastPrint = max(ifnull(lastPrint, 0), excluded.lastPrint); "
+            "INSERT INTO usageByPrinter (printerName, jobs, hours, grams, lastPrint) VALUES (NEW.printerName, 1, NEW.durationHours, NEW.weight, CAST(NEW.timestamp AS INTEGER)) "
+                "ON CONFLICT (printerName) DO UPDATE SET jobs = jobs + 1, hours = hours + excluded.hours, grams = grams + excluded.grams, lastPrint = max(ifnull(lastPrint, 0), excluded.lastPrint); "
+            "INSERT INTO usageByDay (day, jobs, hours, grams) VALUES (date(CAST(NEW.timestamp AS INTEGER), 'unixepoch', 'localtime'), 1, NEW.durationHours, NEW.weight) "
+                "ON CONFLICT (day) DO UPDATE SET jobs = jobs + 1, hours = hours + excluded.hours, grams = grams + excluded.grams; "
+        "END",
+        "CREATE TRIGGER printLogRollupDelete AFTER DELETE ON printLog BEGIN "
+            "UPDATE usageByUser SET jobs = jobs - 1, hours = hours - OLD.durationHours, grams = grams - OLD.weight WHERE user = OLD.user; "
+            "UPDATE usageByPrinter SET jobs = jobs - 1, hours = hours - OLD.durationHours, grams = grams - OLD.weight WHERE printerName = OLD.printerName; "
+            "UPDATE usageByDay SET jobs = jobs - 1, hours = hours - OLD.durationHours, grams = grams - OLD.weight WHERE day = date(CAST(OLD.timestamp AS INTEGER), 'unixepoch', 'localtime'); "
+        "END",
+        updateTrigger,
+        //History from before the rollups existed, once
+        "INSERT INTO usageByUser (user, jobs, hours, grams, lastPrint) "
+            "SELECT user, COUNT(*), total(durationHours), total(weight), MAX(CAST(timestamp AS INTEGER)) FROM printLog GROUP BY user",
+        "INSERT INTO usageByPrinter (printerName, jobs, hours, grams, lastPrint) "
+            "SELECT printerName, COUNT(*), total(durationHours), total(weight), MAX(CAST(timestamp AS INTEGER)) FROM printLog GROUP BY printerName",
+        "INSERT INTO usageByDay (day, jobs, hours, grams) "
+            "SELECT date(CAST(timestamp AS INTEGER), 'unixepoch', 'localtime'), COUNT(*), total(durationHours), total(weight) FROM printLog GROUP BY 1"
+    };
+    if (!db.transaction()) return Error("DatabaseTransactionError", db.lastError().text(), El::Warning);
+    for (const QString &statement : schema) {
+        QSqlQuery q(db); //One-off DDL, not worth a cached statement
+        if (!q.exec(statement)) {
+            Error e("DatabaseMigrationError", q.lastError().text(), El::Warning);
+            db.rollback();
+            return e;
+        }
+    }
+    if (!db.commit()) return Error("DatabaseTransactionError", db.lastError().text(), El::Warning);
+    qInfo() << "Created usage rollup tables";
+    return Error::None();
+}
 
-    QList bound = q.boundValues();
-    for (auto it = bound.constBegin(); it != bound.constEnd(); ++it) {
-        if (!it->isValid()) {
-            return eop("DatabaseQueryBindError", "Failed to bind values", El::Trivial);
+
+Error QTBackend::migrateJournal() {
+    //Runs on every open, dropping and recreating users or printLog takes their triggers with them
+    auto existing = queryRow<int>("SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'journal'", {});
+    if (existing.isError()) return *existing.error();
+    bool created = std::get<0>(existing.get()) == 0;
+    auto hasUsers = queryRow<int>("SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'users'", {});
+    if (hasUsers.isError()) return *hasUsers.error();
+
+    //Append-only event log for central sync, filled by triggers so every writer is covered in the same transaction
+    const QString printPayload = "json_object('printer', %1.printerName, 'model', %1.printer, 'user', %1.user, 'hours', %1.durationHours, 'grams', %1.weight, "
+                                 "'filament', %1.filament, 'file', %1.filename, 'hash', %1.fileHash, 'timestamp', CAST(%1.timestamp AS INTEGER))";
+    QStringList schema = {
+        "CREATE TABLE IF NOT EXISTS journal (seq INTEGER PRIMARY KEY AUTOINCREMENT, kind TEXT NOT NULL, createdAt INTEGER NOT NULL, payload TEXT NOT NULL)",
+        "CREATE TABLE IF NOT EXISTS journalState (key TEXT PRIMARY KEY, value)",
+        "CREATE TRIGGER IF NOT EXISTS journalNoUpdate BEFORE UPDATE ON journal BEGIN SELECT RAISE(ABORT, 'journal is append-only'); END",
+        "CREATE TRIGGER IF NOT EXISTS journalNoDelete BEFORE DELETE ON journal BEGIN SELECT RAISE(ABORT, 'journal is append-only'); END",
+        //Recreated every open so older trigger bodies are replaced, strftime instead of unixepoch() keeps SQLite before 3.38 working
+        "DROP TRIGGER IF EXISTS journalPrint",
+        "CREATE TRIGGER journalPrint AFTER INSERT ON printLog BEGIN "
+            "INSERT INTO journal (kind, createdAt, payload) VALUES ('print', CAST(strftime('%s', 'now') AS INTEGER), " + printPayload.arg("NEW") + "); "
+        "END"
+    };
+    if (std::get<0>(hasUsers.get()) > 0) { //A fresh database gets this once the users table exists
+        schema.append("DROP TRIGGER IF EXISTS journalTraining");
+        schema.append("CREATE TRIGGER journalTraining AFTER UPDATE OF trainingCompleted ON users WHEN NEW.trainingCompleted AND NOT ifnull(OLD.trainingCompleted, 0) BEGIN "
+                          "INSERT INTO journal (kind, createdAt, payload) VALUES ('training', CAST(strftime('%s', 'now') AS INTEGER), json_object('user', NEW.id)); "
+                      "END");
+    }
+    //Prints from before the journal existed, once and in log order
+    if (created) schema.append("INSERT INTO journal (kind, createdAt, payload) SELECT 'print', CAST(timestamp AS INTEGER), " + printPayload.arg("printLog") + " FROM printLog ORDER BY rowid");
+    if (!db.transaction()) return Error("DatabaseTransactionError", db.lastError().text(), El::Warning);
+    for (const QString &statement : std::as_const(schema)) {
+        QSqlQuery q(db);
+        if (!q.exec(statement)) {
+            Error e("DatabaseMigrationError", q.lastError().text(), El::Warning);
+            db.rollback();
+            return e;
         }
     }
-    bool success = q.exec(); //execute the query
-    if (!success || !q.isActive() || !q.isValid() || !q.next()) {
-        return eop("DatabaseQueryError", q.lastError().text(), El::Warning);
+    if (!db.commit()) return Error("DatabaseTransactionError", db.lastError().text(), El::Warning);
+    if (created) qInfo() << "Created print journal";
+    return Error::None();
+}
+
+
+Error QTBackend::migrateArchive() {
+    //One row per stored file, one index entry per time it was printed
+    const QStringList schema = {
+        "CREATE TABLE IF NOT EXISTS archive (hash TEXT PRIMARY KEY, fileName TEXT, size INTEGER, storedSize INTEGER, createdAt INTEGER, lastUsed INTEGER, model TEXT)",
+        "CREATE INDEX IF NOT EXISTS archiveLastUsed ON archive (lastUsed)",
+        "CREATE VIRTUAL TABLE IF NOT EXISTS archiveIndex USING fts5(fileName, user, printer, metadata, hash UNINDEXED, printedAt UNINDEXED)"
+    };
+    for (const QString &statement : schema) {
+        QSqlQuery q(db);
+        if (!q.exec(statement)) return Error("DatabaseMigrationError", q.lastError().text(), El::Warning);
+    }
+    //Archives from before reprints were tied to a printer model
+    QSqlQuery columns("PRAGMA table_info(archive)", db);
+    bool hasModel = false;
+    while (columns.next()) {
+        if (columns.value("name").toString() == "model") hasModel = true;
     }
+    if (!hasModel) {
+        QSqlQuery q(db);
+        if (!q.exec("ALTER TABLE archive ADD COLUMN model TEXT")) return Error("DatabaseMigrationError", q.lastError().text(), El::Warning);
+    }
+    return Error::None();
+}
+
+
+//Utility functions
+
+QSqlQuery* QTBackend::runQuery(const QString &query, const QMap<QString, QVariant> &values, std::optional<Error> &error) {
+    QSqlQuery* q = statements.acquire(query); //Prepared once per SQL text
+    if (q == nullptr) {
+        error.emplace("DatabaseQueryError", statements.lastPrepareError(), El::Warning);
+        return nullptr;
+    }
+    for (auto it = values.constBegin(); it != values.constEnd(); ++it) { //insert values (parameterized to prevent sql injection vulnerability)
+        q->bindValue((it.key().startsWith(":")) ? it.key() : ":" + it.key(), it.value());
+    }
+    const QVariantList bound = q->boundValues();
+    for (const QVariant &value : bound) {
+        if (!value.isValid()) {
+            error.emplace("DatabaseQueryBindError", "Failed to bind values", El::Trivial);
+            return nullptr;
+        }
+    }
+    QElapsedTimer timer;
+    timer.start();
+    bool success = q->exec(); //execute the query
+    statements.recordExecution(timer.nsecsElapsed());
+    if (!success || !q->isActive()) {
+        error.emplace("DatabaseQueryError", q->lastError().text(), El::Warning);
+        return nullptr;
+    }
+    return q;
+}
+
+Error QTBackend::queryDatabase(const QString &query) {
+    return execute(query, {});
+}
+
+Error QTBackend::execute(const QString &query, const QMap<QString, QVariant> &values) {
+    std::optional<Error> error;
+    QSqlQuery* q = runQuery(query, values, error);
+    if (q == nullptr) return *error;
+    q->finish();
+    return Error::None();
+}
+
+Eo<QMap<QString, QVariant>> QTBackend::queryDatabase(const QString &query, const QMap<QString, QVariant> &values) {
+    using eop = Eo<QMap<QString, QVariant>>;
+    std::optional<Error> error;
+    QSqlQuery* q = runQuery(query, values, error);
+    if (q == nullptr) return eop(*error);
+    if (!q->next()) return eop("DatabaseQueryError", "No matching row", El::Warning);
 
     QMap<QString, QVariant> output;
-    QSqlRecord rec = q.record();
+    QSqlRecord rec = q->record();
     for (int i = 0; i < rec.count(); i++) {
         output.insert(rec.fieldName(i), rec.value(i));
     }
-
+    q->finish();
     return eop(output);
 }
 
 Eo<QList<QMap<QString, QVariant>>> QTBackend::queryDatabaseMultirow(const QString &query, const QMap<QString, QVariant> &values) {
     using eop = Eo<QList<QMap<QString, QVariant>>>;
-    QSqlQuery q; //Create query
-    q.prepare(query); //Prepare query
-    for (auto it = values.constBegin(); it != values.constEnd(); ++it) { //insert values (parameterized to prevent sql injection vulnerability)
-        q.bindValue((it.key().startsWith(":")) ? it.key() : ":" + it.key(), it.value());
-    }
-
-    QList bound = q.boundValues();
-    for (auto it = bound.constBegin(); it != bound.constEnd(); ++it) {
-        if (!it->isValid()) {
-            return eop("DatabaseQueryBindError", "Failed to bind values", El::Trivial);
-        }
-    }
-    bool success = q.exec(); //execute the query
-    if (!success || !q.isActive() || !q.isValid()) {
-        return eop("DatabaseQueryError", q.lastError().text(), El::Warning);
-    }
+    std::optional<Error> error;
+    QSqlQuery* q = runQuery(query, values, error);
+    if (q == nullptr) return eop(*error);
 
     QList<QMap<QString, QVariant>> output;
-    while (q.next()) {
-        QSqlRecord rec = q.record();
+    while (q->next()) {
+        QSqlRecord rec = q->record();
         QMap<QString, QVariant> r;
         for (int i = 0; i < rec.count(); i++) {
             r.insert(rec.fieldName(i), rec.value(i));
         }
         output.append(r);
     }
+    q->finish();
     return eop(output);
 }
 
+QString QTBackend::databaseStats() const {
+    return statements.summary() + "\nService: " + dbs.summary() + "\nUsers: " + users.summary() + "\nQuotas: " + quotas.summary() + "\nJournal: " + journal.summary() + "\nArchive: " + archive.summary();
+}
+
 double QTBackend::parseDuration(const QString &durationString) {
     //Regex pattern to extract numbers from string
     static QRegularExpression regex(R"((?:(\d+(?:\.\d+)?)h)?\s*(?:(\d+(?:\.\d+)?)m)?\s*(?:(\d+(?:\.\d+)?)s)?)");
@@ -178,9 +375,10 @@ void QTBackend::bringWindowToFront(DWORD pid) {
 }
 
 AppState QTBackend::appstate() {
-    bool err = false;
-    int prop = root->property("appstate").toInt(&err);
-    if (err) return AppState::Idle;
+    if (root == nullptr) return AppState::Idle;
+    bool ok = false;
+    int prop = root->property("appstate").toInt(&ok); //ok is true on success
+    if (!ok) return AppState::Idle;
     return static_cast<AppState>(prop);
 }
 
@@ -189,8 +387,15 @@ AppState QTBackend::appstate() {
 
 
 Q_INVOKABLE void QTBackend::fileUploaded(const QUrl &fileUrl) {
-    QString filepath = fileUrl.toLocalFile(); //get filepath from url
-    QMap<QString, QString> properties = GCodeParser::parseFile(filepath); //parse the gcode
+    loadPrintFile(fileUrl.toLocalFile(), loadedPrinterId); //get filepath from url
+}
+
+void QTBackend::loadPrintFile(const QString &filepath, quint32 printerId) {
+    QString jobId = TraceRecorder::newJob();
+    qint64 parseStart = TraceRecorder::now();
+    QMap<QString, QString> properties = GCodeStreamParser::parseLocalFile(filepath); //parse and hash the gcode in one read
+    TraceRecorder::span(jobId, "parse", parseStart, QJsonObject{{"source", "local"}, {"file", properties.value("filename")}});
+    properties.insert("jobId", jobId);
     qDebug() << properties;
     QVariantMap propertiesForJS; //convert properties to QVariantMap for QML
     for (auto it = properties.constBegin(); it != properties.constEnd(); ++it) {
@@ -199,46 +404,327 @@ Q_INVOKABLE void QTBackend::fileUploaded(const QUrl &fileUrl) {
 
     //emit signals to main loop and QML to update appstate and load print files
     emit printInfoLoaded(propertiesForJS);
-    emit printLoaded(loadedPrinterId, filepath, properties);
+    emit printLoaded(printerId, filepath, properties);
 }
 
 Q_INVOKABLE void QTBackend::processCommand(const QString &command, const QString &tcltxt, const QString &tcctxt) {
-    QStringList directives = command.split(" ");
-    for (int i = 0; i < directives.length(); i++) {
-        QString directive = directives[i];
-        if (directive.startsWith("\"") && !directive.endsWith("\"")) {
-            int start = i;
-            QStringList toMerge;
-            toMerge.append(directive);
-            while(++i < directives.length() && !directives[i].endsWith("\"")) {
-                toMerge.append(directives[i]);
+    commands.execute(command, terminalLevel);
+}
+
+Q_INVOKABLE QString QTBackend::completeCommand(const QString &command) {
+    CommandEngine::Completion completion = commands.complete(command, terminalLevel);
+    if (completion.candidates.size() > 1) commands.print(completion.candidates.join("   "));
+    return completion.line;
+}
+
+void QTBackend::registerCommands() {
+    using Arg = CommandEngine::Arg;
+    using Type = CommandEngine::ArgType;
+    using Invocation = CommandEngine::Invocation;
+    auto printerNames = [this]() {
+        QStringList names;
+        for (quint32 id : pm.printerIds()) names.append(pm.getPrinter(id)->getName());
+        return names;
+    };
+
+    commands.add({"help", {}, {Arg{"command", Type::Word, true, [this]() { return commands.names(terminalLevel); }}},
+                  "displays the command list, or how to use one command", 1, [this](const Invocation &cmd) {
+        commands.print(commands.help(cmd.authLevel, cmd.text("command")));
+    }});
+    commands.add({"ver", {"version"}, {}, "displays version information", 1, [this](const Invocation &) {
+        commands.print("PCM 3DPK Version " + version);
+    }});
+    commands.add({"exit", {"quit"}, {}, "exit staff mode and return to user interface", 1, [this](const Invocation &) {
+        terminalLevel = 1;
+        emit setAppmode(0);
+        emit setTerminalContent("", "");
+    }});
+    commands.add({"echo", {}, {Arg{"text", Type::Text, true}}, "print text to console", 1, [this](const Invocation &cmd) {
+        commands.print(cmd.text("text"));
+    }});
+    commands.add({"dbstats", {}, {}, "shows database statement cache and query latency counters", 1, [this](const Invocation &) {
+        commands.print(databaseStats());
+    }});
+    commands.add({"discovered", {}, {}, "lists printers found on the network that are not configured", 1, [this](const Invocation &) {
+        QList<DiscoveredPrinter> found = pm.unregisteredPrinters();
+        if (found.isEmpty()) return commands.print("No unregistered printers found");
+        QStringList lines;
+        for (const DiscoveredPrinter &d : found) { //Print a config entry staff can paste into the printer configuration
+            lines.append(QString("%1 %2 '%3' at %4\n\t{\"brand\": \"%1\", \"model\": \"%2\", \"name\": \"%3\", \"hostname\": \"%4\", \"serial\": \"%5\"}")
+                             .arg(d.brand, d.model, d.name, d.address.toString(), d.key));
+        }
+        commands.print(lines);
+    }});
+    commands.add({"import", {}, {Arg{"path", Type::Text, false, []() { return QStringList{"cancel"}; }}},
+                  "add or update users from a CSV or JSON roster, or cancel the running import", 2, [this](const Invocation &cmd) {
+        QString path = cmd.text("path");
+        if (path == "cancel") {
+            if (!roster.isRunning()) return commands.print("No import running");
+            roster.cancel();
+            return commands.print("Import will stop after the current batch");
+        }
+        if (!QFile::exists(path)) return commands.printError("no such file '" + path + "'"); //printError escapes the whole message
+        if (!roster.start(path, cmd.authLevel)) return commands.printError("an import is already running");
+        commands.print("Importing " + path.toHtmlEscaped());
+    }});
+    commands.add({"reprint", {}, {Arg{"query", Type::Text}}, "find an archived print by file, user, printer or settings and load it again, #n picks from the last search", 1, [this](const Invocation &cmd) {
+        reprint(cmd.text("query"));
+    }});
+    commands.add({"usage", {}, {Arg{"view", Type::Choice, true, []() { return QStringList{"user", "printers", "days", "top"}; }}, Arg{"value", Type::Word, true}},
+                  "print hours, grams and job totals, for one user id or the last n days or top n users", 1, [this](const Invocation &cmd) {
+        usageReport(cmd.tokens);
+    }});
+
+    //Fleet commands, printer state is copied here and formatted off the interface thread
+    commands.add({"printers", {}, {Arg{"name", Type::Text, true, printerNames}}, "lists configured printers with connection health", 1, [this](const Invocation &cmd) {
+        QString only = cmd.text("name");
+        QList<QStringList> rows;
+        for (quint32 id : pm.printerIds()) {
+            Printer* p = pm.getPrinter(id);
+            if (!only.isEmpty() && p->getName().compare(only, Qt::CaseInsensitive) != 0) continue;
+            HealthState state = pm.supervisor()->state(id);
+            rows.append({QString::number(id), p->getName(), p->getBrand() + " " + p->getModel(), p->getHostname(), ConnectionSupervisor::stateName(state),
+                         p->isIdle() ? "idle" : "busy", pm.supervisor()->isBreakerOpen(id) ? "breaker open" : ""});
+        }
+        if (rows.isEmpty()) return commands.print(only.isEmpty() ? "No printers configured" : "No printer named '" + only.toHtmlEscaped() + "'");
+        commands.gather([rows]() {
+            QStringList lines;
+            int online = 0;
+            for (const QStringList &row : rows) {
+                if (row[4] == ConnectionSupervisor::stateName(HealthState::Online)) online++;
+                lines.append(QString("%1 %2 (%3) at %4: %5, %6 %7").arg(row[0], row[1].toHtmlEscaped(), row[2].toHtmlEscaped(), row[3], row[4], row[5], row[6]).trimmed());
             }
-            if (i >= directives.length()) {
-                emit tPrint("<font color='red'>Error: expected closing quotation to match opening quotation at: " + directive + "</font>");
-                return;
+            lines.append(QString("%1 of %2 online").arg(online).arg(rows.size()));
+            return lines;
+        });
+    }});
+    commands.add({"queue", {}, {}, "shows printer uploads running and waiting, and the job waiting for a card", 1, [this](const Invocation &) {
+        QList<TransferScheduler::Status> transfers = pm.transferScheduler()->snapshot();
+        Printer* loadedPrinter = pm.getPrinter(loadedPrinterId);
+        QString pending = loadedPrintFilepath.isEmpty() ? QString() : QFileInfo(loadedPrintFilepath).fileName() + (loadedPrinter ? " for " + loadedPrinter->getName() : QString());
+        commands.gather([transfers, pending]() {
+            QStringList lines;
+            if (!pending.isEmpty()) lines.append("Loaded job: " + pending.toHtmlEscaped());
+            for (const TransferScheduler::Status &t : transfers) {
+                lines.append(QString("#%1 %2 %3, %4 KB, %5 for %6 s%7").arg(t.ticket).arg(t.label.toHtmlEscaped(), t.running ? "sending" : "waiting")
+                                 .arg(t.bytes / 1024).arg(t.interactive ? "interactive" : "background").arg(t.elapsedMs / 1000.0, 0, 'f', 1)
+                                 .arg(t.rate > 0 ? QString(", limited to %1 KB/s").arg(t.rate / 1024) : QString()));
+            }
+            if (transfers.isEmpty()) lines.append("No uploads queued");
+            return lines;
+        });
+    }});
+    commands.add({"cancel", {}, {}, "drops the job waiting for a card, its staged upload and preheat", 1, [this](const Invocation &) {
+        if (loadedPrintFilepath.isEmpty()) return commands.print("No job waiting");
+        pm.discardStagedJob();
+        pm.cancelPreheat();
+        pm.forgetJob(loadedPrintFilepath);
+        scanSerial++; //A lookup still in flight must not start it
+        commands.print("Cancelled " + QFileInfo(loadedPrintFilepath).fileName().toHtmlEscaped());
+        loadedPrintFilepath.clear();
+        loadedPrintInfo.clear();
+        if (root != nullptr) root->setProperty("appstate", AppState::Idle);
+    }});
+    commands.add({"stats", {}, {}, "fleet and print totals for today, the last week and all time", 1, [this](const Invocation &) {
+        int online = 0;
+        QList<quint32> ids = pm.printerIds();
+        for (quint32 id : ids) {
+            if (pm.supervisor()->isDispatchable(id)) online++;
+        }
+        QString fleet = QString("Printers: %1 of %2 available").arg(online).arg(ids.size());
+        dbs.read("SELECT (SELECT COUNT(*) FROM users), (SELECT COUNT(*) FROM users WHERE trainingCompleted), "
+                 "total(jobs) FILTER (WHERE day = date('now', 'localtime')), total(hours) FILTER (WHERE day = date('now', 'localtime')), "
+                 "total(jobs) FILTER (WHERE day > date('now', 'localtime', '-7 days')), total(hours) FILTER (WHERE day > date('now', 'localtime', '-7 days')), "
+                 "total(jobs), total(hours), total(grams) FROM usageByDay").then(this, [this, fleet](Eo<DbRows> result) {
+            if (result.isError() || result.get().isEmpty()) return commands.printError(result.errorString());
+            const DbRow &row = result.get().first();
+            commands.print({fleet,
+                            QString("Users: %1, %2 trained").arg(row[0].toLongLong()).arg(row[1].toLongLong()),
+                            QString("Today: %1 jobs, %2 h").arg(row[2].toLongLong()).arg(row[3].toDouble(), 0, 'f', 1),
+                            QString("Last 7 days: %1 jobs, %2 h").arg(row[4].toLongLong()).arg(row[5].toDouble(), 0, 'f', 1),
+                            QString("All time: %1 jobs, %2 h, %3 kg").arg(row[6].toLongLong()).arg(row[7].toDouble(), 0, 'f', 1).arg(row[8].toDouble() / 1000, 0, 'f', 2)});
+        });
+    }});
+    commands.add({"perf", {}, {Arg{"filter", Type::Word, true, []() { return QStringList{"reset", "json"}; }}, Arg{"file", Type::Word, true}},
+                  "latency histograms and counters, matching a name filter, or reset them, or json writes them to a file in the dumps folder", 1, [this](const Invocation &cmd) {
+        QString filter = cmd.text("filter");
+        if (filter == "reset") {
+            PerfRegistry::reset();
+            return commands.print("Latency histograms and counters cleared");
+        }
+        if (filter == "json") {
+            QString path = dumpPath(cmd.has("file") ? cmd.text("file") : "perf.json");
+            if (path.isEmpty()) return commands.printError("Give a file name only, dumps are written to the dumps folder");
+            return commands.gather([path]() -> QStringList {
+                QSaveFile file(path);
+                if (!file.open(QIODevice::WriteOnly)) return {"<font color='red'>Error: cannot write " + path.toHtmlEscaped() + "</font>"};
+                file.write(QJsonDocument(PerfRegistry::toJson()).toJson());
+                if (!file.commit()) return {"<font color='red'>Error: cannot write " + path.toHtmlEscaped() + "</font>"};
+                return {"Wrote " + path.toHtmlEscaped()};
+            });
+        }
+        QStringList lines = PerfRegistry::report(filter);
+        if (filter.isEmpty()) {
+            lines.append("Statements: " + statements.summary());
+            for (quint32 id : pm.printerIds()) {
+                Printer* p = pm.getPrinter(id);
+                lines.append(QString("Link %1: %2 KB/s estimated").arg(p->getName().toHtmlEscaped()).arg(pm.transferScheduler()->estimatedThroughput(p) / 1024, 0, 'f', 0));
             }
-            toMerge.append(directives[i]);
-            QString merged = toMerge.join(" ");
-            directives.remove(start, i-start);
-            directives.insert(start, merged);
         }
+        commands.print(lines.isEmpty() ? QStringList{"Nothing recorded matches '" + filter.toHtmlEscaped() + "'"} : lines);
+    }});
+    commands.add({"trace", {}, {Arg{"minutes", Type::Number, true}, Arg{"file", Type::Word, true}},
+                  "writes the job traces of the last n minutes, 15 by default, to the dumps folder as a Chrome trace file for Perfetto or chrome://tracing", 1, [this](const Invocation &cmd) {
+        double minutes = cmd.has("minutes") ? cmd.args.value("minutes").toDouble() : 15;
+        if (minutes <= 0) return commands.printError("minutes must be more than 0");
+        QString path = dumpPath(cmd.has("file") ? cmd.text("file") : "trace-" + QDateTime::currentDateTime().toString("yyyyMMdd-HHmmss") + ".json");
+        if (path.isEmpty()) return commands.printError("Give a file name only, dumps are written to the dumps folder");
+        qint64 to = TraceRecorder::now();
+        qint64 from = to - qint64(minutes * 60e6);
+        commands.gather([path, from, to]() -> QStringList {
+            QJsonObject trace = TraceRecorder::exportWindow(from, to);
+            QSaveFile file(path);
+            if (!file.open(QIODevice::WriteOnly)) return {"<font color='red'>Error: cannot write " + path.toHtmlEscaped() + "</font>"};
+            file.write(QJsonDocument(trace).toJson(QJsonDocument::Compact));
+            if (!file.commit()) return {"<font color='red'>Error: cannot write " + path.toHtmlEscaped() + "</font>"};
+            return {QString("Wrote %1 trace events to %2").arg(trace.value("otherData").toObject().value("events").toInteger()).arg(path.toHtmlEscaped())};
+        });
+    }});
+    commands.add({"cache", {}, {}, "hit rates and sizes of the in-memory caches", 1, [this](const Invocation &) {
+        commands.print({"Users: " + users.summary(), "Quotas: " + quotas.summary(), "G-code parser: " + GCodeStreamParser::cacheSummary(), "Archive: " + archive.summary()});
+    }});
+    commands.add({"log", {}, {Arg{"category", Type::Word, true, []() { return QStringList{"default", "kiosk.errors", "kiosk.bambu", "kiosk.prusa", "kiosk.octoprint"}; }},
+                              Arg{"level", Type::Choice, true, []() { return QStringList{"debug", "info", "warning", "critical", "off"}; }}},
+                  "shows the log file and levels, or sets the level of a category until the next restart", 2, [this](const Invocation &cmd) {
+        if (!cmd.has("category")) {
+            QStringList lines = Logger::summary();
+            for (QString &line : lines) line = line.toHtmlEscaped();
+            return commands.print(lines);
+        }
+        if (!cmd.has("level")) return commands.printError("Usage: log [category level]");
+        Logger::setLevel(cmd.text("category"), cmd.text("level"));
+        commands.print(cmd.text("category").toHtmlEscaped() + " logs at " + cmd.text("level") + " and above");
+    }});
+}
+
+void QTBackend::openTerminal(const QString &cardid) {
+    //Staff open the terminal by tapping their card while the kiosk is idle, nobody else gets a lookup
+    const UserRecord* known = users.find(cardid);
+    if (known != nullptr && known->authLevel < 1) return;
+    quint64 scan = ++scanSerial;
+    dbs.read("SELECT firstName, authLevel FROM users WHERE id = :id LIMIT 1", {{":id", cardid}}).then(this, [this, scan](Eo<DbRows> result) {
+        if (scan != scanSerial || appstate() != AppState::Idle) return;
+        if (result.isError() || result.get().isEmpty()) return ErrorHandler::softHandle(result);
+        const DbRow &row = result.get().first();
+        quint8 level = quint8(qBound(0, row[1].toInt(), 255));
+        if (level < 1) return;
+        terminalLevel = level;
+        emit setTerminalUser(row[0].toString(), level);
+        emit setTerminalContent("", "");
+        emit setAppmode(1);
+        commands.print("Type help for the commands available at authorization level " + QString::number(level));
+    });
+}
+
+void QTBackend::reprint(const QString &query) {
+    if (!archive.isEnabled()) return commands.printError("the print archive is disabled");
+    if (query.isEmpty()) return commands.printError("reprint needs search words, or #n to pick from the last search");
+    static const QRegularExpression pick("^#(\\d+)$");
+    QRegularExpressionMatch picked = pick.match(query);
+    if (picked.hasMatch()) {
+        int n = picked.captured(1).toInt();
+        if (n < 1 || n > reprintMatches.size()) return commands.printError("no result #" + picked.captured(1) + " in the last search");
+        return loadArchived(reprintMatches[n - 1]);
     }
-    QString cmd = directives[0].toLower();
-    if (cmd == "help") {
-        emit tPrint("Command List:\n\techo - print text to console\n\texit - exit staff mode and return to user interface\n\thelp - displays the command list\n\tver - displays version information");
-    } else if (cmd == "ver" || cmd == "version") {
-        emit tPrint("PCM 3DPK Version " + version);
-    } else if (cmd == "exit" || cmd == "quit") {
+    archive.search(query).then(this, [this](Eo<QList<PrintArchive::Match>> result) {
+        if (result.isError()) return commands.printError(result.errorString());
+        reprintMatches = result.get();
+        if (reprintMatches.isEmpty()) return commands.print("No archived prints match");
+        if (reprintMatches.size() == 1) return loadArchived(reprintMatches.first());
+        QStringList lines;
+        for (int i = 0; i < reprintMatches.size(); i++) {
+            const PrintArchive::Match &m = reprintMatches[i];
+            lines.append(QString("#%1 %2 - %3 on %4, %5").arg(i + 1).arg(m.fileName.toHtmlEscaped(), m.user.trimmed().toHtmlEscaped(), m.printer.toHtmlEscaped(),
+                                                                          QDateTime::fromSecsSinceEpoch(m.printedAt).toString("yyyy-MM-dd HH:mm")));
+        }
+        lines.append("Use reprint #n to load one");
+        commands.print(lines);
+    });
+}
+
+void QTBackend::loadArchived(const PrintArchive::Match &match) {
+    //The file was sliced for the printer it ran on, it goes back to that printer or nowhere
+    qint64 printerId = -1;
+    for (quint32 id : pm.printerIds()) {
+        if (pm.getPrinter(id)->getName() == match.printer) printerId = id;
+    }
+    if (printerId < 0) return commands.printError("printer " + match.printer + " no longer exists");
+    Printer* printer = pm.getPrinter(quint32(printerId));
+    QString model = printer->getBrand() + " " + printer->getModel();
+    if (!match.model.isEmpty() && match.model != model) {
+        return commands.printError(match.printer + " is now a " + model + ", the file was sliced for a " + match.model);
+    }
+    commands.print("Restoring " + match.fileName.toHtmlEscaped() + " for " + match.printer.toHtmlEscaped());
+    archive.restore(match, [this, printerId](const QString &filepath) {
+        if (filepath.isEmpty()) return commands.printError("the archived file could not be restored");
+        if (pm.getPrinter(quint32(printerId)) == nullptr) return commands.printError("the printer was removed while the file was restored");
+        //Back to the user interface, the job goes through the same card scan and quota checks as an upload
         emit setAppmode(0);
         emit setTerminalContent("", "");
-    } else if (cmd == "echo") {
-        QString echo = directives[1];
-        if (echo.startsWith("\"") && echo.endsWith("\"")) {
-            echo = echo.slice(1, echo.length()-2);
-        }
-        emit tPrint(echo);
-    } else {
-        emit tPrint("<font color='red'>Error: unknown command '" + cmd + "'</font>");
+        loadPrintFile(filepath, quint32(printerId));
+    });
+}
+
+void QTBackend::rosterImported(const RosterImporter::Report &report) {
+    for (const QString &error : report.errors) emit tPrint("<font color='orange'>" + error.toHtmlEscaped() + "</font>");
+    emit tPrint(QString("%1 %2: %3 of %4 rows imported, %5 rejected, %6 replaced by a later row for the same card in %7 s")
+                    .arg(report.cancelled ? "Cancelled" : "Finished", report.file.toHtmlEscaped())
+                    .arg(report.imported).arg(report.rows).arg(report.rejected).arg(report.replaced).arg(report.elapsedMs / 1000.0, 0, 'f', 1));
+    if (report.imported > 0) users.load(); //The service's own writes don't move data_version, swap in the new roster explicitly
+}
+
+void QTBackend::usageReport(const QStringList &args) {
+    auto line = [](const DbRow &row, int first) { //jobs, hours, grams starting at column first
+        return QString("%1 jobs, %2 h, %3 g").arg(row[first].toLongLong()).arg(row[first + 1].toDouble(), 0, 'f', 1).arg(row[first + 2].toDouble(), 0, 'f', 0);
+    };
+    auto report = [this](QFuture<Eo<DbRows>> future, std::function<QString(const DbRow &)> format) {
+        future.then(this, [this, format](Eo<DbRows> result) {
+            if (result.isError()) return commands.printError(result.errorString());
+            if (result.get().isEmpty()) return commands.print("No prints recorded");
+            QStringList lines;
+            for (const DbRow &row : result.get()) lines.append(format(row));
+            commands.print(lines);
+        });
+    };
+    QString view = args.value(0).toLower();
+    int limit = args.value(1).toInt();
+    if (limit <= 0) limit = (view == "top") ? 10 : 7;
+    limit = qMin(limit, 365);
+
+    if (view.isEmpty()) {
+        report(dbs.read("SELECT COUNT(*), total(jobs), total(hours), total(grams) FROM usageByPrinter"), [line](const DbRow &row) {
+            return QString("All printers: ") + line(row, 1);
+        });
+    } else if (view == "user") {
+        QString id = args.value(1);
+        if (id.isEmpty()) return commands.printError("usage user needs a card id");
+        report(dbs.read("SELECT usageByUser.user, users.firstName, users.lastName, jobs, hours, grams FROM usageByUser "
+                        "LEFT JOIN users ON users.id = usageByUser.user WHERE usageByUser.user = :id", {{":id", id}}), [line](const DbRow &row) {
+            return QString("%1 %2 (%3): ").arg(row[1].toString().toHtmlEscaped(), row[2].toString().toHtmlEscaped(), row[0].toString().toHtmlEscaped()) + line(row, 3);
+        });
+    } else if (view == "printers") {
+        report(dbs.read("SELECT printerName, jobs, hours, grams FROM usageByPrinter ORDER BY printerName"), [line](const DbRow &row) {
+            return row[0].toString().toHtmlEscaped() + ": " + line(row, 1);
+        });
+    } else if (view == "days") {
+        report(dbs.read("SELECT day, jobs, hours, grams FROM usageByDay ORDER BY day DESC LIMIT :n", {{":n", limit}}), [line](const DbRow &row) {
+            return row[0].toString().toHtmlEscaped() + ": " + line(row, 1);
+        });
+    } else if (view == "top") {
+        report(dbs.read("SELECT usageByUser.user, users.firstName, users.lastName, jobs, hours, grams FROM usageByUser "
+                        "LEFT JOIN users ON users.id = usageByUser.user ORDER BY hours DESC LIMIT :n", {{":n", limit}}), [line](const DbRow &row) {
+            return QString("%1 %2 (%3): ").arg(row[1].toString().toHtmlEscaped(), row[2].toString().toHtmlEscaped(), row[0].toString().toHtmlEscaped()) + line(row, 3);
+        });
     }
 }
 
@@ -270,11 +756,40 @@ Q_INVOKABLE void QTBackend::orcaButtonClicked() { //Runs when orcaslicer button
 
 void QTBackend::setRoot(QObject* r) {
     root = r;
+    connect(root, SIGNAL(appstateChanged()), this, SLOT(appstateChanged())); //QML property, string based connect
+}
+
+void QTBackend::appstateChanged() {
+    AppState state = appstate();
+    AppState previous = previousAppstate;
+    previousAppstate = state;
+    if (state != AppState::Idle || previous == AppState::Idle || previous == AppState::Loading) return;
+    //Job abandoned, take it back off the printer and let it cool
+    scanSerial++; //Lookups still in flight must not dispatch it
+    pm.discardStagedJob();
+    pm.cancelPreheat();
+    pm.forgetJob(loadedPrintFilepath);
+}
+
+void QTBackend::setIdle() {
+    if (root == nullptr) return;
+    if (appstate() == AppState::Loading) root->setProperty("appstate", AppState::Idle);
+}
+
+PrinterManager* QTBackend::printerManager() {
+    return &pm;
 }
 
 void QTBackend::loadConfig(QJsonObject cfg) {
     config = cfg;
     pm.loadConfig(cfg);
+    quotas.loadConfig(cfg.value("quotas").toObject());
+    journal.loadConfig(cfg.value("journal").toObject());
+    archive.loadConfig(cfg.value("archive").toObject());
+    commands.loadConfig(cfg.value("terminal").toObject());
+    TraceRecorder::setCapacity(cfg.value("trace").toObject().value("capacity").toInt(20000));
+    metrics.loadConfig(cfg.value("metrics").toObject());
+    Logger::loadConfig(cfg.value("logging").toObject());
 }
 
 void QTBackend::showMessage(QString message, QString acceptText, int redirectState) {
@@ -286,111 +801,176 @@ void QTBackend::jobLoaded(quint32 id, const QString &filepath, const QMap<QStrin
     loadedPrintFilepath = filepath; //set filepath
     loadedPrintInfo = printInfo; //set printinfo
     loadedPrinterId = id;
+    pm.registerJob(filepath, printInfo);
+    TraceRecorder::instant(printInfo.value("jobId"), "loaded", QJsonObject{{"file", printInfo.value("filename")}, {"duration", printInfo.value("duration")}});
     root->setProperty("appstate", AppState::Prep); //change QML appstate to show print info
+    pm.stageJob(id, filepath); //Upload while the user reads the job info and taps their card
+    pm.preheatJob(id, printInfo);
 }
 
 void QTBackend::cardScanned(const QString &cardid) {
-    if (appstate() != AppState::UserScan) {
+    AppState state = appstate();
+    if (state == AppState::Idle) return openTerminal(cardid);
+    if (state != AppState::UserScan && state != AppState::StaffScan) return; //If we're not in one of the scan states, ignore the card scan
+    quint64 scan = ++scanSerial; //Lookups finish on the database thread, only the latest scan may act
+    scanTimer.start();
+    scanTraceStart = TraceRecorder::now();
+    if (state == AppState::UserScan) {
         currentUserID = cardid;
         qDebug() << "User card scanned: " + cardid;
+    }
 
-        //Get user info
-        auto result = queryDatabase("SELECT cics, trainingCompleted, authLevel FROM users WHERE id = :id LIMIT 1", {{":id", cardid}});
-        if (result.isError()) {
+    //Get user info, the database is only asked about cards the directory hasn't seen
+    static PerfCounter* directoryHits = PerfRegistry::counter("card.directory_hits");
+    static PerfCounter* directoryMisses = PerfRegistry::counter("card.directory_misses");
+    static LatencyHistogram* lookupTime = PerfRegistry::histogram("card.db_lookup");
+    if (const UserRecord* user = users.find(cardid)) {
+        directoryHits->add();
+        if (state == AppState::UserScan) return authorizeUser(*user, scan);
+        return authorizeStaff(*user, scan);
+    }
+    directoryMisses->add();
+    dbs.read("SELECT cics, trainingCompleted, authLevel FROM users WHERE id = :id LIMIT 1", {{":id", cardid}}).then(this, [this, scan, state, cardid](Eo<DbRows> result) {
+        lookupTime->record(scanTimer.nsecsElapsed() / 1000);
+        if (scan != scanSerial || appstate() != state) return;
+        if (result.isError() || result.get().isEmpty()) {
             ErrorHandler::softHandle(result);
-            return showMessage("Your account is not Registered\nPlease Register at the Check-In Kiosk");
-        }
-        QMap<QString, QVariant> response = result.get();
-        bool isCICS = response.value("cics").toBool();
-        bool training = response.value("trainingCompleted").toBool();
-        int authLevel = response.value("authLevel").toInt();
-
-        //Calculate printDuration
-        double printDuration = parseDuration(loadedPrintInfo["duration"]);
-
-        //Print verification / authorization Logic
-        if (authLevel < 1) { //0 is normal, 1 is staff, 2 is system admin, 3 is supervisor
-
-            //ensure all qualifications are met, show feedback message if not;
-            if (!isCICS) return showMessage("Sorry, but only CICS Students\nMay print at the Physical Computing Makerspace", "I Understand");
-            if (!training) return showMessage("Please ask a staff member for\nour 3D print training and have them\nscan their UCard to continue", "Training Completed", AppState::StaffScan);
-            qDebug() << printDuration;
-            if (printDuration > 6.0) return showMessage("Prints cannot be longer than 6 hours\nPlease split up your print and try again");
+            if (state == AppState::UserScan) return showMessage("Your account is not Registered\nPlease Register at the Check-In Kiosk");
+            return showMessage("This user is not Registered\nPlease ask a staff member for\nour 3D print training and have them\nscan their UCard to continue", "Training Completed", AppState::StaffScan);
         }
-    } else if (appstate() == AppState::StaffScan) {
-        //Staff scan to confirm a user has completed 3D Printing training
+        DbRow row = result.get().first();
+        UserRecord user;
+        user.cics = row[0].toBool();
+        user.trained = row[1].toBool();
+        user.authLevel = quint8(qBound(0, row[2].toInt(), 255));
+        users.insert(cardid, user);
+        if (state == AppState::UserScan) authorizeUser(user, scan);
+        else authorizeStaff(user, scan);
+    });
+}
 
-        //Get staff info
+void QTBackend::authorizeUser(const UserRecord &user, quint64 scan) {
+    //Print verification / authorization Logic
+    if (user.authLevel < 1) { //0 is normal, 1 is staff, 2 is system admin, 3 is supervisor
 
-        auto result = queryDatabase("SELECT authLevel FROM users WHERE id = :id LIMIT 1", {{":id", cardid}});
-        if (result.isError()) {
-            ErrorHandler::softHandle(result);
-            return showMessage("This user is not Registered\nPlease ask a staff member for\nour 3D print training and have them\nscan their UCard to continue", "Training Completed", AppState::StaffScan);
+        //ensure all qualifications are met, show feedback message if not;
+        if (!user.cics) return showMessage("Sorry, but only CICS Students\nMay print at the Physical Computing Makerspace", "I Understand");
+        if (!user.trained) return showMessage("Please ask a staff member for\nour 3D print training and have them\nscan their UCard to continue", "Training Completed", AppState::StaffScan);
+    }
+    authorizeQuota(user.authLevel, scan);
+}
+
+void QTBackend::authorizeQuota(quint8 authLevel, quint64 scan) {
+    //Limits for the user's class, answered from memory once their recent history is cached
+    double printDuration = parseDuration(loadedPrintInfo["duration"]);
+    double weight = loadedPrintInfo["weight"].toDouble();
+    QString filepath = loadedPrintFilepath;
+    quotas.check(currentUserID, authLevel, printDuration, weight, [this, scan, filepath](const QuotaEngine::Decision &decision) {
+        if (!scanStillCurrent(scan, filepath)) return;
+        if (!decision.allowed) {
+            TraceRecorder::span(loadedPrintInfo.value("jobId"), "auth", scanTraceStart, QJsonObject{{"result", "refused"}, {"reason", decision.reason}});
+            return showMessage(decision.reason);
         }
-        int authLevel = result.get().value("authLevel").toInt();
+        dispatchAuthorizedPrint();
+    });
+}
 
-        //Check that the user is staff
-        if (authLevel < 1) return showMessage("This user is not Staff\nPlease ask a staff member for\nour 3D print training and have them\nscan their UCard to continue", "Training Completed", AppState::StaffScan);
+QString QTBackend::dumpPath(const QString &fileName) {
+    //Level 1 staff can write these, so they never get to pick the directory
+    if (fileName.isEmpty() || fileName.startsWith('.') || fileName.contains('/') || fileName.contains('\\') || fileName.contains(':')) return QString();
+    QDir dumps(QDir(QCoreApplication::applicationDirPath()).filePath("dumps"));
+    if (!dumps.mkpath(".")) return QString();
+    return dumps.filePath(fileName);
+}
+
+bool QTBackend::scanStillCurrent(quint64 scan, const QString &filepath) {
+    AppState state = appstate();
+    if (scan != scanSerial || (state != AppState::UserScan && state != AppState::StaffScan)) return false;
+    return !filepath.isEmpty() && filepath == loadedPrintFilepath;
+}
+
+void QTBackend::authorizeStaff(const UserRecord &staff, quint64 scan) {
+    //Staff scan to confirm a user has completed 3D Printing training
 
-        //Update user so save their 3d printing status
+    //Check that the user is staff
+    if (staff.authLevel < 1) return showMessage("This user is not Staff\nPlease ask a staff member for\nour 3D print training and have them\nscan their UCard to continue", "Training Completed", AppState::StaffScan);
 
-        auto result2 = queryDatabase("UPDATE users SET trainingCompleted = 1 WHERE id = :id; LIMIT 1", {{":id", currentUserID}});
-        if (result2.isError()) return ErrorHandler::handle(result2);
+    //Update user so save their 3d printing status, the directory is updated before the database
+    QString filepath = loadedPrintFilepath;
+    users.setTrained(currentUserID).then(this, [this, scan, filepath](Eo<int> updated) {
+        if (updated.isError()) return ErrorHandler::handle(updated);
+        if (!scanStillCurrent(scan, filepath)) return; //Still trained, but the job was abandoned
+        journal.nudge();
 
         //Final print check
-         double printDuration = parseDuration(loadedPrintInfo["duration"]);
-        if (printDuration > 6.0) return showMessage("Prints cannot be longer than 6 hours\nPlease split up your print and try again");
-    } else return; //If we're not in one of the scan states, ignore the card scan
+        const UserRecord* user = users.find(currentUserID);
+        authorizeQuota(user ? user->authLevel : 0, scan);
+    });
+}
 
+void QTBackend::dispatchAuthorizedPrint() {
     //This code executes when a print is verified and authorized
-    showMessage("Printing now!"); //show printing message
 
-    //Update user print statistics
+    //Make sure a healthy printer can take the job before it is counted against the user
+    qint64 target = pm.resolveDispatchTarget(loadedPrinterId);
+    if (target < 0) return showMessage("This printer is currently offline\nPlease try again later or ask a staff member");
+    loadedPrinterId = target;
+    static LatencyHistogram* tapToDispatch = PerfRegistry::histogram("card.tap_to_dispatch");
+    if (scanTimer.isValid()) tapToDispatch->record(scanTimer.nsecsElapsed() / 1000);
+    TraceRecorder::span(loadedPrintInfo.value("jobId"), "auth", scanTraceStart, QJsonObject{{"result", "authorized"}});
 
-    auto response = queryDatabase("SELECT printsStarted, filamentUsedGrams, printHours FROM users WHERE id = :id LIMIT 1", {{":id", currentUserID}});
-    if (response.isError()) {
-        ErrorHandler::softHandle(response);
-    } else {
+    showMessage("Printing now!"); //show printing message
 
-        QMap<QString, QVariant> result = response.get();
-        //Increase stats as needed
-        int printsStarted = result.value("printsStarted").toInt();
-        double filamentUsed = result.value("filamentUsedGrams").toDouble();
-        double printHours = result.value("printHours").toDouble();
-        printsStarted++;
-        filamentUsed+=loadedPrintInfo["weight"].toDouble();
-        printHours+=parseDuration(loadedPrintInfo["duration"]);
-
-        //Update stats to database
-        auto response2 = queryDatabase("UPDATE users SET printsStarted = :ps, filamentUsedGrams = :fu, printHours = :ph WHERE id = :id;", {
-            {":ps", printsStarted},
-            {":fu", filamentUsed},
-            {":ph", printHours},
-            {":id", currentUserID}
-        });
-        if (response2.isError()) {
-            ErrorHandler::softHandle(response2);
-        }
-    }
+    //Send the print to the printer first, the accounting below waits on the disk
+    pm.startPrint(loadedPrinterId, loadedPrintFilepath);
+    Printer* printer = pm.getPrinter(loadedPrinterId);
+    archive.store(loadedPrintFilepath, loadedPrintInfo, currentUserID, printer->getName(), printer->getBrand() + " " + printer->getModel()); //Before the next upload replaces the file
 
-    //Send print log to database
-    auto response3 = queryDatabase("INSERT INTO printLog (printerName, durationHours, weight, printer, user, filament, filename, timestamp) "
-                                   "VALUES(:pn, :dh, :wt, :pr, :us, :fm, :fn, :tm)", {
-                                    {":pn", pm.getPrinter(loadedPrinterId)->getName()},
-                                    {":dh", parseDuration(loadedPrintInfo["duration"])},
-                                    {":wt", loadedPrintInfo["weight"].toDouble()},
-                                    {":pr", loadedPrintInfo["printer"]},
-                                    {":us", currentUserID},
-                                    {":fm", loadedPrintInfo["filamentType"]},
-                                    {":fn", loadedPrintInfo["filename"]},
-                                    {":tm", QString("%1").arg(QDateTime::currentSecsSinceEpoch())}
-                                   });
-    if (response3.isError()) {
-        ErrorHandler::softHandle(response3);
-    }
+    //Update user print statistics and the print log together
+    recordPrintStart(currentUserID);
+}
 
-    //Send the print to the printer
-    pm.startPrint(loadedPrinterId, loadedPrintFilepath);
+void QTBackend::recordPrintStart(const QString &userId) {
+    double weight = loadedPrintInfo["weight"].toDouble();
+    double hours = parseDuration(loadedPrintInfo["duration"]);
+    qint64 started = QDateTime::currentSecsSinceEpoch();
+
+    //Counters are incremented in SQL so concurrent or interrupted writers can't lose an update
+    QList<DbStatement> accounting = {
+        {"UPDATE users SET printsStarted = printsStarted + 1, filamentUsedGrams = filamentUsedGrams + :fu, printHours = printHours + :ph "
+         "WHERE id = :id RETURNING printsStarted, filamentUsedGrams, printHours", {
+             {":fu", weight},
+             {":ph", hours},
+             {":id", userId}
+         }},
+        //Send print log to database
+        {"INSERT INTO printLog (printerName, durationHours, weight, printer, user, filament, filename, fileHash, timestamp) "
+         "VALUES(:pn, :dh, :wt, :pr, :us, :fm, :fn, :fh, :tm)", {
+             {":pn", pm.getPrinter(loadedPrinterId)->getName()},
+             {":dh", hours},
+             {":wt", weight},
+             {":pr", loadedPrintInfo["printer"]},
+             {":us", userId},
+             {":fm", loadedPrintInfo["filamentType"]},
+             {":fn", loadedPrintInfo["filename"]},
+             {":fh", loadedPrintInfo["xxh64"]},
+             {":tm", QString("%1").arg(started)}
+         }}
+    };
+    QString jobId = loadedPrintInfo.value("jobId");
+    qint64 traceStart = TraceRecorder::now();
+    dbs.transaction(accounting).then(this, [this, userId, started, hours, weight, jobId, traceStart](Eo<QList<DbRows>> result) {
+        TraceRecorder::span(jobId, "db accounting", traceStart, QJsonObject{{"ok", !result.isError()}});
+        if (result.isError()) return ErrorHandler::softHandle(result);
+        quotas.recordJob(userId, started, hours, weight);
+        journal.nudge();
+        DbRows totals = result.get().first();
+        if (totals.isEmpty()) {
+            qWarning() << "Print accounted to unknown user" << userId;
+            return;
+        }
+        qDebug() << "User" << userId << "now at" << totals[0][0].toInt() << "prints," << totals[0][1].toDouble() << "g," << totals[0][2].toDouble() << "h";
+    });
 }
 
 
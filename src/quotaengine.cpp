@@ -0,0 +1,197 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/quotaengine.h"
+#include <QJsonArray>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QDebug>
+#include <algorithm>
+
+QuotaEngine::QuotaEngine(DatabaseService* dbs, QObject* parent) : QObject(parent) {
+    this->dbs = dbs;
+    loadConfig(QJsonObject());
+}
+
+void QuotaEngine::loadConfig(QJsonObject cfg) {
+    policies.clear();
+    histories.clear();
+    levelClasses.clear();
+    QJsonArray levels = cfg.value("authLevelClasses").toArray(QJsonArray({"student", "staff", "staff", "staff"}));
+    for (const QJsonValue &level : levels) levelClasses.append(level.toString());
+    maxUsers = qMax(16, cfg.value("cachedUsers").toInt(512));
+
+    //Without a quota section students keep the original single job limit
+    QJsonObject classes = cfg.value("classes").toObject(QJsonObject({{"student", QJsonObject({{"maxJobHours", 6}})}}));
+    for (auto it = classes.constBegin(); it != classes.constEnd(); ++it) {
+        QJsonObject c = it.value().toObject();
+        Policy policy;
+        policy.maxJobHours = c.value("maxJobHours").toDouble(-1);
+        policy.maxConcurrentJobs = c.value("maxConcurrentJobs").toInt(-1);
+        for (const QJsonValue &w : c.value("windows").toArray()) {
+            QJsonObject o = w.toObject();
+            Window window;
+            window.hours = o.value("hours").toDouble(-1);
+            window.grams = o.value("grams").toDouble(-1);
+            window.jobs = o.value("jobs").toInt(-1);
+            if (o.contains("since")) { //Fixed window, like a semester
+                QDateTime since = QDateTime::fromString(o.value("since").toString(), Qt::ISODate);
+                if (!since.isValid()) {
+                    qWarning() << "Quota window for" << it.key() << "has an invalid since date" << o.value("since").toString();
+                    continue;
+                }
+                window.since = since.toSecsSinceEpoch();
+                window.label = o.value("label").toString("since " + since.date().toString("MMM d"));
+            } else {
+                window.seconds = qint64(o.value("days").toDouble(7) * 86400);
+                window.label = o.value("label").toString(QString("in the last %1 days").arg(o.value("days").toDouble(7)));
+            }
+            policy.windows.append(window);
+        }
+        policies.insert(it.key(), policy);
+    }
+}
+
+const QuotaEngine::Policy* QuotaEngine::policyFor(quint8 authLevel) const {
+    QString userClass = levelClasses.value(authLevel, levelClasses.isEmpty() ? QString() : levelClasses.last());
+    auto it = policies.constFind(userClass);
+    return (it == policies.constEnd()) ? nullptr : &it.value();
+}
+
+qint64 QuotaEngine::horizon(const Policy &policy, qint64 now) const {
+    qint64 oldest = now - 86400; //Jobs from the last day can still be running
+    if (policy.maxJobHours > 0) oldest = qMin(oldest, now - qint64(policy.maxJobHours * 3600));
+    for (const Window &w : policy.windows) oldest = qMin(oldest, w.seconds > 0 ? now - w.seconds : w.since);
+    return oldest;
+}
+
+void QuotaEngine::append(History &history, qint64 start, double hours, double grams) {
+    history.starts.append(start);
+    history.endsAt.append(start + hours * 3600);
+    history.hoursSum.append(history.hoursSum.last() + hours);
+    history.gramsSum.append(history.gramsSum.last() + grams);
+}
+
+void QuotaEngine::check(const QString &userId, quint8 authLevel, double hours, double grams, std::function<void(const Decision &)> done) {
+    checks++;
+    const Policy* policy = policyFor(authLevel);
+    if (policy == nullptr) return done(Decision()); //Class without limits
+    qint64 now = QDateTime::currentSecsSinceEpoch();
+    if (policy->maxJobHours > 0 && hours > policy->maxJobHours) { //Needs no history
+        refusals++;
+        return done({false, QString("Prints cannot be longer than %1 hours\nPlease split up your print and try again").arg(policy->maxJobHours)});
+    }
+    if (policy->windows.isEmpty() && policy->maxConcurrentJobs < 0) return done(Decision());
+
+    auto cached = histories.find(userId);
+    if (cached != histories.end()) {
+        cacheHits++;
+        cached->lastUsed = ++useClock;
+        QElapsedTimer timer;
+        timer.start();
+        Decision decision = evaluate(*policy, *cached, hours, grams, now, horizon(*policy, now));
+        evaluateNs += timer.nsecsElapsed();
+        if (!decision.allowed) refusals++;
+        return done(decision);
+    }
+
+    //First check for this user, load the part of printLog the windows cover through the (user, timestamp) index
+    qint64 since = horizon(*policy, now);
+    dbs->read("SELECT CAST(timestamp AS INTEGER), durationHours, weight FROM printLog WHERE user = :id AND timestamp >= :since ORDER BY timestamp", {
+        {":id", userId},
+        {":since", QString::number(since)} //printLog stores timestamps as text
+    }).then(this, [this, userId, authLevel, hours, grams, done](Eo<DbRows> result) {
+        const Policy* policy = policyFor(authLevel);
+        if (policy == nullptr) return done(Decision()); //Config reloaded meanwhile
+        if (result.isError()) { //Don't strand the user on a database error, the printLog is still written
+            qWarning() << "Quota history unavailable for" << userId << result.errorString();
+            return done(Decision());
+        }
+        History history;
+        for (const DbRow &row : result.get()) append(history, row[0].toLongLong(), row[1].toDouble(), row[2].toDouble());
+        remember(userId, history);
+        qint64 now = QDateTime::currentSecsSinceEpoch();
+        Decision decision = evaluate(*policy, histories[userId], hours, grams, now, horizon(*policy, now));
+        if (!decision.allowed) refusals++;
+        done(decision);
+    });
+}
+
+QuotaEngine::Decision QuotaEngine::evaluate(const Policy &policy, History &history, double hours, double grams, qint64 now, qint64 horizon) {
+    //Slide the history forward, compacting once most of it has expired
+    const qsizetype n = history.starts.size();
+    while (history.first < n && history.starts[history.first] < horizon) history.first++;
+    if (history.first > 64 && history.first * 2 > n) {
+        History kept;
+        for (qsizetype i = history.first; i < n; i++) {
+            append(kept, history.starts[i], history.hoursSum[i + 1] - history.hoursSum[i], history.gramsSum[i + 1] - history.gramsSum[i]);
+        }
+        kept.lastUsed = history.lastUsed;
+        history = kept;
+    }
+    const qsizetype count = history.starts.size();
+    const auto begin = history.starts.cbegin() + history.first;
+
+    if (policy.maxConcurrentJobs >= 0) {
+        int running = 0;
+        for (qsizetype i = count - 1; i >= history.first && history.starts[i] > now - 86400 * 7; i--) {
+            if (history.endsAt[i] > now) running++;
+        }
+        if (running >= policy.maxConcurrentJobs) {
+            return {false, QString("You already have %1 print%2 running\nPlease wait for %3 to finish").arg(running).arg(running == 1 ? "" : "s", running == 1 ? "it" : "one")};
+        }
+    }
+
+    for (const Window &w : policy.windows) {
+        qint64 start = (w.seconds > 0) ? now - w.seconds : w.since;
+        qsizetype i = std::lower_bound(begin, history.starts.cend(), start) - history.starts.cbegin();
+        double usedHours = history.hoursSum[count] - history.hoursSum[i];
+        double usedGrams = history.gramsSum[count] - history.gramsSum[i];
+        int usedJobs = int(count - i);
+        if (w.hours >= 0 && usedHours + hours > w.hours) {
+            return {false, QString("This print would go over your %1 hour limit %2\nYou have used %3 hours so far").arg(w.hours).arg(w.label).arg(usedHours, 0, 'f', 1)};
+        }
+        if (w.grams >= 0 && usedGrams + grams > w.grams) {
+            return {false, QString("This print would go over your %1 g filament limit %2\nYou have used %3 g so far").arg(w.grams).arg(w.label).arg(usedGrams, 0, 'f', 0)};
+        }
+        if (w.jobs >= 0 && usedJobs + 1 > w.jobs) {
+            return {false, QString("You have reached your limit of %1 prints %2").arg(w.jobs).arg(w.label)};
+        }
+    }
+    return Decision();
+}
+
+void QuotaEngine::remember(const QString &userId, History history) {
+    if (histories.size() >= maxUsers && !histories.contains(userId)) { //Forget the least recently checked user
+        auto oldest = histories.begin();
+        for (auto it = histories.begin(); it != histories.end(); ++it) {
+            if (it->lastUsed < oldest->lastUsed) oldest = it;
+        }
+        histories.erase(oldest);
+    }
+    history.lastUsed = ++useClock;
+    histories.insert(userId, history);
+}
+
+void QuotaEngine::recordJob(const QString &userId, qint64 start, double hours, double grams) {
+    auto it = histories.find(userId);
+    if (it == histories.end()) return; //Loaded from printLog on the next check
+    if (!it->starts.isEmpty() && start < it->starts.last()) { //Out of order, let the next check rebuild it
+        histories.erase(it);
+        return;
+    }
+    append(*it, start, hours, grams);
+}
+
+void QuotaEngine::invalidate() {
+    histories.clear();
+}
+
+QString QuotaEngine::summary() const {
+    double meanUs = cacheHits > 0 ? evaluateNs / 1000.0 / cacheHits : 0;
+    return QString("%1 policies, %2 users cached, %3 checks (%4 from cache, mean %5 us), %6 refused")
+        .arg(policies.size()).arg(histories.size()).arg(checks).arg(cacheHits).arg(meanUs, 0, 'f', 2).arg(refusals);
+}
@@ -0,0 +1,323 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/rosterimporter.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QElapsedTimer>
+#include <QRegularExpression>
+#include <QDebug>
+
+RosterImporter::RosterImporter(DatabaseService* dbs, QObject* parent) : QObject(parent) {
+    this->dbs = dbs;
+}
+
+RosterImporter::~RosterImporter() {
+    if (worker == nullptr) return;
+    cancel();
+    worker->wait();
+    delete worker;
+}
+
+bool RosterImporter::isRunning() const {
+    return worker != nullptr;
+}
+
+void RosterImporter::setBatchSize(int rows) {
+    if (isRunning()) return;
+    batchSize = qBound(1, rows, 5000);
+}
+
+void RosterImporter::cancel() {
+    cancelRequested = true;
+}
+
+bool RosterImporter::start(const QString &filepath, int maxAuthLevel) {
+    if (isRunning()) return false;
+    cancelRequested = false;
+    this->maxAuthLevel = maxAuthLevel;
+    worker = QThread::create([this, filepath]() { run(filepath); });
+    worker->setObjectName("RosterImporter");
+    connect(worker, &QThread::finished, this, [this]() {
+        worker->deleteLater();
+        worker = nullptr;
+    });
+    worker->start();
+    return true;
+}
+
+void RosterImporter::run(const QString &filepath) {
+    Report report;
+    report.file = QFileInfo(filepath).fileName();
+    QElapsedTimer timer;
+    timer.start();
+
+    //Parse and validate everything first, a file that can't be read imports nothing
+    QList<Row> rows;
+    bool json = filepath.endsWith(".json", Qt::CaseInsensitive);
+    bool readable = json ? readJson(filepath, rows, report) : readCsv(filepath, rows, report);
+    if (!readable) {
+        report.elapsedMs = timer.elapsed();
+        QMetaObject::invokeMethod(this, [this, report]() { emit finished(report); }, Qt::QueuedConnection);
+        return;
+    }
+
+    //Later rows for the same card replace earlier ones
+    QHash<QString, qsizetype> latest;
+    for (qsizetype i = 0; i < rows.size(); i++) {
+        auto seen = latest.find(rows[i].id);
+        if (seen != latest.end()) {
+            report.replaced++;
+            rows[seen.value()].id.clear();
+        }
+        latest.insert(rows[i].id, i);
+    }
+
+    const int total = rows.size();
+    int processed = 0;
+    int reportedTenth = 0;
+    for (qsizetype start = 0; start < rows.size(); start += batchSize) {
+        if (cancelRequested) {
+            report.cancelled = true;
+            break;
+        }
+        QList<DbStatement> batch;
+        QList<int> lines;
+        for (qsizetype i = start; i < qMin<qsizetype>(rows.size(), start + batchSize); i++) {
+            if (rows[i].id.isEmpty()) continue;
+            batch.append(upsert(rows[i]));
+            lines.append(rows[i].line);
+        }
+        if (!batch.isEmpty()) {
+            //One transaction per batch, the service interleaves card lookups between batches
+            QFuture<Eo<QList<DbRows>>> committed = dbs->transaction(batch);
+            committed.waitForFinished();
+            static const QString outranked = "the existing user's authLevel is above the importing user's";
+            if (!committed.result().isError()) {
+                const QList<DbRows> results = committed.result().get();
+                for (qsizetype i = 0; i < results.size(); i++) {
+                    if (results[i].isEmpty()) rejectRow(report, lines[i], outranked);
+                    else report.imported++;
+                }
+            } else {
+                //Find the rows the database refused, the rest still go in
+                for (qsizetype i = 0; i < batch.size(); i++) {
+                    QFuture<Eo<int>> single = dbs->write(batch[i].sql, batch[i].values);
+                    single.waitForFinished();
+                    if (single.result().isError()) rejectRow(report, lines[i], single.result().errorString());
+                    else if (single.result().get() == 0) rejectRow(report, lines[i], outranked);
+                    else report.imported++;
+                }
+            }
+        }
+        processed = qMin<int>(total, start + batchSize);
+        if (processed * 10 / total == reportedTenth && processed < total) continue; //Progress in tenths, not per batch
+        reportedTenth = processed * 10 / total;
+        QMetaObject::invokeMethod(this, [this, processed, total]() { emit progress(processed, total); }, Qt::QueuedConnection);
+    }
+
+    report.elapsedMs = timer.elapsed();
+    qInfo() << "Roster import of" << report.file << "finished," << report.imported << "of" << report.rows << "rows in" << report.elapsedMs << "ms";
+    QMetaObject::invokeMethod(this, [this, report]() { emit finished(report); }, Qt::QueuedConnection);
+}
+
+bool RosterImporter::readCsv(const QString &filepath, QList<Row> &rows, Report &report) {
+    QFile file(filepath);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        report.errors.append("cannot open " + filepath + ": " + file.errorString());
+        return false;
+    }
+    QTextStream in(&file);
+    QStringList header;
+    int line = 0;
+    while (!in.atEnd()) {
+        //Quoted fields may span lines, keep reading until the quotes balance
+        QString record = in.readLine();
+        int recordLine = ++line;
+        while (record.count('"') % 2 != 0 && !in.atEnd()) {
+            record += "\n" + in.readLine();
+            line++;
+        }
+        if (record.trimmed().isEmpty()) continue;
+        QStringList cells = splitCsvRecord(record);
+        if (header.isEmpty()) {
+            for (const QString &cell : cells) header.append(cell.trimmed().toLower());
+            if (!header.contains("id") && !header.contains("cardid") && !header.contains("card")) {
+                report.errors.append("line 1: header has no id column");
+                return false;
+            }
+            continue;
+        }
+        report.rows++;
+        Row row;
+        row.line = recordLine;
+        QString error;
+        bool valid = true;
+        for (int i = 0; i < header.size() && valid; i++) valid = setField(row, header[i], cells.value(i).trimmed(), error);
+        if (valid && row.id.isEmpty()) {
+            valid = false;
+            error = "missing id";
+        }
+        if (valid) rows.append(row);
+        else rejectRow(report, recordLine, error);
+        if (cancelRequested) break;
+    }
+    return true;
+}
+
+bool RosterImporter::readJson(const QString &filepath, QList<Row> &rows, Report &report) {
+    QFile file(filepath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        report.errors.append("cannot open " + filepath + ": " + file.errorString());
+        return false;
+    }
+    QJsonParseError parseError;
+    QJsonDocument doc = QJsonDocument::fromJson(file.readAll(), &parseError);
+    if (parseError.error != QJsonParseError::NoError) {
+        report.errors.append("JSON parse error at offset " + QString::number(parseError.offset) + ": " + parseError.errorString());
+        return false;
+    }
+    QJsonArray entries = doc.isArray() ? doc.array() : doc.object().value("users").toArray();
+    for (qsizetype i = 0; i < entries.size(); i++) {
+        report.rows++;
+        Row row;
+        row.line = int(i + 1); //Entry number, JSON has no useful line
+        QJsonObject o = entries[i].toObject();
+        QString error;
+        bool valid = entries[i].isObject();
+        if (!valid) error = "entry is not an object";
+        for (auto it = o.constBegin(); it != o.constEnd() && valid; ++it) {
+            QString value = it.value().isBool() ? (it.value().toBool() ? "true" : "false") : it.value().toVariant().toString();
+            valid = setField(row, it.key().toLower(), value.trimmed(), error);
+        }
+        if (valid && row.id.isEmpty()) {
+            valid = false;
+            error = "missing id";
+        }
+        if (valid) rows.append(row);
+        else rejectRow(report, row.line, error);
+    }
+    return true;
+}
+
+QStringList RosterImporter::splitCsvRecord(const QString &record) {
+    QStringList cells;
+    QString cell;
+    bool quoted = false;
+    for (qsizetype i = 0; i < record.size(); i++) {
+        QChar c = record[i];
+        if (quoted) {
+            if (c == '"' && i + 1 < record.size() && record[i + 1] == '"') {
+                cell += '"';
+                i++;
+            } else if (c == '"') quoted = false;
+            else cell += c;
+        } else if (c == '"') quoted = true;
+        else if (c == ',') {
+            cells.append(cell);
+            cell.clear();
+        } else cell += c;
+    }
+    cells.append(cell);
+    return cells;
+}
+
+bool RosterImporter::parseBool(const QString &value, bool &ok) {
+    static const QStringList yes = {"1", "true", "yes", "y", "t"};
+    static const QStringList no = {"0", "false", "no", "n", "f", ""};
+    QString v = value.toLower();
+    ok = yes.contains(v) || no.contains(v);
+    return yes.contains(v);
+}
+
+bool RosterImporter::setField(Row &row, const QString &column, const QString &value, QString &error) {
+    static const QRegularExpression cardPattern("^[0-9A-Za-z]{1,50}$");
+    bool ok = true;
+    if (column == "id" || column == "cardid" || column == "card") {
+        if (!cardPattern.match(value).hasMatch()) {
+            error = "invalid id '" + value.left(60) + "'";
+            return false;
+        }
+        row.id = value;
+    } else if (column == "firstname" || column == "first") {
+        row.firstName = value.left(50);
+        row.fields |= FirstName;
+    } else if (column == "lastname" || column == "last") {
+        row.lastName = value.left(50);
+        row.fields |= LastName;
+    } else if (column == "email") {
+        if (!value.isEmpty() && (!value.contains('@') || value.size() > 80)) {
+            error = "invalid email '" + value.left(80) + "'";
+            return false;
+        }
+        row.email = value;
+        row.fields |= Email;
+    } else if (column == "umass") {
+        row.umass = parseBool(value, ok);
+        row.fields |= Umass;
+    } else if (column == "cics") {
+        row.cics = parseBool(value, ok);
+        row.fields |= Cics;
+    } else if (column == "trainingcompleted" || column == "trained") {
+        row.trained = parseBool(value, ok);
+        row.fields |= Trained;
+    } else if (column == "authlevel") {
+        row.authLevel = value.isEmpty() ? 0 : value.toInt(&ok);
+        if (ok && (row.authLevel < 0 || row.authLevel > 3)) ok = false;
+        if (ok && row.authLevel > maxAuthLevel) {
+            error = QString("authLevel %1 is above the importing user's level %2").arg(row.authLevel).arg(maxAuthLevel);
+            return false;
+        }
+        row.fields |= AuthLevel;
+    } //Unknown columns are ignored so registrar exports can be used as is
+    if (!ok) error = QString("invalid %1 '%2'").arg(column, value.left(20));
+    return ok;
+}
+
+QString RosterImporter::upsertSql(quint16 fields) {
+    auto cached = sqlByFields.constFind(fields);
+    if (cached != sqlByFields.constEnd()) return cached.value();
+    //New users get every column, existing users only the ones the roster supplies, so print totals and training survive
+    static const QList<QPair<Field, QString>> columns = {
+        {FirstName, "firstName"}, {LastName, "lastName"}, {Email, "email"}, {Umass, "umass"},
+        {Cics, "cics"}, {Trained, "trainingCompleted"}, {AuthLevel, "authLevel"}
+    };
+    QStringList updates;
+    for (const auto &column : columns) {
+        if (fields & column.first) updates.append(column.second + " = excluded." + column.second);
+    }
+    if (updates.isEmpty()) updates.append("id = excluded.id"); //Changes nothing, but still returns the row so it counts as imported
+    //Existing users above the importer's level are left alone, RETURNING comes back empty for them
+    QString sql = "INSERT INTO users (id, firstName, lastName, email, umass, cics, trainingCompleted, authLevel, printsStarted, filamentUsedGrams, printHours) "
+                  "VALUES (:id, :fn, :ln, :em, :um, :cs, :tc, :al, 0, 0.0, 0.0) ON CONFLICT (id) DO UPDATE SET " + updates.join(", ") +
+                  " WHERE users.authLevel <= :max RETURNING id";
+    sqlByFields.insert(fields, sql);
+    return sql;
+}
+
+DbStatement RosterImporter::upsert(const Row &row) {
+    return {upsertSql(row.fields), {
+        {":id", row.id},
+        {":fn", row.firstName},
+        {":ln", row.lastName},
+        {":em", row.email},
+        {":um", row.umass},
+        {":cs", row.cics},
+        {":tc", row.trained},
+        {":al", row.authLevel},
+        {":max", maxAuthLevel}
+    }};
+}
+
+void RosterImporter::rejectRow(Report &report, int line, const QString &reason) {
+    report.rejected++;
+    if (report.errors.size() < MAX_REPORTED_ERRORS) report.errors.append(QString("line %1: %2").arg(line).arg(reason));
+    else if (report.errors.size() == MAX_REPORTED_ERRORS) report.errors.append("further errors omitted");
+}
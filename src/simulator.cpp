@@ -0,0 +1,152 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QJsonDocument>
+#include <QFile>
+#include <QDebug>
+#include <QDateTime>
+#include "headers/fleetsimulator.h"
+#include "headers/printerdiscovery.h"
+
+//Virtual printer fleet for load testing the kiosk without hardware
+//Point the kiosk at the written configuration, the real drivers talk to the simulator unchanged
+//Bambu printers need the FTPS port 990 the driver hardcodes, run with the privileges to bind it
+
+//Fake announcer for the discovery listeners, builds the packets a printer would send and checks what the kiosk keeps of them
+static QByteArray dnsName(const QString &name) {
+    QByteArray out;
+    for (const QString &label : name.split('.', Qt::SkipEmptyParts)) {
+        out.append(char(label.toUtf8().size()));
+        out.append(label.toUtf8());
+    }
+    out.append('\0');
+    return out;
+}
+
+static QByteArray dnsRecord(const QString &name, quint16 type, quint32 ttl, const QByteArray &rdata) {
+    QByteArray out = dnsName(name);
+    const quint8 fixed[] = {quint8(type >> 8), quint8(type), 0, 1, quint8(ttl >> 24), quint8(ttl >> 16), quint8(ttl >> 8), quint8(ttl), quint8(rdata.size() >> 8), quint8(rdata.size())};
+    out.append(reinterpret_cast<const char*>(fixed), sizeof(fixed));
+    return out + rdata;
+}
+
+static QByteArray prusaAnnouncement(const QString &instance, const QString &host, quint32 ip, quint32 ttl) {
+    QByteArray srv("\0\0\0\0\0\x50", 6); //Priority, weight, port 80
+    QByteArray txt = "printer_type=MK4";
+    txt.prepend(char(txt.size()));
+    QByteArray a;
+    for (int shift = 24; shift >= 0; shift -= 8) a.append(char(ip >> shift));
+    QByteArray msg("\0\0\x84\0\0\0\0\x04\0\0\0\0", 12); //Authoritative response, four answers
+    msg += dnsRecord("_prusa-link._tcp.local", 12, ttl, dnsName(instance));
+    msg += dnsRecord(instance, 33, ttl, srv + dnsName(host));
+    msg += dnsRecord(instance, 16, ttl, txt);
+    msg += dnsRecord(host, 1, ttl, a);
+    return msg;
+}
+
+static QByteArray bambuAnnouncement(const QString &serial, const QString &address) {
+    return QString("NOTIFY * HTTP/1.1\r\nHost: 239.255.255.250:1990\r\nNT: urn:bambulab-com:device:3dprinter:1\r\nUSN: %1\r\n"
+                   "Location: %2\r\nDevModel.bambu.com: C12\r\nDevName.bambu.com: Sim P1S\r\n\r\n").arg(serial, address).toUtf8();
+}
+
+static bool checkDiscovery() {
+    PrinterDiscovery discovery; //Never started, the packets go straight to the handlers
+    discovery.setStaleTimeout(10 * 60 * 1000);
+    int discovered = 0;
+    int moved = 0;
+    int lost = 0;
+    QObject::connect(&discovery, &PrinterDiscovery::deviceDiscovered, [&discovered](const DiscoveredPrinter &) { discovered++; });
+    QObject::connect(&discovery, &PrinterDiscovery::deviceAddressChanged, [&moved](const DiscoveredPrinter &, const QHostAddress &) { moved++; });
+    QObject::connect(&discovery, &PrinterDiscovery::deviceLost, [&lost](const DiscoveredPrinter &) { lost++; });
+    QHostAddress sender("192.168.1.2");
+    QStringList failures;
+    auto expect = [&failures](bool ok, const QString &what) {
+        qInfo().noquote() << (ok ? "PASS" : "FAIL") << what;
+        if (!ok) failures.append(what);
+    };
+
+    discovery.handleSsdpDatagram(bambuAnnouncement("01P00A000000001", "192.168.1.20"), sender);
+    discovery.handleMdnsDatagram(prusaAnnouncement("sim-mk4._prusa-link._tcp.local", "sim-mk4.local", 0xC0A8011E, 120), sender);
+    expect(discovered == 2, "both announcers are added");
+    expect(discovery.device("01P00A000000001").model == "P1S", "Bambu model is mapped");
+    expect(discovery.device("sim-mk4._prusa-link._tcp.local").address == QHostAddress("192.168.1.30"), "Prusa address comes from its A record");
+
+    discovery.handleSsdpDatagram(bambuAnnouncement("01P00A000000001", "192.168.1.21"), sender);
+    discovery.handleMdnsDatagram(prusaAnnouncement("sim-mk4._prusa-link._tcp.local", "sim-mk4.local", 0xC0A8011F, 120), sender);
+    expect(discovered == 2 && moved == 2, "re-announcing from a new address is an update, not a new device");
+    expect(discovery.device("sim-mk4._prusa-link._tcp.local").address == QHostAddress("192.168.1.31"), "Prusa address follows the new A record");
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    expect(discovery.mdnsRecordCount() == 3, "mDNS records are held while their TTL runs");
+    discovery.expireAt(now + 60 * 1000);
+    expect(discovery.mdnsRecordCount() == 3 && lost == 0, "nothing expires inside the TTL");
+    discovery.expireAt(now + 121 * 1000);
+    expect(discovery.mdnsRecordCount() == 0, "mDNS records expire after their TTL");
+    expect(lost == 0, "devices outlive their records until the stale timeout");
+
+    discovery.handleMdnsDatagram(prusaAnnouncement("gone._prusa-link._tcp.local", "gone.local", 0xC0A80120, 120), sender);
+    discovery.handleMdnsDatagram(prusaAnnouncement("gone._prusa-link._tcp.local", "gone.local", 0xC0A80120, 0), sender);
+    expect(discovery.mdnsRecordCount() == 0, "a goodbye packet drops the records at once");
+
+    discovery.expireAt(now + 11 * 60 * 1000);
+    expect(lost == 3 && discovery.devices().isEmpty(), "devices expire after the stale timeout");
+    return failures.isEmpty();
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("PCMakerspace3DPSimulator");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Simulated PrusaLink and Bambu LAN printers");
+    parser.addHelpOption();
+    QCommandLineOption configOpt("config", "Simulator settings JSON file", "file");
+    QCommandLineOption prusaOpt("prusa", "Number of virtual Prusa printers (0-100)", "count");
+    QCommandLineOption bambuOpt("bambu", "Number of virtual Bambu printers (0-100)", "count");
+    QCommandLineOption bandwidthOpt("bandwidth", "Upload bandwidth per printer in KB/s, 0 is unlimited", "kbps");
+    QCommandLineOption errorOpt("error-rate", "Chance an upload or print request is refused (0-1)", "rate");
+    QCommandLineOption outageOpt("outage-rate", "Chance per minute a printer drops off the network (0-1)", "rate");
+    QCommandLineOption latencyOpt("latency", "Added response latency in ms", "ms");
+    QCommandLineOption printOpt("print-seconds", "Simulated print duration", "seconds");
+    QCommandLineOption reportOpt("report-interval", "Bambu report interval in ms", "ms");
+    QCommandLineOption journalOpt("journal-port", "Port for the stand-in central journal server, 0 disables it", "port");
+    QCommandLineOption outOpt("kiosk-config", "Where to write the kiosk printer configuration", "file", "simulated_fleet.json");
+    QCommandLineOption discoveryOpt("check-discovery", "Feed the discovery listeners fake SSDP and mDNS announcements, then exit");
+    parser.addOptions({configOpt, prusaOpt, bambuOpt, bandwidthOpt, errorOpt, outageOpt, latencyOpt, printOpt, reportOpt, journalOpt, outOpt, discoveryOpt});
+    parser.process(app);
+    if (parser.isSet(discoveryOpt)) return checkDiscovery() ? 0 : 1;
+
+    QJsonObject cfg;
+    if (parser.isSet(configOpt)) {
+        QFile f(parser.value(configOpt));
+        if (!f.open(QIODevice::ReadOnly)) {
+            qCritical() << "Unable to open simulator config" << f.fileName();
+            return 1;
+        }
+        cfg = QJsonDocument::fromJson(f.readAll()).object();
+    }
+    //Command line values override the file
+    if (parser.isSet(prusaOpt)) cfg.insert("prusaCount", parser.value(prusaOpt).toInt());
+    if (parser.isSet(bambuOpt)) cfg.insert("bambuCount", parser.value(bambuOpt).toInt());
+    if (parser.isSet(bandwidthOpt)) cfg.insert("bandwidthKBps", parser.value(bandwidthOpt).toDouble());
+    if (parser.isSet(errorOpt)) cfg.insert("errorRate", parser.value(errorOpt).toDouble());
+    if (parser.isSet(outageOpt)) cfg.insert("outageRate", parser.value(outageOpt).toDouble());
+    if (parser.isSet(latencyOpt)) cfg.insert("latencyMs", parser.value(latencyOpt).toInt());
+    if (parser.isSet(printOpt)) cfg.insert("printSeconds", parser.value(printOpt).toInt());
+    if (parser.isSet(reportOpt)) cfg.insert("reportIntervalMs", parser.value(reportOpt).toInt());
+    if (parser.isSet(journalOpt)) cfg.insert("journalPort", parser.value(journalOpt).toInt());
+
+    FleetSimulator sim;
+    sim.loadConfig(cfg);
+    if (!sim.start()) {
+        qCritical() << "No virtual printers could be started";
+        return 1;
+    }
+    sim.writeKioskConfig(parser.value(outOpt));
+    return app.exec();
+}
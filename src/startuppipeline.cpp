@@ -0,0 +1,149 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/startuppipeline.h"
+#include <QThreadPool>
+#include <QPointer>
+#include <QDebug>
+#include <atomic>
+#include <memory>
+
+StartupPipeline::StartupPipeline(QObject* parent) : QObject(parent) {}
+
+void StartupPipeline::addStage(const QString &name, const QStringList &dependsOn, std::function<void()> fn) {
+    addAsyncStage(name, dependsOn, [fn](Done done) {
+        fn();
+        done();
+    });
+}
+
+void StartupPipeline::addAsyncStage(const QString &name, const QStringList &dependsOn, std::function<void(Done)> fn) {
+    Stage s;
+    s.name = name;
+    s.dependsOn = dependsOn;
+    s.run = fn;
+    stages.insert(name, s);
+    order.append(name);
+}
+
+void StartupPipeline::addWorkerStage(const QString &name, const QStringList &dependsOn, std::function<void()> fn, std::function<void()> onFinished) {
+    addAsyncStage(name, dependsOn, [this, fn, onFinished](Done done) {
+        QPointer<StartupPipeline> self(this);
+        QThreadPool::globalInstance()->start([self, fn, onFinished, done]() {
+            fn();
+            if (self.isNull()) return;
+            QMetaObject::invokeMethod(self.data(), [onFinished, done]() { //Back on the GUI thread
+                if (onFinished) onFinished();
+                done();
+            }, Qt::QueuedConnection);
+        });
+    });
+}
+
+void StartupPipeline::addBarrier(const QString &name, const QStringList &stages) {
+    barriers.insert(name, stages);
+}
+
+void StartupPipeline::start() {
+    //Drop dependencies on stages that were never registered so they cannot stall startup
+    for (auto it = stages.begin(); it != stages.end(); ++it) {
+        for (const QString &dep : it->dependsOn) {
+            if (!stages.contains(dep)) {
+                qWarning() << "Startup: stage" << it->name << "depends on unknown stage" << dep;
+            }
+        }
+        it->dependsOn.removeIf([this](const QString &dep) { return !stages.contains(dep); });
+    }
+    running = true;
+    clock.start();
+    schedule();
+}
+
+bool StartupPipeline::isFinished(const QString &stage) const {
+    return stages.value(stage).done;
+}
+
+qint64 StartupPipeline::elapsed() const {
+    return clock.isValid() ? clock.elapsed() : 0;
+}
+
+void StartupPipeline::schedule() {
+    bool anyRunning = false;
+    bool allDone = true;
+    for (const QString &name : std::as_const(order)) {
+        Stage &s = stages[name];
+        if (s.done) continue;
+        allDone = false;
+        if (s.started) {
+            anyRunning = true;
+            continue;
+        }
+        bool ready = true;
+        for (const QString &dep : std::as_const(s.dependsOn)) {
+            if (!stages.value(dep).done) {
+                ready = false;
+                break;
+            }
+        }
+        if (!ready) continue;
+
+        s.started = true;
+        s.startedAt = clock.elapsed();
+        anyRunning = true;
+        QPointer<StartupPipeline> self(this);
+        std::shared_ptr<std::atomic_bool> called = std::make_shared<std::atomic_bool>(false);
+        s.run([self, name, called]() { //Done callback, safe to call from any thread
+            if (called->exchange(true)) return;
+            if (self.isNull()) return;
+            QMetaObject::invokeMethod(self.data(), [self, name]() { self->complete(name); }, Qt::QueuedConnection);
+        });
+    }
+    if (allDone && running) {
+        running = false;
+        logSummary();
+        emit finished(clock.elapsed());
+    } else if (!anyRunning && running) {
+        qCritical() << "Startup: dependency cycle detected, remaining stages cannot run";
+        running = false;
+    }
+}
+
+void StartupPipeline::complete(const QString &name) {
+    if (!stages.contains(name)) return;
+    Stage &s = stages[name];
+    if (s.done) return;
+    s.done = true;
+    s.finishedAt = clock.elapsed();
+    qInfo() << "Startup:" << name << "finished in" << (s.finishedAt - s.startedAt) << "ms (+" << s.finishedAt << "ms)";
+    emit stageFinished(name, s.finishedAt - s.startedAt);
+    checkBarriers();
+    schedule();
+}
+
+void StartupPipeline::checkBarriers() {
+    for (auto it = barriers.constBegin(); it != barriers.constEnd(); ++it) {
+        if (reachedBarriers.contains(it.key())) continue;
+        bool reached = true;
+        for (const QString &stage : it.value()) {
+            if (stages.contains(stage) && !stages.value(stage).done) {
+                reached = false;
+                break;
+            }
+        }
+        if (!reached) continue;
+        reachedBarriers.insert(it.key());
+        qInfo() << "Startup: barrier" << it.key() << "reached at +" << clock.elapsed() << "ms";
+        emit barrierReached(it.key(), clock.elapsed());
+    }
+}
+
+void StartupPipeline::logSummary() {
+    qInfo() << "Startup: all stages finished in" << clock.elapsed() << "ms";
+    for (const QString &name : std::as_const(order)) {
+        const Stage &s = stages[name];
+        qInfo().noquote() << QString("  %1 start +%2ms, took %3ms").arg(name, -12).arg(s.startedAt).arg(s.finishedAt - s.startedAt);
+    }
+}
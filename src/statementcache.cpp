@@ -0,0 +1,85 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/statementcache.h"
+#include "headers/perfregistry.h"
+#include <QSqlError>
+
+StatementCache::StatementCache(int capacity) {
+    this->capacity = qMax(1, capacity);
+}
+
+void StatementCache::setDatabase(const QSqlDatabase &db) {
+    clear();
+    this->db = db;
+}
+
+QSqlQuery* StatementCache::acquire(const QString &sql) {
+    //Shared by both connections, the registry's counters are atomic
+    static PerfCounter* registryHits = PerfRegistry::counter("db.statement_hits");
+    static PerfCounter* registryMisses = PerfRegistry::counter("db.statement_misses");
+    useClock++;
+    auto it = statements.find(sql);
+    if (it != statements.end()) {
+        counters.hits++;
+        registryHits->add();
+        it->second.lastUsed = useClock;
+        QSqlQuery* query = it->second.query.get();
+        query->finish(); //Drop the previous result set but keep the compiled statement
+        //Bindings outlive finish(), a caller leaving a placeholder out would silently reuse the last call's value
+        const QStringList bound = query->boundValueNames();
+        for (const QString &name : bound) query->bindValue(name, QVariant());
+        return query;
+    }
+    counters.misses++;
+    registryMisses->add();
+
+    std::unique_ptr<QSqlQuery> query = std::make_unique<QSqlQuery>(db);
+    if (!query->prepare(sql)) {
+        prepareError = query->lastError().text();
+        return nullptr;
+    }
+    if (statements.size() >= size_t(capacity)) {
+        auto oldest = statements.begin();
+        for (auto e = statements.begin(); e != statements.end(); ++e) {
+            if (e->second.lastUsed < oldest->second.lastUsed) oldest = e;
+        }
+        statements.erase(oldest);
+    }
+    Entry &entry = statements[sql];
+    entry.query = std::move(query);
+    entry.lastUsed = useClock;
+    return entry.query.get();
+}
+
+QString StatementCache::lastPrepareError() const {
+    return prepareError;
+}
+
+void StatementCache::recordExecution(qint64 nanoseconds) {
+    static LatencyHistogram* queryTime = PerfRegistry::histogram("db.query");
+    queryTime->record(nanoseconds / 1000);
+    counters.executions++;
+    counters.totalNs += nanoseconds;
+    counters.maxNs = qMax(counters.maxNs, nanoseconds);
+}
+
+void StatementCache::clear() {
+    statements.clear();
+}
+
+StatementCache::Stats StatementCache::stats() const {
+    return counters;
+}
+
+QString StatementCache::summary() const {
+    quint64 lookups = counters.hits + counters.misses;
+    double hitRate = lookups > 0 ? 100.0 * counters.hits / lookups : 0;
+    double meanUs = counters.executions > 0 ? counters.totalNs / 1000.0 / counters.executions : 0;
+    return QString("%1 statements cached, %2 hits / %3 misses (%4%), %5 queries, mean %6 us, max %7 us")
+        .arg(qulonglong(statements.size())).arg(counters.hits).arg(counters.misses).arg(hitRate, 0, 'f', 1)
+        .arg(counters.executions).arg(meanUs, 0, 'f', 1).arg(counters.maxNs / 1000.0, 0, 'f', 1);
+}
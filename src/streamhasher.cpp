@@ -0,0 +1,140 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/streamhasher.h"
+#include <QtEndian>
+#include <cstring>
+
+//XXH64 constants, see the xxHash specification
+static const quint64 PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const quint64 PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const quint64 PRIME64_3 = 0x165667B19E3779F9ULL;
+static const quint64 PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const quint64 PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline quint64 rotl(quint64 x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline quint64 xxhRound(quint64 acc, quint64 input) {
+    acc += input * PRIME64_2;
+    return rotl(acc, 31) * PRIME64_1;
+}
+
+static inline quint64 xxhMerge(quint64 acc, quint64 value) {
+    acc ^= xxhRound(0, value);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+FileDigest FileDigest::fromProperties(const QMap<QString, QString> &properties) {
+    FileDigest d;
+    d.md5 = properties.value("md5");
+    d.xxh64 = properties.value("xxh64");
+    bool ok = false;
+    qint64 size = properties.value("size").toLongLong(&ok);
+    d.size = ok ? size : -1;
+    d.jobId = properties.value("jobId");
+    return d;
+}
+
+StreamHasher::StreamHasher() : md5(QCryptographicHash::Md5) {
+    v1 = PRIME64_1 + PRIME64_2;
+    v2 = PRIME64_2;
+    v3 = 0;
+    v4 = 0 - PRIME64_1;
+}
+
+void StreamHasher::consumeStripe(const uchar* stripe) {
+    v1 = xxhRound(v1, qFromLittleEndian<quint64>(stripe));
+    v2 = xxhRound(v2, qFromLittleEndian<quint64>(stripe + 8));
+    v3 = xxhRound(v3, qFromLittleEndian<quint64>(stripe + 16));
+    v4 = xxhRound(v4, qFromLittleEndian<quint64>(stripe + 24));
+}
+
+void StreamHasher::addData(const char* data, qint64 length) {
+    if (length <= 0) return;
+    md5.addData(QByteArrayView(data, length));
+    total += length;
+    const uchar* p = reinterpret_cast<const uchar*>(data);
+    const uchar* end = p + length;
+    if (buffered > 0) { //Finish the stripe left over from the last chunk
+        int take = qMin<qint64>(32 - buffered, end - p);
+        memcpy(buffer + buffered, p, take);
+        buffered += take;
+        p += take;
+        if (buffered < 32) return;
+        consumeStripe(buffer);
+        buffered = 0;
+    }
+    for (; end - p >= 32; p += 32) consumeStripe(p);
+    buffered = end - p;
+    memcpy(buffer, p, buffered);
+}
+
+void StreamHasher::addData(const QByteArray &data) {
+    addData(data.constData(), data.size());
+}
+
+QString StreamHasher::md5Hex() const {
+    return QString::fromLatin1(md5.result().toHex());
+}
+
+quint64 StreamHasher::xxh64() const {
+    quint64 h;
+    if (total >= 32) {
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = xxhMerge(h, v1);
+        h = xxhMerge(h, v2);
+        h = xxhMerge(h, v3);
+        h = xxhMerge(h, v4);
+    } else {
+        h = PRIME64_5;
+    }
+    h += quint64(total);
+    const uchar* p = buffer;
+    const uchar* end = buffer + buffered;
+    for (; end - p >= 8; p += 8) {
+        h ^= xxhRound(0, qFromLittleEndian<quint64>(p));
+        h = rotl(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (end - p >= 4) {
+        h ^= quint64(qFromLittleEndian<quint32>(p)) * PRIME64_1;
+        h = rotl(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * PRIME64_5;
+        h = rotl(h, 11) * PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+QString StreamHasher::xxh64Hex() const {
+    return QString("%1").arg(xxh64(), 16, 16, QChar('0'));
+}
+
+qint64 StreamHasher::size() const {
+    return total;
+}
+
+FileDigest StreamHasher::digest() const {
+    FileDigest d;
+    d.md5 = md5Hex();
+    d.xxh64 = xxh64Hex();
+    d.size = total;
+    return d;
+}
+
+void StreamHasher::attachTo(QMap<QString, QString> &properties) const {
+    properties.insert("md5", md5Hex());
+    properties.insert("xxh64", xxh64Hex());
+    properties.insert("size", QString::number(total));
+}
@@ -0,0 +1,114 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/tracerecorder.h"
+#include <QElapsedTimer>
+#include <QDateTime>
+#include <QJsonArray>
+#include <algorithm>
+
+QString TraceRecorder::newJob() {
+    return "job-" + QString::number(nextJob.fetch_add(1, std::memory_order_relaxed));
+}
+
+qint64 TraceRecorder::now() {
+    //Wall clock once, then the monotonic clock, so spans never run backwards when NTP steps the time
+    static const qint64 epochStart = QDateTime::currentMSecsSinceEpoch() * 1000;
+    static const QElapsedTimer clock = []() {
+        QElapsedTimer t;
+        t.start();
+        return t;
+    }();
+    return epochStart + clock.nsecsElapsed() / 1000;
+}
+
+void TraceRecorder::span(const QString &jobId, const QString &name, qint64 startUs, const QJsonObject &args) {
+    span(jobId, name, startUs, now(), args);
+}
+
+void TraceRecorder::span(const QString &jobId, const QString &name, qint64 startUs, qint64 endUs, const QJsonObject &args) {
+    record(Event{jobId, name, startUs, qMax(startUs, endUs), args});
+}
+
+void TraceRecorder::instant(const QString &jobId, const QString &name, const QJsonObject &args) {
+    qint64 t = now();
+    record(Event{jobId, name, t, -1, args});
+}
+
+void TraceRecorder::record(Event &&event) {
+    if (event.jobId.isEmpty()) return; //Work that never belonged to a job, e.g. the simulator's own fleet
+    QMutexLocker locker(&lock);
+    if (ring.size() < capacity) {
+        ring.append(std::move(event));
+        return;
+    }
+    ring[head] = std::move(event); //Full, the oldest event goes
+    head = (head + 1) % ring.size();
+}
+
+void TraceRecorder::setCapacity(int events) {
+    QMutexLocker locker(&lock);
+    int wanted = qBound(100, events, 1000000);
+    if (wanted == capacity) return;
+    //Unroll into age order so shrinking keeps the newest events
+    QList<Event> ordered = ring.mid(head) + ring.mid(0, head);
+    if (ordered.size() > wanted) ordered = ordered.mid(ordered.size() - wanted);
+    ring = ordered;
+    head = 0;
+    capacity = wanted;
+}
+
+int TraceRecorder::size() {
+    QMutexLocker locker(&lock);
+    return int(ring.size());
+}
+
+QJsonObject TraceRecorder::exportWindow(qint64 fromUs, qint64 toUs) {
+    QList<Event> selected;
+    {
+        QMutexLocker locker(&lock);
+        for (const Event &e : ring) {
+            qint64 end = e.endUs < 0 ? e.startUs : e.endUs;
+            if (end >= fromUs && e.startUs <= toUs) selected.append(e);
+        }
+    }
+    std::sort(selected.begin(), selected.end(), [](const Event &a, const Event &b) { return a.startUs < b.startUs; });
+
+    //Async events keyed by job id give every job its own track, spans of one job may overlap
+    QJsonArray events;
+    events.append(QJsonObject{{"name", "process_name"}, {"ph", "M"}, {"pid", 1}, {"args", QJsonObject{{"name", "PCM 3DP Kiosk"}}}});
+    for (const Event &e : selected) {
+        QJsonObject args = e.args;
+        args.insert("jobId", e.jobId);
+        QJsonObject base{{"name", e.name}, {"cat", "job"}, {"id", e.jobId}, {"pid", 1}, {"tid", 1}};
+        if (e.endUs < 0) {
+            QJsonObject instant = base;
+            instant.insert("ph", "n");
+            instant.insert("ts", e.startUs);
+            instant.insert("args", args);
+            events.append(instant);
+            continue;
+        }
+        QJsonObject begin = base;
+        begin.insert("ph", "b");
+        begin.insert("ts", e.startUs);
+        begin.insert("args", args);
+        events.append(begin);
+        QJsonObject end = base;
+        end.insert("ph", "e");
+        end.insert("ts", e.endUs);
+        events.append(end);
+    }
+    return QJsonObject{
+        {"traceEvents", events},
+        {"displayTimeUnit", "ms"},
+        {"otherData", QJsonObject{
+            {"from", QDateTime::fromMSecsSinceEpoch(fromUs / 1000).toString(Qt::ISODate)},
+            {"to", QDateTime::fromMSecsSinceEpoch(toUs / 1000).toString(Qt::ISODate)},
+            {"events", qint64(selected.size())}
+        }}
+    };
+}
@@ -0,0 +1,141 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/transferscheduler.h"
+#include <QTimer>
+#include <QDebug>
+
+TransferScheduler::TransferScheduler(QObject* parent) : QObject(parent) {}
+
+void TransferScheduler::loadConfig(QJsonObject cfg) {
+    maxConcurrent = qMax(1, cfg.value("maxConcurrent").toInt(maxConcurrent));
+    bandwidthCap = qMax(0LL, cfg.value("bandwidthKBps").toInteger(bandwidthCap / 1024) * 1024);
+    defaultThroughput = qMax(1.0, cfg.value("defaultThroughputKBps").toDouble(defaultThroughput / 1024) * 1024);
+    backgroundMaxWaitMs = cfg.value("backgroundMaxWaitSeconds").toInteger(backgroundMaxWaitMs / 1000) * 1000;
+}
+
+quint64 TransferScheduler::enqueue(QObject* link, const QString &label, qint64 bytes, Priority priority, std::function<void(quint64)> start) {
+    Transfer t;
+    t.ticket = nextTicket++;
+    t.link = link;
+    t.label = label;
+    t.bytes = qMax(0LL, bytes);
+    t.priority = priority;
+    t.start = start;
+    t.waiting.start();
+    waiting.append(t);
+    schedulePump(); //Deferred so the caller has the ticket before start runs
+    return t.ticket;
+}
+
+void TransferScheduler::promote(quint64 ticket) {
+    for (Transfer &t : waiting) {
+        if (t.ticket != ticket) continue;
+        t.priority = Interactive;
+        schedulePump();
+        return;
+    }
+}
+
+void TransferScheduler::cancel(quint64 ticket) {
+    for (int i = 0; i < waiting.size(); i++) {
+        if (waiting[i].ticket != ticket) continue;
+        waiting.removeAt(i);
+        return;
+    }
+    if (active.remove(ticket) > 0) schedulePump();
+}
+
+void TransferScheduler::finish(quint64 ticket, bool success) {
+    if (!active.contains(ticket)) return;
+    Transfer t = active.take(ticket);
+    qint64 elapsedMs = t.waiting.elapsed();
+    if (success && t.link && t.bytes >= MIN_SAMPLE_BYTES && elapsedMs > 0) {
+        double sample = t.bytes * 1000.0 / elapsedMs;
+        double &estimate = throughput[t.link.data()];
+        estimate = estimate <= 0 ? sample : EWMA_WEIGHT * sample + (1 - EWMA_WEIGHT) * estimate;
+        qInfo().noquote() << QString("Transfer to %1: %2 bytes in %3 ms after %4 ms queued, link estimate %5 KB/s")
+                                 .arg(t.label).arg(t.bytes).arg(elapsedMs).arg(t.waitedMs).arg(estimate / 1024, 0, 'f', 0);
+    }
+    schedulePump();
+}
+
+qint64 TransferScheduler::rateLimit(quint64 ticket) const {
+    return active.contains(ticket) ? active[ticket].rate : 0;
+}
+
+double TransferScheduler::estimatedThroughput(QObject* link) const {
+    double estimate = throughput.value(link, 0);
+    return estimate > 0 ? estimate : defaultThroughput;
+}
+
+QList<TransferScheduler::Status> TransferScheduler::snapshot() const {
+    QList<Status> list;
+    auto add = [&list](const Transfer &t, bool running) {
+        list.append({t.ticket, t.label, t.bytes, running, t.priority == Interactive, t.waiting.elapsed(), t.rate});
+    };
+    for (const Transfer &t : active) add(t, true);
+    for (const Transfer &t : waiting) add(t, false);
+    return list;
+}
+
+void TransferScheduler::schedulePump() {
+    if (pumpPending) return;
+    pumpPending = true;
+    QTimer::singleShot(0, this, &TransferScheduler::pump);
+}
+
+qint64 TransferScheduler::expectedMs(const Transfer &t) const {
+    return qint64(t.bytes * 1000.0 / estimatedThroughput(t.link.data()));
+}
+
+bool TransferScheduler::isUrgent(const Transfer &t) const {
+    return t.priority == Interactive || t.waiting.elapsed() >= backgroundMaxWaitMs;
+}
+
+void TransferScheduler::pump() {
+    pumpPending = false;
+    waiting.removeIf([](const Transfer &t) { return t.link.isNull(); }); //Printer removed while waiting
+    while (!waiting.isEmpty() && active.size() < maxConcurrent) {
+        //Interactive first, then shortest expected transfer, skipping links that already have one running
+        int best = -1;
+        for (int i = 0; i < waiting.size(); i++) {
+            const Transfer &t = waiting[i];
+            bool linkBusy = false;
+            for (const Transfer &a : active) {
+                if (a.link == t.link) {
+                    linkBusy = true;
+                    break;
+                }
+            }
+            if (linkBusy) continue;
+            if (best < 0) {
+                best = i;
+                continue;
+            }
+            const Transfer &b = waiting[best];
+            if (isUrgent(t) != isUrgent(b)) {
+                if (isUrgent(t)) best = i;
+            } else if (expectedMs(t) < expectedMs(b)) {
+                best = i;
+            }
+        }
+        if (best < 0) return;
+
+        //Only admit what fits in the bandwidth budget, a lone transfer always goes
+        double committed = 0;
+        for (const Transfer &a : active) committed += estimatedThroughput(a.link.data());
+        double wanted = estimatedThroughput(waiting[best].link.data());
+        if (bandwidthCap > 0 && !active.isEmpty() && committed + wanted > bandwidthCap) return;
+
+        Transfer t = waiting.takeAt(best);
+        t.waitedMs = t.waiting.elapsed();
+        t.waiting.restart();
+        t.rate = bandwidthCap > 0 ? bandwidthCap / (active.size() + 1) : 0;
+        active.insert(t.ticket, t);
+        t.start(t.ticket);
+    }
+}
@@ -0,0 +1,161 @@
+/*
+ *
+ * Copyright (c) 2025 Antony Rinaldi
+ *
+*/
+
+#include "headers/userdirectory.h"
+#include <QHash>
+#include <QDebug>
+
+UserDirectory::UserDirectory(DatabaseService* dbs, QObject* parent) : QObject(parent) {
+    this->dbs = dbs;
+    pollTimer.setInterval(2000);
+    connect(&pollTimer, &QTimer::timeout, this, &UserDirectory::checkVersion);
+}
+
+void UserDirectory::setPollInterval(int msecs) {
+    pollTimer.setInterval(qMax(100, msecs));
+}
+
+bool UserDirectory::isLoaded() const {
+    return loaded;
+}
+
+int UserDirectory::size() const {
+    return count;
+}
+
+quint32 UserDirectory::hashId(const QString &cardId) {
+    return quint32(qHash(cardId, 0x9e3779b9u)) | 1; //Never zero, so a stored hash can't be mistaken for a free slot
+}
+
+void UserDirectory::place(QList<Slot> &table, const QString &cardId, quint32 hash, const UserRecord &record, int &probes) {
+    const qsizetype mask = table.size() - 1;
+    qsizetype i = hash & mask;
+    int distance = 0;
+    while (table[i].hash != 0 && !(table[i].hash == hash && table[i].id == cardId)) {
+        i = (i + 1) & mask;
+        distance++;
+    }
+    table[i].id = cardId;
+    table[i].hash = hash;
+    table[i].record = record;
+    probes = qMax(probes, distance);
+}
+
+qsizetype UserDirectory::slotOf(const QString &cardId, quint32 hash) const {
+    if (table.isEmpty()) return -1;
+    const qsizetype mask = table.size() - 1;
+    for (qsizetype i = hash & mask; table[i].hash != 0; i = (i + 1) & mask) {
+        if (table[i].hash == hash && table[i].id == cardId) return i;
+    }
+    return -1;
+}
+
+const UserRecord* UserDirectory::find(const QString &cardId) {
+    qsizetype i = slotOf(cardId, hashId(cardId));
+    if (i < 0) {
+        misses++;
+        return nullptr;
+    }
+    hits++;
+    return &table[i].record;
+}
+
+void UserDirectory::insert(const QString &cardId, const UserRecord &record) {
+    if (cardId.isEmpty()) return;
+    if ((count + 1) * 2 > table.size()) { //Grow before the table passes half full
+        QList<Slot> grown(qMax<qsizetype>(64, table.size() * 2));
+        longestProbe = 0;
+        for (const Slot &slot : std::as_const(table)) {
+            if (slot.hash != 0) place(grown, slot.id, slot.hash, slot.record, longestProbe);
+        }
+        table.swap(grown);
+    }
+    const quint32 hash = hashId(cardId);
+    if (slotOf(cardId, hash) < 0) count++;
+    place(table, cardId, hash, record, longestProbe);
+}
+
+QFuture<Eo<int>> UserDirectory::setTrained(const QString &cardId) {
+    qsizetype i = slotOf(cardId, hashId(cardId));
+    bool wasTrained = i < 0 || table[i].record.trained;
+    if (i >= 0) table[i].record.trained = true;
+    return dbs->write("UPDATE users SET trainingCompleted = 1 WHERE id = :id", {{":id", cardId}}).then(this, [this, cardId, wasTrained](Eo<int> result) {
+        if (result.isError() && !wasTrained) { //Put the cache back to what the database still holds, a reload may have moved the slot
+            qsizetype slot = slotOf(cardId, hashId(cardId));
+            if (slot >= 0) table[slot].record.trained = false;
+        }
+        return result;
+    });
+}
+
+void UserDirectory::load() {
+    if (reloading) { //The running reload may have read before the caller's writes landed
+        reloadQueued = true;
+        return;
+    }
+    reloading = true;
+    //Read the version first, a commit landing between the two reads only causes one extra reload.
+    //Both wait for the writes already submitted, the caller usually reloads because of them
+    quint64 after = dbs->lastWrite();
+    dbs->read("PRAGMA data_version", {}, after).then(this, [this](Eo<DbRows> version) {
+        if (!version.isError() && !version.get().isEmpty()) dataVersion = version.get().first()[0].toLongLong();
+    });
+    dbs->read("SELECT id, cics, trainingCompleted, authLevel FROM users", {}, after).then(this, [this](Eo<DbRows> result) {
+        reloading = false;
+        if (result.isError()) {
+            qWarning() << "User directory reload failed:" << result.errorString();
+            reloadQueued = false;
+            return;
+        }
+        const DbRows rows = result.get();
+        qsizetype capacity = 64;
+        while (capacity < rows.size() * 2) capacity *= 2;
+        QList<Slot> fresh(capacity);
+        int probes = 0;
+        int users = 0;
+        for (const DbRow &row : rows) {
+            QString id = row[0].toString();
+            if (id.isEmpty()) continue;
+            UserRecord record;
+            record.cics = row[1].toBool();
+            record.trained = row[2].toBool();
+            record.authLevel = quint8(qBound(0, row[3].toInt(), 255));
+            place(fresh, id, hashId(id), record, probes);
+            users++;
+        }
+        table.swap(fresh); //Lookups between here and the next reload see the new roster as a whole
+        count = users;
+        longestProbe = probes;
+        loaded = true;
+        reloads++;
+        if (!pollTimer.isActive()) pollTimer.start();
+        qInfo() << "User directory loaded" << count << "users";
+        emit reloaded(count);
+        if (reloadQueued) {
+            reloadQueued = false;
+            load();
+        }
+    });
+}
+
+void UserDirectory::checkVersion() {
+    if (reloading) return;
+    //data_version only moves when another connection commits, the service's own writes are already in the cache
+    dbs->read("PRAGMA data_version").then(this, [this](Eo<DbRows> version) {
+        if (version.isError() || version.get().isEmpty()) return;
+        qint64 current = version.get().first()[0].toLongLong();
+        if (current == dataVersion) return;
+        qDebug() << "Users table may have changed outside the kiosk, reloading the user directory";
+        load();
+    });
+}
+
+QString UserDirectory::summary() const {
+    quint64 lookups = hits + misses;
+    double hitRate = lookups > 0 ? 100.0 * hits / lookups : 0;
+    return QString("%1 users in %2 slots, longest probe %3, %4 hits / %5 misses (%6%), %7 reloads")
+        .arg(count).arg(table.size()).arg(longestProbe).arg(hits).arg(misses).arg(hitRate, 0, 'f', 1).arg(reloads);
+}